@@ -0,0 +1,69 @@
+#ifndef __BOOT_H_INCLUDED__
+#define __BOOT_H_INCLUDED__
+
+/*
+* Staged startup. Only the core stage (buttons, leds, door io and command
+* queue) runs in setup(), so the doors can be controlled a few ms after
+* reset. The config stage loads the settings cached on the SD card right
+* after it (see settings.h). All other stages are advanced by boot_loop()
+* from the main loop as soon as the stages they depend on are done - one step
+* of every runnable stage per pass, so a missing shield or an unreachable
+* broker delays only its own stage. The mqtt stage only sets up the client,
+* the connect is advanced by mqtt_loop() in every pass until the broker has
+* answered (on the board the tcp handshake blocks for up to
+* HAL_TCPCONNECTTIMEOUT_MS, never during a command pulse). The stage is done
+* when the first attempt has ended, accepted or not, the client retries in
+* the background. A stage which can't be started is retried every
+* BOOT_RETRYINTERVAL_MS and fails after BOOT_MAXATTEMPTS; the stages which
+* depend on it are skipped.
+*
+* For every stage the time until it was done (ms since reset), the time its
+* steps blocked the main loop (us) and the number of attempts are recorded,
+* as well as the time until the broker was connected first. They are logged
+* when all stages are settled and published once (retained) on
+* gdc/system/boot when the broker is connected.
+*/
+
+#include "hal.h"
+
+#define BOOT_RETRYINTERVAL_MS   1000
+#define BOOT_MAXATTEMPTS        5
+
+// stages in the order of their dependencies
+enum boot_stage_t
+{
+    BOOT_STAGECORE,
+    BOOT_STAGECONFIG,
+    BOOT_STAGEDISPLAY,
+    BOOT_STAGESENSORS,
+    BOOT_STAGENETWORK,
+    BOOT_STAGEMQTT,
+    BOOT_STAGESERVICES,
+    BOOT_NUMSTAGES
+};
+
+// states of a stage
+#define BOOT_WAITING    0   // a stage it depends on isn't done yet
+#define BOOT_RUNNING    1   // started, steps are executed by boot_loop()
+#define BOOT_DONE       2
+#define BOOT_FAILED     3   // failed or skipped
+
+// profile of a stage
+struct boot_stageinfo_t
+{
+    uint8_t state;
+    uint8_t attempts;
+    uint32_t ready_ms;
+    uint32_t busy_us;
+};
+
+/* exports */
+void boot_init();
+void boot_loop();
+bool boot_isstarted(boot_stage_t stage);
+bool boot_isready(boot_stage_t stage);
+bool boot_iscomplete();
+const char *boot_stagename(boot_stage_t stage);
+const boot_stageinfo_t *boot_getstageinfo(boot_stage_t stage);
+
+#endif // __BOOT_H_INCLUDED__
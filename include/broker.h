@@ -0,0 +1,85 @@
+#ifndef __BROKER_H_INCLUDED__
+#define __BROKER_H_INCLUDED__
+
+/*
+* Minimal MQTT 3.1.1 broker for the native target - a local stand-in for
+* the real broker in simulations, tests and benchmarks. It supports CONNECT
+* with last will, SUBSCRIBE with + and # wildcards, retained messages and
+* PINGREQ. QoS 1 publishes of clients are acknowledged and subscriptions
+* with QoS 1 get their messages with QoS 1, but the broker never
+* retransmits them.
+*
+* Clients connect either in-process (the firmware through the tcp back end
+* returned by broker_tcp()) or over a loopback socket (broker_listen(),
+* serviced by broker_poll()). Local observers and publishers use
+* broker_subscribe() and broker_publish().
+*
+* Latency and loss can be injected: every packet is delayed by the latency
+* in both directions (on the clock of hal_native, i.e. virtual time in
+* simulations), a share of the routed publishes is dropped, a share of the
+* publishes of clients is dropped before the PUBACK and a share of the QoS 1
+* deliveries is duplicated.
+*/
+
+#include "hal.h"
+#include "hal_native.h"
+
+#define BROKER_MAXSESSIONS          512
+#define BROKER_MAXFILTERS           16
+#define BROKER_MAXOBSERVERS         8
+#define BROKER_MAXTOPICLENGTH       64
+#define BROKER_MAXPAYLOAD           512
+#define BROKER_MAXCLIENTID          32
+#define BROKER_BUFFERSIZE           4096
+#define BROKER_MAXPENDING           32
+
+// retained messages are stored in a hash table (size must be a power of 2)
+#define BROKER_MAXRETAINED          4096
+
+// session of the in-process client
+#define BROKER_INPROCESS            0
+
+// handler of a local observer - it receives the retain flag of the publisher
+typedef void (*broker_callback_t)(const char *topic, const uint8_t *payload, size_t size, bool retain);
+
+struct broker_stats_t
+{
+    unsigned long connects;
+    unsigned long disconnects;
+    unsigned long wills;
+    unsigned long publishesReceived;
+    unsigned long publishesDelivered;
+    unsigned long publishesDropped;
+    unsigned long publishesLost;
+    unsigned long duplicatesSent;
+    unsigned long bytesReceived;
+    unsigned long bytesSent;
+};
+
+/* setup */
+void broker_init();
+void broker_setonline(bool online);
+bool broker_isonline();
+void broker_setlatency(uint32_t latency_us);
+void broker_setloss(unsigned int percent, uint32_t seed);
+void broker_setpublishloss(unsigned int percent);
+void broker_setduplicates(unsigned int percent);
+
+/* transports */
+const hal_native_tcpops_t *broker_tcp();
+uint16_t broker_listen(uint16_t port);
+void broker_poll();
+void broker_close();
+
+/* local clients */
+bool broker_subscribe(const char *filter, broker_callback_t callback);
+void broker_publish(const char *topic, const uint8_t *payload, size_t size, bool retain);
+void broker_publish(const char *topic, const char *payload, bool retain);
+
+/* state */
+bool broker_clientconnected(const char *clientId);
+const char *broker_retained(const char *topic);
+const broker_stats_t *broker_getstats();
+bool broker_topicmatches(const char *filter, const char *topic);
+
+#endif // __BROKER_H_INCLUDED__
@@ -0,0 +1,34 @@
+#ifndef __BUILDFEATURES_H_INCLUDED__
+#define __BUILDFEATURES_H_INCLUDED__
+
+/*
+* Build-time feature selection. The optional shields are selected by build
+* flags (see the environments in platformio.ini), a subsystem which isn't
+* selected is removed from the firmware: its boot stage, its module in the
+* main loop, its mqtt topics, metrics and display pages.
+*
+*   GDC_FEATURE_SENSORS     MKR ENV shield (temperature, humidity, pressure,
+*                           illuminance) - gdc/system/sensors, sensor metrics
+*                           and the sensor page
+*   GDC_FEATURE_HMI         OLED/button shield (buttons, leds, display) -
+*                           display stage and all pages
+*
+* Both are selected by default. The code tests the constants below in plain
+* if statements, the compiler drops the branches of a feature which isn't
+* selected and the linker the functions which are left unreferenced. Only
+* the hal functions of the libraries of the shields (hal_arduino.cpp) and
+* the tables which are initialized at compile time use the preprocessor.
+*/
+
+#ifndef GDC_FEATURE_SENSORS
+#define GDC_FEATURE_SENSORS 1
+#endif
+
+#ifndef GDC_FEATURE_HMI
+#define GDC_FEATURE_HMI 1
+#endif
+
+constexpr bool featureSensors = (GDC_FEATURE_SENSORS != 0);
+constexpr bool featureHmi = (GDC_FEATURE_HMI != 0);
+
+#endif // __BUILDFEATURES_H_INCLUDED__
@@ -0,0 +1,42 @@
+// Include libraries
+#include "hal.h"
+
+// maximum number of commands waiting to be executed
+#define CMDQUEUE_CAPACITY           8
+
+// sources of a command - every source has its own rate limiter
+#define CMDQUEUE_SOURCELOCAL        0
+#define CMDQUEUE_SOURCEREMOTE       1
+#define CMDQUEUE_NUMSOURCES         2
+
+// what happens with a new command if the queue is full
+#define CMDQUEUE_POLICYDROPNEWEST   0
+#define CMDQUEUE_POLICYDROPOLDEST   1
+
+// a queued door command
+struct command_t
+{
+    uint16_t seq;
+    uint8_t door;
+    uint8_t command;
+    uint8_t source;
+    uint32_t ms_queued;
+};
+
+// counters of the command queue
+struct cmdqueue_stats_t
+{
+    unsigned long accepted;
+    unsigned long merged;
+    unsigned long rejectedRateLimit;
+    unsigned long rejectedFull;
+    uint8_t depth;
+    uint8_t maxDepth;
+};
+
+/* exports */
+void cmdqueue_init();
+uint16_t cmdqueue_push(int door, int command, int source);
+bool cmdqueue_pop(command_t* command);
+const cmdqueue_stats_t* cmdqueue_getstats();
+unsigned long cmdqueue_getrejected();
\ No newline at end of file
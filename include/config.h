@@ -1,8 +1,7 @@
 #ifndef __CONFIG_H_INCLUDED__
 #define __CONFIG_H_INCLUDED__
 
-#include <Arduino.h>
-#include <Ethernet.h>
+#include "hal.h"
 
 // define the input and output pins to control the drive
 // those pin numbers must match the circuit/schematic
@@ -11,6 +10,14 @@
 #define CMD_CLOSEDOOR_OUTPUT      2
 #define STATUS_DOORISCLOSED_INPUT 3
 
+// number of doors controlled by this board - every door needs its own set of
+// 2 outputs and 2 inputs. The pins of all doors are assigned in config.cpp
+// (doorPins[]). A pin can either be a native pin of the board or a pin on an
+// additional MCP23008 expander. Expander address 0 is used by the display shield,
+// so the drive expanders must use the addresses 1..7
+#define DOOR_COUNT                1
+#define DRIVEIO_EXPANDERPIN(address, pin) (0x80 | ((address) << 3) | (pin))
+
 // define the different pages on the OLED display - their sequence
 // can be changed by simply re-arranging their position 
 #define PAGE_OVERVIEW   0
@@ -23,9 +30,9 @@
 /* To change the content of the following variables go to config.cpp */
 
 // variables for global settings shared between the cpp modules
-extern String application;
-extern String version;
-extern String author;
+extern const char application[];
+extern const char version[];
+extern const char author[];
 
 // variables for network settings
 extern byte mac[];
@@ -34,21 +41,68 @@ extern IPAddress dns;
 extern IPAddress subnet;
 extern IPAddress gateway;
 
-// variables for MQTT settings
+// io pins of all doors - first door uses the pins defined above
+struct doorpins_t
+{
+    uint8_t cmdOpenOutput;
+    uint8_t statusOpenInput;
+    uint8_t cmdCloseOutput;
+    uint8_t statusClosedInput;
+};
+extern const doorpins_t doorPins[DOOR_COUNT];
+
+// variables for MQTT settings - the client id and the topic prefix must be
+// unique per device if several controllers share a broker
+#define MQTT_MAXCLIENTIDLENGTH      24
+#define MQTT_MAXTOPICPREFIXLENGTH   24
 extern const char mqttBrokerAddress[];
 extern const unsigned int mqttBrokerPort;
-extern String mqttClientID;
-extern String mqttUsername;
-extern String mqttPassword;
-extern String mqttLastWillMsg;
-extern String mqttFirstWillMsg;
+extern char mqttClientID[];
+extern char mqttTopicPrefix[];
+extern const char mqttUsername[];
+extern const char mqttPassword[];
+extern const char mqttLastWillMsg[];
+extern const char mqttFirstWillMsg[];
+
+// reconnect backoff and resynchronization with the broker (resync.h)
+extern int mqttReconnectMin_ms;
+extern int mqttReconnectMax_ms;
+extern int mqttResyncWindow_ms;
+extern int mqttHeartbeatPolicy;
+extern int mqttUptimeInterval_ms;
+extern int mqttDoorTopicQos;
+extern unsigned long mqttBinaryTopics;
+
+// port of the metrics endpoint (metrics.h)
+extern const unsigned int metricsPort;
+
+// local udp control channel (udpcontrol.h)
+extern unsigned int udpControlPort;
+extern const char udpControlKey[];
 
 // shared varaibles being used in more than one module - look in config.cpp 
 // for their initial values
-extern EthernetClient ethClient;
 extern int displayTimeout_ms;
 extern unsigned long uptime_in_secs;
 extern int ledBlinkDuration_ms;
 extern int commandDuration_ms;
+extern int debounce_button_ms;
+extern int sensorInterval_ms;
+extern int heartbeatInterval_ms;
+
+// rate limits and policies of the command queue
+extern int cmdRateLocalBurst;
+extern int cmdRateLocalRefill_ms;
+extern int cmdRateRemoteBurst;
+extern int cmdRateRemoteRefill_ms;
+extern bool cmdQueueMergePerDoor;
+extern int cmdQueueOverflowPolicy;
+
+// memory statistics
+extern int memLowThreshold_bytes;
+extern int memPublishInterval_ms;
+
+// low-power idle between the passes of the main loop (idle.h)
+extern int idleMode;
 
 #endif // __CONFIG_H_INCLUDED__
\ No newline at end of file
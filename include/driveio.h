@@ -8,11 +8,17 @@
 #define DOORCOMMANDOPEN             1
 #define DOORCOMMANDCLOSE            2
 
+// define the ios of a door (see doorpins_t in config.h)
+#define DRIVEIO_CMDOPENOUTPUT       0
+#define DRIVEIO_STATUSOPENINPUT     1
+#define DRIVEIO_CMDCLOSEOUTPUT      2
+#define DRIVEIO_STATUSCLOSEDINPUT   3
+
 /* exports */
 void driveio_init();
 void driveio_loop();
-bool driveio_doorstatuschanged(int* oldStatus, int* newStatus);
-void driveio_setdoorcommand(int Command);
-int driveio_getiostatus(int io);
-int driveio_getcurrentdoorstatus();
-bool driveio_doorcommandactive();
\ No newline at end of file
+bool driveio_doorstatuschanged(int door, int* oldStatus, int* newStatus);
+void driveio_setdoorcommand(int door, int Command);
+int driveio_getiostatus(int door, int io);
+int driveio_getcurrentdoorstatus(int door);
+bool driveio_doorcommandactive(int door);
\ No newline at end of file
@@ -0,0 +1,172 @@
+#ifndef __FIXEDSTRING_H_INCLUDED__
+#define __FIXEDSTRING_H_INCLUDED__
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+/*
+* String with a fixed capacity of N-1 characters. The text lives inside the
+* object (stack or static memory), so no operation ever allocates from the
+* heap. Text which doesn't fit is cut off.
+*/
+template <size_t N>
+class FixedString
+{
+public:
+    FixedString()
+    {
+        clear();
+    }
+
+    FixedString(const char *text)
+    {
+        clear();
+        append(text);
+    }
+
+    void clear()
+    {
+        len = 0;
+        buffer[0] = 0;
+    }
+
+    const char *c_str() const
+    {
+        return buffer;
+    }
+
+    size_t length() const
+    {
+        return len;
+    }
+
+    static size_t capacity()
+    {
+        return N - 1;
+    }
+
+    bool equals(const char *text) const
+    {
+        return strcmp(buffer, text) == 0;
+    }
+
+    bool operator==(const char *text) const
+    {
+        return equals(text);
+    }
+
+    bool operator!=(const char *text) const
+    {
+        return !equals(text);
+    }
+
+    char operator[](size_t index) const
+    {
+        return (index < len) ? buffer[index] : 0;
+    }
+
+    /*
+    * returns the position of the first occurence of c or -1
+    */
+    int indexOf(char c) const
+    {
+        const char *found = strchr(buffer, c);
+        return (found == NULL) ? -1 : (int)(found - buffer);
+    }
+
+    FixedString &append(const char *text)
+    {
+        return append(text, strlen(text));
+    }
+
+    FixedString &append(const char *text, size_t count)
+    {
+        if (count > N - 1 - len)
+        {
+            count = N - 1 - len;
+        }
+        memcpy(buffer + len, text, count);
+        len += count;
+        buffer[len] = 0;
+        return *this;
+    }
+
+    FixedString &append(char c)
+    {
+        return append(&c, 1);
+    }
+
+    template <size_t M>
+    FixedString &append(const FixedString<M> &text)
+    {
+        return append(text.c_str(), text.length());
+    }
+
+    /*
+    * appends formatted text (printf style)
+    */
+    FixedString &appendf(const char *format, ...) __attribute__((format(printf, 2, 3)))
+    {
+        va_list args;
+        va_start(args, format);
+        int written = vsnprintf(buffer + len, N - len, format, args);
+        va_end(args);
+        if (written > 0)
+        {
+            len = (len + written > N - 1) ? N - 1 : len + written;
+        }
+        return *this;
+    }
+
+    /*
+    * replaces the content by formatted text (printf style)
+    */
+    FixedString &format(const char *format, ...) __attribute__((format(printf, 2, 3)))
+    {
+        va_list args;
+        va_start(args, format);
+        int written = vsnprintf(buffer, N, format, args);
+        va_end(args);
+        len = (written < 0) ? 0 : ((written > (int)N - 1) ? N - 1 : written);
+        buffer[len] = 0;
+        return *this;
+    }
+
+    /*
+    * appends a float with the given number of decimals. Floats are formatted
+    * with integer arithmetics because the nano printf has no float support.
+    */
+    FixedString &appendfloat(float value, unsigned int decimals)
+    {
+        if (value != value)
+        {
+            return append("nan");
+        }
+        unsigned long scale = 1;
+        for (unsigned int i = 0; i < decimals; i++)
+        {
+            scale *= 10;
+        }
+        bool negative = (value < 0);
+        float absolute = (negative ? -value : value) + 0.5f / scale;
+        unsigned long whole = (unsigned long)absolute;
+        unsigned long fraction = (unsigned long)((absolute - whole) * scale);
+        if (negative && ((whole != 0) || (fraction != 0)))
+        {
+            append('-');
+        }
+        appendf("%lu", whole);
+        if (decimals > 0)
+        {
+            appendf(".%0*lu", (int)decimals, fraction);
+        }
+        return *this;
+    }
+
+private:
+    char buffer[N];
+    size_t len;
+};
+
+#endif // __FIXEDSTRING_H_INCLUDED__
\ No newline at end of file
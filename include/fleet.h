@@ -0,0 +1,39 @@
+#ifndef __FLEET_H_INCLUDED__
+#define __FLEET_H_INCLUDED__
+
+/*
+* Broker side of a fleet simulation on the native target. Many instances of
+* the native firmware, each with its own --client-id and --topic-prefix,
+* connect over loopback to the local broker (broker.h) run by this module.
+* The devices are discovered by their status topic. Every device gets a
+* door command in a fixed interval and the time until it echoes the command
+* on getnewdoorstate is measured. The broker can be restarted once to
+* observe the reconnect storm. scripts/fleet_sim.py launches a complete
+* fleet of growing size.
+*
+*   program fleet --port <port> [--duration <ms>] [--probe-interval <ms>]
+*                 [--restart-at <ms> --downtime <ms>]
+*
+* Once per second a json line with the current rates is printed, at the end
+* a json summary.
+*/
+
+#include "hal.h"
+#include "broker.h"
+
+#define FLEET_MAXDEVICES        BROKER_MAXSESSIONS
+#define FLEET_MAXSAMPLES        100000
+
+struct fleet_options_t
+{
+    uint16_t port;
+    uint32_t duration_ms;
+    uint32_t probeInterval_ms;
+    uint32_t restartAt_ms;
+    uint32_t downtime_ms;
+};
+
+int fleet_main(int argc, char **argv);
+int fleet_run(const fleet_options_t &options);
+
+#endif // __FLEET_H_INCLUDED__
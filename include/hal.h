@@ -0,0 +1,195 @@
+#ifndef __HAL_H_INCLUDED__
+#define __HAL_H_INCLUDED__
+
+/*
+* Hardware abstraction layer. All modules access the hardware (gpio, time,
+* i2c devices, ENV sensors, network and serial line) only through these
+* functions. hal_arduino.cpp implements them for the MKR Zero, hal_native.cpp
+* provides simulated back ends with a deterministic virtual clock, so the
+* full firmware can run on Linux (PlatformIO environment "native").
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdio.h>
+#include <ctype.h>
+
+#ifdef ARDUINO
+#include <Arduino.h>
+#include <IPAddress.h>
+#define HAL_LED_BUILTIN     LED_BUILTIN
+// variables in this section keep their content across a reset
+#define HAL_NOINIT          __attribute__((section(".noinit")))
+#else
+#define HIGH                1
+#define LOW                 0
+#define INPUT               0x0
+#define OUTPUT              0x1
+#define INPUT_PULLUP        0x2
+#define INPUT_PULLDOWN      0x3
+#define HAL_LED_BUILTIN     32
+// a reset of the host program doesn't keep the memory anyway
+#define HAL_NOINIT
+typedef uint8_t byte;
+
+/*
+* Minimal replacement of the Arduino IPAddress class for the native target
+*/
+class IPAddress
+{
+public:
+    IPAddress() : address{0, 0, 0, 0} {}
+    IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) : address{a, b, c, d} {}
+    uint8_t operator[](int index) const { return address[index]; }
+    uint8_t &operator[](int index) { return address[index]; }
+
+private:
+    uint8_t address[4];
+};
+#endif
+
+// number of native io port groups (SAMD21: PORTA and PORTB)
+#define HAL_GPIOPORTGROUPS      2
+
+// MCP23008 expanders on the i2c bus (address offset 0..7)
+#define HAL_MAXEXPANDERS        8
+
+// network hardware status as returned by hal_net_begin()
+#define HAL_NET_NOHARDWARE      0
+#define HAL_NET_W5500           3
+#define HAL_TCPCONNECTTIMEOUT_MS 250
+#define HAL_DNSTIMEOUT_MS       100
+
+// watchdog timeout
+#define HAL_WATCHDOG_16S        16
+
+// cause of the last reset as returned by hal_system_resetcause()
+#define HAL_RESETPOWERON        0
+#define HAL_RESETBROWNOUT       1
+#define HAL_RESETEXTERNAL       2
+#define HAL_RESETWATCHDOG       3
+#define HAL_RESETSYSTEM         4   // requested by the firmware (hal_system_reset)
+
+/* time - timestamps are 32 bit and wrap around on all targets */
+uint32_t hal_millis();
+uint32_t hal_micros();
+void hal_delay(unsigned long ms);
+void hal_yield();
+
+/* native gpio */
+void hal_gpio_mode(uint8_t pin, uint8_t mode);
+void hal_gpio_write(uint8_t pin, uint8_t value);
+int hal_gpio_read(uint8_t pin);
+uint32_t hal_gpio_readport(uint8_t group);
+void hal_gpio_portbit(uint8_t pin, uint8_t *group, uint8_t *bit);
+
+/* MCP23008 i2c expanders */
+void hal_expander_begin(uint8_t address);
+void hal_expander_mode(uint8_t address, uint8_t pin, uint8_t mode);
+void hal_expander_write(uint8_t address, uint8_t pin, uint8_t value);
+int hal_expander_read(uint8_t address, uint8_t pin);
+uint8_t hal_expander_readport(uint8_t address);
+
+/* SH1106 OLED display (128x64, 6x10 font) */
+void hal_display_begin();
+void hal_display_powersave(bool enable);
+void hal_display_clear();
+unsigned int hal_display_textwidth(const char *text);
+void hal_display_text(int x, int y, const char *text);
+void hal_display_hline(int x, int y, int width);
+void hal_display_send();
+
+/* MKR ENV shield */
+bool hal_env_begin();
+float hal_env_temperature();
+float hal_env_humidity();
+float hal_env_pressure();
+float hal_env_illuminance();
+
+/* network interface and the tcp socket to the broker. On the board
+   hal_tcp_connect() blocks until the handshake is done, at most
+   HAL_TCPCONNECTTIMEOUT_MS (a broker which is down answers at once). The
+   name of the broker is resolved before the first connect and again after
+   a failed one - the lookup takes up to three tries of HAL_DNSTIMEOUT_MS. */
+int hal_net_begin(byte *mac, IPAddress ip, IPAddress dns, IPAddress gateway, IPAddress subnet);
+bool hal_net_linkup();
+IPAddress hal_net_localip();
+bool hal_tcp_connect(const char *host, uint16_t port);
+bool hal_tcp_connected();
+size_t hal_tcp_write(const uint8_t *buffer, size_t size);
+int hal_tcp_available();
+int hal_tcp_read(uint8_t *buffer, size_t size);
+void hal_tcp_stop();
+
+/* tcp server socket which serves one client at a time (metrics endpoint).
+   hal_server_write() must not be given more than hal_server_writable()
+   bytes, otherwise it may block until the client has read them. The
+   connection is closed without waiting: hal_server_disconnect() sends the
+   FIN after the pending data, hal_server_stop() frees the socket once
+   hal_server_closed() or a timeout of the caller has passed. */
+bool hal_server_begin(uint16_t port);
+bool hal_server_accept();
+bool hal_server_connected();
+int hal_server_available();
+int hal_server_read(uint8_t *buffer, size_t size);
+size_t hal_server_writable();
+size_t hal_server_write(const uint8_t *buffer, size_t size);
+void hal_server_disconnect();
+bool hal_server_closed();
+void hal_server_stop();
+
+/* udp socket (control channel) - hal_udp_receive() returns the size of a
+   waiting datagram or 0 */
+bool hal_udp_begin(uint16_t port);
+int hal_udp_receive(uint8_t *buffer, size_t size, IPAddress *remoteIp, uint16_t *remotePort);
+bool hal_udp_send(IPAddress remoteIp, uint16_t remotePort, const uint8_t *buffer, size_t size);
+
+/* SD card - files in the root directory with 8.3 names. hal_file_read()
+   returns the number of bytes read or -1 if the file can't be opened,
+   hal_file_write() replaces the file. hal_file_writeat() overwrites or
+   appends at offset (at most the size of the file) and creates a missing
+   file. */
+bool hal_sd_begin();
+int hal_file_read(const char *name, uint32_t offset, uint8_t *buffer, size_t size);
+bool hal_file_write(const char *name, const uint8_t *buffer, size_t size);
+bool hal_file_writeat(const char *name, uint32_t offset, const uint8_t *buffer, size_t size);
+bool hal_file_remove(const char *name);
+
+/* low-power idle - hal_sleep() waits up to ms in IDLE or in STANDBY and
+   returns early (*woken) if a wake pin changes or, on the host, a socket
+   has data. Returns the time slept in us. hal_sleep_wakepin() returns false
+   for a pin without an external interrupt, such a pin has to be polled. */
+bool hal_sleep_wakepin(uint8_t pin);
+uint32_t hal_sleep(uint32_t ms, bool standby, bool *woken);
+
+/* watchdog and reset */
+void hal_watchdog_init(int timeout_s, void (*onShutdown)());
+void hal_watchdog_clear();
+void hal_system_reset();
+uint8_t hal_system_resetcause();
+
+/* interrupts - hal_interrupts_disable() returns the previous state for
+   hal_interrupts_restore(), so the calls can be nested */
+uint32_t hal_interrupts_disable();
+void hal_interrupts_restore(uint32_t state);
+
+/* serial line */
+void hal_serial_begin(unsigned long baud);
+void hal_serial_print(const char *text);
+void hal_serial_println(const char *text);
+
+/* memory */
+struct hal_meminfo_t
+{
+    unsigned int free;
+    unsigned int heapSize;
+    unsigned int heapUsed;
+    unsigned int heapFree;
+    unsigned int largestFreeBlock;
+};
+void hal_mem_paint(uint8_t pattern, unsigned int guard);
+unsigned int hal_mem_stackmax(uint8_t pattern);
+void hal_mem_info(hal_meminfo_t *info, bool analyze);
+
+#endif // __HAL_H_INCLUDED__
\ No newline at end of file
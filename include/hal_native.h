@@ -0,0 +1,92 @@
+#ifndef __HAL_NATIVE_H_INCLUDED__
+#define __HAL_NATIVE_H_INCLUDED__
+
+/*
+* Control interface of the simulated back ends of the native target. Tests
+* and simulations use it to drive inputs, advance the virtual clock and
+* observe the outputs of the firmware.
+*/
+
+#include "hal.h"
+
+// clock modes - the virtual clock only advances by hal_native_advance(),
+// hal_delay(), hal_yield() and one tick per loop pass
+#define HAL_NATIVE_CLOCKVIRTUAL     0
+#define HAL_NATIVE_CLOCKREALTIME    1
+
+// virtual time of one pass of loop() and of a hal_yield() call
+#define HAL_NATIVE_LOOPTICK_US      1000
+#define HAL_NATIVE_YIELDTICK_US     50
+
+// virtual time between two checks for a wakeup in hal_sleep()
+#define HAL_NATIVE_SLEEPTICK_US     1000
+
+// simulated size of the ram
+#define HAL_NATIVE_RAMSIZE          32768
+
+// exit code of the native program if the watchdog resets the controller
+#define HAL_NATIVE_EXITWATCHDOG     2
+
+// exit code of the native program if the controller resets itself
+#define HAL_NATIVE_EXITRESET        3
+
+// devices which can be stalled (hal_native_setstall)
+#define HAL_NATIVE_STALLENV         0
+#define HAL_NATIVE_STALLEXPANDER    1
+#define HAL_NATIVE_NUMSTALLS        2
+
+// tcp back end - the default back end uses posix sockets
+struct hal_native_tcpops_t
+{
+    bool (*connect)(const char *host, uint16_t port);
+    bool (*connected)();
+    size_t (*write)(const uint8_t *buffer, size_t size);
+    int (*available)();
+    int (*read)(uint8_t *buffer, size_t size);
+    void (*stop)();
+};
+
+/* clock */
+void hal_native_setclock(int mode, uint32_t start_ms);
+void hal_native_advance(uint32_t us);
+uint64_t hal_native_time_us();
+void hal_native_settimehook(void (*hook)());
+
+/* a wait of hal_sleep() ends at this time (0 = no limit) - the end of a run */
+void hal_native_setsleeplimit(uint64_t until_us);
+
+/* io */
+void hal_native_setinput(uint8_t pin, int value);
+int hal_native_getoutput(uint8_t pin);
+void hal_native_setexpanderinput(uint8_t address, uint8_t pin, int value);
+int hal_native_getexpanderoutput(uint8_t address, uint8_t pin);
+
+/* devices */
+void hal_native_setenv(bool present, float temperature, float humidity, float pressure, float illuminance);
+const char *hal_native_displaytext(int index);
+int hal_native_displaylines();
+bool hal_native_displayon();
+void hal_native_setlink(bool up);
+unsigned long hal_native_watchdogexpired();
+void hal_native_setwatchdogexit(bool exitOnReset);
+unsigned long hal_native_resets();
+void hal_native_setstall(int device, uint32_t ms);
+
+/* network */
+void hal_native_setbroker(const char *host, uint16_t port);
+void hal_native_settcp(const hal_native_tcpops_t *ops);
+void hal_native_setserverport(int port);
+uint16_t hal_native_serverport();
+void hal_native_setudpport(int port);
+uint16_t hal_native_udpport();
+
+/* SD card - a directory of the host, without one there is no card */
+void hal_native_setsddir(const char *path);
+
+/* serial line - output is echoed to stdout and/or passed to a hook */
+void hal_native_setserial(bool echo, void (*hook)(const char *line));
+
+/* runs setup() and loop() until the virtual time has passed duration_ms (0 = forever) */
+void hal_native_run(uint32_t duration_ms);
+
+#endif // __HAL_NATIVE_H_INCLUDED__
\ No newline at end of file
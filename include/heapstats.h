@@ -0,0 +1,5 @@
+/* exports */
+void heapstats_marksteadystate();
+unsigned long heapstats_getallocations();
+unsigned long heapstats_getfrees();
+unsigned long heapstats_getsteadyallocations();
\ No newline at end of file
@@ -1,5 +1,7 @@
 // Include libraries
-#include <Arduino.h>
+#include "hal.h"
+
+#include "fixedstring.h"
 
 #define HMI_BUTTON_NONE          -1
 #define HMI_BUTTON_CLOSEDOOR     0
@@ -12,13 +14,18 @@
 
 #define HMI_BEEPER               7
 
+// a line of text on the display (128 pixels / 6 pixels per character)
+#define HMI_LINELENGTH           22
+typedef FixedString<HMI_LINELENGTH + 1> DisplayLine;
+
 /* exports */
 void hmi_init();
+void hmi_display_begin();
 void hmi_loop();
-void hmi_display_splashscreen(String status);
+void hmi_display_splashscreen(const char* status);
 void hmi_display_off(bool enable);
 int hmi_getbuttonpressed();
 void hmi_setled(int led, int status);
 int hmi_getled(int led);
 void hmi_setled_blinking(int led, bool enable);
-void hmi_display_frame(String title, String text[], int numlines);
+void hmi_display_frame(const char* title, const DisplayLine text[], int numlines);
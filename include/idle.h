@@ -0,0 +1,103 @@
+#ifndef __IDLE_H_INCLUDED__
+#define __IDLE_H_INCLUDED__
+
+/*
+* Low-power idle between the passes of the main loop. During a pass every
+* module which has timed work reports when it is due next (idle_due): the
+* end of a command pulse, the next poll of the inputs on the expanders and
+* the buttons, a blinking led, the display refresh, the sensor interval, the
+* heartbeat led, the state poll and the next poll of the network. Work
+* which is waiting already is reported as due now. At the end of the pass
+* idle_plan() takes the earliest due time and decides how to wait for it:
+*
+*   - not at all if something is due within IDLE_MINSLEEP_MS or if idleMode
+*     is IDLE_MODEOFF (a boot stage waiting for a retry reports its time)
+*   - IDLE (cpu stopped, clocks and peripherals running) for short waits or
+*     while a module holds the clocks (idle_hold, e.g. a command pulse)
+*   - STANDBY (all clocks stopped except the 32 kHz oscillator) for waits of
+*     IDLE_STANDBYMIN_MS and more if idleMode is IDLE_MODESTANDBY
+*
+* A wait never exceeds IDLE_MAXSLEEP_MS, which is well within the deadlines
+* of the supervisor and the hardware watchdog, so periodic work which isn't
+* reported is late by that at most. The door inputs on native pins end a
+* wait at once (pin interrupt). The MKR ETH shield doesn't wire the
+* interrupt of the W5500, the sockets are polled every IDLE_NETPOLL_MS
+* instead - on the host data on a socket ends the wait as well.
+*
+* The time awake and asleep is published every IDLE_PUBLISH_MS on
+* gdc/diag/idle, e.g.
+*
+*   {"duty":3.2,"awake_ms":1920,"idle_ms":13100,"standby_ms":44980,
+*    "sleeps":592,"wakeups":3,"limit":"inputs"}
+*
+* duty is the share of the time awake in percent, wakeups counts the waits
+* ended early by an interrupt and limit is the source which ended most
+* waits - all since the previous publish.
+*/
+
+#include "hal.h"
+
+#define IDLE_MINSLEEP_MS        2
+#define IDLE_STANDBYMIN_MS      20
+#define IDLE_MAXSLEEP_MS        500
+#define IDLE_NETPOLL_MS         50
+#define IDLE_INPUTPOLL_MS       50
+#define IDLE_DISPLAYREFRESH_MS  250
+#define IDLE_PUBLISH_MS         60000
+
+// idleMode (config.cpp)
+#define IDLE_MODEOFF            0
+#define IDLE_MODEIDLE           1   // IDLE only
+#define IDLE_MODESTANDBY        2   // IDLE and STANDBY
+
+// the decision of idle_plan()
+#define IDLE_RUN                0
+#define IDLE_SLEEP              1
+#define IDLE_STANDBY            2
+
+// sources of timed work
+enum idle_source_t
+{
+    IDLE_SOURCEDOORS,
+    IDLE_SOURCEINPUTS,
+    IDLE_SOURCELEDS,
+    IDLE_SOURCEDISPLAY,
+    IDLE_SOURCESENSORS,
+    IDLE_SOURCEHEARTBEAT,
+    IDLE_SOURCESTATE,
+    IDLE_SOURCENETWORK,
+    IDLE_SOURCEBOOT,
+    IDLE_NUMSOURCES,
+    IDLE_SOURCENONE = IDLE_NUMSOURCES   // nothing reported, IDLE_MAXSLEEP_MS
+};
+
+struct idle_plan_t
+{
+    uint8_t mode;               // IDLE_RUN, IDLE_SLEEP or IDLE_STANDBY
+    uint32_t sleep_ms;
+    idle_source_t source;       // the source which is due first
+};
+
+struct idle_stats_t
+{
+    uint64_t awake_us;
+    uint64_t idle_us;
+    uint64_t standby_us;
+    unsigned long sleeps;
+    unsigned long standbys;
+    unsigned long wakeups;      // waits ended early by an interrupt
+    unsigned long skipped;      // passes without a wait
+    uint32_t lastSleep_us;      // the wait after the previous pass
+};
+
+/* exports */
+void idle_init();
+void idle_begin();
+void idle_due(idle_source_t source, uint32_t due_ms);
+void idle_hold();
+void idle_plan(uint32_t now, idle_plan_t *plan);
+void idle_loop();
+const char *idle_sourcename(idle_source_t source);
+const idle_stats_t *idle_getstats();
+
+#endif // __IDLE_H_INCLUDED__
@@ -0,0 +1,16 @@
+// pattern used to paint the free ram at startup
+#define MEMSTATS_PAINTPATTERN   0xA5
+
+// bytes below the current stack pointer which are not painted
+#define MEMSTATS_PAINTGUARD     64
+
+/* exports */
+void memstats_init();
+void memstats_loop();
+unsigned int memstats_getfree();
+unsigned int memstats_getminfree();
+unsigned int memstats_getstackmax();
+unsigned int memstats_getheapsize();
+unsigned int memstats_getheapused();
+unsigned int memstats_getfragmentation();
+bool memstats_islow();
\ No newline at end of file
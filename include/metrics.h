@@ -0,0 +1,43 @@
+#ifndef __METRICS_H_INCLUDED__
+#define __METRICS_H_INCLUDED__
+
+/*
+* Metrics endpoint: a tiny HTTP/1.0 server on metricsPort which answers
+* "GET /metrics" with the counters of the firmware in the Prometheus text
+* format. The response is never built in ram: the metrics are rendered one
+* line at a time from the live counters and streamed into the socket, at
+* most METRICS_MAXBYTESPERPASS bytes per pass of the main loop and never
+* more than the send buffer of the socket takes without blocking. A client
+* which is too slow is dropped after METRICS_TIMEOUT_MS. The connection is
+* closed in the background: the socket is freed when the client has closed
+* its side, after METRICS_CLOSETIMEOUT_MS at the latest.
+*/
+
+#include "hal.h"
+#include "fixedstring.h"
+
+#define METRICS_MAXLINELENGTH       96
+#define METRICS_MAXBYTESPERPASS     256
+#define METRICS_TIMEOUT_MS          2000
+#define METRICS_CLOSETIMEOUT_MS     500
+#define METRICS_ACCEPTINTERVAL_MS   100
+
+// one line of the exposition
+typedef FixedString<METRICS_MAXLINELENGTH> MetricsLine;
+
+// counters of the endpoint
+struct metrics_stats_t
+{
+    unsigned long scrapes;
+    unsigned long rejected;
+    unsigned long dropped;
+    unsigned long bytes;
+};
+
+/* exports */
+void metrics_init();
+void metrics_loop();
+void metrics_doorstatus(int door, int status);
+const metrics_stats_t *metrics_getstats();
+
+#endif // __METRICS_H_INCLUDED__
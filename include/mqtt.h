@@ -1,5 +1,12 @@
+#ifndef __MQTT_H_INCLUDED__
+#define __MQTT_H_INCLUDED__
+
 // Include libraries
-#include <Ethernet.h>
+#include "hal.h"
+
+#include "config.h"
+#include "fixedstring.h"
+#include "mqttclient.h"
 
 // list of allowed topic values
 #define MQTT_COMMANDDOOROPEN    "open"
@@ -11,25 +18,105 @@
 #define MQTT_STATUSDOORSTOPPED  "stopped"
 #define MQTT_STATUSDOORUNKNOWN  "unknown"
 
-// list of supported topics
-#define MQTT_TOPICSYSTEMUPTIME   "gdc/system/uptime"
-#define MQTT_TOPICSYSTEMINFO     "gdc/system/info"
-#define MQTT_TOPICSYSTEMSTATUS   "gdc/system/status"
-#define MQTT_TOPICCONTROLSETNEWDOORSTATE  "gdc/control/setnewdoorstate"
-#define MQTT_TOPICCONTROLGETNEWDOORSTATE  "gdc/control/getnewdoorstate"
-#define MQTT_TOPICCONTROLGETCURRENTDOORSTATE "gdc/control/getcurrentdoorstate"
-#define MQTT_TOPICCONTROLCOMMANDSOURCE  "gdc/control/commandsource"
+// ids of the supported topics. The full topic names of this device are
+// built once from the topic table in mqtt.cpp (topic prefix, door number and
+// path, e.g. "gdc/system/status"), so publishing a topic needs no string
+// building and a received topic is matched by the hash of its name.
+enum mqtt_topic_t
+{
+    MQTT_TOPICSYSTEMUPTIME,
+    MQTT_TOPICSYSTEMUPTIMEREQUEST,
+    MQTT_TOPICSYSTEMINFO,
+    MQTT_TOPICSYSTEMSTATUS,
+    MQTT_TOPICSYSTEMMEMORY,
+    MQTT_TOPICSYSTEMALERT,
+    MQTT_TOPICSYSTEMSENSORS,
+    MQTT_TOPICSYSTEMSNAPSHOT,
+    MQTT_TOPICDIAGTRACE,
+    MQTT_TOPICDIAGCOMMANDQUEUE,
+    MQTT_TOPICDIAGDELIVERY,
+    MQTT_TOPICSYSTEMBOOT,
+    MQTT_TOPICDIAGWATCHDOG,
+    MQTT_TOPICDIAGCRASH,
+    MQTT_TOPICCONFIGSET,
+    MQTT_TOPICCONFIGACTIVE,
+    MQTT_TOPICUPDATECHUNK,
+    MQTT_TOPICUPDATESTATUS,
+    MQTT_TOPICSTATE,
+    MQTT_TOPICSTATEDELTA,
+    MQTT_TOPICSTATEREQUEST,
+    MQTT_TOPICDIAGIDLE,
+
+    // the control topics of the first door - all other doors use the same
+    // topics with the door number inserted, e.g. "gdc/door2/control/commandsource"
+    // (see mqtt_doortopic)
+    MQTT_TOPICCONTROLSETNEWDOORSTATE,
+    MQTT_TOPICCONTROLGETNEWDOORSTATE,
+    MQTT_TOPICCONTROLGETCURRENTDOORSTATE,
+    MQTT_TOPICCONTROLCOMMANDSOURCE,
+
+    MQTT_TOPICFIRSTDOOR = MQTT_TOPICCONTROLSETNEWDOORSTATE,
+    MQTT_NUMDOORTOPICS = MQTT_TOPICCONTROLCOMMANDSOURCE + 1 - MQTT_TOPICFIRSTDOOR,
+    MQTT_NUMTOPICS = MQTT_TOPICFIRSTDOOR + DOOR_COUNT * MQTT_NUMDOORTOPICS
+};
+
+// the topic prefix (mqttTopicPrefix) replaces the root "gdc" of the topics
+#define MQTT_TOPICDOORPREFIX    "door"
+
+// a command can carry an optional correlation id, e.g. "open:4711" - the
+// id is reported with the latency trace of the command. An id longer than
+// TRACE_MAXIDLENGTH or with other characters than [A-Za-z0-9._-] is
+// replaced by a generated one.
+#define MQTT_CORRELATIONSEPARATOR   ':'
 
 // list of command sources
 #define MQTT_COMMANDSOURCELOCAL     "local"
 #define MQTT_COMMANDSOURCEREMOTE    "remote"
 #define MQTT_COMMANDSOURCEEXTERNAL  "external"
 
+// heartbeat policies (mqttHeartbeatPolicy): fixed publishes the uptime and
+// the retained status every second. Adaptive relies on the last will for the
+// liveness, publishes the status only when it changes and the uptime every
+// mqttUptimeInterval_ms or when it is requested on gdc/system/uptime/get.
+#define MQTT_HEARTBEATFIXED     0
+#define MQTT_HEARTBEATADAPTIVE  1
+
+// counters of the heartbeat - saved are the messages the fixed policy
+// would have sent in addition while connected
+struct mqtt_heartbeatstats_t
+{
+    unsigned long uptimePublishes;
+    unsigned long statusPublishes;
+    unsigned long requests;
+    unsigned long saved;
+};
+
+// a full topic name
+typedef FixedString<64> MqttTopic;
+
+/*
+ * Returns the id of a control topic of a door
+ */
+constexpr mqtt_topic_t mqtt_doortopic(int door, mqtt_topic_t topic)
+{
+    return (mqtt_topic_t)(topic + door * MQTT_NUMDOORTOPICS);
+}
+
 /* exports */
 void mqtt_init();
+void mqtt_buildtopics();
 void mqtt_loop();
-void mqtt_publish(String topic, String payload, bool retain);
-String mqtt_getcommand();
+bool mqtt_setdevice(const char* clientId, const char* topicPrefix);
+void mqtt_publish(mqtt_topic_t topic, const char* payload, bool retain);
+void mqtt_publish(mqtt_topic_t topic, const uint8_t* payload, size_t size, bool retain);
+const char* mqtt_topicname(mqtt_topic_t topic);
+const char* mqtt_topicpath(mqtt_topic_t topic);
+const char* mqtt_doorstate(int door);
+const mqtt_heartbeatstats_t* mqtt_getheartbeatstats();
+const mqttclient_stats_t* mqtt_getdeliverystats();
 int mqtt_getpacketsreceived();
 int mqtt_getpacketssent();
 bool mqtt_isconnected();
+bool mqtt_hasattempted();
+
+#endif // __MQTT_H_INCLUDED__
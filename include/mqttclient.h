@@ -0,0 +1,169 @@
+#ifndef __MQTTCLIENT_H_INCLUDED__
+#define __MQTTCLIENT_H_INCLUDED__
+
+// Include libraries
+#include "hal.h"
+#include "config.h"
+
+// size of the send and receive buffer - the largest packet which can be
+// sent or received (the sensors topic needs about 200 bytes)
+#define MQTTCLIENT_BUFFERSIZE           256
+// 4 device topics, 2 retained system topics and a command and a retained
+// state topic per door (see mqtt_connected)
+#define MQTTCLIENT_MAXSUBSCRIPTIONS     (6 + 2 * DOOR_COUNT)
+#define MQTTCLIENT_MAXTOPICLENGTH       64
+
+// time to wait for the CONNACK of the broker (see MQTTClient::update)
+#define MQTTCLIENT_CONNECTTIMEOUT_MS    3000
+
+// QoS 1: publishes waiting for their PUBACK, the largest payload which can
+// be kept for a retransmit, the time until a retransmit and the number of
+// retransmits before a publish is given up. The ids of the last received
+// QoS 1 publishes are kept to detect duplicates.
+#define MQTTCLIENT_MAXINFLIGHT          8
+#define MQTTCLIENT_MAXINFLIGHTPAYLOAD   32
+#define MQTTCLIENT_RETRYTIMEOUT_MS      2000
+#define MQTTCLIENT_MAXRETRIES           5
+#define MQTTCLIENT_MAXRECEIVEDIDS       8
+
+// mqtt 3.1.1 control packet types
+#define MQTTCLIENT_CONNECT      0x10
+#define MQTTCLIENT_CONNACK      0x20
+#define MQTTCLIENT_PUBLISH      0x30
+#define MQTTCLIENT_PUBACK       0x40
+#define MQTTCLIENT_SUBSCRIBE    0x80
+#define MQTTCLIENT_SUBACK       0x90
+#define MQTTCLIENT_UNSUBSCRIBE  0xA0
+#define MQTTCLIENT_UNSUBACK     0xB0
+#define MQTTCLIENT_PINGREQ      0xC0
+#define MQTTCLIENT_PINGRESP     0xD0
+#define MQTTCLIENT_DISCONNECT   0xE0
+
+// handler for received messages - the payload is zero terminated
+typedef void (*mqttclient_callback_t)(const char *payload, const size_t size);
+
+// handler for a message on a subscribed topic which didn't fit into the
+// receive buffer - it only learns the topic and the size of the payload
+typedef void (*mqttclient_oversizecallback_t)(const char *topic, const size_t size);
+
+// counters of the QoS 1 delivery - downgraded publishes were sent with QoS 0
+// because the in-flight table was full or the payload too large
+struct mqttclient_stats_t
+{
+    unsigned long published;
+    unsigned long acknowledged;
+    unsigned long retransmits;
+    unsigned long expired;
+    unsigned long downgraded;
+    unsigned long duplicates;
+    uint64_t ackLatencyTotal_us;
+    uint32_t ackLatencyMax_us;
+};
+
+/*
+* Minimal MQTT 3.1.1 client working on fixed buffers. It supports the
+* features used by the controller: connect with last will and credentials,
+* subscriptions with one handler per topic, QoS 0 and QoS 1 publish and keep
+* alive. QoS 1 publishes are kept in a fixed in-flight table until they are
+* acknowledged. They are retransmitted after a timeout and after a reconnect,
+* and also a publish while the connection is down is sent after the next
+* connect. connect() only sends the CONNECT packet, the CONNACK is awaited
+* by update(), so the main loop keeps running while the broker answers.
+* Nothing is allocated from the heap. The transport is the tcp socket of the
+* hardware abstraction layer.
+*/
+class MQTTClient
+{
+public:
+    void begin();
+    void setKeepAliveTimeout(uint16_t seconds);
+    void setCleanSession(bool cleanSession);
+    void setWill(const char *topic, const char *message, bool retain, uint8_t qos);
+    void setOversizeCallback(mqttclient_oversizecallback_t callback);
+    bool connect(const char *clientId, const char *username, const char *password);
+    void disconnect();
+    bool isConnected();
+    bool isConnecting();
+    bool subscribe(const char *topic, mqttclient_callback_t callback, uint8_t qos = 0);
+    bool unsubscribe(const char *topic);
+    bool publish(const char *topic, const char *payload, bool retain = false, uint8_t qos = 0);
+    bool publish(const char *topic, const uint8_t *payload, size_t size, bool retain, uint8_t qos);
+    void update();
+    uint8_t getInflight();
+    const mqttclient_stats_t *getStats();
+
+private:
+    // the topic is not copied - a received topic is matched by its length
+    // and hash
+    struct subscription_t
+    {
+        const char *topic;
+        uint16_t length;
+        uint32_t hash;
+        mqttclient_callback_t callback;
+    };
+
+    // a QoS 1 publish waiting for its PUBACK - the topic is not copied
+    struct inflight_t
+    {
+        bool used;
+        bool sent;
+        bool retain;
+        uint8_t retries;
+        uint8_t size;
+        uint16_t id;
+        const char *topic;
+        uint8_t payload[MQTTCLIENT_MAXINFLIGHTPAYLOAD];
+        uint32_t us_published;
+        uint32_t prev_ms_sent;
+    };
+
+    uint16_t keepAlive_s = 60;
+    bool cleanSession = true;
+    const char *willTopic = NULL;
+    const char *willMessage = NULL;
+    bool willRetain = false;
+    uint8_t willQos = 0;
+    mqttclient_oversizecallback_t oversizeCallback = NULL;
+    bool connected = false;
+    bool connecting = false;
+    bool connackReceived = false;
+    uint8_t connackCode = 0;
+    uint16_t nextPacketId = 1;
+    uint32_t prev_ms_sent = 0;
+    uint32_t prev_ms_received = 0;
+    uint32_t prev_ms_ping = 0;
+    uint32_t prev_ms_connect = 0;
+    bool pingOutstanding = false;
+
+    subscription_t subscriptions[MQTTCLIENT_MAXSUBSCRIPTIONS];
+    uint8_t numSubscriptions = 0;
+
+    inflight_t inflight[MQTTCLIENT_MAXINFLIGHT];
+    uint16_t receivedIds[MQTTCLIENT_MAXRECEIVEDIDS];
+    uint8_t nextReceivedId = 0;
+    mqttclient_stats_t stats;
+
+    // send buffer and state of the receive state machine
+    uint8_t txBuffer[MQTTCLIENT_BUFFERSIZE];
+    uint8_t rxBuffer[MQTTCLIENT_BUFFERSIZE + 1];
+    uint8_t rxState = 0;
+    uint8_t rxHeader = 0;
+    uint32_t rxLength = 0;
+    uint32_t rxMultiplier = 1;
+    uint32_t rxPos = 0;
+
+    size_t writeheader(uint8_t header, uint32_t remainingLength);
+    size_t writestring(size_t pos, const char *text);
+    bool send(size_t length);
+    bool sendpublish(const char *topic, const uint8_t *payload, size_t size, bool retain, uint8_t flags, uint16_t id);
+    void sendinflight(inflight_t &entry);
+    void receive();
+    void receiveconnack();
+    void handlepacket();
+    void handleoversize();
+    uint16_t packetid();
+    static uint32_t hash(const uint8_t *data, size_t length);
+};
+
+#endif // __MQTTCLIENT_H_INCLUDED__
\ No newline at end of file
@@ -0,0 +1,104 @@
+#ifndef __PAYLOAD_H_INCLUDED__
+#define __PAYLOAD_H_INCLUDED__
+
+/*
+* Writer of the telemetry payloads (sensors, info, snapshot, boot and the
+* memory and diagnostics topics). A payload is a flat record of named fields and
+* is encoded as json object or - if the topic is selected in
+* mqttBinaryTopics - in a compact binary form: one byte with the schema
+* version of the topic followed by a CBOR array with the values of all
+* fields in the order they were added. The field names and units are not
+* sent, they are defined by the schema version. A json payload always starts
+* with '{', so a decoder can tell both forms apart by the first byte (see
+* scripts/payload_decode.py).
+*/
+
+#include "hal.h"
+#include "mqtt.h"
+
+// schema versions of the binary payloads - a version must be incremented
+// whenever the fields of its topic change (and the decoder updated)
+#define PAYLOAD_SCHEMASENSORS       1
+#define PAYLOAD_SCHEMAINFO          1
+#define PAYLOAD_SCHEMASNAPSHOT      1
+#define PAYLOAD_SCHEMAMEMORY        1
+#define PAYLOAD_SCHEMATRACE         1
+#define PAYLOAD_SCHEMACOMMANDQUEUE  1
+#define PAYLOAD_SCHEMADELIVERY      1
+#define PAYLOAD_SCHEMABOOT          3
+#define PAYLOAD_SCHEMAWATCHDOG      1
+#define PAYLOAD_SCHEMACRASH         1
+#define PAYLOAD_SCHEMACONFIG        1
+#define PAYLOAD_SCHEMAUPDATE        1
+#define PAYLOAD_SCHEMASTATE         1
+#define PAYLOAD_SCHEMAIDLE          1
+
+// size of the payload buffer - the mqtt packet must fit into 256 bytes
+// (MQTTCLIENT_BUFFERSIZE), with a long topic prefix a payload close to the
+// maximum doesn't and is dropped by mqtt_send()
+#define PAYLOAD_MAXSIZE             224
+
+// a CBOR array header of one byte takes up to 23 values
+#define PAYLOAD_MAXFIELDS           23
+
+class PayloadWriter
+{
+public:
+    PayloadWriter(mqtt_topic_t topic, uint8_t schema);
+    PayloadWriter(mqtt_topic_t topic, uint8_t schema, bool binary);
+
+    void addUint(const char *name, unsigned long value);
+    void addBool(const char *name, bool value);
+    void addString(const char *name, const char *value);
+    void addMeasurement(const char *name, float value, unsigned int decimals, const char *unit);
+    void addNumber(const char *name, float value, unsigned int decimals);
+    void addMissing(const char *name);
+    void beginArray(const char *name, uint8_t count);
+    void endArray();
+    void end();
+    void publish(bool retain);
+
+    bool isBinary() const
+    {
+        return binary;
+    }
+
+    bool isValid() const
+    {
+        return !overflow;
+    }
+
+    const char *data() const
+    {
+        return (const char *)buffer;
+    }
+
+    size_t size() const
+    {
+        return len;
+    }
+
+private:
+    void init(mqtt_topic_t topic, uint8_t schema, bool binary);
+    void field(const char *name);
+    void put(const void *data, size_t count);
+    void putbyte(uint8_t c);
+    void putheader(uint8_t major, uint32_t value);
+    void puttext(const char *text);
+    void putfloat(float value);
+
+    mqtt_topic_t topic;
+    bool binary;
+    bool overflow;
+    bool ended;
+    bool inArray;
+    uint8_t fields;
+    uint8_t items;
+    size_t len;
+    uint8_t buffer[PAYLOAD_MAXSIZE + 1];
+};
+
+/* exports */
+bool payload_isbinarytopic(mqtt_topic_t topic);
+
+#endif // __PAYLOAD_H_INCLUDED__
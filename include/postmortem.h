@@ -0,0 +1,71 @@
+#ifndef __POSTMORTEM_H_INCLUDED__
+#define __POSTMORTEM_H_INCLUDED__
+
+/*
+* Post-mortem record. A small record in ram which is not initialized at
+* startup (section .noinit, see HAL_NOINIT, the board build checks its
+* placement with scripts/check_noinit.py) keeps the last state of the
+* controller across a reset: the duration of the last POSTMORTEM_LOOPS passes
+* of the main loop, the supervised module which was running, the last
+* POSTMORTEM_EVENTS door and mqtt events and the reason of the reset if the
+* firmware initiated it (shutdown handler of the watchdog, supervisor).
+*
+* The record is written continuously. Its checksum is the sum of all words
+* and is updated with every word written, so the record is valid at any
+* moment and needs no final write before the reset. It is frozen once the
+* cause is recorded. After power-on the ram
+* holds random data, the checksum doesn't match and the record is started
+* over. After any other reset postmortem_init() finds a valid record, keeps a
+* copy and postmortem_loop() publishes it once (retained) on gdc/diag/crash
+* when the broker is connected, e.g.
+*
+*   {"cause":"watchdog","uptime":5321,"module":"hmi","module_ms":16002,
+*    "loops_us":[212,...],"events":["door1 closed",...]}
+*
+* uptime is the time in s since the previous start when the record was
+* written last, module_ms the time the module was running by then. The
+* oldest loop timing and event come first. The sizes are chosen so the
+* payload fits into PAYLOAD_MAXSIZE.
+*/
+
+#include "hal.h"
+
+#define POSTMORTEM_MAGIC        0x47444350UL    // "GDCP"
+#define POSTMORTEM_LOOPS        6
+#define POSTMORTEM_EVENTS       4
+#define POSTMORTEM_EVENTLENGTH  16              // incl. terminating zero, multiple of 4
+
+// loop timings are clipped to 16 bits
+#define POSTMORTEM_MAXLOOP_US   65535UL
+
+// reason of the reset recorded by the firmware - without one the reset
+// cause reported by the hardware is published
+#define POSTMORTEM_CAUSENONE        0
+#define POSTMORTEM_CAUSEWATCHDOG    1   // the hardware watchdog expired
+#define POSTMORTEM_CAUSESUPERVISOR  2   // a critical module was unhealthy
+
+// the record - all members are words, the checksum covers all but itself
+struct postmortem_record_t
+{
+    uint32_t magic;
+    uint32_t cause;
+    uint32_t module;            // supervisor_module_t, SUPERVISOR_NONE between the modules
+    uint32_t moduleBegin_ms;
+    uint32_t uptime_ms;         // time of the last update since the start
+    uint32_t loopHead;
+    uint32_t loops_us[POSTMORTEM_LOOPS];
+    uint32_t eventHead;
+    uint32_t events[POSTMORTEM_EVENTS][POSTMORTEM_EVENTLENGTH / 4];
+    uint32_t checksum;
+};
+
+/* exports */
+void postmortem_init();
+void postmortem_loop();
+void postmortem_looptime(uint32_t duration_us);
+void postmortem_module(uint8_t module);
+void postmortem_event(const char *text);
+void postmortem_setcause(uint8_t cause);
+const postmortem_record_t *postmortem_getlast();
+
+#endif // __POSTMORTEM_H_INCLUDED__
@@ -0,0 +1,36 @@
+#ifndef __RESYNC_H_INCLUDED__
+#define __RESYNC_H_INCLUDED__
+
+/*
+* Resynchronization with the broker after a (re)connect. Reconnects are
+* delayed by an exponential backoff with random jitter, so a fleet of
+* controllers doesn't hit a restarted broker in the same moment. For every
+* retained topic the hash of the payload the broker is known to hold is
+* tracked. It is learned from the retained messages the broker delivers
+* right after the connect and from every retained publish of the device.
+* After a connect only the retained topics whose current payload differs
+* from the broker's copy are published again (see mqtt.cpp).
+*/
+
+#include "hal.h"
+#include "mqtt.h"
+
+// counters of the resynchronization
+struct resync_stats_t
+{
+    unsigned long connects;
+    unsigned long resent;
+    unsigned long skipped;
+};
+
+/* exports */
+void resync_init(uint32_t seed);
+uint32_t resync_reconnectdelay(uint8_t attempt);
+void resync_begin();
+void resync_received(mqtt_topic_t topic, const char *payload, size_t size);
+void resync_published(mqtt_topic_t topic, const char *payload, size_t size);
+bool resync_isdivergent(mqtt_topic_t topic, const char *payload, size_t size);
+uint32_t resync_hash(const char *data, size_t size);
+const resync_stats_t *resync_getstats();
+
+#endif // __RESYNC_H_INCLUDED__
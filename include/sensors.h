@@ -1,5 +1,5 @@
 /* exports */
-void sensors_init();
+bool sensors_init();
 void sensors_loop();
 float sensors_get_temperature();
 float sensors_get_humidity();
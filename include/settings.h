@@ -0,0 +1,71 @@
+#ifndef __SETTINGS_H_INCLUDED__
+#define __SETTINGS_H_INCLUDED__
+
+/*
+* Runtime settings. The timing parameters of config.cpp which can be tuned
+* without a reflash are listed in a table with their valid range (all are
+* int variables with a time in ms).
+* A new set is delivered as json object on the retained topic gdc/config/set,
+* only the fields to change need to be given - the others keep their compiled
+* default, e.g.
+*
+*   {"display_ms":60000,"debounce_ms":80}
+*
+* A document with an unknown field, a value which is not an unsigned number
+* or a value out of range is rejected as a whole, so a typo never leaves a
+* half applied set. An accepted document is applied at once - the modules
+* read the variables on every use - and cached on the SD card
+* (SETTINGS_CACHEFILE). The cache is loaded by the config stage right after
+* the core stage (see boot.h), so the tuned values are active long before
+* the broker is connected. An empty retained message restores the compiled
+* defaults and removes the cache.
+*
+* The active values are echoed (retained) on gdc/config/active with the
+* source of the last document and the fields of a rejected document, e.g.
+*
+*   {"display_ms":60000,...,"heartbeat_ms":1000,"source":"broker","rejected":""}
+*
+* A document which is too large or no json object is rejected with
+* "rejected":"document". SETTINGS_MAXDOCUMENT is the largest document which
+* fits into the receive buffer of the mqtt client with the longest topic
+* prefix, a larger one is reported by the client without its content.
+*/
+
+#include "hal.h"
+#include "mqttclient.h"
+
+#define SETTINGS_CACHEFILE      "CONFIG.JSN"
+// receive buffer - topic length, <prefix>/config/set and the packet id
+#define SETTINGS_MAXDOCUMENT    (MQTTCLIENT_BUFFERSIZE - 2 - (MQTT_MAXTOPICPREFIXLENGTH - 1 + sizeof("/config/set") - 1) - 2)
+#define SETTINGS_MAXNAMELENGTH  16
+
+// source of the active document
+#define SETTINGS_SOURCEDEFAULT  0
+#define SETTINGS_SOURCESD       1
+#define SETTINGS_SOURCEBROKER   2
+
+// a setting - the variable of config.cpp and its valid range
+struct settings_def_t
+{
+    const char *name;
+    int *value;
+    int min;
+    int max;
+};
+
+struct settings_stats_t
+{
+    unsigned long accepted;
+    unsigned long rejected;
+    unsigned long cacheWrites;
+    uint8_t source;
+};
+
+/* exports */
+void settings_init();
+void settings_loop();
+bool settings_apply(const char *document, size_t size, uint8_t source);
+void settings_rejectoversize(uint8_t source);
+const settings_stats_t *settings_getstats();
+
+#endif // __SETTINGS_H_INCLUDED__
@@ -0,0 +1,28 @@
+#ifndef __SHA256_H_INCLUDED__
+#define __SHA256_H_INCLUDED__
+
+/*
+* SHA-256 (FIPS 180-4) and HMAC-SHA256 (RFC 2104) on fixed buffers, used to
+* authenticate the frames of the udp control channel (udpcontrol.h)
+*/
+
+#include "hal.h"
+
+#define SHA256_BLOCKSIZE    64
+#define SHA256_DIGESTSIZE   32
+
+struct sha256_t
+{
+    uint32_t state[8];
+    uint64_t length;
+    uint8_t block[SHA256_BLOCKSIZE];
+    size_t blockLength;
+};
+
+/* exports */
+void sha256_init(sha256_t *ctx);
+void sha256_update(sha256_t *ctx, const uint8_t *data, size_t size);
+void sha256_final(sha256_t *ctx, uint8_t digest[SHA256_DIGESTSIZE]);
+void hmac_sha256(const uint8_t *key, size_t keySize, const uint8_t *data, size_t size, uint8_t mac[SHA256_DIGESTSIZE]);
+
+#endif // __SHA256_H_INCLUDED__
@@ -0,0 +1,111 @@
+#ifndef __SIM_H_INCLUDED__
+#define __SIM_H_INCLUDED__
+
+/*
+* Discrete-event simulator for the native target. The complete firmware
+* (setup() and loop()) runs on the virtual clock of hal_native.cpp and is
+* driven by scheduled events: door input edges, button presses, sensor
+* values, broker outages, link changes and remote commands. Events fire at
+* their virtual time even while the firmware blocks (e.g. in hal_delay()).
+* The firmware connects to the in-process broker of broker.h, which the
+* simulator observes to record every published topic. Latency and loss
+* can be injected with broker_setlatency() and broker_setloss().
+*
+* Events can be scheduled by code (sim_door(), sim_command(), ...) or be
+* loaded from a trace, one event per line:
+*
+*   <time_ms> door <door> open|closed|moving|external
+*   <time_ms> input <pin> 0|1
+*   <time_ms> button open|close|info <duration_ms>
+*   <time_ms> sensors <temperature> <humidity> <pressure> <illuminance>
+*   <time_ms> broker up|down
+*   <time_ms> link up|down
+*   <time_ms> command <door> <payload>
+*
+* Times are relative to sim_init(). Empty lines and lines starting with #
+* are ignored.
+*/
+
+#include "hal.h"
+
+// capacity of the event queue and of the topic recorder
+#define SIM_MAXEVENTS           4096
+#define SIM_MAXTOPICS           64
+#define SIM_MAXPAYLOAD          256
+#define SIM_MAXTEXT             64
+
+// event types
+#define SIM_EVENTDOOR           0
+#define SIM_EVENTINPUT          1
+#define SIM_EVENTBUTTON         2
+#define SIM_EVENTBUTTONRELEASE  3
+#define SIM_EVENTSENSORS        4
+#define SIM_EVENTBROKER         5
+#define SIM_EVENTLINK           6
+#define SIM_EVENTCOMMAND        7
+
+// door states of the simulated drive (both status inputs)
+#define SIM_DOOROPEN            0
+#define SIM_DOORCLOSED          1
+#define SIM_DOORMOVING          2
+#define SIM_DOOREXTERNAL        3
+
+// number of buckets of the loop time histogram (bucket n: < 2^n us)
+#define SIM_HISTOGRAMBUCKETS    24
+
+struct sim_event_t
+{
+    uint64_t at_ms;
+    uint8_t type;
+    int16_t index;
+    int32_t value;
+    float values[4];
+    char text[SIM_MAXTEXT];
+};
+
+// timing of the loop() passes - host time and virtual time per pass
+struct sim_loopstats_t
+{
+    unsigned long passes;
+    uint64_t hostTotal_ns;
+    uint64_t hostMax_ns;
+    uint64_t virtualTotal_us;
+    uint64_t virtualMax_us;
+    unsigned long histogram[SIM_HISTOGRAMBUCKETS];
+};
+
+/* setup - starts the virtual clock at start_ms and runs setup() */
+void sim_init(uint32_t start_ms, uint32_t looptick_us);
+void sim_setlooptick(uint32_t looptick_us);
+void sim_doormodel(int door, uint32_t travel_ms);
+
+/* events */
+bool sim_schedule(const sim_event_t &event);
+bool sim_door(uint64_t at_ms, int door, int state);
+bool sim_input(uint64_t at_ms, uint8_t pin, int value);
+bool sim_button(uint64_t at_ms, int button, uint32_t duration_ms);
+bool sim_sensors(uint64_t at_ms, float temperature, float humidity, float pressure, float illuminance);
+int sim_sensorramp(uint64_t from_ms, uint64_t to_ms, uint32_t step_ms, const float from[4], const float to[4]);
+bool sim_broker(uint64_t at_ms, bool up);
+bool sim_link(uint64_t at_ms, bool up);
+bool sim_command(uint64_t at_ms, int door, const char *payload);
+int sim_loadtrace(const char *text);
+int sim_loadfile(const char *path);
+int sim_pending();
+
+/* run */
+void sim_run(uint64_t duration_ms);
+uint64_t sim_now_ms();
+double sim_speedup();
+
+/* observations */
+unsigned long sim_publishcount(const char *topic);
+const char *sim_lastpayload(const char *topic);
+bool sim_lastretain(const char *topic);
+unsigned long sim_connects();
+bool sim_connected();
+const sim_loopstats_t *sim_loopstats();
+uint64_t sim_looppercentile_us(int percent);
+void sim_sethook(void (*hook)(const char *topic, const char *payload, bool retain));
+
+#endif // __SIM_H_INCLUDED__
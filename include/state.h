@@ -0,0 +1,54 @@
+#ifndef __STATE_H_INCLUDED__
+#define __STATE_H_INCLUDED__
+
+/*
+* Aggregated device state. The state which is spread over the door, sensor
+* and system topics is collected into one document: the current state and the
+* last command source of every door, the sensor values, the ethernet link,
+* the number of broker connects and the health of the supervised modules.
+*
+* The full document is published (retained) on gdc/state after every
+* connect, when it is requested on gdc/state/get and every
+* STATE_REFRESH_MS while it changes. Every change is published right away on
+* gdc/state/delta with the changed fields only, e.g.
+*
+*   gdc/state        {"seq":41,"doors":["closed"],"sources":["remote"],
+*                     "temperature":21.5,"humidity":40,"pressure":100.5,
+*                     "illuminance":250,"link":true,"connects":1,"healthy":true}
+*   gdc/state/delta  {"seq":42,"doors":["opening"],"sources":["local"]}
+*
+* seq is incremented with every delta, the full document carries the seq of
+* the last delta it includes. A consumer applies a delta whose seq follows
+* the one it knows and requests the full document otherwise (e.g. after a
+* reboot of the controller seq starts over). Both topics use the same
+* schema (PAYLOAD_SCHEMASTATE), a field which isn't part of a delta is null
+* in the binary form. The sensor values are compared at the precision they
+* are published with, the link and the health are checked every
+* STATE_POLL_MS. The json form of the full document fits into
+* PAYLOAD_MAXSIZE with up to 2 doors, more doors need the binary form
+* (mqttBinaryTopics).
+*/
+
+#include "hal.h"
+#include "mqtt.h"
+
+#define STATE_POLL_MS           1000
+#define STATE_REFRESH_MS        60000
+#define STATE_MAXTEXT           12
+
+struct state_stats_t
+{
+    uint32_t seq;
+    unsigned long fulls;
+    unsigned long deltas;
+    unsigned long requests;
+};
+
+/* exports */
+void state_init();
+void state_loop();
+void state_published(mqtt_topic_t topic, const char *payload, size_t size);
+void state_request();
+const state_stats_t *state_getstats();
+
+#endif // __STATE_H_INCLUDED__
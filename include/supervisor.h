@@ -0,0 +1,70 @@
+#ifndef __SUPERVISOR_H_INCLUDED__
+#define __SUPERVISOR_H_INCLUDED__
+
+/*
+* Software watchdog of the modules. loop() brackets the loop function of
+* every supervised module with supervisor_begin()/supervisor_end(). A pass
+* which takes longer than the budget of its module is an overrun, a module
+* which doesn't complete a pass within its deadline has missed its check-in
+* (a module is supervised from its first pass on, see boot.h).
+*
+* Escalation:
+*   1. every overrun and missed check-in is counted and published on
+*      gdc/diag/watchdog (at most once per module and SUPERVISOR_WINDOW_MS)
+*   2. a critical module is unhealthy if it misses its check-in, if one pass
+*      exceeds its deadline or if it overruns SUPERVISOR_MAXOVERRUNS times
+*      within SUPERVISOR_WINDOW_MS. The hardware watchdog is only cleared
+*      while all critical modules are healthy.
+*   3. SUPERVISOR_RESETGRACE_MS after a critical module got unhealthy the
+*      controller is reset - the reason is published and logged before. If
+*      even that doesn't happen, the hardware watchdog resets the board.
+*
+* If the hardware watchdog expires, supervisor_getactive() tells which
+* module was running at that moment.
+*/
+
+#include "hal.h"
+
+#define SUPERVISOR_WINDOW_MS        10000
+#define SUPERVISOR_MAXOVERRUNS      5
+#define SUPERVISOR_RESETGRACE_MS    1000
+
+// supervised modules
+enum supervisor_module_t
+{
+    SUPERVISOR_DRIVEIO,
+    SUPERVISOR_HMI,
+    SUPERVISOR_SENSORS,
+    SUPERVISOR_MQTT,
+    SUPERVISOR_DISPLAY,
+    SUPERVISOR_NUMMODULES,
+    SUPERVISOR_NONE = SUPERVISOR_NUMMODULES
+};
+
+// events published on gdc/diag/watchdog
+#define SUPERVISOR_EVENTOVERRUN     "overrun"
+#define SUPERVISOR_EVENTMISSED      "missed"
+#define SUPERVISOR_EVENTRESET       "reset"
+
+// counters of a module
+struct supervisor_stats_t
+{
+    unsigned long passes;
+    unsigned long overruns;
+    unsigned long missed;
+    uint32_t max_ms;        // longest pass
+    uint32_t lastOverrun_ms;// time over the budget of the last overrun
+    bool healthy;
+};
+
+/* exports */
+void supervisor_init();
+void supervisor_loop();
+void supervisor_begin(supervisor_module_t module);
+void supervisor_end(supervisor_module_t module);
+supervisor_module_t supervisor_getactive(uint32_t *elapsed_ms);
+const char *supervisor_modulename(supervisor_module_t module);
+const supervisor_stats_t *supervisor_getstats(supervisor_module_t module);
+bool supervisor_ishealthy();
+
+#endif // __SUPERVISOR_H_INCLUDED__
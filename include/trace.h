@@ -0,0 +1,19 @@
+// stages of a command trace - timestamps are taken in this order
+#define TRACE_RECEIVED      0   // command received in the mqtt callback
+#define TRACE_DEQUEUED      1   // command picked up by loop()
+#define TRACE_PULSESTART    2   // rising edge of the command pulse
+#define TRACE_FIRSTCHANGE   3   // first change of the door inputs
+#define TRACE_FINALSTATE    4   // door reached the requested state
+#define TRACE_NUMSTAGES     5
+
+// traces which do not reach the final state are published after this time
+#define TRACE_TIMEOUT_MS    120000
+
+// maximum length of a correlation id
+#define TRACE_MAXIDLENGTH   24
+
+/* exports */
+void trace_begin(int door, int command, const char* correlationId);
+void trace_mark(int door, int stage);
+void trace_doorstatus(int door, int status);
+void trace_loop();
\ No newline at end of file
@@ -0,0 +1,85 @@
+#ifndef __UDPCONTROL_H_INCLUDED__
+#define __UDPCONTROL_H_INCLUDED__
+
+/*
+* Local udp control channel: door commands and status queries which don't
+* need the broker. Every frame has a fixed size and is authenticated by an
+* HMAC-SHA256 (truncated to 128 bits) with the shared key udpControlKey.
+* The counter of a frame must be higher than the counter of the last
+* accepted frame, so a recorded frame can't be replayed. The highest
+* accepted counter is kept on the SD card (UDPCONTROL_COUNTERFILE) and
+* loaded at the start, so this holds across resets and power cycles: a
+* command is only executed once its counter is written, the counter of a
+* query is written with the next command or after
+* UDPCONTROL_SAVEINTERVAL_MS. The channel isn't started without the SD card
+* or with an invalid counter file (remove it to start over). Commands enter the
+* same command queue as the mqtt commands (source remote) and every valid
+* frame is answered at once with a status frame carrying the same counter.
+* Invalid frames are dropped without an answer.
+*
+* Frame (28 bytes, numbers big-endian):
+*   0  magic 'G'      1  version        2  type           3  door (1..)
+*   4  command/state  5  result         6  seq (2)        8  counter (4)
+*   12 mac (16) over bytes 0..11
+*/
+
+#include "hal.h"
+
+#define UDPCONTROL_MAGIC        'G'
+#define UDPCONTROL_VERSION      1
+#define UDPCONTROL_FRAMESIZE    28
+#define UDPCONTROL_MACOFFSET    12
+#define UDPCONTROL_MACSIZE      16
+
+// frames handled per pass of the main loop
+#define UDPCONTROL_MAXPERPASS   4
+
+#define UDPCONTROL_COUNTERFILE  "UDPCTR.DAT"
+#define UDPCONTROL_COUNTERMAGIC 0x47554331  // "GUC1"
+#define UDPCONTROL_SAVEINTERVAL_MS 60000
+
+// results of udpcontrol_decode()
+#define UDPCONTROL_FRAMEVALID   0
+#define UDPCONTROL_FRAMEMALFORMED 1     // size, magic or version
+#define UDPCONTROL_FRAMEBADMAC  2
+
+// frame types
+#define UDPCONTROL_COMMAND      0x01    // door command (DOORCOMMANDOPEN/DOORCOMMANDCLOSE)
+#define UDPCONTROL_QUERY        0x02    // status query
+#define UDPCONTROL_STATUS       0x81    // answer: door state (driveio.h) and result
+
+// results of the status frame
+#define UDPCONTROL_OK           0
+#define UDPCONTROL_REJECTED     1       // rate limit or full command queue
+#define UDPCONTROL_INVALID      2       // unknown door, command or type
+
+struct udpcontrol_frame_t
+{
+    uint8_t type;
+    uint8_t door;
+    uint8_t value;
+    uint8_t result;
+    uint16_t seq;
+    uint32_t counter;
+};
+
+// counters of the control channel
+struct udpcontrol_stats_t
+{
+    unsigned long received;
+    unsigned long accepted;
+    unsigned long malformed;
+    unsigned long badMac;
+    unsigned long replayed;
+    unsigned long counterWrites;
+    unsigned long counterFailures;  // commands dropped as their counter couldn't be written
+};
+
+/* exports */
+void udpcontrol_init();
+void udpcontrol_loop();
+void udpcontrol_encode(const udpcontrol_frame_t &frame, const uint8_t *key, size_t keySize, uint8_t *buffer);
+uint8_t udpcontrol_decode(const uint8_t *buffer, size_t size, const uint8_t *key, size_t keySize, udpcontrol_frame_t *frame);
+const udpcontrol_stats_t *udpcontrol_getstats();
+
+#endif // __UDPCONTROL_H_INCLUDED__
@@ -0,0 +1,79 @@
+#ifndef __UPDATE_H_INCLUDED__
+#define __UPDATE_H_INCLUDED__
+
+/*
+* Firmware staging. A new firmware image is sent in numbered chunks on
+* gdc/update/chunk and written to the SD card (UPDATE_IMAGEFILE) while the
+* controller keeps running. A chunk is a binary payload with a header of 16
+* bytes (little endian) followed by the data:
+*
+*   version(1) reserved(1) index(2) image size(4) image crc(4) chunk crc(4)
+*
+* Every chunk has UPDATE_CHUNKSIZE bytes, only the last one is shorter. The
+* crcs are CRC-32 (as zlib.crc32). The image is identified by its size and
+* crc, chunk 0 of another image starts it over.
+*
+* The chunks are collected in a buffer of one SD sector and written as
+* whole sectors, the image is never held in ram. Chunks must arrive in
+* order: a chunk with a bad crc or after a gap is dropped, a chunk which was
+* already received is ignored. The progress is written to UPDATE_STATEFILE
+* with every sector, so a transfer interrupted by a reconnect or a reset is
+* resumed at the first chunk of the sector which wasn't written yet. Once
+* the last chunk is written the crc of the whole image is checked.
+*
+* The state is published (retained) on gdc/update/status after every sector
+* and whenever a chunk was dropped, e.g.
+*
+*   {"state":"receiving","size":180224,"crc":305419896,"next":96,
+*    "received":12288,"rate_bps":5120,"errors":0}
+*
+* next is the chunk expected next - the sender sends the chunks of one
+* sector and waits for the status (see scripts/update_upload.py).
+* received counts the bytes of the image before next, so it goes on after a
+* resume and drops with the chunks of a sector which had to be sent again.
+* rate_bps is the throughput of the chunks accepted since the transfer was
+* started or resumed. Installing the image is not part of the firmware.
+*/
+
+#include "hal.h"
+
+#define UPDATE_IMAGEFILE        "UPDATE.IMG"
+#define UPDATE_STATEFILE        "UPDATE.STA"
+#define UPDATE_VERSION          1
+#define UPDATE_HEADERSIZE       16
+#define UPDATE_CHUNKSIZE        128
+#define UPDATE_SECTORSIZE       512
+#define UPDATE_CHUNKSPERSECTOR  (UPDATE_SECTORSIZE / UPDATE_CHUNKSIZE)
+
+// flash of the MKR Zero without the bootloader
+#define UPDATE_MAXIMAGESIZE     (256UL * 1024 - 8192)
+
+// states of the transfer
+#define UPDATE_STATEIDLE        0
+#define UPDATE_STATERECEIVING   1
+#define UPDATE_STATECOMPLETE    2   // all chunks written and the image crc matches
+#define UPDATE_STATEFAILED      3   // the image crc doesn't match, chunk 0 starts over
+
+struct update_stats_t
+{
+    uint8_t state;
+    uint32_t size;
+    uint32_t crc;
+    uint32_t next;              // index of the next chunk
+    uint32_t received;          // bytes of the image before next
+    uint32_t start_ms;          // first chunk since the start or resume
+    uint32_t startReceived;     // received at start_ms
+    uint32_t last_ms;
+    unsigned long errors;       // bad chunks, gaps and failed writes
+    unsigned long duplicates;
+    unsigned long sectorWrites;
+};
+
+/* exports */
+void update_init();
+void update_loop();
+void update_chunk(const uint8_t *payload, size_t size);
+uint32_t update_crc32(uint32_t crc, const uint8_t *data, size_t size);
+const update_stats_t *update_getstats();
+
+#endif // __UPDATE_H_INCLUDED__
@@ -1,56 +1,58 @@
-#include <Arduino.h>
-#include <Ethernet.h>
+#include "hal.h"
 
-#define every_second     1000
-#define every_10_seconds 10000
+#include "config.h"
+#include "idle.h"
+#include "fixedstring.h"
 
 /*
 * converts IP address to string
 */
-String IPAddressToString(IPAddress address)
+FixedString<16> IPAddressToString(IPAddress address)
 {
-        return String(address[0]) + "." +
-               String(address[1]) + "." +
-               String(address[2]) + "." +
-               String(address[3]);
+        FixedString<16> text;
+        return text.format("%u.%u.%u.%u", address[0], address[1], address[2], address[3]);
 }
 
 /*
 * converts float to string
 */
-String toString(float fvalue)
+FixedString<16> toString(float fvalue)
 {
-        return String(fvalue, 0);
+        FixedString<16> text;
+        return text.appendfloat(fvalue, 0);
 }
 
 /*
 * converts float to string with decimal
 */
-String toString(float fvalue, unsigned int num)
+FixedString<16> toString(float fvalue, unsigned int num)
 {
-        return String(fvalue, num);
+        FixedString<16> text;
+        return text.appendfloat(fvalue, num);
 }
 
 /*
-* returns true if 1 second is over
+* returns true if the heartbeat interval is over (heartbeatInterval_ms)
 */
-bool timespan_one_second(){
-        static uint32_t prev_ms = millis();   
-        if (millis() > prev_ms + 1000){
-                prev_ms = millis();
-                return true;
+bool timespan_heartbeat(){
+        static uint32_t prev_ms = hal_millis();   
+        bool over = (hal_millis() - prev_ms > (uint32_t)heartbeatInterval_ms);
+        if (over){
+                prev_ms = hal_millis();
         }
-        return false;
+        idle_due(IDLE_SOURCEHEARTBEAT, prev_ms + heartbeatInterval_ms + 1);
+        return over;
 }
 
 /*
-* returns true if 10 seconds are over
+* returns true if the sensor interval is over (sensorInterval_ms)
 */
-bool timespan_ten_seconds(){
-        static uint32_t prev_ms = millis();   
-        if (millis() > prev_ms + 10000){
-                prev_ms = millis();
-                return true;
+bool timespan_sensors(){
+        static uint32_t prev_ms = hal_millis();   
+        bool over = (hal_millis() - prev_ms > (uint32_t)sensorInterval_ms);
+        if (over){
+                prev_ms = hal_millis();
         }
-        return false;
+        idle_due(IDLE_SOURCESENSORS, prev_ms + sensorInterval_ms + 1);
+        return over;
 }
\ No newline at end of file
@@ -0,0 +1,59 @@
+"""
+Compares the results of the microbenchmarks (test/test_benchmark) with a
+baseline. A benchmark is reported as regression if it takes more than the
+tolerated time or if it allocates more heap memory per call than before.
+The exit code is 1 if there is at least one regression.
+
+    GDC_BENCHMARK_OUTPUT=baseline.json pio test -e native -f test_benchmark
+    ... change the firmware ...
+    pio test -e native -f test_benchmark
+    python scripts/benchmark_compare.py baseline.json benchmark.json --tolerance 10
+"""
+import argparse
+import json
+import sys
+
+
+def load(path):
+    with open(path) as f:
+        data = json.load(f)
+    return data.get("version", "?"), {b["name"]: b for b in data["benchmarks"]}
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Compare benchmark results with a baseline")
+    parser.add_argument("baseline", help="json file of the baseline run")
+    parser.add_argument("current", help="json file of the current run")
+    parser.add_argument("--tolerance", type=float, default=10.0, help="allowed slowdown in percent (default 10)")
+    args = parser.parse_args()
+
+    baseVersion, baseline = load(args.baseline)
+    currentVersion, current = load(args.current)
+    print("baseline %s, current %s" % (baseVersion, currentVersion))
+    print("%-24s %12s %12s %8s %10s  %s" % ("benchmark", "base [ns]", "now [ns]", "change", "alloc/call", "result"))
+
+    regressions = 0
+    for name, result in current.items():
+        base = baseline.get(name)
+        if base is None:
+            print("%-24s %12s %12.1f %8s %10.3f  new" % (name, "-", result["ns_per_call"], "-", result["allocations_per_call"]))
+            continue
+        change = (result["ns_per_call"] - base["ns_per_call"]) * 100.0 / base["ns_per_call"]
+        slower = change > args.tolerance
+        allocates = result["allocations_per_call"] > base["allocations_per_call"]
+        verdict = "ok"
+        if slower or allocates:
+            regressions += 1
+            verdict = "REGRESSION" + (" (time)" if slower else "") + (" (heap)" if allocates else "")
+        print("%-24s %12.1f %12.1f %+7.1f%% %10.3f  %s" % (name, base["ns_per_call"], result["ns_per_call"], change,
+                                                        result["allocations_per_call"], verdict))
+    for name in baseline:
+        if name not in current:
+            print("%-24s missing in current run" % name)
+
+    print("%d regression(s)" % regressions)
+    sys.exit(1 if regressions else 0)
+
+
+if __name__ == "__main__":
+    main()
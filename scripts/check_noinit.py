@@ -0,0 +1,70 @@
+"""
+Checks the placement of the section .noinit (see HAL_NOINIT in include/hal.h)
+after the link of a board environment. The linker script of the core has no
+rule for it, so the linker places it as an orphan section. The startup code
+copies .data and zeroes .bss and malloc() takes the ram from the symbol end
+on - the post-mortem record only survives a reset outside of all of them.
+The build fails otherwise.
+
+    extra_scripts = post:scripts/check_noinit.py
+"""
+import subprocess
+
+Import("env")
+
+
+def tool(name):
+    # arm-none-eabi-gcc -> arm-none-eabi-<name>
+    return env.subst("$CC")[:-len("gcc")] + name
+
+
+def run(args):
+    return subprocess.run(args, check=True, capture_output=True, text=True, env=env["ENV"]).stdout
+
+
+def sections(elf):
+    # objdump -h: Idx Name Size VMA LMA File-off Algn
+    result = {}
+    for line in run([tool("objdump"), "-h", elf]).splitlines():
+        fields = line.split()
+        if len(fields) >= 4 and fields[0].isdigit():
+            result[fields[1]] = (int(fields[3], 16), int(fields[2], 16))
+    return result
+
+
+def symbols(elf):
+    result = {}
+    for line in run([tool("nm"), elf]).splitlines():
+        fields = line.split()
+        if len(fields) == 3:
+            result[fields[2]] = int(fields[0], 16)
+    return result
+
+
+def check_noinit(source, target, env):
+    elf = str(target[0])
+    noinit = sections(elf).get(".noinit")
+    if noinit is None:
+        print("NOINIT: no section .noinit in %s" % elf)
+        return 1
+    start, end = noinit[0], noinit[0] + noinit[1]
+    symbol = symbols(elf)
+    missing = [name for name in ("__data_start__", "__data_end__", "__bss_start__", "__bss_end__", "end", "__StackTop")
+               if name not in symbol]
+    if missing:
+        print("NOINIT: symbols %s of the linker script not found" % ", ".join(missing))
+        return 1
+    ranges = [
+        ("initialized data", symbol["__data_start__"], symbol["__data_end__"]),
+        ("zeroed bss", symbol["__bss_start__"], symbol["__bss_end__"]),
+        ("heap and stack", symbol["end"], symbol["__StackTop"]),
+    ]
+    for name, low, high in ranges:
+        if start < high and low < end:
+            print("NOINIT: .noinit 0x%08x-0x%08x overlaps the %s 0x%08x-0x%08x" % (start, end, name, low, high))
+            return 1
+    print("NOINIT: .noinit 0x%08x-0x%08x (%d bytes) is kept across a reset" % (start, end, end - start))
+    return 0
+
+
+env.AddPostAction("$BUILD_DIR/${PROGNAME}.elf", check_noinit)
@@ -0,0 +1,93 @@
+"""
+Fleet simulation: runs growing fleets of native firmware instances against
+one local broker and reports the broker message rate, the command round
+trip per device and the reconnect storm after a broker restart.
+
+Every instance is the native program (pio run -e native) with its own
+client id and topic prefix. The broker is the same program in fleet mode
+(see include/fleet.h), which also measures the round trips.
+
+    pio run -e native
+    python scripts/fleet_sim.py --sizes 10,50,100,200 --duration 60
+"""
+import argparse
+import json
+import os
+import signal
+import subprocess
+import sys
+import time
+
+
+def run_fleet(program, size, args):
+    duration_ms = int(args.duration * 1000)
+    restart_ms = int(duration_ms * 0.6)
+    broker = subprocess.Popen(
+        [program, "fleet", "--port", str(args.port), "--duration", str(duration_ms),
+         "--probe-interval", str(args.probe_interval), "--restart-at", str(restart_ms),
+         "--downtime", str(args.downtime)],
+        stdout=subprocess.PIPE, universal_newlines=True)
+    time.sleep(0.5)
+
+    devices = []
+    for i in range(size):
+        devices.append(subprocess.Popen(
+            [program, "--realtime", "--quiet", "--broker", "127.0.0.1", str(args.port),
+             "--client-id", "gdc-fleet-%d" % i, "--topic-prefix", "fleet/%d" % i],
+            stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL))
+
+    seconds = []
+    summary = None
+    for line in broker.stdout:
+        data = json.loads(line)
+        if "summary" in data:
+            summary = data["summary"]
+        else:
+            seconds.append(data)
+            if args.verbose:
+                print("  " + line.strip())
+    broker.wait()
+
+    for device in devices:
+        device.send_signal(signal.SIGTERM)
+    for device in devices:
+        device.wait()
+    return summary, seconds
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--program", default=os.path.join(".pio", "build", "native", "program"))
+    parser.add_argument("--sizes", default="10,50,100", help="comma separated fleet sizes")
+    parser.add_argument("--duration", type=float, default=60.0, help="seconds per fleet size")
+    parser.add_argument("--port", type=int, default=18830)
+    parser.add_argument("--probe-interval", type=int, default=5000, help="ms between two commands per device")
+    parser.add_argument("--downtime", type=int, default=3000, help="ms the broker is down on the restart")
+    parser.add_argument("--output", help="write all results as json")
+    parser.add_argument("--verbose", action="store_true", help="print the rates of every second")
+    args = parser.parse_args()
+
+    results = []
+    print("%6s %10s %8s %10s %10s %10s %12s %12s %12s" % (
+        "size", "msg/s", "answers", "p50 [ms]", "p99 [ms]", "max [ms]", "worst [ms]", "reconn [ms]", "connects/s"))
+    for size in [int(s) for s in args.sizes.split(",")]:
+        summary, seconds = run_fleet(args.program, size, args)
+        if summary is None:
+            print("%6d fleet broker failed" % size)
+            return 1
+        results.append({"size": size, "summary": summary, "seconds": seconds})
+        latency = summary["latency_us"]
+        restart = summary["restart"]
+        print("%6d %10.0f %8s %10.1f %10.1f %10.1f %12.1f %12d %12d" % (
+            size, summary["messages_per_s"], "%d/%d" % (summary["answers"], summary["probes"]),
+            latency["p50"] / 1000.0, latency["p99"] / 1000.0, latency["max"] / 1000.0,
+            summary["device_mean_us"]["max"] / 1000.0, restart["reconnect_ms"], restart["peak_connects_per_s"]))
+
+    if args.output:
+        with open(args.output, "w") as f:
+            json.dump(results, f, indent=1)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
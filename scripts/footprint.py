@@ -0,0 +1,86 @@
+"""
+Reports the footprint of the feature selections (see
+include/buildfeatures.h): flash and ram of the firmware of the board and the
+time of a pass of the main loop. Flash is .text + .data, ram is .data + .bss (the stack and the
+heap come on top). The loop time is taken from the native build which runs
+the same loop on the host - it is only good for comparing the selections,
+on the board see gdc_loop_duration_mean_us of the metrics endpoint.
+
+    python scripts/footprint.py
+    python scripts/footprint.py --no-build --duration 120000
+"""
+import argparse
+import os
+import re
+import shutil
+import subprocess
+import sys
+
+# feature selection -> (board environment, native environment)
+SELECTIONS = [
+    ("full", "mkrzero-full", "native"),
+    ("minimal", "mkrzero-minimal", "native-minimal"),
+]
+
+
+def find_size_tool():
+    tool = shutil.which("arm-none-eabi-size")
+    if tool:
+        return tool
+    # the toolchain installed by PlatformIO
+    path = os.path.expanduser("~/.platformio/packages/toolchain-gccarmnoneeabi/bin/arm-none-eabi-size")
+    return path if os.path.exists(path) else None
+
+
+def build(env):
+    subprocess.run(["pio", "run", "-e", env], check=True, stdout=subprocess.DEVNULL)
+
+
+def flash_ram(tool, env):
+    elf = os.path.join(".pio", "build", env, "firmware.elf")
+    if tool is None or not os.path.exists(elf):
+        return None, None
+    output = subprocess.run([tool, "-A", elf], check=True, capture_output=True, text=True).stdout
+    sections = {}
+    for line in output.splitlines():
+        fields = line.split()
+        if len(fields) >= 2 and fields[1].isdigit():
+            sections[fields[0]] = int(fields[1])
+    text, data, bss = sections.get(".text", 0), sections.get(".data", 0), sections.get(".bss", 0)
+    return text + data, data + bss
+
+
+def loop_time(env, duration_ms):
+    program = os.path.join(".pio", "build", env, "program")
+    if not os.path.exists(program):
+        return None, None
+    # no broker is listening on port 1, the loop runs without connection
+    output = subprocess.run([program, "--quiet", "--loop-stats", "--duration", str(duration_ms),
+                             "--broker", "127.0.0.1", "1"], capture_output=True, text=True).stdout
+    match = re.search(r"loop: passes \d+ mean_ns (\d+) max_ns (\d+)", output)
+    return (int(match.group(1)), int(match.group(2))) if match else (None, None)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Report flash, ram and loop time of the feature selections")
+    parser.add_argument("--no-build", action="store_true", help="use the existing builds")
+    parser.add_argument("--duration", type=int, default=60000, help="simulated run time of the loop in ms (default 60000)")
+    args = parser.parse_args()
+
+    tool = find_size_tool()
+    if tool is None:
+        print("arm-none-eabi-size not found, flash and ram are not reported", file=sys.stderr)
+
+    print("%-10s %12s %10s %14s %14s" % ("features", "flash [B]", "ram [B]", "loop mean [ns]", "loop max [ns]"))
+    for name, boardEnv, nativeEnv in SELECTIONS:
+        if not args.no_build:
+            build(boardEnv)
+            build(nativeEnv)
+        flash, ram = flash_ram(tool, boardEnv)
+        mean, peak = loop_time(nativeEnv, args.duration)
+        print("%-10s %12s %10s %14s %14s" % (name, flash if flash is not None else "-", ram if ram is not None else "-",
+                                            mean if mean is not None else "-", peak if peak is not None else "-"))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,117 @@
+"""
+Aggregates the command latency traces published by the controller on
+gdc/diag/trace into percentiles per stage.
+
+Traces are either read from a file (one json trace per line, e.g. captured
+with "mosquitto_sub -t gdc/diag/trace > traces.log") or collected live from
+the broker (requires paho-mqtt). In live mode the script can also send
+commands with correlation ids itself and then adds the end-to-end latency
+as seen by the client (publish of the command until arrival of the trace).
+
+    python scripts/latency_report.py --file traces.log
+    python scripts/latency_report.py --broker mosquitto.local --commands 20
+"""
+import argparse
+import json
+import sys
+import time
+
+SEGMENTS = [
+    ("broker->loop", "received", "dequeued"),
+    ("loop->pulse", "dequeued", "pulse"),
+    ("pulse->change", "pulse", "change"),
+    ("change->final", "change", "final"),
+    ("total", "received", "final"),
+]
+
+
+def percentile(values, p):
+    values = sorted(values)
+    if not values:
+        return None
+    index = min(len(values) - 1, int(round(p / 100.0 * (len(values) - 1))))
+    return values[index]
+
+
+def report(traces, roundtrips):
+    print("%-16s %6s %12s %12s %12s %12s" % ("segment", "count", "p50 [ms]", "p90 [ms]", "p99 [ms]", "max [ms]"))
+    rows = []
+    for name, start, end in SEGMENTS:
+        rows.append((name, [(t[end] - t[start]) / 1000.0 for t in traces if start in t and end in t]))
+    if roundtrips:
+        rows.append(("client e2e", roundtrips))
+    for name, values in rows:
+        if not values:
+            continue
+        print("%-16s %6d %12.2f %12.2f %12.2f %12.2f" % (name, len(values), percentile(values, 50),
+                                                         percentile(values, 90), percentile(values, 99), max(values)))
+    timeouts = sum(1 for t in traces if t.get("timeout"))
+    print("traces: %d, timeouts: %d" % (len(traces), timeouts))
+
+
+def read_file(path):
+    traces = []
+    with open(path) as f:
+        for line in f:
+            line = line.strip()
+            if line.startswith("{"):
+                traces.append(json.loads(line))
+    return traces
+
+
+def collect_live(args):
+    import paho.mqtt.client as mqtt
+
+    traces = []
+    sent = {}
+    roundtrips = []
+
+    def on_message(client, userdata, msg):
+        trace = json.loads(msg.payload.decode())
+        traces.append(trace)
+        if trace["id"] in sent:
+            roundtrips.append((time.time() - sent.pop(trace["id"])) * 1000.0)
+
+    client = mqtt.Client()
+    client.username_pw_set(args.username, args.password)
+    client.on_message = on_message
+    client.connect(args.broker, args.port)
+    client.subscribe(args.tracetopic)
+    client.loop_start()
+
+    commands = ["open", "close"]
+    for i in range(args.commands):
+        correlation_id = "lat-%d-%d" % (int(time.time()), i)
+        sent[correlation_id] = time.time()
+        client.publish(args.commandtopic, "%s:%s" % (commands[i % 2], correlation_id))
+        time.sleep(args.interval)
+    deadline = time.time() + args.wait
+    while time.time() < deadline and (sent or args.commands == 0):
+        time.sleep(0.5)
+    client.loop_stop()
+    return traces, roundtrips
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--file", help="read traces from file instead of the broker")
+    parser.add_argument("--broker", default="localhost")
+    parser.add_argument("--port", type=int, default=1883)
+    parser.add_argument("--username", default="mosquitto")
+    parser.add_argument("--password", default="mosquitto")
+    parser.add_argument("--tracetopic", default="gdc/diag/trace")
+    parser.add_argument("--commandtopic", default="gdc/control/setnewdoorstate")
+    parser.add_argument("--commands", type=int, default=0, help="number of open/close commands to send")
+    parser.add_argument("--interval", type=float, default=30.0, help="seconds between two commands")
+    parser.add_argument("--wait", type=float, default=150.0, help="seconds to wait for outstanding traces")
+    args = parser.parse_args()
+
+    if args.file:
+        report(read_file(args.file), [])
+    else:
+        report(*collect_live(args))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,183 @@
+"""
+Decodes the telemetry payloads of the controller (see include/payload.h)
+into json. A payload is either json already or - if the topic is selected
+in mqttBinaryTopics - one byte with the schema version of the topic and a
+CBOR array with the field values in the order of the schema below. Both
+forms are told apart by the first byte: json always starts with '{'.
+
+The payloads are decoded live from the broker (requires paho-mqtt) or given
+as hex on the command line, e.g. copied from a packet capture:
+
+    python scripts/payload_decode.py --broker mosquitto.local
+    python scripts/payload_decode.py --hex gdc/system/sensors 0184fa41ac0000fa42200000fa42c9999afa437a0000
+
+The decoder can be imported by other scripts: decode(topic, payload).
+"""
+import argparse
+import json
+import struct
+import sys
+
+# field names per topic path and schema version - must match the order of
+# the fields in the firmware. The sensor values keep the units of the json
+# form, which are not sent in the binary form.
+SCHEMAS = {
+    "system/sensors": {1: ["temperature", "humidity", "pressure", "illuminance"]},
+    "system/info": {1: ["application", "version", "author"]},
+    "system/snapshot": {1: ["uptime", "connects", "resent", "skipped", "doors"]},
+    "system/memory": {1: ["free", "minfree", "stackmax", "heap", "heapused", "fragmentation", "allocations"]},
+    "system/boot": {1: ["total", "core", "display", "sensors", "network", "mqtt", "services", "failed"],
+                    2: ["total", "core", "config", "display", "sensors", "network", "mqtt", "services", "failed"],
+                    3: ["total", "connected", "core", "config", "display", "sensors", "network", "mqtt", "services",
+                        "failed"]},
+    "diag/watchdog": {1: ["module", "event", "elapsed_ms", "limit_ms", "overruns"]},
+    "diag/crash": {1: ["cause", "uptime", "module", "module_ms", "loops_us", "events"]},
+    "config/active": {1: ["display_ms", "blink_ms", "pulse_ms", "debounce_ms", "sensors_ms", "heartbeat_ms",
+                          "source", "rejected"]},
+    "update/status": {1: ["state", "size", "crc", "next", "received", "rate_bps", "errors"]},
+    "state": {1: ["seq", "doors", "sources", "temperature", "humidity", "pressure", "illuminance", "link", "connects",
+                  "healthy"]},
+    "state/delta": {1: ["seq", "doors", "sources", "temperature", "humidity", "pressure", "illuminance", "link",
+                        "connects", "healthy"]},
+    "diag/trace": {1: ["id", "door", "command", "received", "dequeued", "pulse", "change", "final", "timeout"]},
+    "diag/commandqueue": {1: ["depth", "maxdepth", "accepted", "merged", "ratelimited", "overflow"]},
+    "diag/delivery": {1: ["published", "acked", "retransmits", "expired", "downgraded", "duplicates",
+                          "ack_mean_us", "ack_max_us"]},
+    "diag/idle": {1: ["duty", "awake_ms", "idle_ms", "standby_ms", "sleeps", "wakeups", "limit"]},
+}
+
+# units of the measurements on system/sensors (json form)
+UNITS = {"temperature": "°C", "humidity": "%", "pressure": "kPa", "illuminance": "lx"}
+
+
+class CborReader:
+    """Reads the subset of CBOR the firmware writes: unsigned integers,
+    text strings, definite arrays, float32, booleans and null"""
+
+    def __init__(self, data, pos=0):
+        self.data = data
+        self.pos = pos
+
+    def byte(self):
+        value = self.data[self.pos]
+        self.pos += 1
+        return value
+
+    def argument(self, info):
+        if info < 24:
+            return info
+        size = {24: 1, 25: 2, 26: 4, 27: 8}.get(info)
+        if size is None:
+            raise ValueError("unsupported CBOR length %d" % info)
+        value = int.from_bytes(self.data[self.pos:self.pos + size], "big")
+        self.pos += size
+        return value
+
+    def read(self):
+        initial = self.byte()
+        major, info = initial >> 5, initial & 0x1F
+        if major == 0:
+            return self.argument(info)
+        if major == 1:
+            return -1 - self.argument(info)
+        if major == 3:
+            length = self.argument(info)
+            text = self.data[self.pos:self.pos + length].decode("utf-8")
+            self.pos += length
+            return text
+        if major == 4:
+            return [self.read() for _ in range(self.argument(info))]
+        if initial == 0xF4:
+            return False
+        if initial == 0xF5:
+            return True
+        if initial == 0xF6:
+            return None
+        if initial == 0xFA:
+            value = struct.unpack(">f", self.data[self.pos:self.pos + 4])[0]
+            self.pos += 4
+            return value
+        raise ValueError("unsupported CBOR item 0x%02x" % initial)
+
+
+def topic_path(topic):
+    """Returns the path below the topic prefix, e.g. system/sensors"""
+    for path in SCHEMAS:
+        if topic == path or topic.endswith("/" + path):
+            return path
+    return None
+
+
+def decode(topic, payload):
+    """Returns the payload of a topic as dict (json form) and the size of
+    the binary form (0 if the payload is json)"""
+    if payload[:1] == b"{":
+        return json.loads(payload.decode("utf-8")), 0
+    path = topic_path(topic)
+    if path is None:
+        raise ValueError("no schema for topic %s" % topic)
+    version = payload[0]
+    fields = SCHEMAS[path].get(version)
+    if fields is None:
+        raise ValueError("unknown schema version %d of %s" % (version, path))
+    values = CborReader(payload, 1).read()
+    if len(values) != len(fields):
+        raise ValueError("%s: %d values, schema %d has %d fields" % (path, len(values), version, len(fields)))
+    result = {}
+    for name, value in zip(fields, values):
+        if value is None:
+            continue
+        if name in UNITS and path == "system/sensors":
+            value = {"value": round(value, 4), "unit": UNITS[name]}
+        result[name] = value
+    return result, len(payload)
+
+
+def show(topic, payload):
+    try:
+        document, size = decode(topic, payload)
+    except ValueError as error:
+        print("%s: %s" % (topic, error))
+        return
+    form = ("binary %d bytes, json %d bytes" % (size, len(json.dumps(document, separators=(",", ":")))) if size
+            else "json %d bytes" % len(payload))
+    print("%s (%s): %s" % (topic, form, json.dumps(document, ensure_ascii=False)))
+
+
+def collect_live(args):
+    import paho.mqtt.client as mqtt
+
+    def on_message(client, userdata, msg):
+        if topic_path(msg.topic) is not None and msg.payload:
+            show(msg.topic, msg.payload)
+
+    client = mqtt.Client()
+    client.username_pw_set(args.username, args.password)
+    client.on_message = on_message
+    client.connect(args.broker, args.port)
+    client.subscribe(args.prefix + "/#")
+    client.loop_forever()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--hex", nargs=2, metavar=("TOPIC", "PAYLOAD"), help="decode one payload given as hex")
+    parser.add_argument("--broker", default="localhost")
+    parser.add_argument("--port", type=int, default=1883)
+    parser.add_argument("--username", default="mosquitto")
+    parser.add_argument("--password", default="mosquitto")
+    parser.add_argument("--prefix", default="gdc", help="topic prefix of the controller")
+    args = parser.parse_args()
+
+    if args.hex:
+        show(args.hex[0], bytes.fromhex(args.hex[1]))
+    else:
+        try:
+            collect_live(args)
+        except KeyboardInterrupt:
+            pass
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,86 @@
+"""
+Sends a command or a status query to the udp control channel of the
+controller (see include/udpcontrol.h) and prints the status frame of the
+answer. The counter of a frame is the current time in 100 ms steps since
+2024, so it is higher than the counter of the frame before as long as the
+frames are more than 100 ms apart.
+
+    python scripts/udp_control.py --host 192.168.1.50 --key secret open 1
+    python scripts/udp_control.py --host 192.168.1.50 --key secret status 1
+"""
+import argparse
+import hashlib
+import hmac
+import socket
+import struct
+import sys
+import time
+
+MAGIC = ord("G")
+VERSION = 1
+MACSIZE = 16
+COMMAND, QUERY, STATUS = 0x01, 0x02, 0x81
+COMMANDS = {"open": 1, "close": 2}
+STATES = {0: "external", 1: "open", 2: "closed", 3: "moving or stopped"}
+RESULTS = {0: "ok", 1: "rejected", 2: "invalid"}
+EPOCH = 1704067200
+
+
+def encode(key, type, door, value, counter, result=0, seq=0):
+    header = struct.pack(">BBBBBBHI", MAGIC, VERSION, type, door, value, result, seq, counter)
+    return header + hmac.new(key, header, hashlib.sha256).digest()[:MACSIZE]
+
+
+def decode(key, frame):
+    """Returns (type, door, value, result, seq, counter) or None if the frame
+    is not valid"""
+    if len(frame) != 12 + MACSIZE:
+        return None
+    header, mac = frame[:12], frame[12:]
+    if not hmac.compare_digest(hmac.new(key, header, hashlib.sha256).digest()[:MACSIZE], mac):
+        return None
+    magic, version, type, door, value, result, seq, counter = struct.unpack(">BBBBBBHI", header)
+    if magic != MAGIC or version != VERSION:
+        return None
+    return type, door, value, result, seq, counter
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--host", default="127.0.0.1")
+    parser.add_argument("--port", type=int, default=4210)
+    parser.add_argument("--key", required=True, help="shared key (udpControlKey)")
+    parser.add_argument("--timeout", type=float, default=1.0)
+    parser.add_argument("action", choices=["open", "close", "status"])
+    parser.add_argument("door", type=int, nargs="?", default=1, help="door number, 1 = first door")
+    args = parser.parse_args()
+
+    key = args.key.encode("utf-8")
+    counter = int((time.time() - EPOCH) * 10)
+    if args.action == "status":
+        frame = encode(key, QUERY, args.door, 0, counter)
+    else:
+        frame = encode(key, COMMAND, args.door, COMMANDS[args.action], counter)
+
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.settimeout(args.timeout)
+    start = time.monotonic()
+    sock.sendto(frame, (args.host, args.port))
+    try:
+        answer, _ = sock.recvfrom(64)
+    except socket.timeout:
+        print("no answer (wrong key, old counter or channel disabled)")
+        return 1
+    elapsed_ms = (time.monotonic() - start) * 1000
+    status = decode(key, answer)
+    if status is None or status[0] != STATUS or status[5] != counter:
+        print("invalid answer")
+        return 1
+    _, door, value, result, seq, _ = status
+    print("door %d: %s, result %s, seq %d (%.1f ms)" % (door, STATES.get(value, value), RESULTS.get(result, result),
+                                                      seq, elapsed_ms))
+    return 0 if result == 0 else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())
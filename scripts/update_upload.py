@@ -0,0 +1,97 @@
+"""
+Sends a firmware image to the controller, which stages it on its SD card
+(see include/update.h). The chunks of one SD sector are sent, then the
+script waits for the status on gdc/update/status and goes on at the chunk
+the controller expects next. An interrupted transfer of the same image is
+resumed where the controller left off. Requires paho-mqtt.
+
+    python scripts/update_upload.py .pio/build/mkrzero-release/firmware.bin --broker mosquitto.local
+"""
+import argparse
+import os
+import struct
+import sys
+import threading
+import time
+import zlib
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+from payload_decode import decode  # noqa: E402
+
+VERSION = 1
+CHUNKSIZE = 128
+CHUNKSPERSECTOR = 4
+
+
+def chunk(image, crc, index):
+    data = image[index * CHUNKSIZE:(index + 1) * CHUNKSIZE]
+    return struct.pack("<BBHIII", VERSION, 0, index, len(image), crc, zlib.crc32(data)) + data
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("image", help="firmware image (.bin)")
+    parser.add_argument("--broker", default="localhost")
+    parser.add_argument("--port", type=int, default=1883)
+    parser.add_argument("--username", default="mosquitto")
+    parser.add_argument("--password", default="mosquitto")
+    parser.add_argument("--prefix", default="gdc", help="topic prefix of the controller")
+    parser.add_argument("--timeout", type=float, default=10.0, help="seconds to wait for a status")
+    args = parser.parse_args()
+
+    import paho.mqtt.client as mqtt
+
+    with open(args.image, "rb") as f:
+        image = f.read()
+    crc = zlib.crc32(image)
+    chunks = (len(image) + CHUNKSIZE - 1) // CHUNKSIZE
+    status = {}
+    changed = threading.Event()
+
+    def on_message(client, userdata, msg):
+        status.clear()
+        status.update(decode(msg.topic, msg.payload)[0])
+        changed.set()
+
+    client = mqtt.Client()
+    client.username_pw_set(args.username, args.password)
+    client.on_message = on_message
+    client.connect(args.broker, args.port)
+    client.subscribe(args.prefix + "/update/status")
+    client.loop_start()
+
+    # the retained status tells whether this image was started before
+    changed.wait(args.timeout)
+    sameImage = status.get("size") == len(image) and status.get("crc") == crc
+    if sameImage and status.get("state") == "complete":
+        print("image is already staged")
+        return
+    index = status["next"] if sameImage and status.get("state") == "receiving" else 0
+    print("%d bytes, %d chunks, crc %08x, starting at chunk %d" % (len(image), chunks, crc, index))
+
+    start = time.time()
+    sent = 0
+    while True:
+        end = min(chunks, (index // CHUNKSPERSECTOR + 1) * CHUNKSPERSECTOR)
+        changed.clear()
+        for i in range(index, end):
+            client.publish(args.prefix + "/update/chunk", chunk(image, crc, i), qos=1)
+            sent += 1
+        if not changed.wait(args.timeout):
+            print("no status, sending chunk %d again" % index)
+            continue
+        if status.get("state") == "complete":
+            break
+        if status.get("state") == "failed":
+            print("\nimage crc doesn't match on the controller")
+            sys.exit(1)
+        index = status["next"] if status.get("size") == len(image) else 0
+        print("\rchunk %d of %d, %d B/s" % (index, chunks, status.get("rate_bps", 0)), end="")
+    elapsed = time.time() - start
+    client.loop_stop()
+    print("\nimage staged: %d chunks sent in %.1f s (%.0f B/s), controller reports %d B/s, %d errors" %
+          (sent, elapsed, len(image) / elapsed, status.get("rate_bps", 0), status.get("errors", 0)))
+
+
+if __name__ == "__main__":
+    main()
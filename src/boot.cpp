@@ -0,0 +1,351 @@
+#include "hal.h"
+
+#include "config.h"
+#include "boot.h"
+#include "driveio.h"
+#include "hmi.h"
+#include "sensors.h"
+#include "cmdqueue.h"
+#include "mqtt.h"
+#include "metrics.h"
+#include "udpcontrol.h"
+#include "heapstats.h"
+#include "settings.h"
+#include "update.h"
+#include "state.h"
+#include "idle.h"
+#include "buildfeatures.h"
+#include "payload.h"
+#include "fixedstring.h"
+
+// a step of a stage returns BOOT_DONE, BOOT_FAILED (the attempt failed, it
+// is retried) or BOOT_RUNNING (not finished yet, called again next pass)
+typedef uint8_t (*boot_step_t)();
+
+struct boot_stagedef_t
+{
+    const char *name;
+    uint8_t depends;    // bit mask of the stages which must be done before
+    boot_step_t step;
+};
+
+#define BOOT_DEPENDS(stage) (1 << (stage))
+
+uint8_t boot_stepcore();
+uint8_t boot_stepconfig();
+uint8_t boot_stepdisplay();
+uint8_t boot_stepsensors();
+uint8_t boot_stepnetwork();
+uint8_t boot_stepmqtt();
+uint8_t boot_stepservices();
+
+// the stages in the order of boot_stage_t
+const boot_stagedef_t bootStages[BOOT_NUMSTAGES] = {
+    {"core", 0, boot_stepcore},
+    {"config", BOOT_DEPENDS(BOOT_STAGECORE), boot_stepconfig},
+    {"display", BOOT_DEPENDS(BOOT_STAGECORE), boot_stepdisplay},
+    {"sensors", BOOT_DEPENDS(BOOT_STAGECORE), boot_stepsensors},
+    {"network", BOOT_DEPENDS(BOOT_STAGECORE), boot_stepnetwork},
+    {"mqtt", BOOT_DEPENDS(BOOT_STAGENETWORK), boot_stepmqtt},
+    {"services", BOOT_DEPENDS(BOOT_STAGENETWORK), boot_stepservices}};
+
+boot_stageinfo_t bootStageInfo[BOOT_NUMSTAGES];
+uint32_t prev_ms_attempt[BOOT_NUMSTAGES];
+uint32_t bootStart_ms = 0;
+uint32_t bootComplete_ms = 0;
+bool bootComplete = false;
+bool bootPublished = false;
+bool bootMqttStarted = false;
+uint32_t bootConnected_ms = 0;      // first connect to the broker, 0 before
+
+/*
+* Core stage: everything the local door control needs. The topic names are
+* built here as well, door changes are queued for the broker from the start.
+*/
+uint8_t boot_stepcore()
+{
+    if (featureHmi)
+    {
+        hmi_init();
+    }
+    driveio_init();
+    cmdqueue_init();
+    mqtt_buildtopics();
+    state_init();
+    idle_init();
+    return BOOT_DONE;
+}
+
+/*
+* Settings cached on the SD card - without a card the compiled values stay
+* active until the broker delivers the settings. The progress of a firmware
+* transfer is loaded as well.
+*/
+uint8_t boot_stepconfig()
+{
+    settings_init();
+    update_init();
+    return BOOT_DONE;
+}
+
+/*
+* OLED display of the HMI shield - the stage is done at once in a build
+* without the shield (see buildfeatures.h)
+*/
+uint8_t boot_stepdisplay()
+{
+    if (featureHmi)
+    {
+        hmi_display_begin();
+    }
+    return BOOT_DONE;
+}
+
+/*
+* The MKR ENV shield - without it the doors still work, only the sensor
+* values are missing. The stage is done at once in a build without the
+* shield.
+*/
+uint8_t boot_stepsensors()
+{
+    if (!featureSensors)
+    {
+        return BOOT_DONE;
+    }
+    return sensors_init() ? BOOT_DONE : BOOT_FAILED;
+}
+
+/*
+* MKR ETH shield with a fully configured static ip
+*/
+uint8_t boot_stepnetwork()
+{
+    FixedString<64> line;
+    int hardwareStatus = hal_net_begin(mac, ip, dns, gateway, subnet);
+    if (hardwareStatus == HAL_NET_NOHARDWARE)
+    {
+        hal_serial_println("ERROR: Ethernet shield was not found");
+        return BOOT_FAILED;
+    }
+    hal_serial_println(line.format("INIT: Ethernet chipset type is %d", hardwareStatus).c_str());
+    if (!hal_net_linkup())
+    {
+        hal_serial_println("ERROR: Ethernet cable is not connected");
+    }
+    IPAddress address = hal_net_localip();
+    hal_serial_println(line.format("INIT: Controller network interface is at %u.%u.%u.%u", address[0], address[1], address[2], address[3]).c_str());
+    return BOOT_DONE;
+}
+
+/*
+* Initializes the mqtt client - the current door status is published by the
+* resynchronization after every connect (see resync.h). The connect itself
+* doesn't run here: mqtt_loop() opens the socket, awaits the CONNACK and
+* retries in the background. The stage is done when the first attempt has
+* ended, so an unreachable broker doesn't hold up the end of the boot. The
+* time of the first connect is recorded separately by boot_loop().
+*/
+uint8_t boot_stepmqtt()
+{
+    if (!bootMqttStarted)
+    {
+        bootMqttStarted = true;
+        mqtt_init();
+    }
+    return mqtt_hasattempted() ? BOOT_DONE : BOOT_RUNNING;
+}
+
+/*
+* Metrics endpoint and udp control channel
+*/
+uint8_t boot_stepservices()
+{
+    metrics_init();
+    udpcontrol_init();
+    return BOOT_DONE;
+}
+
+/*
+* Executes one step of a stage and records its duration and result
+*/
+void boot_step(int stage)
+{
+    boot_stageinfo_t &info = bootStageInfo[stage];
+    FixedString<80> line;
+    if (info.state == BOOT_WAITING)
+    {
+        info.state = BOOT_RUNNING;
+    }
+
+    uint32_t start_us = hal_micros();
+    uint8_t result = bootStages[stage].step();
+    info.busy_us += hal_micros() - start_us;
+    if (result == BOOT_RUNNING)
+    {
+        return;
+    }
+
+    info.attempts++;
+    if (result == BOOT_DONE)
+    {
+        info.state = BOOT_DONE;
+        info.ready_ms = hal_millis() - bootStart_ms;
+        hal_serial_println(line.format("INIT: Stage %s ready after %lu ms", bootStages[stage].name, (unsigned long)info.ready_ms).c_str());
+    }
+    else if (info.attempts >= BOOT_MAXATTEMPTS)
+    {
+        info.state = BOOT_FAILED;
+        info.ready_ms = hal_millis() - bootStart_ms;
+        hal_serial_println(line.format("ERROR: Stage %s failed after %d attempts", bootStages[stage].name, info.attempts).c_str());
+    }
+    else
+    {
+        prev_ms_attempt[stage] = hal_millis();
+    }
+}
+
+/*
+* Publishes the profile of all stages (retained), e.g.
+* {"total":12,"connected":40,"core":[0,850,1],"config":[0,1200,1],...,"failed":"sensors"} with
+* the ms since reset until all stages were settled and until the broker was
+* connected first, then ready ms, busy us and attempts of every stage
+*/
+void boot_publish()
+{
+    FixedString<64> failed;
+    PayloadWriter payload(MQTT_TOPICSYSTEMBOOT, PAYLOAD_SCHEMABOOT);
+    payload.addUint("total", bootComplete_ms);
+    payload.addUint("connected", bootConnected_ms);
+    for (int stage = 0; stage < BOOT_NUMSTAGES; stage++)
+    {
+        const boot_stageinfo_t &info = bootStageInfo[stage];
+        payload.beginArray(bootStages[stage].name, 3);
+        payload.addUint(NULL, info.ready_ms);
+        payload.addUint(NULL, info.busy_us);
+        payload.addUint(NULL, info.attempts);
+        payload.endArray();
+        if (info.state == BOOT_FAILED)
+        {
+            failed.appendf("%s%s", failed.length() ? "," : "", bootStages[stage].name);
+        }
+    }
+    payload.addString("failed", failed.c_str());
+    payload.publish(true);
+}
+
+/*
+* Runs the core stage - is called by setup()
+*/
+void boot_init()
+{
+    bootStart_ms = hal_millis();
+    bootComplete = false;
+    bootPublished = false;
+    bootMqttStarted = false;
+    bootConnected_ms = 0;
+    memset(bootStageInfo, 0, sizeof(bootStageInfo));
+    memset(prev_ms_attempt, 0, sizeof(prev_ms_attempt));
+    boot_step(BOOT_STAGECORE);
+}
+
+/*
+* Advances every stage which can run by one step. When all stages are
+* settled the profile is logged and published and the steady state of the
+* heap begins.
+*/
+void boot_loop()
+{
+    if ((bootConnected_ms == 0) && mqtt_isconnected())
+    {
+        bootConnected_ms = hal_millis() - bootStart_ms;
+    }
+    if (bootComplete)
+    {
+        if (!bootPublished && mqtt_isconnected())
+        {
+            bootPublished = true;
+            boot_publish();
+        }
+        return;
+    }
+
+    bool complete = true;
+    for (int stage = 0; stage < BOOT_NUMSTAGES; stage++)
+    {
+        boot_stageinfo_t &info = bootStageInfo[stage];
+        if ((info.state == BOOT_DONE) || (info.state == BOOT_FAILED))
+        {
+            continue;
+        }
+        complete = false;
+
+        // a stage which depends on a failed one is skipped
+        bool ready = true;
+        for (int other = 0; other < BOOT_NUMSTAGES; other++)
+        {
+            if (bootStages[stage].depends & BOOT_DEPENDS(other))
+            {
+                if (bootStageInfo[other].state == BOOT_FAILED)
+                {
+                    info.state = BOOT_FAILED;
+                    info.ready_ms = hal_millis() - bootStart_ms;
+                }
+                ready = ready && (bootStageInfo[other].state == BOOT_DONE);
+            }
+        }
+        if (ready && ((info.attempts == 0) || (hal_millis() - prev_ms_attempt[stage] >= BOOT_RETRYINTERVAL_MS)))
+        {
+            boot_step(stage);
+        }
+        if (ready && (info.attempts > 0))
+        {
+            // the next attempt of a failed step (see idle.h) - a running
+            // stage waits for a module which reports its own due time
+            idle_due(IDLE_SOURCEBOOT, prev_ms_attempt[stage] + BOOT_RETRYINTERVAL_MS);
+        }
+    }
+
+    if (complete)
+    {
+        FixedString<64> line;
+        bootComplete = true;
+        bootComplete_ms = hal_millis() - bootStart_ms;
+        hal_serial_println(line.format("INIT: Boot completed after %lu ms", (unsigned long)bootComplete_ms).c_str());
+        heapstats_marksteadystate();
+    }
+}
+
+/*
+* Returns true if a stage is running or done, i.e. the loop of its module
+* may be called
+*/
+bool boot_isstarted(boot_stage_t stage)
+{
+    return (bootStageInfo[stage].state == BOOT_RUNNING) || (bootStageInfo[stage].state == BOOT_DONE);
+}
+
+/*
+* Returns true if a stage is done
+*/
+bool boot_isready(boot_stage_t stage)
+{
+    return bootStageInfo[stage].state == BOOT_DONE;
+}
+
+/*
+* Returns true if all stages are done or failed
+*/
+bool boot_iscomplete()
+{
+    return bootComplete;
+}
+
+const char *boot_stagename(boot_stage_t stage)
+{
+    return bootStages[stage].name;
+}
+
+const boot_stageinfo_t *boot_getstageinfo(boot_stage_t stage)
+{
+    return &bootStageInfo[stage];
+}
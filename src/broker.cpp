@@ -0,0 +1,1100 @@
+#ifndef ARDUINO
+
+// Include libraries
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "broker.h"
+#include "mqttclient.h"
+
+#define BROKER_UNSUBSCRIBE      0xA0
+#define BROKER_UNSUBACK         0xB0
+
+// largest packet the broker builds (header, length, topic and payload)
+#define BROKER_MAXPACKET        (5 + 2 + BROKER_MAXTOPICLENGTH + 2 + BROKER_MAXPAYLOAD)
+
+/*
+* Byte stream of one direction of a session. Written bytes become readable
+* when their due time has passed, which delays them by the injected latency.
+*/
+struct brokerpipe_t
+{
+    uint8_t data[BROKER_BUFFERSIZE];
+    size_t length;
+    size_t ready;
+    size_t pos;
+    size_t pendingEnd[BROKER_MAXPENDING];
+    uint64_t pendingDue_us[BROKER_MAXPENDING];
+    int numPending;
+};
+
+struct brokersession_t
+{
+    bool open;
+    bool connected;
+    int socket;
+    char clientId[BROKER_MAXCLIENTID];
+    bool hasWill;
+    bool willRetain;
+    char willTopic[BROKER_MAXTOPICLENGTH];
+    uint8_t willPayload[BROKER_MAXPAYLOAD];
+    size_t willSize;
+    char filters[BROKER_MAXFILTERS][BROKER_MAXTOPICLENGTH];
+    uint8_t filterQos[BROKER_MAXFILTERS];
+    int numFilters;
+    uint16_t nextPacketId;
+    brokerpipe_t rx;
+    brokerpipe_t tx;
+};
+
+struct brokerretained_t
+{
+    bool used;
+    char topic[BROKER_MAXTOPICLENGTH];
+    char payload[BROKER_MAXPAYLOAD + 1];
+    size_t size;
+};
+
+struct brokerobserver_t
+{
+    char filter[BROKER_MAXTOPICLENGTH];
+    broker_callback_t callback;
+};
+
+// sessions 0..brokerNumSessions-1 may be open
+brokersession_t brokerSessions[BROKER_MAXSESSIONS];
+int brokerNumSessions = 0;
+brokerretained_t brokerRetained[BROKER_MAXRETAINED];
+brokerobserver_t brokerObservers[BROKER_MAXOBSERVERS];
+int brokerNumObservers = 0;
+broker_stats_t brokerStats;
+
+bool brokerOnline = true;
+uint32_t brokerLatency_us = 0;
+unsigned int brokerLossPercent = 0;
+unsigned int brokerPublishLossPercent = 0;
+unsigned int brokerDuplicatePercent = 0;
+uint32_t brokerRandom = 1;
+int brokerListenSocket = -1;
+uint16_t brokerListenPort = 0;
+
+uint16_t broker_openlisten(uint16_t port);
+
+/*
+* Returns true with the given probability in percent
+*/
+bool broker_chance(unsigned int percent)
+{
+    if (percent == 0)
+    {
+        return false;
+    }
+    // xorshift32 - reproducible for a given seed
+    brokerRandom ^= brokerRandom << 13;
+    brokerRandom ^= brokerRandom >> 17;
+    brokerRandom ^= brokerRandom << 5;
+    return (brokerRandom % 100) < percent;
+}
+
+/*
+* Returns true if the next delivery shall be dropped
+*/
+bool broker_lost()
+{
+    return broker_chance(brokerLossPercent);
+}
+
+/*
+* Pipe handling
+*/
+void pipe_reset(brokerpipe_t &pipe)
+{
+    pipe.length = 0;
+    pipe.ready = 0;
+    pipe.pos = 0;
+    pipe.numPending = 0;
+}
+
+bool pipe_write(brokerpipe_t &pipe, const uint8_t *data, size_t size)
+{
+    if (pipe.pos == pipe.length)
+    {
+        pipe_reset(pipe);
+    }
+    if ((pipe.length + size > BROKER_BUFFERSIZE) && (pipe.pos > 0))
+    {
+        // drop the consumed bytes
+        memmove(pipe.data, pipe.data + pipe.pos, pipe.length - pipe.pos);
+        for (int i = 0; i < pipe.numPending; i++)
+        {
+            pipe.pendingEnd[i] -= pipe.pos;
+        }
+        pipe.length -= pipe.pos;
+        pipe.ready -= pipe.pos;
+        pipe.pos = 0;
+    }
+    if (pipe.length + size > BROKER_BUFFERSIZE)
+    {
+        return false;
+    }
+    memcpy(pipe.data + pipe.length, data, size);
+    pipe.length += size;
+
+    if ((brokerLatency_us == 0) && (pipe.numPending == 0))
+    {
+        pipe.ready = pipe.length;
+    }
+    else if (pipe.numPending < BROKER_MAXPENDING)
+    {
+        pipe.pendingEnd[pipe.numPending] = pipe.length;
+        pipe.pendingDue_us[pipe.numPending++] = hal_native_time_us() + brokerLatency_us;
+    }
+    else
+    {
+        // no more marks - the bytes are released together with the last ones
+        pipe.pendingEnd[pipe.numPending - 1] = pipe.length;
+        pipe.pendingDue_us[pipe.numPending - 1] = hal_native_time_us() + brokerLatency_us;
+    }
+    return true;
+}
+
+void pipe_release(brokerpipe_t &pipe, uint64_t now_us)
+{
+    int count = 0;
+    while ((count < pipe.numPending) && (pipe.pendingDue_us[count] <= now_us))
+    {
+        pipe.ready = pipe.pendingEnd[count++];
+    }
+    if (count > 0)
+    {
+        memmove(pipe.pendingEnd, pipe.pendingEnd + count, (pipe.numPending - count) * sizeof(size_t));
+        memmove(pipe.pendingDue_us, pipe.pendingDue_us + count, (pipe.numPending - count) * sizeof(uint64_t));
+        pipe.numPending -= count;
+    }
+}
+
+/*
+* Queues a packet for a client
+*/
+void broker_send(brokersession_t &session, const uint8_t *packet, size_t length)
+{
+    if (pipe_write(session.tx, packet, length))
+    {
+        brokerStats.bytesSent += length;
+    }
+}
+
+/*
+* Builds a PUBLISH packet. The flags are the QoS and DUP bits, a QoS 1
+* packet carries the id. Returns its length.
+*/
+size_t broker_buildpublish(uint8_t *packet, const char *topic, const uint8_t *payload, size_t size, bool retain, uint8_t flags, uint16_t id)
+{
+    size_t topicLength = strlen(topic);
+    uint32_t remaining = 2 + topicLength + ((flags & 0x06) ? 2 : 0) + size;
+    size_t pos = 0;
+    packet[pos++] = MQTTCLIENT_PUBLISH | flags | (retain ? 0x01 : 0x00);
+    do
+    {
+        uint8_t digit = remaining % 128;
+        remaining /= 128;
+        packet[pos++] = digit | ((remaining > 0) ? 0x80 : 0x00);
+    } while (remaining > 0);
+    packet[pos++] = topicLength >> 8;
+    packet[pos++] = topicLength & 0xFF;
+    memcpy(packet + pos, topic, topicLength);
+    pos += topicLength;
+    if (flags & 0x06)
+    {
+        packet[pos++] = id >> 8;
+        packet[pos++] = id & 0xFF;
+    }
+    memcpy(packet + pos, payload, size);
+    return pos + size;
+}
+
+/*
+* Delivers a message to a client with QoS 0 or 1. The broker doesn't wait for
+* the PUBACK of a QoS 1 message, but a share of them can be sent twice (see
+* broker_setduplicates) as if the PUBACK had been lost.
+*/
+void broker_deliver(brokersession_t &session, const char *topic, const uint8_t *payload, size_t size, bool retain, uint8_t qos)
+{
+    if (broker_lost())
+    {
+        brokerStats.publishesDropped++;
+        return;
+    }
+    uint8_t packet[BROKER_MAXPACKET];
+    uint16_t id = 0;
+    if (qos > 0)
+    {
+        id = (session.nextPacketId == 0) ? 1 : session.nextPacketId;
+        session.nextPacketId = id + 1;
+    }
+    broker_send(session, packet, broker_buildpublish(packet, topic, payload, size, retain, qos << 1, id));
+    brokerStats.publishesDelivered++;
+    if ((qos > 0) && broker_chance(brokerDuplicatePercent))
+    {
+        broker_send(session, packet, broker_buildpublish(packet, topic, payload, size, retain, (qos << 1) | 0x08, id));
+        brokerStats.duplicatesSent++;
+    }
+}
+
+/*
+* Returns the slot of a retained topic in the hash table. A new slot is
+* taken if create is set. Cleared messages keep their slot with size 0.
+*/
+brokerretained_t *broker_findretained(const char *topic, bool create)
+{
+    // FNV-1a
+    uint32_t hash = 2166136261UL;
+    for (const char *c = topic; *c != 0; c++)
+    {
+        hash = (hash ^ (uint8_t)*c) * 16777619UL;
+    }
+    for (int probe = 0; probe < BROKER_MAXRETAINED; probe++)
+    {
+        brokerretained_t &entry = brokerRetained[(hash + probe) & (BROKER_MAXRETAINED - 1)];
+        if (!entry.used)
+        {
+            if (!create)
+            {
+                return NULL;
+            }
+            entry.used = true;
+            entry.size = 0;
+            snprintf(entry.topic, sizeof(entry.topic), "%s", topic);
+            return &entry;
+        }
+        if (strcmp(entry.topic, topic) == 0)
+        {
+            return &entry;
+        }
+    }
+    return NULL;
+}
+
+/*
+* Stores or clears (empty payload) a retained message
+*/
+void broker_retain(const char *topic, const uint8_t *payload, size_t size)
+{
+    brokerretained_t *entry = broker_findretained(topic, size > 0);
+    if (entry != NULL)
+    {
+        memcpy(entry->payload, payload, size);
+        entry->payload[size] = 0;
+        entry->size = size;
+    }
+}
+
+/*
+* Routes a message to all matching subscriptions of the clients and to the
+* local observers
+*/
+void broker_route(const char *topic, const uint8_t *payload, size_t size, bool retain)
+{
+    if (size > BROKER_MAXPAYLOAD)
+    {
+        size = BROKER_MAXPAYLOAD;
+    }
+    if (retain)
+    {
+        broker_retain(topic, payload, size);
+    }
+    for (int s = 0; s < brokerNumSessions; s++)
+    {
+        brokersession_t &session = brokerSessions[s];
+        for (int i = 0; session.connected && (i < session.numFilters); i++)
+        {
+            if (broker_topicmatches(session.filters[i], topic))
+            {
+                // retain is only set for messages sent on a new subscription
+                broker_deliver(session, topic, payload, size, false, session.filterQos[i]);
+                break;
+            }
+        }
+    }
+    for (int i = 0; i < brokerNumObservers; i++)
+    {
+        if (broker_topicmatches(brokerObservers[i].filter, topic))
+        {
+            if (broker_lost())
+            {
+                brokerStats.publishesDropped++;
+                continue;
+            }
+            brokerStats.publishesDelivered++;
+            brokerObservers[i].callback(topic, payload, size, retain);
+        }
+    }
+}
+
+/*
+* Closes a session. The will is published if the client has not sent a
+* DISCONNECT before.
+*/
+void broker_closesession(brokersession_t &session, bool publishWill)
+{
+    bool will = session.connected && session.hasWill && publishWill;
+    if (session.connected)
+    {
+        brokerStats.disconnects++;
+    }
+    if (session.socket >= 0)
+    {
+        close(session.socket);
+    }
+    session.open = false;
+    session.connected = false;
+    session.socket = -1;
+    session.hasWill = false;
+    session.numFilters = 0;
+    session.clientId[0] = 0;
+    pipe_reset(session.rx);
+    pipe_reset(session.tx);
+    if (will)
+    {
+        brokerStats.wills++;
+        broker_route(session.willTopic, session.willPayload, session.willSize, session.willRetain);
+    }
+}
+
+/*
+* Reads a string of a packet. Returns false if it exceeds the packet or the
+* buffer.
+*/
+bool broker_readstring(const uint8_t *body, uint32_t length, uint32_t &pos, char *text, size_t size)
+{
+    if (pos + 2 > length)
+    {
+        return false;
+    }
+    uint16_t textLength = (body[pos] << 8) | body[pos + 1];
+    pos += 2;
+    if ((pos + textLength > length) || (textLength >= size))
+    {
+        return false;
+    }
+    memcpy(text, body + pos, textLength);
+    text[textLength] = 0;
+    pos += textLength;
+    return true;
+}
+
+/*
+* CONNECT - the client id and the will are stored, credentials are ignored
+*/
+void broker_handleconnect(brokersession_t &session, const uint8_t *body, uint32_t length)
+{
+    char protocol[8];
+    char clientId[BROKER_MAXCLIENTID];
+    uint32_t pos = 0;
+    if (session.connected || !broker_readstring(body, length, pos, protocol, sizeof(protocol)) || (pos + 4 > length))
+    {
+        broker_closesession(session, true);
+        return;
+    }
+    uint8_t flags = body[pos + 1];
+    pos += 4;
+    if (!broker_readstring(body, length, pos, clientId, sizeof(clientId)))
+    {
+        broker_closesession(session, true);
+        return;
+    }
+    session.hasWill = (flags & 0x04) != 0;
+    if (session.hasWill)
+    {
+        char willPayload[BROKER_MAXPAYLOAD + 1];
+        if (!broker_readstring(body, length, pos, session.willTopic, sizeof(session.willTopic)) ||
+            !broker_readstring(body, length, pos, willPayload, sizeof(willPayload)))
+        {
+            broker_closesession(session, false);
+            return;
+        }
+        session.willSize = strlen(willPayload);
+        memcpy(session.willPayload, willPayload, session.willSize);
+        session.willRetain = (flags & 0x20) != 0;
+    }
+
+    // a second connect with the same id takes over the session
+    for (int s = 0; (clientId[0] != 0) && (s < brokerNumSessions); s++)
+    {
+        if (brokerSessions[s].connected && (strcmp(brokerSessions[s].clientId, clientId) == 0))
+        {
+            broker_closesession(brokerSessions[s], false);
+        }
+    }
+    snprintf(session.clientId, sizeof(session.clientId), "%s", clientId);
+    session.connected = true;
+    brokerStats.connects++;
+    const uint8_t connack[] = {MQTTCLIENT_CONNACK, 0x02, 0x00, 0x00};
+    broker_send(session, connack, sizeof(connack));
+}
+
+/*
+* SUBSCRIBE - every filter is granted with the requested QoS (at most 1) and
+* the matching retained messages are sent
+*/
+void broker_handlesubscribe(brokersession_t &session, const uint8_t *body, uint32_t length)
+{
+    uint8_t suback[4 + BROKER_MAXFILTERS];
+    size_t count = 0;
+    uint32_t pos = 2;
+    int first = session.numFilters;
+    char filter[BROKER_MAXTOPICLENGTH];
+    while ((pos < length) && (count < BROKER_MAXFILTERS))
+    {
+        if (!broker_readstring(body, length, pos, filter, sizeof(filter)) || (pos >= length))
+        {
+            broker_closesession(session, true);
+            return;
+        }
+        uint8_t qos = (body[pos++] > 0) ? 1 : 0;
+        bool granted = false;
+        for (int i = 0; i < session.numFilters; i++)
+        {
+            if (strcmp(session.filters[i], filter) == 0)
+            {
+                session.filterQos[i] = qos;
+                granted = true;
+            }
+        }
+        if (!granted && (session.numFilters < BROKER_MAXFILTERS))
+        {
+            session.filterQos[session.numFilters] = qos;
+            snprintf(session.filters[session.numFilters++], BROKER_MAXTOPICLENGTH, "%s", filter);
+            granted = true;
+        }
+        suback[4 + count++] = granted ? qos : 0x80;
+    }
+    suback[0] = MQTTCLIENT_SUBACK;
+    suback[1] = 2 + count;
+    suback[2] = body[0];
+    suback[3] = body[1];
+    broker_send(session, suback, 4 + count);
+
+    for (int r = 0; r < BROKER_MAXRETAINED; r++)
+    {
+        for (int i = first; (brokerRetained[r].size > 0) && (i < session.numFilters); i++)
+        {
+            if (broker_topicmatches(session.filters[i], brokerRetained[r].topic))
+            {
+                broker_deliver(session, brokerRetained[r].topic, (const uint8_t *)brokerRetained[r].payload, brokerRetained[r].size, true,
+                               session.filterQos[i]);
+                break;
+            }
+        }
+    }
+}
+
+/*
+* UNSUBSCRIBE
+*/
+void broker_handleunsubscribe(brokersession_t &session, const uint8_t *body, uint32_t length)
+{
+    uint32_t pos = 2;
+    char filter[BROKER_MAXTOPICLENGTH];
+    while ((pos < length) && broker_readstring(body, length, pos, filter, sizeof(filter)))
+    {
+        for (int i = 0; i < session.numFilters; i++)
+        {
+            if (strcmp(session.filters[i], filter) == 0)
+            {
+                memmove(session.filters[i], session.filters[i + 1], (session.numFilters - i - 1) * BROKER_MAXTOPICLENGTH);
+                memmove(&session.filterQos[i], &session.filterQos[i + 1], session.numFilters - i - 1);
+                session.numFilters--;
+                break;
+            }
+        }
+    }
+    const uint8_t unsuback[] = {BROKER_UNSUBACK, 0x02, body[0], body[1]};
+    broker_send(session, unsuback, sizeof(unsuback));
+}
+
+/*
+* PUBLISH - QoS 1 and 2 are acknowledged with PUBACK. A share of the publishes
+* can be dropped before they are acknowledged (see broker_setpublishloss).
+*/
+void broker_handlepublish(brokersession_t &session, uint8_t header, const uint8_t *body, uint32_t length)
+{
+    char topic[BROKER_MAXTOPICLENGTH];
+    uint32_t pos = 0;
+    if (!broker_readstring(body, length, pos, topic, sizeof(topic)))
+    {
+        broker_closesession(session, true);
+        return;
+    }
+    if (broker_chance(brokerPublishLossPercent))
+    {
+        brokerStats.publishesLost++;
+        return;
+    }
+    if (((header >> 1) & 0x03) > 0)
+    {
+        if (pos + 2 > length)
+        {
+            broker_closesession(session, true);
+            return;
+        }
+        const uint8_t puback[] = {MQTTCLIENT_PUBACK, 0x02, body[pos], body[pos + 1]};
+        broker_send(session, puback, sizeof(puback));
+        pos += 2;
+    }
+    brokerStats.publishesReceived++;
+    broker_route(topic, body + pos, length - pos, (header & 0x01) != 0);
+}
+
+/*
+* Handles a complete packet of a client
+*/
+void broker_handlepacket(brokersession_t &session, uint8_t header, const uint8_t *body, uint32_t length)
+{
+    // only CONNECT is allowed before the session is established
+    if (!session.connected && ((header & 0xF0) != MQTTCLIENT_CONNECT))
+    {
+        broker_closesession(session, false);
+        return;
+    }
+    switch (header & 0xF0)
+    {
+    case MQTTCLIENT_CONNECT:
+        broker_handleconnect(session, body, length);
+        break;
+
+    case MQTTCLIENT_SUBSCRIBE:
+        broker_handlesubscribe(session, body, length);
+        break;
+
+    case BROKER_UNSUBSCRIBE:
+        broker_handleunsubscribe(session, body, length);
+        break;
+
+    case MQTTCLIENT_PUBLISH:
+        broker_handlepublish(session, header, body, length);
+        break;
+
+    case MQTTCLIENT_PINGREQ:
+    {
+        const uint8_t pingresp[] = {MQTTCLIENT_PINGRESP, 0x00};
+        broker_send(session, pingresp, sizeof(pingresp));
+        break;
+    }
+
+    case MQTTCLIENT_DISCONNECT:
+        broker_closesession(session, false);
+        break;
+    }
+}
+
+/*
+* Splits the received bytes of a session into packets
+*/
+void broker_parsepackets(brokersession_t &session)
+{
+    while (session.open && (session.rx.ready - session.rx.pos >= 2))
+    {
+        const uint8_t *data = session.rx.data + session.rx.pos;
+        size_t available = session.rx.ready - session.rx.pos;
+        uint32_t length = 0;
+        uint32_t multiplier = 1;
+        size_t pos = 1;
+        do
+        {
+            if ((pos >= available) || (pos > 4))
+            {
+                return;
+            }
+            length += (data[pos] & 0x7F) * multiplier;
+            multiplier *= 128;
+        } while (data[pos++] & 0x80);
+        if (pos + length > available)
+        {
+            return;
+        }
+        session.rx.pos += pos + length;
+        broker_handlepacket(session, data[0], data + pos, length);
+    }
+}
+
+/*
+* Reads the bytes of a socket client
+*/
+void broker_receivesocket(brokersession_t &session)
+{
+    uint8_t buffer[512];
+    while (session.open)
+    {
+        // a full pipe stops reading (tcp flow control slows the client down)
+        size_t space = BROKER_BUFFERSIZE - (session.rx.length - session.rx.pos);
+        if (space == 0)
+        {
+            break;
+        }
+        ssize_t received = recv(session.socket, buffer, (space < sizeof(buffer)) ? space : sizeof(buffer), MSG_DONTWAIT);
+        if (received == 0)
+        {
+            // connection closed by the client
+            broker_closesession(session, true);
+            break;
+        }
+        if (received < 0)
+        {
+            if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+            {
+                broker_closesession(session, true);
+            }
+            break;
+        }
+        brokerStats.bytesReceived += received;
+        if (!pipe_write(session.rx, buffer, received))
+        {
+            broker_closesession(session, true);
+        }
+    }
+}
+
+/*
+* Sends the due bytes to a socket client
+*/
+void broker_sendsocket(brokersession_t &session)
+{
+    if (session.open && (session.tx.ready > session.tx.pos))
+    {
+        ssize_t sent = send(session.socket, session.tx.data + session.tx.pos, session.tx.ready - session.tx.pos, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (sent > 0)
+        {
+            session.tx.pos += sent;
+        }
+        else if ((sent < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK))
+        {
+            broker_closesession(session, true);
+        }
+    }
+}
+
+/*
+* Processes everything which is due on all sessions
+*/
+void broker_service()
+{
+    uint64_t now_us = hal_native_time_us();
+    while ((brokerNumSessions > 0) && !brokerSessions[brokerNumSessions - 1].open)
+    {
+        brokerNumSessions--;
+    }
+    for (int s = 0; s < brokerNumSessions; s++)
+    {
+        brokersession_t &session = brokerSessions[s];
+        if (!session.open)
+        {
+            continue;
+        }
+        if (session.socket >= 0)
+        {
+            broker_receivesocket(session);
+        }
+        pipe_release(session.rx, now_us);
+        broker_parsepackets(session);
+        pipe_release(session.tx, now_us);
+        if (session.socket >= 0)
+        {
+            broker_sendsocket(session);
+        }
+    }
+}
+
+/*
+* in-process tcp back end - one session (BROKER_INPROCESS) for the firmware
+*/
+bool broker_tcp_connect(const char *host, uint16_t port)
+{
+    brokersession_t &session = brokerSessions[BROKER_INPROCESS];
+    if (session.open)
+    {
+        broker_closesession(session, true);
+    }
+    session.socket = -1;
+    session.open = brokerOnline;
+    if (session.open && (brokerNumSessions <= BROKER_INPROCESS))
+    {
+        brokerNumSessions = BROKER_INPROCESS + 1;
+    }
+    return session.open;
+}
+
+bool broker_tcp_connected()
+{
+    broker_service();
+    return brokerSessions[BROKER_INPROCESS].open;
+}
+
+size_t broker_tcp_write(const uint8_t *buffer, size_t size)
+{
+    brokersession_t &session = brokerSessions[BROKER_INPROCESS];
+    if (!session.open || !pipe_write(session.rx, buffer, size))
+    {
+        return 0;
+    }
+    brokerStats.bytesReceived += size;
+    broker_service();
+    return size;
+}
+
+int broker_tcp_available()
+{
+    broker_service();
+    brokersession_t &session = brokerSessions[BROKER_INPROCESS];
+    return session.open ? session.tx.ready - session.tx.pos : 0;
+}
+
+int broker_tcp_read(uint8_t *buffer, size_t size)
+{
+    broker_service();
+    brokersession_t &session = brokerSessions[BROKER_INPROCESS];
+    size_t count = 0;
+    while (session.open && (count < size) && (session.tx.pos < session.tx.ready))
+    {
+        buffer[count++] = session.tx.data[session.tx.pos++];
+    }
+    return count;
+}
+
+void broker_tcp_stop()
+{
+    brokersession_t &session = brokerSessions[BROKER_INPROCESS];
+    if (session.open)
+    {
+        // bytes in flight (e.g. DISCONNECT) still arrive before the close
+        pipe_release(session.rx, UINT64_MAX);
+        broker_parsepackets(session);
+    }
+    if (session.open)
+    {
+        broker_closesession(session, true);
+    }
+}
+
+const hal_native_tcpops_t brokerTcp = {broker_tcp_connect, broker_tcp_connected, broker_tcp_write, broker_tcp_available, broker_tcp_read, broker_tcp_stop};
+
+/*
+* Resets the broker: closes all sessions and the listening socket, clears
+* the retained messages, observers, statistics and injected faults
+*/
+void broker_init()
+{
+    broker_close();
+    for (int s = 0; s < BROKER_MAXSESSIONS; s++)
+    {
+        if (brokerSessions[s].open)
+        {
+            broker_closesession(brokerSessions[s], false);
+        }
+        brokerSessions[s].socket = -1;
+    }
+    brokerNumSessions = 0;
+    memset(brokerRetained, 0, sizeof(brokerRetained));
+    brokerNumObservers = 0;
+    memset(&brokerStats, 0, sizeof(brokerStats));
+    brokerOnline = true;
+    brokerLatency_us = 0;
+    brokerLossPercent = 0;
+    brokerPublishLossPercent = 0;
+    brokerDuplicatePercent = 0;
+    brokerRandom = 1;
+}
+
+/*
+* Takes the broker offline (like a crash - all sessions are dropped without
+* publishing wills, new connections are refused) or back online
+*/
+void broker_setonline(bool online)
+{
+    brokerOnline = online;
+    for (int s = 0; !online && (s < brokerNumSessions); s++)
+    {
+        if (brokerSessions[s].open)
+        {
+            broker_closesession(brokerSessions[s], false);
+        }
+    }
+    // socket clients see a closed port while the broker is offline
+    if (!online && (brokerListenSocket >= 0))
+    {
+        close(brokerListenSocket);
+        brokerListenSocket = -1;
+    }
+    if (online && (brokerListenPort != 0) && (brokerListenSocket < 0))
+    {
+        broker_openlisten(brokerListenPort);
+    }
+}
+
+bool broker_isonline()
+{
+    return brokerOnline;
+}
+
+/*
+* Delays every packet by latency_us in both directions
+*/
+void broker_setlatency(uint32_t latency_us)
+{
+    brokerLatency_us = latency_us;
+}
+
+/*
+* Drops percent of all routed publishes (pseudo random, reproducible by seed)
+*/
+void broker_setloss(unsigned int percent, uint32_t seed)
+{
+    brokerLossPercent = percent;
+    brokerRandom = (seed != 0) ? seed : 1;
+}
+
+/*
+* Drops percent of the publishes received from clients before they are
+* acknowledged - a QoS 1 client must send them again
+*/
+void broker_setpublishloss(unsigned int percent)
+{
+    brokerPublishLossPercent = percent;
+}
+
+/*
+* Sends percent of the QoS 1 deliveries twice, the second time with the
+* DUP flag
+*/
+void broker_setduplicates(unsigned int percent)
+{
+    brokerDuplicatePercent = percent;
+}
+
+const hal_native_tcpops_t *broker_tcp()
+{
+    return &brokerTcp;
+}
+
+/*
+* Opens the listening socket. Returns the port or 0 on failure.
+*/
+uint16_t broker_openlisten(uint16_t port)
+{
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+    socklen_t addressLength = sizeof(address);
+    int flag = 1;
+
+    brokerListenSocket = socket(AF_INET, SOCK_STREAM, 0);
+    if ((brokerListenSocket < 0) ||
+        (setsockopt(brokerListenSocket, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag)) != 0) ||
+        (bind(brokerListenSocket, (struct sockaddr *)&address, sizeof(address)) != 0) ||
+        (listen(brokerListenSocket, BROKER_MAXSESSIONS) != 0) ||
+        (getsockname(brokerListenSocket, (struct sockaddr *)&address, &addressLength) != 0))
+    {
+        if (brokerListenSocket >= 0)
+        {
+            close(brokerListenSocket);
+            brokerListenSocket = -1;
+        }
+        return 0;
+    }
+    fcntl(brokerListenSocket, F_SETFL, fcntl(brokerListenSocket, F_GETFL) | O_NONBLOCK);
+    return ntohs(address.sin_port);
+}
+
+/*
+* Accepts clients on 127.0.0.1:port (0 selects a free port). Returns the
+* port or 0 on failure.
+*/
+uint16_t broker_listen(uint16_t port)
+{
+    broker_close();
+    brokerListenPort = broker_openlisten(port);
+    return brokerListenPort;
+}
+
+/*
+* Accepts new socket clients and services all sessions. Must be called
+* regularly if broker_listen() is used.
+*/
+void broker_poll()
+{
+    int client;
+    while ((brokerListenSocket >= 0) && ((client = accept(brokerListenSocket, NULL, NULL)) >= 0))
+    {
+        brokersession_t *session = NULL;
+        for (int s = BROKER_INPROCESS + 1; (session == NULL) && (s < BROKER_MAXSESSIONS); s++)
+        {
+            if (!brokerSessions[s].open)
+            {
+                session = &brokerSessions[s];
+                if (s >= brokerNumSessions)
+                {
+                    brokerNumSessions = s + 1;
+                }
+            }
+        }
+        if (!brokerOnline || (session == NULL))
+        {
+            close(client);
+            continue;
+        }
+        int flag = 1;
+        setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+        session->open = true;
+        session->socket = client;
+    }
+    broker_service();
+}
+
+/*
+* Closes the listening socket and all socket sessions
+*/
+void broker_close()
+{
+    for (int s = BROKER_INPROCESS + 1; s < brokerNumSessions; s++)
+    {
+        if (brokerSessions[s].open && (brokerSessions[s].socket >= 0))
+        {
+            broker_closesession(brokerSessions[s], true);
+        }
+    }
+    if (brokerListenSocket >= 0)
+    {
+        close(brokerListenSocket);
+        brokerListenSocket = -1;
+    }
+    brokerListenPort = 0;
+}
+
+/*
+* Adds a local observer for a topic filter. The matching retained messages
+* are delivered immediately.
+*/
+bool broker_subscribe(const char *filter, broker_callback_t callback)
+{
+    if ((brokerNumObservers == BROKER_MAXOBSERVERS) || (strlen(filter) >= BROKER_MAXTOPICLENGTH))
+    {
+        return false;
+    }
+    brokerobserver_t &observer = brokerObservers[brokerNumObservers++];
+    snprintf(observer.filter, sizeof(observer.filter), "%s", filter);
+    observer.callback = callback;
+    for (int r = 0; r < BROKER_MAXRETAINED; r++)
+    {
+        if ((brokerRetained[r].size > 0) && broker_topicmatches(filter, brokerRetained[r].topic))
+        {
+            callback(brokerRetained[r].topic, (const uint8_t *)brokerRetained[r].payload, brokerRetained[r].size, true);
+        }
+    }
+    return true;
+}
+
+/*
+* Publishes a message as a local client (e.g. a remote command)
+*/
+void broker_publish(const char *topic, const uint8_t *payload, size_t size, bool retain)
+{
+    if (!brokerOnline || (strlen(topic) >= BROKER_MAXTOPICLENGTH))
+    {
+        return;
+    }
+    brokerStats.publishesReceived++;
+    broker_route(topic, payload, size, retain);
+}
+
+void broker_publish(const char *topic, const char *payload, bool retain)
+{
+    broker_publish(topic, (const uint8_t *)payload, strlen(payload), retain);
+}
+
+/*
+* Returns true if a client with this id has an established session
+*/
+bool broker_clientconnected(const char *clientId)
+{
+    for (int s = 0; s < brokerNumSessions; s++)
+    {
+        if (brokerSessions[s].connected && (strcmp(brokerSessions[s].clientId, clientId) == 0))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+* Returns the retained message of a topic (NULL if there is none)
+*/
+const char *broker_retained(const char *topic)
+{
+    brokerretained_t *entry = broker_findretained(topic, false);
+    return ((entry != NULL) && (entry->size > 0)) ? entry->payload : NULL;
+}
+
+const broker_stats_t *broker_getstats()
+{
+    return &brokerStats;
+}
+
+/*
+* Matches a topic against a filter with the wildcards + (one level) and #
+* (all remaining levels, also the parent level). Topics starting with $ are
+* not matched by a leading wildcard.
+*/
+bool broker_topicmatches(const char *filter, const char *topic)
+{
+    if ((*topic == '$') && ((*filter == '+') || (*filter == '#')))
+    {
+        return false;
+    }
+    while (*filter != 0)
+    {
+        if (*filter == '#')
+        {
+            return true;
+        }
+        if (*filter == '+')
+        {
+            while ((*topic != 0) && (*topic != '/'))
+            {
+                topic++;
+            }
+            filter++;
+        }
+        else
+        {
+            while ((*filter != 0) && (*filter != '/'))
+            {
+                if (*filter++ != *topic++)
+                {
+                    return false;
+                }
+            }
+        }
+        if (*filter == 0)
+        {
+            return *topic == 0;
+        }
+        if (*topic != '/')
+        {
+            // "a/#" also matches "a"
+            return (*topic == 0) && (strcmp(filter, "/#") == 0);
+        }
+        filter++;
+        topic++;
+    }
+    return *topic == 0;
+}
+
+#endif // ARDUINO
@@ -0,0 +1,179 @@
+#include "hal.h"
+
+#include "config.h"
+#include "cmdqueue.h"
+
+/*
+* Token bucket - a command consumes one token, tokens are refilled with
+* a fixed interval up to the burst size of the source
+*/
+struct tokenbucket_t
+{
+    uint8_t tokens;
+    uint8_t burst;
+    uint32_t refill_ms;
+    uint32_t prev_ms_refill;
+};
+
+// ring buffer of commands waiting for execution
+command_t queue[CMDQUEUE_CAPACITY];
+uint8_t queueHead = 0;
+uint8_t queueCount = 0;
+uint16_t queueSeq = 0;
+
+tokenbucket_t buckets[CMDQUEUE_NUMSOURCES];
+cmdqueue_stats_t queueStats;
+
+// forward declarations
+bool cmdqueue_taketoken(int source);
+
+/*
+* Inits the queue and fills the token buckets of all sources
+*/
+void cmdqueue_init()
+{
+    queueHead = 0;
+    queueCount = 0;
+    memset(&queueStats, 0, sizeof(queueStats));
+
+    buckets[CMDQUEUE_SOURCELOCAL].burst = cmdRateLocalBurst;
+    buckets[CMDQUEUE_SOURCELOCAL].refill_ms = cmdRateLocalRefill_ms;
+    buckets[CMDQUEUE_SOURCEREMOTE].burst = cmdRateRemoteBurst;
+    buckets[CMDQUEUE_SOURCEREMOTE].refill_ms = cmdRateRemoteRefill_ms;
+    for (int source = 0; source < CMDQUEUE_NUMSOURCES; source++)
+    {
+        buckets[source].tokens = buckets[source].burst;
+        buckets[source].prev_ms_refill = hal_millis();
+    }
+}
+
+/*
+* Takes a token from the bucket of a source. Returns false if the source
+* has exceeded its rate.
+*/
+bool cmdqueue_taketoken(int source)
+{
+    tokenbucket_t &bucket = buckets[source];
+    uint32_t now = hal_millis();
+    if (bucket.refill_ms > 0)
+    {
+        uint32_t refills = (now - bucket.prev_ms_refill) / bucket.refill_ms;
+        if (refills > 0)
+        {
+            bucket.tokens = (bucket.tokens + refills > bucket.burst) ? bucket.burst : bucket.tokens + refills;
+            bucket.prev_ms_refill += refills * bucket.refill_ms;
+        }
+    }
+    if (bucket.tokens == 0)
+    {
+        return false;
+    }
+    bucket.tokens--;
+    return true;
+}
+
+/*
+* Queues a door command. If a command for the same door is still waiting
+* and merging is enabled, the waiting command is replaced (last one wins)
+* and keeps its place in the queue. Returns the sequence number of the
+* command or 0 if it was rejected. A command which doesn't fit into the
+* queue takes no token and no sequence number.
+*/
+uint16_t cmdqueue_push(int door, int command, int source)
+{
+    command_t *merged = NULL;
+    if (cmdQueueMergePerDoor)
+    {
+        for (uint8_t i = 0; (i < queueCount) && (merged == NULL); i++)
+        {
+            command_t &queued = queue[(queueHead + i) % CMDQUEUE_CAPACITY];
+            if (queued.door == door)
+            {
+                merged = &queued;
+            }
+        }
+    }
+    if ((merged == NULL) && (queueCount == CMDQUEUE_CAPACITY) && (cmdQueueOverflowPolicy == CMDQUEUE_POLICYDROPNEWEST))
+    {
+        queueStats.rejectedFull++;
+        return 0;
+    }
+
+    if (!cmdqueue_taketoken(source))
+    {
+        queueStats.rejectedRateLimit++;
+        return 0;
+    }
+
+    // next sequence number - 0 is reserved for rejected commands
+    if (++queueSeq == 0)
+    {
+        queueSeq = 1;
+    }
+
+    if (merged != NULL)
+    {
+        merged->seq = queueSeq;
+        merged->command = command;
+        merged->source = source;
+        merged->ms_queued = hal_millis();
+        queueStats.merged++;
+        return queueSeq;
+    }
+
+    if (queueCount == CMDQUEUE_CAPACITY)
+    {
+        // CMDQUEUE_POLICYDROPOLDEST
+        queueStats.rejectedFull++;
+        queueHead = (queueHead + 1) % CMDQUEUE_CAPACITY;
+        queueCount--;
+    }
+
+    command_t &entry = queue[(queueHead + queueCount) % CMDQUEUE_CAPACITY];
+    entry.seq = queueSeq;
+    entry.door = door;
+    entry.command = command;
+    entry.source = source;
+    entry.ms_queued = hal_millis();
+    queueCount++;
+
+    queueStats.accepted++;
+    queueStats.depth = queueCount;
+    if (queueCount > queueStats.maxDepth)
+    {
+        queueStats.maxDepth = queueCount;
+    }
+    return queueSeq;
+}
+
+/*
+* Takes the oldest command from the queue. Returns false if the queue is empty
+*/
+bool cmdqueue_pop(command_t* command)
+{
+    if (queueCount == 0)
+    {
+        return false;
+    }
+    *command = queue[queueHead];
+    queueHead = (queueHead + 1) % CMDQUEUE_CAPACITY;
+    queueCount--;
+    queueStats.depth = queueCount;
+    return true;
+}
+
+/*
+* Returns the counters of the queue
+*/
+const cmdqueue_stats_t* cmdqueue_getstats()
+{
+    return &queueStats;
+}
+
+/*
+* Returns the number of rejected commands (rate limit and overflow)
+*/
+unsigned long cmdqueue_getrejected()
+{
+    return queueStats.rejectedRateLimit + queueStats.rejectedFull;
+}
\ No newline at end of file
@@ -1,9 +1,9 @@
 #include "config.h"
 
 // this information is shown on the OLED display and also sent to the MQTT broker
-String application = "GarageDoorController";
-String version = "0.1.5";
-String author = "smhex";
+const char application[] = "GarageDoorController";
+const char version[] = "0.1.5";
+const char author[] = "smhex";
 
 // Network configuration - sets MAC and IP address
 byte mac[] = {0xDE, 0xAD, 0xBE, 0xEF, 0xFE, 0xED};
@@ -12,14 +12,57 @@ IPAddress dns(192, 168, 30, 1);
 IPAddress subnet(255, 255, 255, 0);
 IPAddress gateway(192, 168, 30, 1);
 
+// Drive IO configuration - one entry per door. Pins of a second door could be
+// located on an expander, e.g. {DRIVEIO_EXPANDERPIN(1, 0), DRIVEIO_EXPANDERPIN(1, 1), 
+// DRIVEIO_EXPANDERPIN(1, 2), DRIVEIO_EXPANDERPIN(1, 3)}
+const doorpins_t doorPins[DOOR_COUNT] = {
+    {CMD_OPENDOOR_OUTPUT, STATUS_DOORISOPEN_INPUT, CMD_CLOSEDOOR_OUTPUT, STATUS_DOORISCLOSED_INPUT},
+};
+
 // MQTT configuration
 const char mqttBrokerAddress[] = "mosquitto.debes-online.com";
 const unsigned int mqttBrokerPort = 1883;
-String mqttClientID = "arduino-gdc";
-String mqttUsername = "mosquitto";
-String mqttPassword = "mosquitto";
-String mqttLastWillMsg = "offline";
-String mqttFirstWillMsg = "online";
+char mqttClientID[MQTT_MAXCLIENTIDLENGTH] = "arduino-gdc";
+char mqttTopicPrefix[MQTT_MAXTOPICPREFIXLENGTH] = "gdc";
+const char mqttUsername[] = "mosquitto";
+const char mqttPassword[] = "mosquitto";
+const char mqttLastWillMsg[] = "offline";
+const char mqttFirstWillMsg[] = "online";
+
+// a lost connection is retried after mqttReconnectMin_ms, the delay doubles
+// with every failed attempt up to mqttReconnectMax_ms. Half of each delay is
+// random, so several controllers don't reconnect at the same time.
+int mqttReconnectMin_ms = 1000;
+int mqttReconnectMax_ms = 16000;
+
+// time in ms after a connect to receive the retained messages of the broker
+// before the divergent retained topics are published again
+int mqttResyncWindow_ms = 500;
+
+// MQTT_HEARTBEATFIXED (0) publishes the uptime and the retained status every
+// second. MQTT_HEARTBEATADAPTIVE (1) publishes the status only when it changes
+// (the last will reports a lost device) and the uptime every
+// mqttUptimeInterval_ms (0 = only on request on gdc/system/uptime/get)
+int mqttHeartbeatPolicy = 1;
+int mqttUptimeInterval_ms = 60000;
+
+// QoS of the door topics: the door state changes are published and the
+// commands are subscribed with QoS 1, so they are retransmitted until the
+// broker has acknowledged them
+int mqttDoorTopicQos = 1;
+
+// telemetry topics which are published in the compact binary form instead
+// of json (see payload.h), one bit per topic id: e.g.
+// (1UL << MQTT_TOPICSYSTEMSENSORS) | (1UL << MQTT_TOPICDIAGDELIVERY)
+unsigned long mqttBinaryTopics = 0;
+
+// the metrics are served on http://<ip>:metricsPort/metrics
+const unsigned int metricsPort = 9100;
+
+// udp control channel for door commands without the broker, 0 = disabled.
+// The key must be the same on the client (scripts/udp_control.py) - change it!
+unsigned int udpControlPort = 0;
+const char udpControlKey[] = "change-this-shared-key";
 
 // duration for OLED display in HMI module being active after button press
 int displayTimeout_ms = 30000;
@@ -28,4 +71,37 @@ int displayTimeout_ms = 30000;
 int ledBlinkDuration_ms = 100;
 
 // duration in ms for the command pulse
-int commandDuration_ms = 500;
\ No newline at end of file
+int commandDuration_ms = 500;
+
+// time in ms a button must be stable before a press is accepted
+int debounce_button_ms = 100;
+
+// interval in ms for publishing the sensor values
+int sensorInterval_ms = 10000;
+
+// interval in ms for toggling the heartbeat led
+int heartbeatInterval_ms = 1000;
+
+// command rate limits per source (token bucket): number of commands which may
+// be sent at once and the interval in ms in which one more command is allowed.
+// A button held down repeats every 100ms and is limited by this as well.
+int cmdRateLocalBurst = 2;
+int cmdRateLocalRefill_ms = 1000;
+int cmdRateRemoteBurst = 3;
+int cmdRateRemoteRefill_ms = 2000;
+
+// a new command replaces a waiting command of the same door (last one wins)
+bool cmdQueueMergePerDoor = true;
+
+// CMDQUEUE_POLICYDROPNEWEST (0) or CMDQUEUE_POLICYDROPOLDEST (1) if the queue is full
+int cmdQueueOverflowPolicy = 0;
+
+// an alert is published on gdc/system/alert if the free ram drops below this value
+int memLowThreshold_bytes = 2048;
+
+// interval in ms for analyzing and publishing the memory statistics
+int memPublishInterval_ms = 60000;
+
+// low-power idle when nothing is due: IDLE_MODEOFF (0), IDLE_MODEIDLE (1) or
+// IDLE_MODESTANDBY (2) - see idle.h
+int idleMode = 2;
@@ -1,156 +1,343 @@
-#include <Arduino.h>
+#include "hal.h"
 
 #include "config.h"
 #include "driveio.h"
+#include "trace.h"
+#include "idle.h"
 
-// internal variables holding the different door states
-bool doorStatusIsUnknwon = true;
-bool doorStatusIsOpen = false;
-bool doorStatusIsClosed = false;
-bool doorStatusIsMovingOrStopped = false;
-bool doorStatusIsExternal = false;
+// pins on an expander are encoded by DRIVEIO_EXPANDERPIN(address, pin)
+#define DRIVEIO_ISEXPANDERPIN(pin)      (((pin) & 0x80) != 0)
+#define DRIVEIO_EXPANDERADDRESS(pin)    (((pin) >> 3) & 0x07)
+#define DRIVEIO_EXPANDERIO(pin)         ((pin) & 0x07)
 
-// status of active commands
-bool commandOpenDoorActive = false;
-bool commandCloseDoorActive = false;
+/*
+* Compact state record of a single door. All flags and both status values
+* fit into one byte, the timestamps are needed for the asynchronous pulses
+*/
+struct door_t
+{
+    uint8_t currentStatus : 2;
+    uint8_t previousStatus : 2;
+    uint8_t commandOpenActive : 1;
+    uint8_t commandCloseActive : 1;
+    uint8_t statusOpen : 1;
+    uint8_t statusClosed : 1;
+    uint32_t prev_ms_open;
+    uint32_t prev_ms_close;
+};
 
-// helper variables to maintain the door status
-int currentDoorStatus = DOORSTATUSEXTERNAL;
-int previousDoorStatus = DOORSTATUSEXTERNAL;
+/*
+* Drive io engine for N doors. The number of doors is fixed at compile time,
+* so all state lives in one static array and a loop pass costs the same
+* amount of work for every door. All inputs are sampled in one batched pass:
+* each native port group and each used expander is read exactly once.
+*/
+template <uint8_t N>
+class DriveIO
+{
+public:
+    door_t doors[N];
 
-// helper variables to create the pulse asynchronously
-unsigned long prev_ms_open = 0;  
-unsigned long prev_ms_close = 0;  
+    void init();
+    void scan();
+    void pulse();
+    void setoutput(uint8_t pin, int value);
+    int readinput(uint8_t pin);
 
-// forward declarations
-void driveio_readiosignals();
+private:
+    uint8_t expanderInputs[HAL_MAXEXPANDERS];
+    uint8_t expanderMask = 0;
+    bool polledInputs = false;      // an input on an expander or a pin without
+                                    // an external interrupt has to be polled
+    uint32_t nativeInputs[HAL_GPIOPORTGROUPS];
+
+    void initpin(uint8_t pin, bool output);
+};
+
+DriveIO<DOOR_COUNT> driveio;
 
 /*
-* Inits the IO interface pins to the drive (2x Input, 2x Output)
+* Inits the IO interface pins to the drive (2x Input, 2x Output per door)
 */
-void driveio_init()
+template <uint8_t N>
+void DriveIO<N>::init()
 {
-    // setup pins and modes
-    pinMode(CMD_OPENDOOR_OUTPUT, OUTPUT);
-    pinMode(STATUS_DOORISOPEN_INPUT, INPUT_PULLDOWN);
-    pinMode(CMD_CLOSEDOOR_OUTPUT, OUTPUT);
-    pinMode(STATUS_DOORISCLOSED_INPUT, INPUT_PULLDOWN);
+    for (uint8_t i = 0; i < N; i++)
+    {
+        doors[i] = door_t();
+        doors[i].currentStatus = DOORSTATUSEXTERNAL;
+        doors[i].previousStatus = DOORSTATUSEXTERNAL;
+        initpin(doorPins[i].cmdOpenOutput, true);
+        initpin(doorPins[i].statusOpenInput, false);
+        initpin(doorPins[i].cmdCloseOutput, true);
+        initpin(doorPins[i].statusClosedInput, false);
+    }
 }
 
 /*
-* The door status is read and if a command is requested the
-* necessary pulse at the corresponding pin is created.
+* Sets up a single pin either natively or on its expander. An expander is
+* initialized when the first of its pins is configured.
 */
-void driveio_loop()
+template <uint8_t N>
+void DriveIO<N>::initpin(uint8_t pin, bool output)
 {
-    // read signals
-    driveio_readiosignals();
+    if (DRIVEIO_ISEXPANDERPIN(pin))
+    {
+        uint8_t address = DRIVEIO_EXPANDERADDRESS(pin);
+        if ((expanderMask & (1 << address)) == 0)
+        {
+            hal_expander_begin(address);
+            expanderMask |= (1 << address);
+        }
+        hal_expander_mode(address, DRIVEIO_EXPANDERIO(pin), output ? OUTPUT : INPUT);
+        if (output)
+        {
+            hal_expander_write(address, DRIVEIO_EXPANDERIO(pin), LOW);
+        }
+        polledInputs |= !output;
+    }
+    else
+    {
+        hal_gpio_mode(pin, output ? OUTPUT : INPUT_PULLDOWN);
+        if (output)
+        {
+            hal_gpio_write(pin, LOW);
+        }
+        else
+        {
+            // a change of the input ends a low-power wait (see idle.h)
+            polledInputs |= !hal_sleep_wakepin(pin);
+        }
+    }
+}
 
-    /* To open or close the door a 500ms (default) pulse is required 
-     * at the output pin(s). The pulse width can be configured via the
-     * variable "commandDuration_ms". The rising edge is generated a 
-     * soon as a driveio_setdoorcommand() is called. 
-     */
-    if (commandOpenDoorActive)
+/*
+* Reads all inputs at once and updates the status of every door
+*/
+template <uint8_t N>
+void DriveIO<N>::scan()
+{
+    // one register read per port group and one i2c transfer per expander
+    for (uint8_t group = 0; group < HAL_GPIOPORTGROUPS; group++)
     {
-        digitalWrite(CMD_OPENDOOR_OUTPUT, HIGH);
-        if (millis() > prev_ms_open + commandDuration_ms){
-                digitalWrite(CMD_OPENDOOR_OUTPUT, LOW);
-                commandOpenDoorActive = false;
+        nativeInputs[group] = hal_gpio_readport(group);
+    }
+    for (uint8_t address = 0; address < HAL_MAXEXPANDERS; address++)
+    {
+        if (expanderMask & (1 << address))
+        {
+            expanderInputs[address] = hal_expander_readport(address);
         }
     }
-    if (commandCloseDoorActive)
-    {  
-         digitalWrite(CMD_CLOSEDOOR_OUTPUT, HIGH);  
-        if (millis() > prev_ms_close + commandDuration_ms){
-                digitalWrite(CMD_CLOSEDOOR_OUTPUT, LOW);
-                commandCloseDoorActive = false;      
+
+    for (uint8_t i = 0; i < N; i++)
+    {
+        door_t &door = doors[i];
+
+        // preserve previous status
+        door.previousStatus = door.currentStatus;
+        door.statusOpen = readinput(doorPins[i].statusOpenInput);
+        door.statusClosed = readinput(doorPins[i].statusClosedInput);
+
+        // both inputs set means moving/stopped, none of them means external
+        if (door.statusOpen && door.statusClosed)
+        {
+            door.currentStatus = DOORSTATUSMOVINGORSTOPPED;
+        }
+        else if (door.statusOpen)
+        {
+            door.currentStatus = DOORSTATUSOPEN;
+        }
+        else if (door.statusClosed)
+        {
+            door.currentStatus = DOORSTATUSCLOSED;
+        }
+        else
+        {
+            door.currentStatus = DOORSTATUSEXTERNAL;
+        }
+        if (door.currentStatus != door.previousStatus)
+        {
+            trace_doorstatus(i, door.currentStatus);
         }
     }
+    if (polledInputs)
+    {
+        idle_due(IDLE_SOURCEINPUTS, hal_millis() + IDLE_INPUTPOLL_MS);
+    }
+}
 
-    // let the other loops run
-    yield();
+/*
+* Ends the command pulses which have been started by driveio_setdoorcommand().
+* The outputs are only written on the edges of a pulse.
+*/
+template <uint8_t N>
+void DriveIO<N>::pulse()
+{
+    uint32_t now = hal_millis();
+    for (uint8_t i = 0; i < N; i++)
+    {
+        door_t &door = doors[i];
+        if (door.commandOpenActive && (now - door.prev_ms_open > (uint32_t)commandDuration_ms))
+        {
+            setoutput(doorPins[i].cmdOpenOutput, LOW);
+            door.commandOpenActive = false;
+        }
+        if (door.commandCloseActive && (now - door.prev_ms_close > (uint32_t)commandDuration_ms))
+        {
+            setoutput(doorPins[i].cmdCloseOutput, LOW);
+            door.commandCloseActive = false;
+        }
+
+        // a running pulse ends on time, the clocks are kept running
+        if (door.commandOpenActive)
+        {
+            idle_due(IDLE_SOURCEDOORS, door.prev_ms_open + commandDuration_ms + 1);
+            idle_hold();
+        }
+        if (door.commandCloseActive)
+        {
+            idle_due(IDLE_SOURCEDOORS, door.prev_ms_close + commandDuration_ms + 1);
+            idle_hold();
+        }
+    }
 }
 
 /*
-* Returns the current state of the door and also a flag, indicating
-* whether is has changed or not. The params "oldStatus" and "newStatus"
-* are provided by the caller. 
+* Writes an output pin (native or expander)
 */
-bool driveio_doorstatuschanged(int* oldStatus, int* newStatus){
-    if (currentDoorStatus!=previousDoorStatus){
-        *oldStatus = previousDoorStatus;
-        *newStatus = currentDoorStatus;
+template <uint8_t N>
+void DriveIO<N>::setoutput(uint8_t pin, int value)
+{
+    if (DRIVEIO_ISEXPANDERPIN(pin))
+    {
+        hal_expander_write(DRIVEIO_EXPANDERADDRESS(pin), DRIVEIO_EXPANDERIO(pin), value);
+    }
+    else
+    {
+        hal_gpio_write(pin, value);
     }
-    return (currentDoorStatus==previousDoorStatus) ? false : true;
 }
 
 /*
-* Reads the IO signals to update internal status variables
+* Returns the state of an input pin from the last batched scan
 */
-void driveio_readiosignals(){
-    
-    // preserve previous status
-    previousDoorStatus = currentDoorStatus;
-
-    // get current door status
-    currentDoorStatus = DOORSTATUSEXTERNAL;
-    doorStatusIsOpen = digitalRead(STATUS_DOORISOPEN_INPUT);
-    doorStatusIsClosed = digitalRead(STATUS_DOORISCLOSED_INPUT);
-    doorStatusIsExternal = (!doorStatusIsOpen && !doorStatusIsClosed);
-    doorStatusIsMovingOrStopped = (doorStatusIsOpen && doorStatusIsClosed);
-
-    // put into doorStatus variable
-    if (doorStatusIsMovingOrStopped){
-        currentDoorStatus = DOORSTATUSMOVINGORSTOPPED;
+template <uint8_t N>
+int DriveIO<N>::readinput(uint8_t pin)
+{
+    if (DRIVEIO_ISEXPANDERPIN(pin))
+    {
+        return (expanderInputs[DRIVEIO_EXPANDERADDRESS(pin)] >> DRIVEIO_EXPANDERIO(pin)) & 1;
     }
-    else{
-        if (doorStatusIsOpen){currentDoorStatus = DOORSTATUSOPEN;}
-        if (doorStatusIsClosed){currentDoorStatus = DOORSTATUSCLOSED;}
+    uint8_t group;
+    uint8_t bit;
+    hal_gpio_portbit(pin, &group, &bit);
+    return (nativeInputs[group] >> bit) & 1;
+}
+
+/*
+* Inits the IO interface pins of all doors
+*/
+void driveio_init()
+{
+    driveio.init();
+}
+
+/*
+* The door status is read and if a command is requested the
+* necessary pulse at the corresponding pin is created.
+*/
+void driveio_loop()
+{
+    // read signals of all doors
+    driveio.scan();
+
+    /* To open or close the door a 500ms (default) pulse is required
+     * at the output pin(s). The pulse width can be configured via the
+     * variable "commandDuration_ms". The rising edge is generated as
+     * soon as a driveio_setdoorcommand() is called.
+     */
+    driveio.pulse();
+
+    // let the other loops run
+    hal_yield();
+}
+
+/*
+* Returns the current state of the door and also a flag, indicating
+* whether is has changed or not. The params "oldStatus" and "newStatus"
+* are provided by the caller.
+*/
+bool driveio_doorstatuschanged(int door, int* oldStatus, int* newStatus){
+    const door_t &d = driveio.doors[door];
+    if (d.currentStatus!=d.previousStatus){
+        *oldStatus = d.previousStatus;
+        *newStatus = d.currentStatus;
     }
+    return (d.currentStatus==d.previousStatus) ? false : true;
 }
 
 /*
 * Sets the IO signals to request the new door status (open or close).
-* The output is actually set during the loop() function to make it
-* non blocking. 
+* The rising edge is created immediately, the falling edge is created
+* during the loop() function to make it non blocking.
 */
-void driveio_setdoorcommand(int Command)
+void driveio_setdoorcommand(int door, int Command)
 {
-    if ((Command == DOORCOMMANDOPEN) && (!commandOpenDoorActive))
+    door_t &d = driveio.doors[door];
+    if ((Command == DOORCOMMANDOPEN) && (!d.commandOpenActive))
     {
-        commandOpenDoorActive = true;
-        prev_ms_open = millis();  
+        d.commandOpenActive = true;
+        d.prev_ms_open = hal_millis();
+        driveio.setoutput(doorPins[door].cmdOpenOutput, HIGH);
+        trace_mark(door, TRACE_PULSESTART);
     }
-    if ((Command == DOORCOMMANDCLOSE) && (!commandCloseDoorActive))
+    if ((Command == DOORCOMMANDCLOSE) && (!d.commandCloseActive))
     {
-        commandCloseDoorActive = true;
-        prev_ms_close = millis(); 
+        d.commandCloseActive = true;
+        d.prev_ms_close = hal_millis();
+        driveio.setoutput(doorPins[door].cmdCloseOutput, HIGH);
+        trace_mark(door, TRACE_PULSESTART);
     }
+
+    // the next pass schedules the end of the pulse (see idle.h)
+    idle_due(IDLE_SOURCEDOORS, hal_millis());
 }
 
 /*
  * Returns true if a command (open/close) is active at the moment. It is
  * only true during the command pulse
  * */
-bool driveio_doorcommandactive()
+bool driveio_doorcommandactive(int door)
 {
-    return (commandOpenDoorActive || commandCloseDoorActive);
+    return (driveio.doors[door].commandOpenActive || driveio.doors[door].commandCloseActive);
 }
 
 /*
-* Returns the state of the IO. Parameter "io" corresponds with one of
-* input or output pins
+* Returns the state of an IO of a door. Parameter "io" is one of the
+* DRIVEIO_xxx values. Outputs are high during the command pulse.
 */
-int driveio_getiostatus(int io)
+int driveio_getiostatus(int door, int io)
 {
-    return digitalRead(io);
+    const door_t &d = driveio.doors[door];
+    switch (io)
+    {
+    case DRIVEIO_CMDOPENOUTPUT:
+        return d.commandOpenActive;
+    case DRIVEIO_STATUSOPENINPUT:
+        return d.statusOpen;
+    case DRIVEIO_CMDCLOSEOUTPUT:
+        return d.commandCloseActive;
+    case DRIVEIO_STATUSCLOSEDINPUT:
+        return d.statusClosed;
+    }
+    return LOW;
 }
 
 /*
-* Returns the current door status 
+* Returns the current door status
 */
-int driveio_getcurrentdoorstatus()
+int driveio_getcurrentdoorstatus(int door)
 {
-    return currentDoorStatus;
+    return driveio.doors[door].currentStatus;
 }
\ No newline at end of file
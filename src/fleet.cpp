@@ -0,0 +1,301 @@
+#ifndef ARDUINO
+
+// Include libraries
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "hal.h"
+#include "hal_native.h"
+#include "config.h"
+#include "mqtt.h"
+#include "broker.h"
+#include "fleet.h"
+
+struct fleetdevice_t
+{
+    char prefix[BROKER_MAXTOPICLENGTH];
+    bool online;
+    bool probePending;
+    uint64_t probeSent_us;
+    unsigned long probes;
+    unsigned long answers;
+    uint64_t latencyTotal_us;
+    uint64_t latencyMax_us;
+};
+
+fleetdevice_t fleetDevices[FLEET_MAXDEVICES];
+int fleetNumDevices = 0;
+
+// round trip of every answered command
+uint32_t fleetSamples[FLEET_MAXSAMPLES];
+unsigned long fleetNumSamples = 0;
+
+// counters of the current second and of the whole run
+unsigned long fleetMessages = 0;
+unsigned long fleetSecondMessages = 0;
+unsigned long fleetSecondAnswers = 0;
+uint64_t fleetSecondLatency_us = 0;
+
+/*
+* Copies the device prefix if the topic is the given topic of a device, e.g.
+* "fleet/7" of "fleet/7/system/status"
+*/
+bool fleet_prefix(const char *topic, mqtt_topic_t deviceTopic, char *prefix)
+{
+    const char *path = mqtt_topicpath(deviceTopic);
+    size_t length = strlen(topic);
+    size_t pathLength = strlen(path);
+    if ((length <= pathLength + 1) || (topic[length - pathLength - 1] != '/') || (strcmp(topic + length - pathLength, path) != 0))
+    {
+        return false;
+    }
+    snprintf(prefix, BROKER_MAXTOPICLENGTH, "%.*s", (int)(length - pathLength - 1), topic);
+    return true;
+}
+
+fleetdevice_t *fleet_device(const char *prefix, bool create)
+{
+    for (int i = 0; i < fleetNumDevices; i++)
+    {
+        if (strcmp(fleetDevices[i].prefix, prefix) == 0)
+        {
+            return &fleetDevices[i];
+        }
+    }
+    if (!create || (fleetNumDevices == FLEET_MAXDEVICES))
+    {
+        return NULL;
+    }
+    fleetdevice_t *device = &fleetDevices[fleetNumDevices++];
+    memset(device, 0, sizeof(fleetdevice_t));
+    snprintf(device->prefix, sizeof(device->prefix), "%s", prefix);
+    return device;
+}
+
+/*
+* Observes all messages: discovers the devices and measures the round trip
+* of the commands
+*/
+void fleet_onmessage(const char *topic, const uint8_t *payload, size_t size, bool retain)
+{
+    char prefix[BROKER_MAXTOPICLENGTH];
+    fleetMessages++;
+    fleetSecondMessages++;
+    if (fleet_prefix(topic, MQTT_TOPICSYSTEMSTATUS, prefix))
+    {
+        fleetdevice_t *device = fleet_device(prefix, true);
+        if (device != NULL)
+        {
+            device->online = (size == strlen(mqttFirstWillMsg)) && (memcmp(payload, mqttFirstWillMsg, size) == 0);
+        }
+    }
+    else if (fleet_prefix(topic, MQTT_TOPICCONTROLGETNEWDOORSTATE, prefix))
+    {
+        fleetdevice_t *device = fleet_device(prefix, false);
+        if ((device != NULL) && device->probePending)
+        {
+            uint64_t latency_us = hal_native_time_us() - device->probeSent_us;
+            device->probePending = false;
+            device->answers++;
+            device->latencyTotal_us += latency_us;
+            if (latency_us > device->latencyMax_us)
+            {
+                device->latencyMax_us = latency_us;
+            }
+            if (fleetNumSamples < FLEET_MAXSAMPLES)
+            {
+                fleetSamples[fleetNumSamples++] = latency_us;
+            }
+            fleetSecondAnswers++;
+            fleetSecondLatency_us += latency_us;
+        }
+    }
+}
+
+/*
+* Sends a command to every online device whose interval has passed. A
+* command without an answer within the interval counts as lost.
+*/
+void fleet_probe(uint32_t interval_ms)
+{
+    uint64_t now_us = hal_native_time_us();
+    for (int i = 0; i < fleetNumDevices; i++)
+    {
+        fleetdevice_t &device = fleetDevices[i];
+        if (!device.online || (now_us - device.probeSent_us < (uint64_t)interval_ms * 1000))
+        {
+            continue;
+        }
+        MqttTopic topic;
+        topic.format("%s/%s", device.prefix, mqtt_topicpath(MQTT_TOPICCONTROLSETNEWDOORSTATE));
+        device.probePending = true;
+        device.probeSent_us = now_us;
+        broker_publish(topic.c_str(), (device.probes % 2 == 0) ? MQTT_COMMANDDOOROPEN : MQTT_COMMANDDOORCLOSE, false);
+        device.probes++;
+    }
+}
+
+int fleet_compare(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+uint32_t fleet_percentile(int percent)
+{
+    if (fleetNumSamples == 0)
+    {
+        return 0;
+    }
+    return fleetSamples[(fleetNumSamples - 1) * percent / 100];
+}
+
+/*
+* Runs the fleet broker. Returns 0 or 1 if the port can't be opened.
+*/
+int fleet_run(const fleet_options_t &options)
+{
+    hal_native_setclock(HAL_NATIVE_CLOCKREALTIME, 0);
+    broker_init();
+    broker_subscribe("#", fleet_onmessage);
+    if (broker_listen(options.port) == 0)
+    {
+        fprintf(stderr, "cannot listen on port %u\n", options.port);
+        return 1;
+    }
+
+    const broker_stats_t *stats = broker_getstats();
+    uint64_t restartAt_us = (uint64_t)options.restartAt_ms * 1000;
+    uint64_t up_us = restartAt_us + (uint64_t)options.downtime_ms * 1000;
+    bool restarted = false;
+    unsigned long sessionsBefore = 0;
+    long reconnect_ms = -1;
+    unsigned long peakConnects = 0;
+    uint64_t nextReport_us = 1000000;
+    unsigned long prevConnects = 0;
+
+    while (hal_native_time_us() < (uint64_t)options.duration_ms * 1000)
+    {
+        uint64_t now_us = hal_native_time_us();
+        broker_poll();
+
+        // restart of the broker: all sessions are dropped without wills
+        if ((options.restartAt_ms > 0) && !restarted && (now_us >= restartAt_us))
+        {
+            restarted = true;
+            sessionsBefore = stats->connects - stats->disconnects;
+            broker_setonline(false);
+            for (int i = 0; i < fleetNumDevices; i++)
+            {
+                fleetDevices[i].probePending = false;
+            }
+        }
+        if (restarted && !broker_isonline() && (now_us >= up_us))
+        {
+            broker_setonline(true);
+        }
+        if (restarted && broker_isonline() && (reconnect_ms < 0) && (stats->connects - stats->disconnects >= sessionsBefore))
+        {
+            reconnect_ms = (now_us - up_us) / 1000;
+        }
+        if (broker_isonline())
+        {
+            fleet_probe(options.probeInterval_ms);
+        }
+
+        if (now_us >= nextReport_us)
+        {
+            int online = 0;
+            for (int i = 0; i < fleetNumDevices; i++)
+            {
+                online += fleetDevices[i].online;
+            }
+            unsigned long connects = stats->connects - prevConnects;
+            if (restarted && (now_us > up_us) && (connects > peakConnects))
+            {
+                peakConnects = connects;
+            }
+            printf("{\"t_ms\":%lu,\"devices\":%d,\"sessions\":%lu,\"messages_per_s\":%lu,\"connects_per_s\":%lu,\"latency_mean_us\":%lu}\n",
+                   (unsigned long)(now_us / 1000), online, stats->connects - stats->disconnects, fleetSecondMessages, connects,
+                   fleetSecondAnswers ? (unsigned long)(fleetSecondLatency_us / fleetSecondAnswers) : 0);
+            fflush(stdout);
+            prevConnects = stats->connects;
+            fleetSecondMessages = 0;
+            fleetSecondAnswers = 0;
+            fleetSecondLatency_us = 0;
+            nextReport_us += 1000000;
+        }
+        usleep(100);
+    }
+
+    // summary
+    unsigned long probes = 0;
+    unsigned long answers = 0;
+    uint64_t deviceMin_us = 0;
+    uint64_t deviceMax_us = 0;
+    for (int i = 0; i < fleetNumDevices; i++)
+    {
+        const fleetdevice_t &device = fleetDevices[i];
+        probes += device.probes;
+        answers += device.answers;
+        uint64_t mean_us = device.answers ? device.latencyTotal_us / device.answers : 0;
+        if ((i == 0) || (mean_us < deviceMin_us))
+        {
+            deviceMin_us = mean_us;
+        }
+        if (mean_us > deviceMax_us)
+        {
+            deviceMax_us = mean_us;
+        }
+    }
+    qsort(fleetSamples, fleetNumSamples, sizeof(uint32_t), fleet_compare);
+    printf("{\"summary\":{\"devices\":%d,\"duration_ms\":%lu,\"messages_per_s\":%.1f,\"probes\":%lu,\"answers\":%lu,"
+           "\"latency_us\":{\"p50\":%lu,\"p90\":%lu,\"p99\":%lu,\"max\":%lu},\"device_mean_us\":{\"min\":%lu,\"max\":%lu},"
+           "\"restart\":{\"sessions_before\":%lu,\"reconnect_ms\":%ld,\"peak_connects_per_s\":%lu}}}\n",
+           fleetNumDevices, (unsigned long)options.duration_ms, fleetMessages * 1000.0 / options.duration_ms, probes, answers,
+           (unsigned long)fleet_percentile(50), (unsigned long)fleet_percentile(90), (unsigned long)fleet_percentile(99),
+           (unsigned long)fleet_percentile(100), (unsigned long)deviceMin_us, (unsigned long)deviceMax_us,
+           sessionsBefore, reconnect_ms, peakConnects);
+    broker_close();
+    return 0;
+}
+
+/*
+* Parses the options of "program fleet"
+*/
+int fleet_main(int argc, char **argv)
+{
+    fleet_options_t options = {1883, 60000, 5000, 0, 3000};
+    for (int i = 1; i < argc; i++)
+    {
+        if ((i + 1 < argc) && (strcmp(argv[i], "--port") == 0))
+        {
+            options.port = atoi(argv[++i]);
+        }
+        else if ((i + 1 < argc) && (strcmp(argv[i], "--duration") == 0))
+        {
+            options.duration_ms = strtoul(argv[++i], NULL, 10);
+        }
+        else if ((i + 1 < argc) && (strcmp(argv[i], "--probe-interval") == 0))
+        {
+            options.probeInterval_ms = strtoul(argv[++i], NULL, 10);
+        }
+        else if ((i + 1 < argc) && (strcmp(argv[i], "--restart-at") == 0))
+        {
+            options.restartAt_ms = strtoul(argv[++i], NULL, 10);
+        }
+        else if ((i + 1 < argc) && (strcmp(argv[i], "--downtime") == 0))
+        {
+            options.downtime_ms = strtoul(argv[++i], NULL, 10);
+        }
+        else
+        {
+            fprintf(stderr, "unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+    return fleet_run(options);
+}
+
+#endif // ARDUINO
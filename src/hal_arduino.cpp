@@ -0,0 +1,757 @@
+#ifdef ARDUINO
+
+// Include libraries
+#include <Arduino.h>
+#include <SPI.h>
+#include <Wire.h>
+#include <Ethernet.h>
+#include <SD.h>
+#include <EthernetUdp.h>
+#include <Dns.h>
+#include <utility/w5100.h>
+#include <WDTZero.h>
+#include <Adafruit_MCP23008.h>
+#include "buildfeatures.h"
+#if GDC_FEATURE_HMI
+#include <U8g2lib.h>
+#endif
+#if GDC_FEATURE_SENSORS
+#include <Arduino_MKRENV.h>
+#endif
+#include <malloc.h>
+#include <new>
+
+#include "hal.h"
+
+// symbols of the linker script and the newlib-nano allocator
+extern "C" char *sbrk(int incr);
+extern "C" char __StackTop;
+
+struct nanochunk_t
+{
+    long size;
+    nanochunk_t *next;
+};
+extern "C" nanochunk_t *__malloc_free_list;
+
+// devices
+EthernetClient ethClient;
+EthernetClient serverClient;
+EthernetUDP ethUdp;
+WDTZero watchdog;
+#if GDC_FEATURE_HMI
+U8G2_SH1106_128X64_NONAME_F_HW_I2C u8g2(U8G2_R0, /* reset=*/U8X8_PIN_NONE);
+#endif
+Adafruit_MCP23008 expanders[HAL_MAXEXPANDERS];
+uint8_t expanderMask = 0;
+
+// SD card - the classes of the SD library are used directly, the File
+// class would allocate every open file on the heap
+Sd2Card sdCard;
+SdVolume sdVolume;
+SdFile sdRoot;
+SdFile sdFile;
+bool sdReady = false;
+
+// SysTick and with it millis() stop in STANDBY - the time slept is added.
+// The RTC ticks (1024 Hz) are summed up and converted as a whole, so the
+// fractions of a ms don't get lost with every wait.
+uint64_t sleepTicks = 0;
+uint32_t sleepOffset_ms = 0;
+uint32_t sleepOffset_us = 0;
+
+/*
+* time
+*/
+uint32_t hal_millis()
+{
+    return millis() + sleepOffset_ms;
+}
+
+uint32_t hal_micros()
+{
+    return micros() + sleepOffset_us;
+}
+
+void hal_delay(unsigned long ms)
+{
+    delay(ms);
+}
+
+void hal_yield()
+{
+    yield();
+}
+
+/*
+* native gpio - the port registers are read directly to sample all inputs
+* of a port group at once
+*/
+void hal_gpio_mode(uint8_t pin, uint8_t mode)
+{
+    pinMode(pin, mode);
+}
+
+void hal_gpio_write(uint8_t pin, uint8_t value)
+{
+    digitalWrite(pin, value);
+}
+
+int hal_gpio_read(uint8_t pin)
+{
+    return digitalRead(pin);
+}
+
+uint32_t hal_gpio_readport(uint8_t group)
+{
+    return PORT->Group[group].IN.reg;
+}
+
+void hal_gpio_portbit(uint8_t pin, uint8_t *group, uint8_t *bit)
+{
+    *group = g_APinDescription[pin].ulPort;
+    *bit = g_APinDescription[pin].ulPin;
+}
+
+/*
+* MCP23008 expanders - an expander is initialized by the first call of
+* hal_expander_begin() for its address
+*/
+void hal_expander_begin(uint8_t address)
+{
+    if ((expanderMask & (1 << address)) == 0)
+    {
+        expanders[address].begin(address);
+        expanderMask |= (1 << address);
+    }
+}
+
+void hal_expander_mode(uint8_t address, uint8_t pin, uint8_t mode)
+{
+    expanders[address].pinMode(pin, (mode == OUTPUT) ? OUTPUT : INPUT);
+    if (mode == INPUT_PULLUP)
+    {
+        expanders[address].pullUp(pin, HIGH);
+    }
+}
+
+void hal_expander_write(uint8_t address, uint8_t pin, uint8_t value)
+{
+    expanders[address].digitalWrite(pin, value);
+}
+
+int hal_expander_read(uint8_t address, uint8_t pin)
+{
+    return expanders[address].digitalRead(pin);
+}
+
+uint8_t hal_expander_readport(uint8_t address)
+{
+    return expanders[address].readGPIO();
+}
+
+/*
+* display - without the HMI shield (see buildfeatures.h) the library isn't
+* linked and the functions do nothing
+*/
+#if GDC_FEATURE_HMI
+void hal_display_begin()
+{
+    u8g2.begin();
+}
+
+void hal_display_powersave(bool enable)
+{
+    u8g2.setPowerSave(enable);
+}
+
+void hal_display_clear()
+{
+    u8g2.clearBuffer();
+    u8g2.setFont(u8g2_font_6x10_tf);
+    u8g2.setFontRefHeightExtendedText();
+    u8g2.setDrawColor(1);
+    u8g2.setFontPosTop();
+    u8g2.setFontDirection(0);
+}
+
+unsigned int hal_display_textwidth(const char *text)
+{
+    return u8g2.getUTF8Width(text);
+}
+
+void hal_display_text(int x, int y, const char *text)
+{
+    u8g2.drawStr(x, y, text);
+}
+
+void hal_display_hline(int x, int y, int width)
+{
+    u8g2.drawHLine(x, y, width);
+}
+
+void hal_display_send()
+{
+    u8g2.sendBuffer();
+}
+#else
+void hal_display_begin()
+{
+}
+
+void hal_display_powersave(bool enable)
+{
+}
+
+void hal_display_clear()
+{
+}
+
+unsigned int hal_display_textwidth(const char *text)
+{
+    return 0;
+}
+
+void hal_display_text(int x, int y, const char *text)
+{
+}
+
+void hal_display_hline(int x, int y, int width)
+{
+}
+
+void hal_display_send()
+{
+}
+#endif
+
+/*
+* MKR ENV shield - without it (see buildfeatures.h) the library isn't linked
+* and the shield is reported missing
+*/
+#if GDC_FEATURE_SENSORS
+bool hal_env_begin()
+{
+    return ENV.begin();
+}
+
+float hal_env_temperature()
+{
+    return ENV.readTemperature();
+}
+
+float hal_env_humidity()
+{
+    return ENV.readHumidity();
+}
+
+float hal_env_pressure()
+{
+    return ENV.readPressure();
+}
+
+float hal_env_illuminance()
+{
+    return ENV.readIlluminance();
+}
+#else
+bool hal_env_begin()
+{
+    return false;
+}
+
+float hal_env_temperature()
+{
+    return 0;
+}
+
+float hal_env_humidity()
+{
+    return 0;
+}
+
+float hal_env_pressure()
+{
+    return 0;
+}
+
+float hal_env_illuminance()
+{
+    return 0;
+}
+#endif
+
+/*
+* network interface (MKR ETH shield) and the tcp socket
+*/
+int hal_net_begin(byte *mac, IPAddress ip, IPAddress dns, IPAddress gateway, IPAddress subnet)
+{
+    Ethernet.begin(mac, ip, dns, gateway, subnet);
+    return Ethernet.hardwareStatus();
+}
+
+bool hal_net_linkup()
+{
+    return Ethernet.linkStatus() != LinkOFF;
+}
+
+IPAddress hal_net_localip()
+{
+    return Ethernet.localIP();
+}
+
+/*
+* The address of the broker is kept until a connect fails - the lookup of
+* EthernetClient::connect(host) would wait up to 5 s for every attempt
+*/
+const char *tcpHost = NULL;
+IPAddress tcpAddress;
+
+bool hal_tcp_connect(const char *host, uint16_t port)
+{
+    if (host != tcpHost)
+    {
+        DNSClient dns;
+        dns.begin(Ethernet.dnsServerIP());
+        if (dns.getHostByName(host, tcpAddress, HAL_DNSTIMEOUT_MS) != 1)
+        {
+            return false;
+        }
+        tcpHost = host;
+    }
+    ethClient.setConnectionTimeout(HAL_TCPCONNECTTIMEOUT_MS);
+    if (!ethClient.connect(tcpAddress, port))
+    {
+        tcpHost = NULL;
+        return false;
+    }
+    return true;
+}
+
+bool hal_tcp_connected()
+{
+    return ethClient.connected();
+}
+
+size_t hal_tcp_write(const uint8_t *buffer, size_t size)
+{
+    return ethClient.write(buffer, size);
+}
+
+int hal_tcp_available()
+{
+    return ethClient.available();
+}
+
+int hal_tcp_read(uint8_t *buffer, size_t size)
+{
+    return ethClient.read(buffer, size);
+}
+
+void hal_tcp_stop()
+{
+    ethClient.stop();
+}
+
+/*
+* tcp server socket - the EthernetServer gets its port on construction, so it
+* is constructed in static memory by hal_server_begin()
+*/
+alignas(EthernetServer) uint8_t ethServerMemory[sizeof(EthernetServer)];
+EthernetServer *ethServer = NULL;
+
+bool hal_server_begin(uint16_t port)
+{
+    if (ethServer == NULL)
+    {
+        ethServer = new (ethServerMemory) EthernetServer(port);
+    }
+    ethServer->begin();
+    return true;
+}
+
+bool hal_server_accept()
+{
+    if ((ethServer == NULL) || serverClient)
+    {
+        return false;
+    }
+    serverClient = ethServer->accept();
+    return serverClient;
+}
+
+bool hal_server_connected()
+{
+    return serverClient.connected();
+}
+
+int hal_server_available()
+{
+    return serverClient.available();
+}
+
+int hal_server_read(uint8_t *buffer, size_t size)
+{
+    return serverClient.read(buffer, size);
+}
+
+size_t hal_server_writable()
+{
+    // free space in the send buffer of the W5500 socket
+    int writable = serverClient.availableForWrite();
+    return (writable > 0) ? writable : 0;
+}
+
+size_t hal_server_write(const uint8_t *buffer, size_t size)
+{
+    return serverClient.write(buffer, size);
+}
+
+void hal_server_disconnect()
+{
+    // EthernetClient::stop() would wait up to 1 s for the client to close,
+    // the FIN is sent directly
+    uint8_t socket = serverClient.getSocketNumber();
+    if (socket < MAX_SOCK_NUM)
+    {
+        SPI.beginTransaction(SPI_ETHERNET_SETTINGS);
+        W5100.execCmdSn(socket, Sock_DISCON);
+        SPI.endTransaction();
+    }
+}
+
+bool hal_server_closed()
+{
+    return serverClient.status() == SnSR::CLOSED;
+}
+
+void hal_server_stop()
+{
+    // returns at once if the socket is closed, otherwise after 1 ms with
+    // the socket closed forcibly
+    serverClient.setConnectionTimeout(0);
+    serverClient.stop();
+}
+
+/*
+* udp socket
+*/
+bool hal_udp_begin(uint16_t port)
+{
+    return ethUdp.begin(port) == 1;
+}
+
+int hal_udp_receive(uint8_t *buffer, size_t size, IPAddress *remoteIp, uint16_t *remotePort)
+{
+    int available = ethUdp.parsePacket();
+    if (available <= 0)
+    {
+        return 0;
+    }
+    *remoteIp = ethUdp.remoteIP();
+    *remotePort = ethUdp.remotePort();
+    int count = ethUdp.read(buffer, size);
+    // a datagram larger than the buffer is dropped completely
+    return (available > (int)size) ? 0 : count;
+}
+
+bool hal_udp_send(IPAddress remoteIp, uint16_t remotePort, const uint8_t *buffer, size_t size)
+{
+    return ethUdp.beginPacket(remoteIp, remotePort) && (ethUdp.write(buffer, size) == size) && ethUdp.endPacket();
+}
+
+/*
+* SD card of the MKR Zero
+*/
+bool hal_sd_begin()
+{
+    if (!sdReady)
+    {
+        sdReady = sdCard.init(SPI_HALF_SPEED, SDCARD_SS_PIN) && sdVolume.init(&sdCard) && sdRoot.openRoot(&sdVolume);
+    }
+    return sdReady;
+}
+
+int hal_file_read(const char *name, uint32_t offset, uint8_t *buffer, size_t size)
+{
+    if (!sdReady || !sdFile.open(&sdRoot, name, O_READ))
+    {
+        return -1;
+    }
+    int count = sdFile.seekSet(offset) ? sdFile.read(buffer, size) : -1;
+    sdFile.close();
+    return count;
+}
+
+bool hal_file_write(const char *name, const uint8_t *buffer, size_t size)
+{
+    if (!sdReady || !sdFile.open(&sdRoot, name, O_CREAT | O_WRITE | O_TRUNC))
+    {
+        return false;
+    }
+    bool written = (sdFile.write(buffer, size) == size);
+    return sdFile.close() && written;
+}
+
+bool hal_file_writeat(const char *name, uint32_t offset, const uint8_t *buffer, size_t size)
+{
+    if (!sdReady || !sdFile.open(&sdRoot, name, O_CREAT | O_WRITE))
+    {
+        return false;
+    }
+    bool written = sdFile.seekSet(offset) && (sdFile.write(buffer, size) == size);
+    return sdFile.close() && written;
+}
+
+bool hal_file_remove(const char *name)
+{
+    return sdReady && SdFile::remove(&sdRoot, name);
+}
+
+/*
+* low-power idle - IDLE stops the cpu only, SysTick ends every WFI after
+* 1 ms at the latest. STANDBY stops all clocks but generic clock 2, which
+* runs from the 32 kHz ultra low power oscillator at 1024 Hz (the watchdog
+* library uses the same setup) and clocks the RTC which ends the wait and
+* the EIC which detects the edges of the wake pins.
+*/
+volatile bool sleepWake = false;
+bool sleepRtcReady = false;
+
+void sleep_onwakepin()
+{
+    sleepWake = true;
+}
+
+extern "C" void RTC_Handler()
+{
+    RTC->MODE0.INTFLAG.reg = RTC_MODE0_INTFLAG_CMP0;
+}
+
+void sleep_clockinit()
+{
+    GCLK->GENDIV.reg = GCLK_GENDIV_ID(2) | GCLK_GENDIV_DIV(4);
+    GCLK->GENCTRL.reg = GCLK_GENCTRL_ID(2) | GCLK_GENCTRL_GENEN | GCLK_GENCTRL_SRC_OSCULP32K | GCLK_GENCTRL_DIVSEL | GCLK_GENCTRL_RUNSTDBY;
+    while (GCLK->STATUS.bit.SYNCBUSY) {}
+}
+
+/*
+* Routes generic clock 2 to a peripheral (GCLK_CLKCTRL_ID_*) - the channel
+* is disabled first
+*/
+void sleep_clockroute(uint16_t id)
+{
+    GCLK->CLKCTRL.reg = id;
+    while (GCLK->STATUS.bit.SYNCBUSY) {}
+    GCLK->CLKCTRL.reg = id | GCLK_CLKCTRL_GEN_GCLK2 | GCLK_CLKCTRL_CLKEN;
+    while (GCLK->STATUS.bit.SYNCBUSY) {}
+}
+
+/*
+* The RTC counts at 1024 Hz and ends a STANDBY with compare 0
+*/
+void sleep_rtcinit()
+{
+    sleep_clockinit();
+    PM->APBAMASK.reg |= PM_APBAMASK_RTC;
+    sleep_clockroute(GCLK_CLKCTRL_ID_RTC);
+    RTC->MODE0.CTRL.reg = RTC_MODE0_CTRL_SWRST;
+    while (RTC->MODE0.STATUS.bit.SYNCBUSY) {}
+    RTC->MODE0.CTRL.reg = RTC_MODE0_CTRL_MODE_COUNT32 | RTC_MODE0_CTRL_PRESCALER_DIV1;
+    RTC->MODE0.INTENSET.reg = RTC_MODE0_INTENSET_CMP0;
+    NVIC_EnableIRQ(RTC_IRQn);
+    RTC->MODE0.CTRL.reg |= RTC_MODE0_CTRL_ENABLE;
+    while (RTC->MODE0.STATUS.bit.SYNCBUSY) {}
+    sleepRtcReady = true;
+}
+
+bool hal_sleep_wakepin(uint8_t pin)
+{
+    if (g_APinDescription[pin].ulExtInt == NOT_AN_INTERRUPT)
+    {
+        return false;
+    }
+    attachInterrupt(digitalPinToInterrupt(pin), sleep_onwakepin, CHANGE);
+    sleep_clockinit();
+    sleep_clockroute(GCLK_CLKCTRL_ID_EIC);
+    EIC->WAKEUP.reg |= (1 << g_APinDescription[pin].ulExtInt);
+    return true;
+}
+
+uint32_t hal_sleep(uint32_t ms, bool standby, bool *woken)
+{
+    uint32_t start_us = hal_micros();
+    // STANDBY would drop the usb port, with a host attached only IDLE is used
+    if (standby && USBDevice.configured())
+    {
+        standby = false;
+    }
+    if (standby)
+    {
+        if (!sleepRtcReady)
+        {
+            sleep_rtcinit();
+        }
+        RTC->MODE0.COUNT.reg = 0;
+        while (RTC->MODE0.STATUS.bit.SYNCBUSY) {}
+        RTC->MODE0.COMP[0].reg = (ms * 1024 + 999) / 1000;
+        while (RTC->MODE0.STATUS.bit.SYNCBUSY) {}
+        RTC->MODE0.INTFLAG.reg = RTC_MODE0_INTFLAG_CMP0;
+        SCB->SCR |= SCB_SCR_SLEEPDEEP_Msk;
+        // an interrupt after the check still ends the WFI
+        __disable_irq();
+        if (!sleepWake)
+        {
+            __DSB();
+            __WFI();
+        }
+        __enable_irq();
+        SCB->SCR &= ~SCB_SCR_SLEEPDEEP_Msk;
+        RTC->MODE0.READREQ.reg = RTC_READREQ_RREQ;
+        while (RTC->MODE0.STATUS.bit.SYNCBUSY) {}
+        sleepTicks += RTC->MODE0.COUNT.reg;
+        sleepOffset_ms = (uint32_t)(sleepTicks * 1000 / 1024);
+        sleepOffset_us = (uint32_t)(sleepTicks * 1000000 / 1024);
+    }
+    else
+    {
+        PM->SLEEP.reg = PM_SLEEP_IDLE_CPU;
+        uint32_t start_ms = millis();
+        while (millis() - start_ms < ms)
+        {
+            __disable_irq();
+            if (!sleepWake)
+            {
+                __DSB();
+                __WFI();
+            }
+            __enable_irq();
+            if (sleepWake)
+            {
+                break;
+            }
+        }
+    }
+    *woken = sleepWake;
+    sleepWake = false;
+    return hal_micros() - start_us;
+}
+
+/*
+* watchdog
+*/
+void hal_watchdog_init(int timeout_s, void (*onShutdown)())
+{
+    watchdog.attachShutdown(onShutdown);
+    watchdog.setup(WDT_SOFTCYCLE16S);
+}
+
+void hal_watchdog_clear()
+{
+    watchdog.clear();
+}
+
+void hal_system_reset()
+{
+    Serial.flush();
+    NVIC_SystemReset();
+}
+
+uint8_t hal_system_resetcause()
+{
+    uint8_t cause = PM->RCAUSE.reg;
+    if (cause & PM_RCAUSE_SYST)
+    {
+        return HAL_RESETSYSTEM;
+    }
+    if (cause & PM_RCAUSE_WDT)
+    {
+        return HAL_RESETWATCHDOG;
+    }
+    if (cause & PM_RCAUSE_EXT)
+    {
+        return HAL_RESETEXTERNAL;
+    }
+    if (cause & (PM_RCAUSE_BOD12 | PM_RCAUSE_BOD33))
+    {
+        return HAL_RESETBROWNOUT;
+    }
+    return HAL_RESETPOWERON;
+}
+
+uint32_t hal_interrupts_disable()
+{
+    uint32_t state = __get_PRIMASK();
+    __disable_irq();
+    return state;
+}
+
+void hal_interrupts_restore(uint32_t state)
+{
+    __set_PRIMASK(state);
+}
+
+/*
+* serial line
+*/
+void hal_serial_begin(unsigned long baud)
+{
+    Serial.begin(baud);
+}
+
+void hal_serial_print(const char *text)
+{
+    Serial.print(text);
+}
+
+void hal_serial_println(const char *text)
+{
+    Serial.println(text);
+}
+
+/*
+* memory - the ram between heap and stack is painted to find the deepest
+* stack usage later
+*/
+void hal_mem_paint(uint8_t pattern, unsigned int guard)
+{
+    char *from = sbrk(0);
+    char *to = (char *)__get_MSP() - guard;
+    if (to > from)
+    {
+        memset(from, pattern, to - from);
+    }
+}
+
+unsigned int hal_mem_stackmax(uint8_t pattern)
+{
+    char *p = sbrk(0);
+    while ((p < &__StackTop) && (*p == (char)pattern))
+    {
+        p++;
+    }
+    return &__StackTop - p;
+}
+
+void hal_mem_info(hal_meminfo_t *info, bool analyze)
+{
+    // arena is the high water mark of the heap because nano malloc never
+    // returns memory to the system
+    struct mallinfo heap = mallinfo();
+    info->free = ((char *)__get_MSP() - sbrk(0)) + heap.fordblks;
+    info->heapSize = heap.arena;
+    info->heapUsed = heap.uordblks;
+    info->heapFree = heap.fordblks;
+    info->largestFreeBlock = 0;
+    if (analyze)
+    {
+        for (nanochunk_t *chunk = __malloc_free_list; chunk != NULL; chunk = chunk->next)
+        {
+            if ((unsigned int)chunk->size > info->largestFreeBlock)
+            {
+                info->largestFreeBlock = chunk->size;
+            }
+        }
+    }
+}
+#endif // ARDUINO
\ No newline at end of file
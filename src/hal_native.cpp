@@ -0,0 +1,1302 @@
+#ifndef ARDUINO
+
+// Include libraries
+#include <stdlib.h>
+#include <time.h>
+#include <malloc.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "hal.h"
+#include "hal_native.h"
+#include "config.h"
+#include "mqtt.h"
+#include "fleet.h"
+
+// firmware entry points (main.cpp)
+void setup();
+void loop();
+
+#define NATIVE_MAXPINS          64
+#define NATIVE_MAXDISPLAYTEXTS  8
+
+// clock
+int nativeClockMode = HAL_NATIVE_CLOCKVIRTUAL;
+uint64_t nativeTime_us = 0;
+uint64_t nativeRealtimeStart_us = 0;
+
+// native pins and expanders
+uint8_t nativePinModes[NATIVE_MAXPINS];
+uint8_t nativePinValues[NATIVE_MAXPINS];
+struct nativeexpander_t
+{
+    uint8_t outputMask;
+    uint8_t latch;
+    uint8_t inputs;
+};
+nativeexpander_t nativeExpanders[HAL_MAXEXPANDERS];
+
+// display - the texts of the frame being drawn and of the frame on the display
+struct nativedisplay_t
+{
+    char texts[NATIVE_MAXDISPLAYTEXTS][32];
+    int count;
+};
+nativedisplay_t nativeDrawing;
+nativedisplay_t nativeShown;
+bool nativeDisplayOn = true;
+
+// ENV shield
+bool nativeEnvPresent = true;
+float nativeTemperature = 20.0;
+float nativeHumidity = 50.0;
+float nativePressure = 101.3;
+float nativeIlluminance = 100.0;
+
+// network
+bool nativeLinkUp = true;
+IPAddress nativeLocalIp;
+const char *nativeBrokerHost = NULL;
+uint16_t nativeBrokerPort = 0;
+int nativeSocket = -1;
+
+// server socket - the port can be overridden (0 = any free port)
+#define NATIVE_SERVERWINDOW     2048
+int nativeServerPortOverride = -1;
+uint16_t nativeServerPort = 0;
+int nativeServerSocket = -1;
+int nativeServerClient = -1;
+
+// udp socket - the port can be overridden (0 = any free port)
+int nativeUdpPortOverride = -1;
+uint16_t nativeUdpPort = 0;
+int nativeUdpSocket = -1;
+
+// directory with the files of the SD card
+const char *nativeSdDir = NULL;
+bool nativeSdReady = false;
+
+// watchdog
+void (*nativeWatchdogShutdown)() = NULL;
+uint32_t nativeWatchdogTimeout_ms = 0;
+uint32_t nativeWatchdogCleared_ms = 0;
+unsigned long nativeWatchdogExpired = 0;
+bool nativeWatchdogExit = false;
+unsigned long nativeResets = 0;
+uint8_t nativeResetCause = HAL_RESETPOWERON;
+
+// inputs which end a wait of hal_sleep() when they change
+uint64_t nativeWakePins = 0;
+bool nativeWakePending = false;
+uint64_t nativeSleepLimit_us = 0;
+
+// devices which block for a while on every access (hal_native_setstall)
+uint32_t nativeStall_ms[HAL_NATIVE_NUMSTALLS];
+
+// serial line
+bool nativeSerialEcho = true;
+void (*nativeSerialHook)(const char *line) = NULL;
+char nativeSerialLine[256];
+size_t nativeSerialLength = 0;
+
+bool nativeSetupDone = false;
+
+// called whenever the virtual clock has advanced
+void (*nativeTimeHook)() = NULL;
+
+// forward declarations
+bool posix_connect(const char *host, uint16_t port);
+bool posix_connected();
+size_t posix_write(const uint8_t *buffer, size_t size);
+int posix_available();
+int posix_read(uint8_t *buffer, size_t size);
+void posix_stop();
+
+const hal_native_tcpops_t posixTcp = {posix_connect, posix_connected, posix_write, posix_available, posix_read, posix_stop};
+const hal_native_tcpops_t *nativeTcp = &posixTcp;
+
+/*
+* Returns the monotonic time of the host in us
+*/
+uint64_t native_realtime_us()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/*
+* Returns the monotonic time of the host in ns - the passes of loop() are
+* timed with it
+*/
+uint64_t native_realtime_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// host time of the passes of loop() run by hal_native_run()
+uint64_t nativeLoopPasses = 0;
+uint64_t nativeLoopTotal_ns = 0;
+uint64_t nativeLoopMax_ns = 0;
+
+/*
+* Checks the simulated watchdog - the shutdown handler is called like on
+* the board if the watchdog was not cleared in time
+*/
+void native_checkwatchdog()
+{
+    if ((nativeWatchdogTimeout_ms > 0) && (hal_millis() - nativeWatchdogCleared_ms > nativeWatchdogTimeout_ms))
+    {
+        nativeWatchdogExpired++;
+        nativeResetCause = HAL_RESETWATCHDOG;
+        nativeWatchdogCleared_ms = hal_millis();
+        if (nativeWatchdogShutdown != NULL)
+        {
+            nativeWatchdogShutdown();
+        }
+        if (nativeWatchdogExit)
+        {
+            // the board would reboot now
+            if (nativeSerialLength > 0)
+            {
+                hal_serial_println("");
+            }
+            fflush(stdout);
+            exit(HAL_NATIVE_EXITWATCHDOG);
+        }
+    }
+}
+
+/*
+* Blocks for the stall time of a device (see hal_native_setstall)
+*/
+void native_stall(int device)
+{
+    if (nativeStall_ms[device] > 0)
+    {
+        hal_delay(nativeStall_ms[device]);
+    }
+}
+
+/*
+* time - millis() and micros() wrap around at 32 bit like on the board
+*/
+uint32_t hal_millis()
+{
+    return (uint32_t)(hal_native_time_us() / 1000);
+}
+
+uint32_t hal_micros()
+{
+    return (uint32_t)hal_native_time_us();
+}
+
+void hal_delay(unsigned long ms)
+{
+    if (nativeClockMode == HAL_NATIVE_CLOCKREALTIME)
+    {
+        usleep(ms * 1000);
+    }
+    else
+    {
+        hal_native_advance(ms * 1000);
+    }
+}
+
+void hal_yield()
+{
+    if (nativeClockMode == HAL_NATIVE_CLOCKVIRTUAL)
+    {
+        hal_native_advance(HAL_NATIVE_YIELDTICK_US);
+    }
+    else
+    {
+        // leave the cpu to the other instances of a fleet simulation
+        usleep(HAL_NATIVE_YIELDTICK_US);
+    }
+}
+
+/*
+* native gpio - pin n is bit n%32 of port group n/32
+*/
+void hal_gpio_mode(uint8_t pin, uint8_t mode)
+{
+    nativePinModes[pin] = mode;
+    if (mode == INPUT_PULLUP)
+    {
+        nativePinValues[pin] = HIGH;
+    }
+}
+
+void hal_gpio_write(uint8_t pin, uint8_t value)
+{
+    nativePinValues[pin] = value ? HIGH : LOW;
+}
+
+int hal_gpio_read(uint8_t pin)
+{
+    return nativePinValues[pin];
+}
+
+uint32_t hal_gpio_readport(uint8_t group)
+{
+    uint32_t port = 0;
+    for (uint8_t bit = 0; bit < 32; bit++)
+    {
+        port |= (uint32_t)(nativePinValues[group * 32 + bit] & 1) << bit;
+    }
+    return port;
+}
+
+void hal_gpio_portbit(uint8_t pin, uint8_t *group, uint8_t *bit)
+{
+    *group = pin / 32;
+    *bit = pin % 32;
+}
+
+/*
+* MCP23008 expanders - inputs read high unless the simulation pulls them low
+*/
+void hal_expander_begin(uint8_t address)
+{
+}
+
+void hal_expander_mode(uint8_t address, uint8_t pin, uint8_t mode)
+{
+    if (mode == OUTPUT)
+    {
+        nativeExpanders[address].outputMask |= (1 << pin);
+    }
+    else
+    {
+        nativeExpanders[address].outputMask &= ~(1 << pin);
+    }
+}
+
+void hal_expander_write(uint8_t address, uint8_t pin, uint8_t value)
+{
+    if (value)
+    {
+        nativeExpanders[address].latch |= (1 << pin);
+    }
+    else
+    {
+        nativeExpanders[address].latch &= ~(1 << pin);
+    }
+}
+
+int hal_expander_read(uint8_t address, uint8_t pin)
+{
+    native_stall(HAL_NATIVE_STALLEXPANDER);
+    return (hal_expander_readport(address) >> pin) & 1;
+}
+
+uint8_t hal_expander_readport(uint8_t address)
+{
+    const nativeexpander_t &expander = nativeExpanders[address];
+    return (expander.latch & expander.outputMask) | (expander.inputs & ~expander.outputMask);
+}
+
+/*
+* display - the texts of a frame are recorded instead of rendered
+*/
+void hal_display_begin()
+{
+    nativeDrawing.count = 0;
+    nativeShown.count = 0;
+}
+
+void hal_display_powersave(bool enable)
+{
+    nativeDisplayOn = !enable;
+}
+
+void hal_display_clear()
+{
+    nativeDrawing.count = 0;
+}
+
+unsigned int hal_display_textwidth(const char *text)
+{
+    return 6 * strlen(text);
+}
+
+void hal_display_text(int x, int y, const char *text)
+{
+    if (nativeDrawing.count < NATIVE_MAXDISPLAYTEXTS)
+    {
+        snprintf(nativeDrawing.texts[nativeDrawing.count++], sizeof(nativeDrawing.texts[0]), "%s", text);
+    }
+}
+
+void hal_display_hline(int x, int y, int width)
+{
+}
+
+void hal_display_send()
+{
+    nativeShown = nativeDrawing;
+}
+
+/*
+* ENV shield
+*/
+bool hal_env_begin()
+{
+    return nativeEnvPresent;
+}
+
+float hal_env_temperature()
+{
+    native_stall(HAL_NATIVE_STALLENV);
+    return nativeTemperature;
+}
+
+float hal_env_humidity()
+{
+    native_stall(HAL_NATIVE_STALLENV);
+    return nativeHumidity;
+}
+
+float hal_env_pressure()
+{
+    native_stall(HAL_NATIVE_STALLENV);
+    return nativePressure;
+}
+
+float hal_env_illuminance()
+{
+    native_stall(HAL_NATIVE_STALLENV);
+    return nativeIlluminance;
+}
+
+/*
+* network interface
+*/
+int hal_net_begin(byte *mac, IPAddress ip, IPAddress dns, IPAddress gateway, IPAddress subnet)
+{
+    nativeLocalIp = ip;
+    return HAL_NET_W5500;
+}
+
+bool hal_net_linkup()
+{
+    return nativeLinkUp;
+}
+
+IPAddress hal_net_localip()
+{
+    return nativeLocalIp;
+}
+
+/*
+* tcp socket - the host and port can be overridden for the simulation
+*/
+bool hal_tcp_connect(const char *host, uint16_t port)
+{
+    if (nativeBrokerHost != NULL)
+    {
+        host = nativeBrokerHost;
+        port = nativeBrokerPort;
+    }
+    return nativeTcp->connect(host, port);
+}
+
+bool hal_tcp_connected()
+{
+    return nativeTcp->connected();
+}
+
+size_t hal_tcp_write(const uint8_t *buffer, size_t size)
+{
+    return nativeTcp->write(buffer, size);
+}
+
+int hal_tcp_available()
+{
+    return nativeTcp->available();
+}
+
+int hal_tcp_read(uint8_t *buffer, size_t size)
+{
+    return nativeTcp->read(buffer, size);
+}
+
+void hal_tcp_stop()
+{
+    nativeTcp->stop();
+}
+
+/*
+* posix socket back end
+*/
+bool posix_connect(const char *host, uint16_t port)
+{
+    posix_stop();
+
+    char service[8];
+    snprintf(service, sizeof(service), "%u", port);
+    struct addrinfo hints;
+    struct addrinfo *result = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, service, &hints, &result) != 0)
+    {
+        return false;
+    }
+    nativeSocket = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+    if ((nativeSocket < 0) || (connect(nativeSocket, result->ai_addr, result->ai_addrlen) != 0))
+    {
+        freeaddrinfo(result);
+        posix_stop();
+        return false;
+    }
+    freeaddrinfo(result);
+    int flag = 1;
+    setsockopt(nativeSocket, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+    return true;
+}
+
+bool posix_connected()
+{
+    if (nativeSocket < 0)
+    {
+        return false;
+    }
+    uint8_t c;
+    ssize_t result = recv(nativeSocket, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    if ((result == 0) || ((result < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK)))
+    {
+        posix_stop();
+        return false;
+    }
+    return true;
+}
+
+size_t posix_write(const uint8_t *buffer, size_t size)
+{
+    if (nativeSocket < 0)
+    {
+        return 0;
+    }
+    ssize_t written = send(nativeSocket, buffer, size, MSG_NOSIGNAL);
+    return (written < 0) ? 0 : written;
+}
+
+int posix_available()
+{
+    int available = 0;
+    if ((nativeSocket < 0) || (ioctl(nativeSocket, FIONREAD, &available) != 0))
+    {
+        return 0;
+    }
+    return available;
+}
+
+int posix_read(uint8_t *buffer, size_t size)
+{
+    if (nativeSocket < 0)
+    {
+        return -1;
+    }
+    ssize_t received = recv(nativeSocket, buffer, size, MSG_DONTWAIT);
+    return (received <= 0) ? -1 : received;
+}
+
+void posix_stop()
+{
+    if (nativeSocket >= 0)
+    {
+        close(nativeSocket);
+        nativeSocket = -1;
+    }
+}
+
+/*
+* tcp server socket on 127.0.0.1. The send window of the W5500 socket is
+* simulated: no more than NATIVE_SERVERWINDOW bytes may wait for the client.
+*/
+bool hal_server_begin(uint16_t port)
+{
+    if (nativeServerPortOverride >= 0)
+    {
+        port = nativeServerPortOverride;
+    }
+    hal_server_stop();
+    if (nativeServerSocket >= 0)
+    {
+        close(nativeServerSocket);
+    }
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+    socklen_t addressLength = sizeof(address);
+    int flag = 1;
+
+    nativeServerSocket = socket(AF_INET, SOCK_STREAM, 0);
+    if ((nativeServerSocket < 0) ||
+        (setsockopt(nativeServerSocket, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag)) != 0) ||
+        (bind(nativeServerSocket, (struct sockaddr *)&address, sizeof(address)) != 0) ||
+        (listen(nativeServerSocket, 1) != 0) ||
+        (getsockname(nativeServerSocket, (struct sockaddr *)&address, &addressLength) != 0))
+    {
+        if (nativeServerSocket >= 0)
+        {
+            close(nativeServerSocket);
+            nativeServerSocket = -1;
+        }
+        nativeServerPort = 0;
+        return false;
+    }
+    fcntl(nativeServerSocket, F_SETFL, fcntl(nativeServerSocket, F_GETFL) | O_NONBLOCK);
+    nativeServerPort = ntohs(address.sin_port);
+    return true;
+}
+
+bool hal_server_accept()
+{
+    if ((nativeServerSocket < 0) || (nativeServerClient >= 0))
+    {
+        return false;
+    }
+    nativeServerClient = accept(nativeServerSocket, NULL, NULL);
+    return nativeServerClient >= 0;
+}
+
+bool hal_server_connected()
+{
+    if (nativeServerClient < 0)
+    {
+        return false;
+    }
+    uint8_t c;
+    ssize_t result = recv(nativeServerClient, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return (result > 0) || ((result < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)));
+}
+
+int hal_server_available()
+{
+    int available = 0;
+    if ((nativeServerClient < 0) || (ioctl(nativeServerClient, FIONREAD, &available) != 0))
+    {
+        return 0;
+    }
+    return available;
+}
+
+int hal_server_read(uint8_t *buffer, size_t size)
+{
+    if (nativeServerClient < 0)
+    {
+        return -1;
+    }
+    ssize_t received = recv(nativeServerClient, buffer, size, MSG_DONTWAIT);
+    return (received <= 0) ? -1 : received;
+}
+
+size_t hal_server_writable()
+{
+    int queued = 0;
+    if ((nativeServerClient < 0) || (ioctl(nativeServerClient, TIOCOUTQ, &queued) != 0))
+    {
+        return 0;
+    }
+    return (queued < NATIVE_SERVERWINDOW) ? NATIVE_SERVERWINDOW - queued : 0;
+}
+
+size_t hal_server_write(const uint8_t *buffer, size_t size)
+{
+    if (nativeServerClient < 0)
+    {
+        return 0;
+    }
+    ssize_t written = send(nativeServerClient, buffer, size, MSG_NOSIGNAL | MSG_DONTWAIT);
+    return (written < 0) ? 0 : written;
+}
+
+void hal_server_disconnect()
+{
+    if (nativeServerClient >= 0)
+    {
+        shutdown(nativeServerClient, SHUT_WR);
+    }
+}
+
+bool hal_server_closed()
+{
+    return !hal_server_connected();
+}
+
+void hal_server_stop()
+{
+    if (nativeServerClient >= 0)
+    {
+        close(nativeServerClient);
+        nativeServerClient = -1;
+    }
+}
+
+/*
+* udp socket on 127.0.0.1
+*/
+bool hal_udp_begin(uint16_t port)
+{
+    if (nativeUdpPortOverride >= 0)
+    {
+        port = nativeUdpPortOverride;
+    }
+    if (nativeUdpSocket >= 0)
+    {
+        close(nativeUdpSocket);
+    }
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+    socklen_t addressLength = sizeof(address);
+
+    nativeUdpSocket = socket(AF_INET, SOCK_DGRAM, 0);
+    if ((nativeUdpSocket < 0) ||
+        (bind(nativeUdpSocket, (struct sockaddr *)&address, sizeof(address)) != 0) ||
+        (getsockname(nativeUdpSocket, (struct sockaddr *)&address, &addressLength) != 0))
+    {
+        if (nativeUdpSocket >= 0)
+        {
+            close(nativeUdpSocket);
+            nativeUdpSocket = -1;
+        }
+        nativeUdpPort = 0;
+        return false;
+    }
+    nativeUdpPort = ntohs(address.sin_port);
+    return true;
+}
+
+int hal_udp_receive(uint8_t *buffer, size_t size, IPAddress *remoteIp, uint16_t *remotePort)
+{
+    if (nativeUdpSocket < 0)
+    {
+        return 0;
+    }
+    struct sockaddr_in address;
+    socklen_t addressLength = sizeof(address);
+    ssize_t received = recvfrom(nativeUdpSocket, buffer, size, MSG_DONTWAIT | MSG_TRUNC, (struct sockaddr *)&address, &addressLength);
+    if ((received <= 0) || ((size_t)received > size))
+    {
+        return 0;
+    }
+    uint32_t ip = ntohl(address.sin_addr.s_addr);
+    *remoteIp = IPAddress(ip >> 24, ip >> 16, ip >> 8, ip);
+    *remotePort = ntohs(address.sin_port);
+    return received;
+}
+
+bool hal_udp_send(IPAddress remoteIp, uint16_t remotePort, const uint8_t *buffer, size_t size)
+{
+    if (nativeUdpSocket < 0)
+    {
+        return false;
+    }
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(((uint32_t)remoteIp[0] << 24) | ((uint32_t)remoteIp[1] << 16) | ((uint32_t)remoteIp[2] << 8) | remoteIp[3]);
+    address.sin_port = htons(remotePort);
+    return sendto(nativeUdpSocket, buffer, size, 0, (struct sockaddr *)&address, sizeof(address)) == (ssize_t)size;
+}
+
+/*
+* SD card - the files are plain files in nativeSdDir. The posix calls are
+* used, they don't allocate memory.
+*/
+bool native_sdpath(const char *name, char *path, size_t size)
+{
+    return nativeSdReady && (snprintf(path, size, "%s/%s", nativeSdDir, name) < (int)size);
+}
+
+bool hal_sd_begin()
+{
+    nativeSdReady = (nativeSdDir != NULL) && (access(nativeSdDir, R_OK | W_OK) == 0);
+    return nativeSdReady;
+}
+
+int hal_file_read(const char *name, uint32_t offset, uint8_t *buffer, size_t size)
+{
+    char path[256];
+    int fd = native_sdpath(name, path, sizeof(path)) ? open(path, O_RDONLY) : -1;
+    if (fd < 0)
+    {
+        return -1;
+    }
+    ssize_t count = pread(fd, buffer, size, offset);
+    close(fd);
+    return (count < 0) ? -1 : (int)count;
+}
+
+bool hal_file_write(const char *name, const uint8_t *buffer, size_t size)
+{
+    char path[256];
+    int fd = native_sdpath(name, path, sizeof(path)) ? open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644) : -1;
+    if (fd < 0)
+    {
+        return false;
+    }
+    bool written = (write(fd, buffer, size) == (ssize_t)size);
+    close(fd);
+    return written;
+}
+
+bool hal_file_writeat(const char *name, uint32_t offset, const uint8_t *buffer, size_t size)
+{
+    char path[256];
+    int fd = native_sdpath(name, path, sizeof(path)) ? open(path, O_WRONLY | O_CREAT, 0644) : -1;
+    if (fd < 0)
+    {
+        return false;
+    }
+    bool written = (pwrite(fd, buffer, size, offset) == (ssize_t)size);
+    close(fd);
+    return written;
+}
+
+bool hal_file_remove(const char *name)
+{
+    char path[256];
+    return native_sdpath(name, path, sizeof(path)) && (unlink(path) == 0);
+}
+
+/*
+* Returns true if a wake pin has changed or a socket has data - like the
+* interrupts which end a wait on the board
+*/
+bool native_wakeup()
+{
+    if (nativeWakePending || (nativeTcp->available() > 0))
+    {
+        return true;
+    }
+    // a waiting client of the metrics endpoint, its request and udp datagrams
+    int sockets[2] = {(nativeServerClient < 0) ? nativeServerSocket : nativeServerClient, nativeUdpSocket};
+    struct pollfd fds[2];
+    nfds_t count = 0;
+    for (int i = 0; i < 2; i++)
+    {
+        if (sockets[i] >= 0)
+        {
+            fds[count].fd = sockets[i];
+            fds[count].events = POLLIN;
+            count++;
+        }
+    }
+    return (count > 0) && (poll(fds, count, 0) > 0);
+}
+
+/*
+* low-power idle - the wait advances the virtual clock in ticks of
+* HAL_NATIVE_SLEEPTICK_US (the time hook runs after every tick) and ends
+* early like on the board. IDLE and STANDBY don't differ on the host. A run
+* (hal_native_run, sim_run) ends the wait at its end, so a short run still
+* takes about its duration.
+*/
+bool hal_sleep_wakepin(uint8_t pin)
+{
+    nativeWakePins |= (uint64_t)1 << pin;
+    return true;
+}
+
+void hal_native_setsleeplimit(uint64_t until_us)
+{
+    nativeSleepLimit_us = until_us;
+}
+
+uint32_t hal_sleep(uint32_t ms, bool standby, bool *woken)
+{
+    uint64_t start_us = hal_native_time_us();
+    *woken = false;
+    uint64_t end_us = start_us + (uint64_t)ms * 1000;
+    if ((nativeSleepLimit_us > 0) && (nativeSleepLimit_us < end_us))
+    {
+        end_us = nativeSleepLimit_us;
+    }
+    while (hal_native_time_us() < end_us)
+    {
+        if (native_wakeup())
+        {
+            *woken = true;
+            break;
+        }
+        if (nativeClockMode == HAL_NATIVE_CLOCKREALTIME)
+        {
+            usleep(HAL_NATIVE_SLEEPTICK_US);
+        }
+        hal_native_advance(HAL_NATIVE_SLEEPTICK_US);
+    }
+    nativeWakePending = false;
+    return (uint32_t)(hal_native_time_us() - start_us);
+}
+
+/*
+* watchdog
+*/
+void hal_watchdog_init(int timeout_s, void (*onShutdown)())
+{
+    nativeWatchdogShutdown = onShutdown;
+    nativeWatchdogTimeout_ms = timeout_s * 1000;
+    nativeWatchdogCleared_ms = hal_millis();
+}
+
+void hal_watchdog_clear()
+{
+    nativeWatchdogCleared_ms = hal_millis();
+}
+
+/*
+* A reset is counted - the native program exits like on a watchdog reset
+*/
+void hal_system_reset()
+{
+    nativeResets++;
+    nativeResetCause = HAL_RESETSYSTEM;
+    if (nativeWatchdogExit)
+    {
+        if (nativeSerialLength > 0)
+        {
+            hal_serial_println("");
+        }
+        fflush(stdout);
+        exit(HAL_NATIVE_EXITRESET);
+    }
+}
+
+/*
+* The cause of the last simulated reset
+*/
+uint8_t hal_system_resetcause()
+{
+    return nativeResetCause;
+}
+
+/*
+* interrupts - the simulated ones (watchdog, wake pins) run from the main
+* loop, there is nothing to disable
+*/
+uint32_t hal_interrupts_disable()
+{
+    return 0;
+}
+
+void hal_interrupts_restore(uint32_t state)
+{
+}
+
+/*
+* serial line - output is collected line by line
+*/
+void hal_serial_begin(unsigned long baud)
+{
+}
+
+void hal_serial_print(const char *text)
+{
+    for (; *text != 0; text++)
+    {
+        if (*text == '\n')
+        {
+            hal_serial_println("");
+        }
+        else if (nativeSerialLength < sizeof(nativeSerialLine) - 1)
+        {
+            nativeSerialLine[nativeSerialLength++] = *text;
+        }
+    }
+}
+
+void hal_serial_println(const char *text)
+{
+    hal_serial_print(text);
+    nativeSerialLine[nativeSerialLength] = 0;
+    if (nativeSerialEcho)
+    {
+        printf("[%10u] %s\n", hal_millis(), nativeSerialLine);
+    }
+    if (nativeSerialHook != NULL)
+    {
+        nativeSerialHook(nativeSerialLine);
+    }
+    nativeSerialLength = 0;
+}
+
+/*
+* memory - there is no stack painting on the host, the heap figures are
+* taken from glibc and the free memory is related to the ram of the board.
+* The heap which the host runtime has used before setup() is not counted.
+*/
+size_t nativeHeapBaseline = 0;
+
+void hal_mem_paint(uint8_t pattern, unsigned int guard)
+{
+    nativeHeapBaseline = mallinfo2().uordblks;
+}
+
+unsigned int hal_mem_stackmax(uint8_t pattern)
+{
+    return 0;
+}
+
+void hal_mem_info(hal_meminfo_t *info, bool analyze)
+{
+    struct mallinfo2 heap = mallinfo2();
+    size_t used = (heap.uordblks > nativeHeapBaseline) ? heap.uordblks - nativeHeapBaseline : 0;
+    info->heapSize = heap.arena;
+    info->heapUsed = used;
+    info->heapFree = heap.fordblks;
+    info->largestFreeBlock = heap.fordblks;
+    info->free = (used < HAL_NATIVE_RAMSIZE) ? HAL_NATIVE_RAMSIZE - used : 0;
+}
+
+/*
+* simulation control
+*/
+void hal_native_setclock(int mode, uint32_t start_ms)
+{
+    nativeClockMode = mode;
+    nativeTime_us = (uint64_t)start_ms * 1000;
+    nativeRealtimeStart_us = native_realtime_us() - nativeTime_us;
+}
+
+void hal_native_advance(uint32_t us)
+{
+    if (nativeClockMode == HAL_NATIVE_CLOCKVIRTUAL)
+    {
+        nativeTime_us += us;
+    }
+    native_checkwatchdog();
+    if (nativeTimeHook != NULL)
+    {
+        nativeTimeHook();
+    }
+}
+
+uint64_t hal_native_time_us()
+{
+    if (nativeClockMode == HAL_NATIVE_CLOCKREALTIME)
+    {
+        nativeTime_us = native_realtime_us() - nativeRealtimeStart_us;
+    }
+    return nativeTime_us;
+}
+
+void hal_native_settimehook(void (*hook)())
+{
+    nativeTimeHook = hook;
+}
+
+void hal_native_setinput(uint8_t pin, int value)
+{
+    uint8_t level = value ? HIGH : LOW;
+    if ((nativePinValues[pin] != level) && (nativeWakePins & ((uint64_t)1 << pin)))
+    {
+        nativeWakePending = true;
+    }
+    nativePinValues[pin] = level;
+}
+
+int hal_native_getoutput(uint8_t pin)
+{
+    return nativePinValues[pin];
+}
+
+void hal_native_setexpanderinput(uint8_t address, uint8_t pin, int value)
+{
+    if (value)
+    {
+        nativeExpanders[address].inputs |= (1 << pin);
+    }
+    else
+    {
+        nativeExpanders[address].inputs &= ~(1 << pin);
+    }
+}
+
+int hal_native_getexpanderoutput(uint8_t address, uint8_t pin)
+{
+    return (nativeExpanders[address].latch >> pin) & 1;
+}
+
+void hal_native_setenv(bool present, float temperature, float humidity, float pressure, float illuminance)
+{
+    nativeEnvPresent = present;
+    nativeTemperature = temperature;
+    nativeHumidity = humidity;
+    nativePressure = pressure;
+    nativeIlluminance = illuminance;
+}
+
+const char *hal_native_displaytext(int index)
+{
+    return (index < nativeShown.count) ? nativeShown.texts[index] : "";
+}
+
+int hal_native_displaylines()
+{
+    return nativeShown.count;
+}
+
+bool hal_native_displayon()
+{
+    return nativeDisplayOn;
+}
+
+void hal_native_setlink(bool up)
+{
+    nativeLinkUp = up;
+}
+
+unsigned long hal_native_watchdogexpired()
+{
+    return nativeWatchdogExpired;
+}
+
+void hal_native_setwatchdogexit(bool exitOnReset)
+{
+    nativeWatchdogExit = exitOnReset;
+}
+
+unsigned long hal_native_resets()
+{
+    return nativeResets;
+}
+
+void hal_native_setstall(int device, uint32_t ms)
+{
+    nativeStall_ms[device] = ms;
+}
+
+void hal_native_setbroker(const char *host, uint16_t port)
+{
+    nativeBrokerHost = host;
+    nativeBrokerPort = port;
+}
+
+void hal_native_setserverport(int port)
+{
+    nativeServerPortOverride = port;
+}
+
+uint16_t hal_native_serverport()
+{
+    return nativeServerPort;
+}
+
+void hal_native_setudpport(int port)
+{
+    nativeUdpPortOverride = port;
+}
+
+uint16_t hal_native_udpport()
+{
+    return nativeUdpPort;
+}
+
+void hal_native_setsddir(const char *path)
+{
+    nativeSdDir = path;
+    nativeSdReady = false;
+}
+
+void hal_native_settcp(const hal_native_tcpops_t *ops)
+{
+    nativeTcp->stop();
+    nativeTcp = (ops != NULL) ? ops : &posixTcp;
+}
+
+void hal_native_setserial(bool echo, void (*hook)(const char *line))
+{
+    nativeSerialEcho = echo;
+    nativeSerialHook = hook;
+}
+
+void hal_native_run(uint32_t duration_ms)
+{
+    if (!nativeSetupDone)
+    {
+        nativeSetupDone = true;
+        setup();
+    }
+    uint64_t end_us = hal_native_time_us() + (uint64_t)duration_ms * 1000;
+    hal_native_setsleeplimit((duration_ms == 0) ? 0 : end_us);
+    while ((duration_ms == 0) || (hal_native_time_us() < end_us))
+    {
+        uint64_t start_ns = native_realtime_ns();
+        loop();
+        uint64_t elapsed_ns = native_realtime_ns() - start_ns;
+        nativeLoopPasses++;
+        nativeLoopTotal_ns += elapsed_ns;
+        if (elapsed_ns > nativeLoopMax_ns)
+        {
+            nativeLoopMax_ns = elapsed_ns;
+        }
+        if (nativeClockMode == HAL_NATIVE_CLOCKREALTIME)
+        {
+            // a pass of loop() takes about one tick on the board
+            usleep(HAL_NATIVE_LOOPTICK_US);
+        }
+        hal_native_advance(HAL_NATIVE_LOOPTICK_US);
+    }
+    hal_native_setsleeplimit(0);
+}
+
+/*
+* The simulated inputs start in a defined state: all expander inputs are
+* high (buttons use pullups and are active low)
+*/
+struct nativeinit_t
+{
+    nativeinit_t()
+    {
+        for (int address = 0; address < HAL_MAXEXPANDERS; address++)
+        {
+            nativeExpanders[address].inputs = 0xFF;
+        }
+    }
+} nativeInit;
+
+#ifndef PIO_UNIT_TESTING
+/*
+* Prints the options of main() and of the fleet mode
+*/
+void native_usage(FILE *stream)
+{
+    fprintf(stream,
+            "usage: program [options]\n"
+            "  --broker <host> <port>  connect to this broker instead of the configured one\n"
+            "  --realtime              run with the real clock instead of the virtual clock\n"
+            "  --duration <ms>         stop after this time (default: run forever)\n"
+            "  --quiet                 don't echo the serial output\n"
+            "  --client-id <id>        mqtt client id of this instance\n"
+            "  --topic-prefix <prefix> topic prefix of this instance (default \"gdc\")\n"
+            "  --metrics-port <port>   port of the metrics endpoint (0 = any free port)\n"
+            "  --udp-port <port>       port of the udp control channel (enables it)\n"
+            "  --sd-dir <path>         directory with the files of the SD card\n"
+            "  --loop-stats            print the host time of the passes of loop() at the end\n"
+            "  --help                  print this help\n"
+            "       program fleet [--port <port>] [--duration <ms>] [--probe-interval <ms>]\n"
+            "                     [--restart-at <ms>] [--downtime <ms>]\n"
+            "                          run the broker of a fleet simulation\n");
+}
+
+/*
+* Entry point of the native firmware. Options:
+*   --broker <host> <port>  connect to this broker instead of the configured one
+*   --realtime              run with the real clock instead of the virtual clock
+*   --duration <ms>         stop after this time (default: run forever)
+*   --quiet                 don't echo the serial output
+*   --client-id <id>        mqtt client id of this instance
+*   --topic-prefix <prefix> topic prefix of this instance (default "gdc")
+*   --metrics-port <port>   port of the metrics endpoint (0 = any free port)
+*   --udp-port <port>       port of the udp control channel (enables it)
+*   --sd-dir <path>         directory with the files of the SD card
+*   --loop-stats            print the host time of the passes of loop() at
+*                           the end (see scripts/footprint.py)
+*   --help                  print the options
+* The program exits with HAL_NATIVE_EXITWATCHDOG if the watchdog expires and
+* with 1 on an unknown option or a missing argument.
+* "program fleet ..." runs the broker of a fleet simulation instead (fleet.h).
+*/
+int main(int argc, char **argv)
+{
+    uint32_t duration_ms = 0;
+    const char *clientId = mqttClientID;
+    const char *topicPrefix = mqttTopicPrefix;
+    bool loopStats = false;
+    if ((argc > 1) && (strcmp(argv[1], "fleet") == 0))
+    {
+        return fleet_main(argc - 1, argv + 1);
+    }
+    hal_native_setwatchdogexit(true);
+    for (int i = 1; i < argc; i++)
+    {
+        if ((strcmp(argv[i], "--broker") == 0) && (i + 2 < argc))
+        {
+            hal_native_setbroker(argv[i + 1], atoi(argv[i + 2]));
+            i += 2;
+        }
+        else if (strcmp(argv[i], "--realtime") == 0)
+        {
+            hal_native_setclock(HAL_NATIVE_CLOCKREALTIME, 0);
+        }
+        else if ((strcmp(argv[i], "--duration") == 0) && (i + 1 < argc))
+        {
+            duration_ms = strtoul(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--quiet") == 0)
+        {
+            hal_native_setserial(false, NULL);
+        }
+        else if ((strcmp(argv[i], "--client-id") == 0) && (i + 1 < argc))
+        {
+            clientId = argv[++i];
+        }
+        else if ((strcmp(argv[i], "--topic-prefix") == 0) && (i + 1 < argc))
+        {
+            topicPrefix = argv[++i];
+        }
+        else if ((strcmp(argv[i], "--metrics-port") == 0) && (i + 1 < argc))
+        {
+            hal_native_setserverport(atoi(argv[++i]));
+        }
+        else if ((strcmp(argv[i], "--udp-port") == 0) && (i + 1 < argc))
+        {
+            udpControlPort = atoi(argv[++i]);
+        }
+        else if ((strcmp(argv[i], "--sd-dir") == 0) && (i + 1 < argc))
+        {
+            hal_native_setsddir(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--loop-stats") == 0)
+        {
+            loopStats = true;
+        }
+        else if (strcmp(argv[i], "--help") == 0)
+        {
+            native_usage(stdout);
+            return 0;
+        }
+        else
+        {
+            fprintf(stderr, "unknown option or missing argument %s\n", argv[i]);
+            native_usage(stderr);
+            return 1;
+        }
+    }
+    if (!mqtt_setdevice(clientId, topicPrefix))
+    {
+        fprintf(stderr, "client id or topic prefix too long\n");
+        return 1;
+    }
+    hal_native_run(duration_ms);
+    if (loopStats && (nativeLoopPasses > 0))
+    {
+        printf("loop: passes %llu mean_ns %llu max_ns %llu\n", (unsigned long long)nativeLoopPasses,
+               (unsigned long long)(nativeLoopTotal_ns / nativeLoopPasses), (unsigned long long)nativeLoopMax_ns);
+    }
+    return 0;
+}
+#endif // PIO_UNIT_TESTING
+
+#endif // ARDUINO
\ No newline at end of file
@@ -0,0 +1,125 @@
+#include "hal.h"
+#ifdef ARDUINO
+#include <reent.h>
+#endif
+
+#include "heapstats.h"
+
+/*
+* Counts all heap operations. The allocator functions are wrapped by the
+* linker (see build_flags in platformio.ini: -Wl,--wrap=_malloc_r ... for
+* newlib on the board, -Wl,--wrap=malloc ... for glibc on the native
+* target), so every malloc/new allocation of the firmware and the libraries
+* passes through here.
+*/
+volatile unsigned long heapAllocations = 0;
+volatile unsigned long heapFrees = 0;
+
+// number of allocations when setup() has finished
+unsigned long heapAllocationsAtSteadyState = 0;
+
+#ifdef ARDUINO
+extern "C"
+{
+    void *__real__malloc_r(struct _reent *r, size_t size);
+    void *__real__calloc_r(struct _reent *r, size_t count, size_t size);
+    void *__real__realloc_r(struct _reent *r, void *ptr, size_t size);
+    void __real__free_r(struct _reent *r, void *ptr);
+
+    void *__wrap__malloc_r(struct _reent *r, size_t size)
+    {
+        heapAllocations++;
+        return __real__malloc_r(r, size);
+    }
+
+    void *__wrap__calloc_r(struct _reent *r, size_t count, size_t size)
+    {
+        heapAllocations++;
+        return __real__calloc_r(r, count, size);
+    }
+
+    void *__wrap__realloc_r(struct _reent *r, void *ptr, size_t size)
+    {
+        heapAllocations++;
+        return __real__realloc_r(r, ptr, size);
+    }
+
+    void __wrap__free_r(struct _reent *r, void *ptr)
+    {
+        if (ptr != NULL)
+        {
+            heapFrees++;
+        }
+        __real__free_r(r, ptr);
+    }
+}
+#else
+extern "C"
+{
+    void *__real_malloc(size_t size);
+    void *__real_calloc(size_t count, size_t size);
+    void *__real_realloc(void *ptr, size_t size);
+    void __real_free(void *ptr);
+
+    void *__wrap_malloc(size_t size)
+    {
+        heapAllocations++;
+        return __real_malloc(size);
+    }
+
+    void *__wrap_calloc(size_t count, size_t size)
+    {
+        heapAllocations++;
+        return __real_calloc(count, size);
+    }
+
+    void *__wrap_realloc(void *ptr, size_t size)
+    {
+        heapAllocations++;
+        return __real_realloc(ptr, size);
+    }
+
+    void __wrap_free(void *ptr)
+    {
+        if (ptr != NULL)
+        {
+            heapFrees++;
+        }
+        __real_free(ptr);
+    }
+}
+#endif
+
+/*
+* Marks the end of the startup - all allocations after this point are
+* counted as steady state allocations
+*/
+void heapstats_marksteadystate()
+{
+    heapAllocationsAtSteadyState = heapAllocations;
+}
+
+/*
+* Returns the number of allocations since start
+*/
+unsigned long heapstats_getallocations()
+{
+    return heapAllocations;
+}
+
+/*
+* Returns the number of frees since start
+*/
+unsigned long heapstats_getfrees()
+{
+    return heapFrees;
+}
+
+/*
+* Returns the number of allocations since the steady state was reached.
+* This should always be 0.
+*/
+unsigned long heapstats_getsteadyallocations()
+{
+    return heapAllocations - heapAllocationsAtSteadyState;
+}
\ No newline at end of file
@@ -1,62 +1,64 @@
 // Include libraries
-#include <U8g2lib.h>
-#include <Wire.h>
-#include <Adafruit_MCP23008.h>
+#include "hal.h"
 
 #include "config.h"
 #include "hmi.h"
+#include "idle.h"
 
 // internal defines
 #define BUTTONSTATUS_PRESSED 0 // inputs use internal pullup's
+#define HMI_EXPANDER         0 // mcp23008 of the display shield
 
 // button states
 int buttonPressed = 0;
-int debounce_button_ms = 100;
+
+bool displayReady = false;
 
 bool doorOpenLedBlink = false;
 bool doorClosedLedBlink = false;
 
 
 // Display shield with button
-U8G2_SH1106_128X64_NONAME_F_HW_I2C u8g2(U8G2_R0, /* reset=*/U8X8_PIN_NONE);
-Adafruit_MCP23008 mcp;
 const unsigned int displayWidth = 128;
 const unsigned int displayHeight = 64;
 
-#define ALIGN_CENTER(t) ((displayWidth - (u8g2.getUTF8Width(t))) / 2)
-#define ALIGN_RIGHT(t) (displayWidth - u8g2.getUTF8Width(t))
+#define ALIGN_CENTER(t) ((displayWidth - (hal_display_textwidth(t))) / 2)
+#define ALIGN_RIGHT(t) (displayWidth - hal_display_textwidth(t))
 #define ALIGN_LEFT 0
 
 /*
-* Initializes the display and its buttons. After bootup the application informaton is
-* shown as a splashscreen for 5 secons.
+* Initializes the buttons and leds of the display shield. The display itself
+* is started later by hmi_display_begin() (see boot.h).
 */
 void hmi_init()
 {
-    // initialize display and mcp23008 chip
-    u8g2.begin();
-
     // initialize mcp23008 chip at default address 0 - 3 buttons as input
-    mcp.begin();
-    mcp.pinMode(HMI_BUTTON_OPENDOOR, INPUT);
-    mcp.pullUp(HMI_BUTTON_OPENDOOR, HIGH);
-    mcp.pinMode(HMI_BUTTON_SYSTEMINFO, INPUT);
-    mcp.pullUp(HMI_BUTTON_SYSTEMINFO, HIGH);
-    mcp.pinMode(HMI_BUTTON_CLOSEDOOR, INPUT);
-    mcp.pullUp(HMI_BUTTON_CLOSEDOOR, HIGH);
+    hal_expander_begin(HMI_EXPANDER);
+    hal_expander_mode(HMI_EXPANDER, HMI_BUTTON_OPENDOOR, INPUT_PULLUP);
+    hal_expander_mode(HMI_EXPANDER, HMI_BUTTON_SYSTEMINFO, INPUT_PULLUP);
+    hal_expander_mode(HMI_EXPANDER, HMI_BUTTON_CLOSEDOOR, INPUT_PULLUP);
 
     // configure 3 leds as output
-    mcp.pinMode(HMI_LED_DOORCLOSED, OUTPUT);
-    mcp.pinMode(HMI_LED_SYSTEMINFO, OUTPUT);
-    mcp.pinMode(HMI_LED_DOOROPEN, OUTPUT);
+    hal_expander_mode(HMI_EXPANDER, HMI_LED_DOORCLOSED, OUTPUT);
+    hal_expander_mode(HMI_EXPANDER, HMI_LED_SYSTEMINFO, OUTPUT);
+    hal_expander_mode(HMI_EXPANDER, HMI_LED_DOOROPEN, OUTPUT);
 
     // Beeper
-    mcp.pinMode(HMI_BEEPER, OUTPUT);
+    hal_expander_mode(HMI_EXPANDER, HMI_BEEPER, OUTPUT);
 
     // set all leds to OFF
-    mcp.digitalWrite(HMI_LED_DOOROPEN, LOW);
-    mcp.digitalWrite(HMI_LED_SYSTEMINFO, LOW);
-    mcp.digitalWrite(HMI_LED_DOORCLOSED, LOW);
+    hal_expander_write(HMI_EXPANDER, HMI_LED_DOOROPEN, LOW);
+    hal_expander_write(HMI_EXPANDER, HMI_LED_SYSTEMINFO, LOW);
+    hal_expander_write(HMI_EXPANDER, HMI_LED_DOORCLOSED, LOW);
+}
+
+/*
+* Initializes the display - until then all drawing is skipped
+*/
+void hmi_display_begin()
+{
+    hal_display_begin();
+    displayReady = true;
 }
 
 /*
@@ -65,7 +67,10 @@ void hmi_init()
 */
 void hmi_display_off(bool enable)
 {
-    u8g2.setPowerSave(!enable);
+    if (displayReady)
+    {
+        hal_display_powersave(!enable);
+    }
 }
 
 /*
@@ -75,21 +80,21 @@ void hmi_loop()
 {
     // check button pressed states
     buttonPressed = HMI_BUTTON_NONE;
-    static uint32_t prev_ms_debounce = millis();
-    if (millis() > prev_ms_debounce + debounce_button_ms)
+    static uint32_t prev_ms_debounce = hal_millis();
+    if (hal_millis() - prev_ms_debounce > (uint32_t)debounce_button_ms)
     {
-        prev_ms_debounce = millis();
-        if (mcp.digitalRead(HMI_BUTTON_OPENDOOR) == BUTTONSTATUS_PRESSED)
+        prev_ms_debounce = hal_millis();
+        if (hal_expander_read(HMI_EXPANDER, HMI_BUTTON_OPENDOOR) == BUTTONSTATUS_PRESSED)
         {
             buttonPressed = HMI_BUTTON_OPENDOOR;
         }
 
-        if (mcp.digitalRead(HMI_BUTTON_CLOSEDOOR) == BUTTONSTATUS_PRESSED)
+        if (hal_expander_read(HMI_EXPANDER, HMI_BUTTON_CLOSEDOOR) == BUTTONSTATUS_PRESSED)
         {
             buttonPressed = HMI_BUTTON_CLOSEDOOR;
         }
 
-        if (mcp.digitalRead(HMI_BUTTON_SYSTEMINFO) == BUTTONSTATUS_PRESSED)
+        if (hal_expander_read(HMI_EXPANDER, HMI_BUTTON_SYSTEMINFO) == BUTTONSTATUS_PRESSED)
         {
             buttonPressed = HMI_BUTTON_SYSTEMINFO;
             hmi_setled(HMI_LED_SYSTEMINFO, HIGH);
@@ -100,32 +105,37 @@ void hmi_loop()
         }
     }
 
+    // the buttons are on the expander and have to be polled
+    idle_due(IDLE_SOURCEINPUTS, prev_ms_debounce + debounce_button_ms + 1);
+
     // activate blinking
     if (doorOpenLedBlink)
     {
-        static uint32_t prev_ms_on = millis();
-        if (millis() > prev_ms_on + ledBlinkDuration_ms)
+        static uint32_t prev_ms_on = hal_millis();
+        if (hal_millis() - prev_ms_on > (uint32_t)ledBlinkDuration_ms)
         {
-            prev_ms_on = millis();
+            prev_ms_on = hal_millis();
             int ledState = hmi_getled(HMI_LED_DOOROPEN);
             ledState = (ledState == LOW) ? HIGH : LOW;
             hmi_setled(HMI_LED_DOOROPEN, ledState);
         }
+        idle_due(IDLE_SOURCELEDS, prev_ms_on + ledBlinkDuration_ms + 1);
     }
     if (doorClosedLedBlink)
     {
-        static uint32_t prev_ms_on = millis();
-        if (millis() > prev_ms_on + ledBlinkDuration_ms)
+        static uint32_t prev_ms_on = hal_millis();
+        if (hal_millis() - prev_ms_on > (uint32_t)ledBlinkDuration_ms)
         {
-            prev_ms_on = millis();
+            prev_ms_on = hal_millis();
             int ledState = hmi_getled(HMI_LED_DOORCLOSED);
             ledState = (ledState == LOW) ? HIGH : LOW;
             hmi_setled(HMI_LED_DOORCLOSED, ledState);
         }
+        idle_due(IDLE_SOURCELEDS, prev_ms_on + ledBlinkDuration_ms + 1);
     }
 
     // let other loops run
-    yield();
+    hal_yield();
 }
 
 /*
@@ -141,7 +151,7 @@ int hmi_getbuttonpressed()
 */
 void hmi_setled(int led, int status)
 {
-    mcp.digitalWrite(led, status);
+    hal_expander_write(HMI_EXPANDER, led, status);
 }
 
 /*
@@ -149,7 +159,7 @@ void hmi_setled(int led, int status)
 */
 int hmi_getled(int led)
 {
-    return mcp.digitalRead(led);
+    return hal_expander_read(HMI_EXPANDER, led);
 }
 
 /*
@@ -177,21 +187,20 @@ void hmi_setled_blinking(int led, bool enable)
 * draws a full frame with title and text information. The title has a horizontal line
 * as a separator between the text
 */
-void hmi_display_frame(String title, String text[], int numlines)
+void hmi_display_frame(const char* title, const DisplayLine text[], int numlines)
 {
+    if (!displayReady)
+    {
+        return;
+    }
     int startPos = (numlines==4) ? 18 : 27;
     if (numlines==2) {startPos=36;}
-    u8g2.clearBuffer();
-    u8g2.setFont(u8g2_font_6x10_tf);
-    u8g2.setFontRefHeightExtendedText();
-    u8g2.setDrawColor(1);
-    u8g2.setFontPosTop();
-    u8g2.setFontDirection(0);
-    u8g2.drawStr(ALIGN_CENTER(title.c_str()), 2, title.c_str());
-    u8g2.drawHLine(0, 13, displayWidth);
+    hal_display_clear();
+    hal_display_text(ALIGN_CENTER(title), 2, title);
+    hal_display_hline(0, 13, displayWidth);
     for (int i = 0; i < numlines; i++)
     {
-        u8g2.drawStr(ALIGN_CENTER(text[i].c_str()), startPos + (i * 12), text[i].c_str());
+        hal_display_text(ALIGN_CENTER(text[i].c_str()), startPos + (i * 12), text[i].c_str());
     }
-    u8g2.sendBuffer();
+    hal_display_send();
 }
\ No newline at end of file
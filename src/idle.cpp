@@ -0,0 +1,179 @@
+#include "hal.h"
+
+#include "config.h"
+#include "idle.h"
+#include "mqtt.h"
+#include "payload.h"
+
+const char *const idleSourceNames[IDLE_NUMSOURCES + 1] = {
+    "doors", "inputs", "leds", "display", "sensors", "heartbeat", "state", "network", "boot", "none"};
+
+// the due times reported in the current pass
+uint32_t idleDue_ms[IDLE_NUMSOURCES];
+uint16_t idleReported = 0;
+bool idleHeld = false;
+
+// counters since the start and since the last publish
+idle_stats_t idleStats;
+idle_stats_t idleWindow;
+unsigned long idleWindowLimits[IDLE_NUMSOURCES + 1];
+uint32_t prev_us_wake = 0;
+uint32_t prev_ms_idlepublish = 0;
+
+/*
+* Starts with an empty window - is called by the core stage (see boot.h)
+*/
+void idle_init()
+{
+    memset(&idleStats, 0, sizeof(idleStats));
+    memset(&idleWindow, 0, sizeof(idleWindow));
+    memset(idleWindowLimits, 0, sizeof(idleWindowLimits));
+    idleReported = 0;
+    idleHeld = false;
+    prev_us_wake = hal_micros();
+    prev_ms_idlepublish = hal_millis();
+}
+
+/*
+* Forgets the due times of the previous pass - is called at the start of
+* every pass
+*/
+void idle_begin()
+{
+    idleReported = 0;
+    idleHeld = false;
+}
+
+/*
+* A source has work due at due_ms (hal_millis), the earliest time of a
+* source within a pass counts
+*/
+void idle_due(idle_source_t source, uint32_t due_ms)
+{
+    uint16_t bit = 1 << source;
+    if (!(idleReported & bit) || ((int32_t)(due_ms - idleDue_ms[source]) < 0))
+    {
+        idleDue_ms[source] = due_ms;
+        idleReported |= bit;
+    }
+}
+
+/*
+* Keeps the clocks running during the wait after this pass (no STANDBY)
+*/
+void idle_hold()
+{
+    idleHeld = true;
+}
+
+/*
+* Decides how to wait for the earliest due time reported in this pass -
+* has no side effects
+*/
+void idle_plan(uint32_t now, idle_plan_t *plan)
+{
+    int32_t wait_ms = IDLE_MAXSLEEP_MS;
+    plan->source = IDLE_SOURCENONE;
+    for (int source = 0; source < IDLE_NUMSOURCES; source++)
+    {
+        if ((idleReported & (1 << source)) && ((int32_t)(idleDue_ms[source] - now) < wait_ms))
+        {
+            wait_ms = (int32_t)(idleDue_ms[source] - now);
+            plan->source = (idle_source_t)source;
+        }
+    }
+    if ((idleMode == IDLE_MODEOFF) || (wait_ms < IDLE_MINSLEEP_MS))
+    {
+        plan->mode = IDLE_RUN;
+        plan->sleep_ms = 0;
+        return;
+    }
+    plan->sleep_ms = wait_ms;
+    bool standby = (idleMode == IDLE_MODESTANDBY) && !idleHeld && (wait_ms >= IDLE_STANDBYMIN_MS);
+    plan->mode = standby ? IDLE_STANDBY : IDLE_SLEEP;
+}
+
+/*
+* Publishes the counters of the window on gdc/diag/idle
+*/
+void idle_publish()
+{
+    uint64_t total_us = idleWindow.awake_us + idleWindow.idle_us + idleWindow.standby_us;
+    int limit = IDLE_SOURCENONE;
+    for (int source = 0; source < IDLE_NUMSOURCES; source++)
+    {
+        if (idleWindowLimits[source] > idleWindowLimits[limit])
+        {
+            limit = source;
+        }
+    }
+    PayloadWriter payload(MQTT_TOPICDIAGIDLE, PAYLOAD_SCHEMAIDLE);
+    payload.addNumber("duty", total_us ? (float)idleWindow.awake_us * 100 / total_us : 100.0f, 1);
+    payload.addUint("awake_ms", (unsigned long)(idleWindow.awake_us / 1000));
+    payload.addUint("idle_ms", (unsigned long)(idleWindow.idle_us / 1000));
+    payload.addUint("standby_ms", (unsigned long)(idleWindow.standby_us / 1000));
+    payload.addUint("sleeps", idleWindow.sleeps);
+    payload.addUint("wakeups", idleWindow.wakeups);
+    payload.addString("limit", idleSourceNames[limit]);
+    payload.publish(false);
+}
+
+/*
+* Waits for the work which is due next - is called at the end of every
+* pass, after the watchdog was cleared
+*/
+void idle_loop()
+{
+    uint32_t awake_us = hal_micros() - prev_us_wake;
+    idleStats.awake_us += awake_us;
+    idleWindow.awake_us += awake_us;
+
+    if ((hal_millis() - prev_ms_idlepublish >= IDLE_PUBLISH_MS) && mqtt_isconnected())
+    {
+        prev_ms_idlepublish = hal_millis();
+        idle_publish();
+        memset(&idleWindow, 0, sizeof(idleWindow));
+        memset(idleWindowLimits, 0, sizeof(idleWindowLimits));
+    }
+
+    idle_plan_t plan;
+    idle_plan(hal_millis(), &plan);
+    uint32_t slept_us = 0;
+    if (plan.mode == IDLE_RUN)
+    {
+        idleStats.skipped++;
+        idleWindow.skipped++;
+    }
+    else
+    {
+        bool standby = (plan.mode == IDLE_STANDBY);
+        bool woken = false;
+        slept_us = hal_sleep(plan.sleep_ms, standby, &woken);
+        uint64_t &total_us = standby ? idleStats.standby_us : idleStats.idle_us;
+        uint64_t &window_us = standby ? idleWindow.standby_us : idleWindow.idle_us;
+        total_us += slept_us;
+        window_us += slept_us;
+        idleStats.sleeps++;
+        idleWindow.sleeps++;
+        idleStats.standbys += standby;
+        idleWindow.standbys += standby;
+        idleStats.wakeups += woken;
+        idleWindow.wakeups += woken;
+        if (!woken)
+        {
+            idleWindowLimits[plan.source]++;
+        }
+    }
+    idleStats.lastSleep_us = slept_us;
+    prev_us_wake = hal_micros();
+}
+
+const char *idle_sourcename(idle_source_t source)
+{
+    return idleSourceNames[source];
+}
+
+const idle_stats_t *idle_getstats()
+{
+    return &idleStats;
+}
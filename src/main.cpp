@@ -6,12 +6,7 @@
 */
 
 // Include libraries
-#include <Arduino.h>
-
-#include <SPI.h>
-#include <Ethernet.h>
-#include <WDTZero.h>
-#include <ArduinoJson.h>
+#include "hal.h"
 
 // Include local libraries/headers
 #include "config.h"
@@ -20,17 +15,27 @@
 #include "util.h"
 #include "mqtt.h"
 #include "sensors.h"
-
-EthernetClient ethClient;
+#include "trace.h"
+#include "cmdqueue.h"
+#include "heapstats.h"
+#include "memstats.h"
+#include "payload.h"
+#include "metrics.h"
+#include "udpcontrol.h"
+#include "boot.h"
+#include "supervisor.h"
+#include "postmortem.h"
+#include "settings.h"
+#include "update.h"
+#include "state.h"
+#include "idle.h"
+#include "buildfeatures.h"
 
 // Heartbeat counter
 unsigned long uptime_in_secs = 0;
 bool mainFirstRun = true;
 
-// Watchdog
-WDTZero watchdog;
-
-unsigned long millisWhenStarted_ms;
+uint32_t prev_ms_uptime;
 int ledState = LOW;
 
 // maintain door status
@@ -38,22 +43,32 @@ int oldDoorStatus = 0;
 int newDoorStatus = 0;
 int lastCommand = 0;
 
+// the hmi buttons and leds belong to the first door
+#define HMI_DOOR 0
+
 // initial page to display on the display after system start
 int currentSystemInfoPage = PAGE_OVERVIEW;
 
-unsigned long prev_displayTimeout_ms = 0;
+uint32_t prev_displayTimeout_ms = 0;
 bool displayIsOn = false;
 
+// the page after the given one - starts over with the first page after the
+// last one, the sensor page is skipped without the ENV shield
+constexpr int page_next(int page)
+{
+  return (page == PAGE_SYSTEM) ? PAGE_OVERVIEW : (((page + 1 == PAGE_SENSORS) && !featureSensors) ? page + 2 : page + 1);
+}
+
 // Forward declarations
 void watchdog_init();
 void watchdog_reset();
 void watchdog_onShutdown();
 void publish_sensor_values();
-void command_open(String fromSource);
-void command_close(String fromSource);
-void status_isopen();
-void status_isclosed();
-void status_ismovingorstopped();
+void command_open(int door, const char* fromSource);
+void command_close(int door, const char* fromSource);
+void status_isopen(int door);
+void status_isclosed(int door);
+void status_ismovingorstopped(int door);
 void show_systeminfo();
 void show_page_sensors();
 void show_page_overview();
@@ -61,133 +76,141 @@ void show_page_driveio();
 void show_page_hmi();
 void show_page_mqtt();
 void show_page_system();
+void publish_cmdqueue_stats();
+void publish_delivery_stats();
+void check_heap_allocations();
 
-// setup the board an all variables
+// setup the board an all variables - only the core stage runs here, all
+// other stages are started by boot_loop() (see boot.h)
 void setup()
 {
-  // Init serial line with 9600 baud and wait 5s to get a terminal connected
-  Serial.begin(9600);
-  delay(2000);
+  // paint the free ram to find the stack high water mark later
+  memstats_init();
 
-  // setup watchdog
-  watchdog_init();
+  // Init serial line with 9600 baud - there is no wait for a terminal, the
+  // boot profile is published when the broker is connected
+  hal_serial_begin(9600);
 
-  // initialize display
-  hmi_init();
+  // setup watchdog and the supervisor of the modules
+  watchdog_init();
+  supervisor_init();
 
   // store offset for uptime counter
-  millisWhenStarted_ms = millis();
+  prev_ms_uptime = hal_millis();
+
+  // This should be the first line in the serial log
+  hal_serial_println("INIT: Starting...");
+  hal_serial_println("INIT: Sketch built on " __DATE__ " at " __TIME__);
+
+  // keep the post-mortem record of the previous run and start a new one
+  postmortem_init();
 
-  // show initial screen
+  // buttons, leds, baseboard and the queue for door commands
+  boot_init();
+
+  // show initial screen as soon as the display is started
   displayIsOn = true;
-  prev_displayTimeout_ms = millis();
-  hmi_display_off(displayIsOn);
-  show_page_overview();
+  prev_displayTimeout_ms = hal_millis();
+}
 
-  // This should be the first line in the serial log
-  Serial.println("INIT: Starting...");
-  Serial.println("INIT: Sketch built on " __DATE__ " at " __TIME__);
+// main loop - reads/writes commands and sensor values
+void loop()
+{
+  uint32_t loopStart_us = hal_micros();
 
-  // check if all the hardware is installed/present
-  // start with MKR ENV shield
-  sensors_init();
+  // the modules report their timed work during the pass (see idle.h)
+  idle_begin();
 
-  // init baseboard
-  driveio_init();
+  // count the uptime in seconds - the difference to the last count is used,
+  // so the uptime keeps counting when millis() wraps after 49 days
+  uint32_t elapsed_secs = (hal_millis() - prev_ms_uptime) / 1000;
+  uptime_in_secs += elapsed_secs;
+  prev_ms_uptime += elapsed_secs * 1000;
 
-  // check MKR ETH shield / connection
-  // interface uses a fully configured static ip
-  Ethernet.begin(mac, ip, dns, gateway, subnet);
+  // advance the boot stages which are not done yet
+  boot_loop();
 
-  // Check for Ethernet hardware present
-  if (Ethernet.hardwareStatus() == EthernetNoHardware)
-  {
-    Serial.println("ERROR: Ethernet shield was not found");
-    while (true)
-    {
-      delay(1);
-    }
-  }
-  else
+  // loop over all modules - the modules of the later boot stages only once
+  // they are started. Every module checks in with the supervisor.
+  supervisor_begin(SUPERVISOR_DRIVEIO);
+  driveio_loop();
+  supervisor_end(SUPERVISOR_DRIVEIO);
+  if (featureHmi)
   {
-    Serial.print("INIT: Ethernet chipset type is ");
-    Serial.println(Ethernet.hardwareStatus());
+    supervisor_begin(SUPERVISOR_HMI);
+    hmi_loop();
+    supervisor_end(SUPERVISOR_HMI);
   }
-  if (Ethernet.linkStatus() == LinkOFF)
+  if (featureSensors && boot_isready(BOOT_STAGESENSORS))
   {
-    Serial.println("ERROR: Ethernet cable is not connected");
-  }
-  Serial.print("INIT: Controller network interface is at ");
-  Serial.println(Ethernet.localIP());
-
-  // Initialize MQTT client
-  mqtt_init();
+    supervisor_begin(SUPERVISOR_SENSORS);
+    sensors_loop();
+    supervisor_end(SUPERVISOR_SENSORS);
 
-  // publish the current door status - this is necessary because the
-  // status is normally updated only if it has changed
-  // Note: mqtt_init() must be called before - otherwise the mqtt connection
-  // is not working
-  if (driveio_getcurrentdoorstatus()==DOORSTATUSOPEN)
-  {
-    mqtt_publish(MQTT_TOPICCONTROLGETCURRENTDOORSTATE, MQTT_STATUSDOOROPEN, true);
+    // gets the current sensor values and sends them via mqtt
+    publish_sensor_values();
   }
-  if (driveio_getcurrentdoorstatus()==DOORSTATUSCLOSED)
+  if (boot_isstarted(BOOT_STAGEMQTT))
   {
-    mqtt_publish(MQTT_TOPICCONTROLGETCURRENTDOORSTATE, MQTT_STATUSDOORCLOSED, true);
+    supervisor_begin(SUPERVISOR_MQTT);
+    mqtt_loop();
+    supervisor_end(SUPERVISOR_MQTT);
   }
-}
 
-// main loop - reads/writes commands and sensor values
-void loop()
-{
-  // calculate uptime in seconds
-  uptime_in_secs = (millis() - millisWhenStarted_ms) / 1000;
-
-  // loop over all modules
-  driveio_loop();
-  hmi_loop();
-  sensors_loop();
-  mqtt_loop();
+  // commands of the udp control channel go into the command queue before
+  // it's executed below, so they are run in the same pass
+  udpcontrol_loop();
 
-  // gets the current sensor values and sends them via mqtt
-  publish_sensor_values();
+  // publish finished command traces, the post-mortem record, the active
+  // settings, the state of a firmware transfer and the aggregated state
+  trace_loop();
+  postmortem_loop();
+  settings_loop();
+  update_loop();
+  state_loop();
 
-  // trigger the watchdog
-  watchdog_reset();
+  // sample free memory and publish the memory statistics
+  memstats_loop();
 
-  // check if door status was changed
-  if (driveio_doorstatuschanged(&oldDoorStatus, &newDoorStatus))
+  // check if the status of a door was changed
+  FixedString<POSTMORTEM_EVENTLENGTH> eventText;
+  for (int door = 0; door < DOOR_COUNT; door++)
   {
-    if ((newDoorStatus == DOORSTATUSOPEN) && (driveio_doorcommandactive()==false))
-    {
-      status_isopen();
-    }
-    if ((newDoorStatus == DOORSTATUSCLOSED) && (driveio_doorcommandactive()==false))
-    {
-      status_isclosed();
-    }
-    if (newDoorStatus == DOORSTATUSMOVINGORSTOPPED)
-    {
-      status_ismovingorstopped();
-    }
-    if (newDoorStatus == DOORSTATUSEXTERNAL)
+    if (driveio_doorstatuschanged(door, &oldDoorStatus, &newDoorStatus))
     {
-      mqtt_publish(MQTT_TOPICCONTROLCOMMANDSOURCE, MQTT_COMMANDSOURCEEXTERNAL, false);
+      metrics_doorstatus(door, newDoorStatus);
+      if ((newDoorStatus == DOORSTATUSOPEN) && (driveio_doorcommandactive(door)==false))
+      {
+        status_isopen(door);
+      }
+      if ((newDoorStatus == DOORSTATUSCLOSED) && (driveio_doorcommandactive(door)==false))
+      {
+        status_isclosed(door);
+      }
+      if (newDoorStatus == DOORSTATUSMOVINGORSTOPPED)
+      {
+        status_ismovingorstopped(door);
+      }
+      if (newDoorStatus == DOORSTATUSEXTERNAL)
+      {
+        postmortem_event(eventText.format("door%d external", door + 1).c_str());
+        mqtt_publish(mqtt_doortopic(door, MQTT_TOPICCONTROLCOMMANDSOURCE), MQTT_COMMANDSOURCEEXTERNAL, false);
+      }
     }
   }
 
   // check for user command (button press on HMI)
-  int buttonPressed = hmi_getbuttonpressed();
+  int buttonPressed = featureHmi ? hmi_getbuttonpressed() : HMI_BUTTON_NONE;
   if (buttonPressed != HMI_BUTTON_NONE)
   {
     lastCommand = buttonPressed;
     if (buttonPressed == HMI_BUTTON_OPENDOOR)
     {
-      command_open(MQTT_COMMANDSOURCELOCAL);
+      cmdqueue_push(HMI_DOOR, DOORCOMMANDOPEN, CMDQUEUE_SOURCELOCAL);
     }
     if (buttonPressed == HMI_BUTTON_CLOSEDOOR)
     {
-      command_close(MQTT_COMMANDSOURCELOCAL);
+      cmdqueue_push(HMI_DOOR, DOORCOMMANDCLOSE, CMDQUEUE_SOURCELOCAL);
     }
     if (buttonPressed == HMI_BUTTON_SYSTEMINFO)
     {
@@ -195,130 +218,181 @@ void loop()
       // only activate the display again
       if (displayIsOn)
       {
-        if (currentSystemInfoPage == PAGE_SYSTEM)
-        {
-          // start over with first page agin
-          currentSystemInfoPage = PAGE_OVERVIEW;
-        }
-        else
-        {
-          //switch to next page
-          currentSystemInfoPage++;
-        }
+        currentSystemInfoPage = page_next(currentSystemInfoPage);
       }
       char buffer[80];
       sprintf(buffer, "RUN: SYSINFO: %d", currentSystemInfoPage);
-      Serial.println(buffer);
+      hal_serial_println(buffer);
       displayIsOn = true;
-      prev_displayTimeout_ms = millis();
+      prev_displayTimeout_ms = hal_millis();
       hmi_display_off(displayIsOn);
     }
   }
 
-  // check for remote command (over MQTT)
-  String remoteCommand = mqtt_getcommand();
-  if (remoteCommand.length() != 0)
+  // execute all queued commands (local and remote)
+  command_t queuedCommand;
+  while (cmdqueue_pop(&queuedCommand))
   {
-    if (remoteCommand == MQTT_COMMANDDOOROPEN)
+    const char* source = (queuedCommand.source == CMDQUEUE_SOURCELOCAL) ? MQTT_COMMANDSOURCELOCAL : MQTT_COMMANDSOURCEREMOTE;
+    if (queuedCommand.source == CMDQUEUE_SOURCEREMOTE)
     {
-      command_open(MQTT_COMMANDSOURCEREMOTE);
+      trace_mark(queuedCommand.door, TRACE_DEQUEUED);
     }
-    if (remoteCommand == MQTT_COMMANDDOORCLOSE)
+    if (queuedCommand.command == DOORCOMMANDOPEN)
     {
-      command_close(MQTT_COMMANDSOURCEREMOTE);
+      command_open(queuedCommand.door, source);
     }
+    if (queuedCommand.command == DOORCOMMANDCLOSE)
+    {
+      command_close(queuedCommand.door, source);
+    }
+  }
+  publish_cmdqueue_stats();
+  publish_delivery_stats();
+  check_heap_allocations();
+
+  // serve the metrics endpoint without blocking
+  if (boot_isready(BOOT_STAGESERVICES))
+  {
+    metrics_loop();
   }
 
-  if (displayIsOn)
+  if (featureHmi && boot_isready(BOOT_STAGEDISPLAY))
   {
-    show_systeminfo();
-    if (millis() > prev_displayTimeout_ms + displayTimeout_ms)
+    supervisor_begin(SUPERVISOR_DISPLAY);
+    if (displayIsOn)
     {
-      displayIsOn = false;
-      hmi_display_off(displayIsOn);
+      idle_due(IDLE_SOURCEDISPLAY, hal_millis() + IDLE_DISPLAYREFRESH_MS);
+      show_systeminfo();
+      if (hal_millis() - prev_displayTimeout_ms > (uint32_t)displayTimeout_ms)
+      {
+        displayIsOn = false;
+        hmi_display_off(displayIsOn);
+      }
     }
+    supervisor_end(SUPERVISOR_DISPLAY);
+  }
+
+  // check the deadlines of the modules - the watchdog is only triggered
+  // while all critical modules are healthy (see supervisor.h)
+  supervisor_loop();
+  if (supervisor_ishealthy())
+  {
+    watchdog_reset();
   }
+  postmortem_looptime(hal_micros() - loopStart_us);
   mainFirstRun = false;
+
+  // wait in low-power mode until the next work is due
+  idle_loop();
 }
 
 /*
  * set door to open
  */
-void command_open(String fromSource)
+void command_open(int door, const char* fromSource)
 {
   char buffer[80];
-  sprintf(buffer, "RUN: Command: DOOROPEN (source=%s)", fromSource.c_str());
-  Serial.println(buffer);
+  sprintf(buffer, "RUN: Command: DOOROPEN (door=%d, source=%s)", door + 1, fromSource);
+  hal_serial_println(buffer);
+  sprintf(buffer, "open%d %s", door + 1, fromSource);
+  postmortem_event(buffer);
 
-  mqtt_publish(MQTT_TOPICCONTROLGETNEWDOORSTATE, MQTT_COMMANDDOOROPEN, false);
-  mqtt_publish(MQTT_TOPICCONTROLGETCURRENTDOORSTATE, MQTT_STATUSDOOROPENING, false);
-  mqtt_publish(MQTT_TOPICCONTROLCOMMANDSOURCE, fromSource, false);
+  mqtt_publish(mqtt_doortopic(door, MQTT_TOPICCONTROLGETNEWDOORSTATE), MQTT_COMMANDDOOROPEN, false);
+  mqtt_publish(mqtt_doortopic(door, MQTT_TOPICCONTROLGETCURRENTDOORSTATE), MQTT_STATUSDOOROPENING, false);
+  mqtt_publish(mqtt_doortopic(door, MQTT_TOPICCONTROLCOMMANDSOURCE), fromSource, false);
 
-  driveio_setdoorcommand(DOORCOMMANDOPEN);
+  driveio_setdoorcommand(door, DOORCOMMANDOPEN);
 
-  hmi_setled_blinking(HMI_LED_DOORCLOSED, false);
-  hmi_setled_blinking(HMI_LED_DOOROPEN, true);
-  hmi_setled(HMI_LED_DOORCLOSED, LOW);
+  if (featureHmi && (door == HMI_DOOR))
+  {
+    hmi_setled_blinking(HMI_LED_DOORCLOSED, false);
+    hmi_setled_blinking(HMI_LED_DOOROPEN, true);
+    hmi_setled(HMI_LED_DOORCLOSED, LOW);
+  }
 }
 
 /*
  * set door to close
  */
-void command_close(String fromSource)
+void command_close(int door, const char* fromSource)
 {
   char buffer[80];
-  sprintf(buffer, "RUN: Command: DOORCLOSE (source=%s)", fromSource.c_str());
-  Serial.println(buffer);
+  sprintf(buffer, "RUN: Command: DOORCLOSE (door=%d, source=%s)", door + 1, fromSource);
+  hal_serial_println(buffer);
+  sprintf(buffer, "close%d %s", door + 1, fromSource);
+  postmortem_event(buffer);
 
-  mqtt_publish(MQTT_TOPICCONTROLGETNEWDOORSTATE, MQTT_COMMANDDOORCLOSE, false);
-  mqtt_publish(MQTT_TOPICCONTROLGETCURRENTDOORSTATE, MQTT_STATUSDOORCLOSING, false);
-  mqtt_publish(MQTT_TOPICCONTROLCOMMANDSOURCE, fromSource, false);
+  mqtt_publish(mqtt_doortopic(door, MQTT_TOPICCONTROLGETNEWDOORSTATE), MQTT_COMMANDDOORCLOSE, false);
+  mqtt_publish(mqtt_doortopic(door, MQTT_TOPICCONTROLGETCURRENTDOORSTATE), MQTT_STATUSDOORCLOSING, false);
+  mqtt_publish(mqtt_doortopic(door, MQTT_TOPICCONTROLCOMMANDSOURCE), fromSource, false);
 
-  driveio_setdoorcommand(DOORCOMMANDCLOSE);
+  driveio_setdoorcommand(door, DOORCOMMANDCLOSE);
 
-  hmi_setled(HMI_LED_DOOROPEN, LOW);
-  hmi_setled_blinking(HMI_LED_DOOROPEN, false);
-  hmi_setled_blinking(HMI_LED_DOORCLOSED, true);
+  if (featureHmi && (door == HMI_DOOR))
+  {
+    hmi_setled(HMI_LED_DOOROPEN, LOW);
+    hmi_setled_blinking(HMI_LED_DOOROPEN, false);
+    hmi_setled_blinking(HMI_LED_DOORCLOSED, true);
+  }
 }
 
 /*
  *  door is open
  */
-void status_isopen()
+void status_isopen(int door)
 {
-  Serial.println("RUN: STATUS: DOOROPEN");
+  char buffer[80];
+  sprintf(buffer, "RUN: STATUS: DOOROPEN (door=%d)", door + 1);
+  hal_serial_println(buffer);
+  sprintf(buffer, "door%d open", door + 1);
+  postmortem_event(buffer);
 
-  mqtt_publish(MQTT_TOPICCONTROLGETCURRENTDOORSTATE, MQTT_STATUSDOOROPEN, true);
-  mqtt_publish(MQTT_TOPICCONTROLGETNEWDOORSTATE, MQTT_COMMANDDOOROPEN, false);
+  mqtt_publish(mqtt_doortopic(door, MQTT_TOPICCONTROLGETCURRENTDOORSTATE), MQTT_STATUSDOOROPEN, true);
+  mqtt_publish(mqtt_doortopic(door, MQTT_TOPICCONTROLGETNEWDOORSTATE), MQTT_COMMANDDOOROPEN, false);
 
-  hmi_setled_blinking(HMI_LED_DOOROPEN, false);
-  hmi_setled_blinking(HMI_LED_DOORCLOSED, false);
-  hmi_setled(HMI_LED_DOOROPEN, HIGH);
-  hmi_setled(HMI_LED_DOORCLOSED, LOW);
+  if (featureHmi && (door == HMI_DOOR))
+  {
+    hmi_setled_blinking(HMI_LED_DOOROPEN, false);
+    hmi_setled_blinking(HMI_LED_DOORCLOSED, false);
+    hmi_setled(HMI_LED_DOOROPEN, HIGH);
+    hmi_setled(HMI_LED_DOORCLOSED, LOW);
+  }
 }
 
 /*
  *  door is closed
  */
-void status_isclosed()
+void status_isclosed(int door)
 {
-  Serial.println("RUN: STATUS: DOORCLOSED");
+  char buffer[80];
+  sprintf(buffer, "RUN: STATUS: DOORCLOSED (door=%d)", door + 1);
+  hal_serial_println(buffer);
+  sprintf(buffer, "door%d closed", door + 1);
+  postmortem_event(buffer);
 
-  mqtt_publish(MQTT_TOPICCONTROLGETCURRENTDOORSTATE, MQTT_STATUSDOORCLOSED, true);
-  mqtt_publish(MQTT_TOPICCONTROLGETNEWDOORSTATE, MQTT_COMMANDDOORCLOSE, false);
+  mqtt_publish(mqtt_doortopic(door, MQTT_TOPICCONTROLGETCURRENTDOORSTATE), MQTT_STATUSDOORCLOSED, true);
+  mqtt_publish(mqtt_doortopic(door, MQTT_TOPICCONTROLGETNEWDOORSTATE), MQTT_COMMANDDOORCLOSE, false);
 
-  hmi_setled_blinking(HMI_LED_DOOROPEN, false);
-  hmi_setled_blinking(HMI_LED_DOORCLOSED, false);
-  hmi_setled(HMI_LED_DOOROPEN, LOW);
-  hmi_setled(HMI_LED_DOORCLOSED, HIGH);
+  if (featureHmi && (door == HMI_DOOR))
+  {
+    hmi_setled_blinking(HMI_LED_DOOROPEN, false);
+    hmi_setled_blinking(HMI_LED_DOORCLOSED, false);
+    hmi_setled(HMI_LED_DOOROPEN, LOW);
+    hmi_setled(HMI_LED_DOORCLOSED, HIGH);
+  }
 }
 
 /*
- *  door is closed
+ *  door is moving or stopped
  */
-void status_ismovingorstopped()
+void status_ismovingorstopped(int door)
 {
-  Serial.println("RUN: STATUS: DOORMOVINGORSTOPPED");
+  char buffer[80];
+  sprintf(buffer, "RUN: STATUS: DOORMOVINGORSTOPPED (door=%d)", door + 1);
+  hal_serial_println(buffer);
+  sprintf(buffer, "door%d moving", door + 1);
+  postmortem_event(buffer);
 }
 
 /*
@@ -332,7 +406,10 @@ void show_systeminfo()
     show_page_overview();
     break;
   case PAGE_SENSORS:
-    show_page_sensors();
+    if (featureSensors)
+    {
+      show_page_sensors();
+    }
     break;
   case PAGE_DRIVEIO:
     show_page_driveio();
@@ -354,33 +431,106 @@ void show_systeminfo()
  */
 void publish_sensor_values()
 {
-  if (timespan_ten_seconds() | mainFirstRun)
+  if (timespan_sensors() | mainFirstRun)
+  {
+    // prepare payload for sensors topic (json or binary, see payload.h)
+    // attention: size of the mqtt buffer is limited to 256 bytes
+    PayloadWriter payload(MQTT_TOPICSYSTEMSENSORS, PAYLOAD_SCHEMASENSORS);
+    payload.addMeasurement("temperature", sensors_get_temperature(), 1, "°C");
+    payload.addMeasurement("humidity", sensors_get_humidity(), 0, "%");
+    payload.addMeasurement("pressure", sensors_get_pressure(), 0, "kPa");
+    payload.addMeasurement("illuminance", sensors_get_illuminance(), 4, "lx");
+    payload.publish(false);
+  }
+}
+
+/*
+ * Publishes the counters of the command queue every 10s, but only if
+ * they have changed since the last time
+ */
+void publish_cmdqueue_stats()
+{
+  static uint32_t prev_ms = hal_millis();
+  static unsigned long prev_total = 0;
+  if (hal_millis() - prev_ms < 10000)
+  {
+    return;
+  }
+  prev_ms = hal_millis();
+
+  const cmdqueue_stats_t *stats = cmdqueue_getstats();
+  unsigned long total = stats->accepted + stats->merged + cmdqueue_getrejected();
+  if (total == prev_total)
   {
-    // json document
-    DynamicJsonDocument jsonSensorValuesDoc(256);
-    char jsonSensorValuesBuffer[256];
-
-    JsonObject sensorTemperature = jsonSensorValuesDoc.createNestedObject("temperature");
-    sensorTemperature["value"] = toString(sensors_get_temperature(), 1);
-    sensorTemperature["unit"] = "°C";
-
-    JsonObject sensorHumidity = jsonSensorValuesDoc.createNestedObject("humidity");
-    sensorHumidity["value"] = toString(sensors_get_humidity());
-    sensorHumidity["unit"] = "%";
-
-    JsonObject sensorPressure = jsonSensorValuesDoc.createNestedObject("pressure");
-    sensorPressure["value"] = toString(sensors_get_pressure());
-    sensorPressure["unit"] = "kPa";
-
-    JsonObject sensorIlluminance = jsonSensorValuesDoc.createNestedObject("illuminance");
-    sensorIlluminance["value"] = toString(sensors_get_illuminance(),4);
-    sensorIlluminance["unit"] = "lx";
-
-    // prepare json payload for sensors topic
-    // serialize json document into global buffer and publish
-    // attention: size of buffer is limited to 256 bytes
-    serializeJson(jsonSensorValuesDoc, jsonSensorValuesBuffer);
-    mqtt_publish("gdc/system/sensors", jsonSensorValuesBuffer, false);
+    return;
+  }
+  prev_total = total;
+
+  PayloadWriter payload(MQTT_TOPICDIAGCOMMANDQUEUE, PAYLOAD_SCHEMACOMMANDQUEUE);
+  payload.addUint("depth", stats->depth);
+  payload.addUint("maxdepth", stats->maxDepth);
+  payload.addUint("accepted", stats->accepted);
+  payload.addUint("merged", stats->merged);
+  payload.addUint("ratelimited", stats->rejectedRateLimit);
+  payload.addUint("overflow", stats->rejectedFull);
+  payload.publish(false);
+}
+
+/*
+ * Publishes the counters of the QoS 1 delivery every 10s, but only if they
+ * have changed since the last time: retransmits, expired publishes, dropped
+ * duplicates and the time until the PUBACK in us
+ */
+void publish_delivery_stats()
+{
+  static uint32_t prev_ms = hal_millis();
+  static unsigned long prev_total = 0;
+  if (hal_millis() - prev_ms < 10000)
+  {
+    return;
+  }
+  prev_ms = hal_millis();
+
+  const mqttclient_stats_t *stats = mqtt_getdeliverystats();
+  unsigned long total = stats->published + stats->acknowledged + stats->duplicates + stats->downgraded;
+  if (total == prev_total)
+  {
+    return;
+  }
+  prev_total = total;
+
+  PayloadWriter payload(MQTT_TOPICDIAGDELIVERY, PAYLOAD_SCHEMADELIVERY);
+  payload.addUint("published", stats->published);
+  payload.addUint("acked", stats->acknowledged);
+  payload.addUint("retransmits", stats->retransmits);
+  payload.addUint("expired", stats->expired);
+  payload.addUint("downgraded", stats->downgraded);
+  payload.addUint("duplicates", stats->duplicates);
+  payload.addUint("ack_mean_us", stats->acknowledged ? (unsigned long)(stats->ackLatencyTotal_us / stats->acknowledged) : 0UL);
+  payload.addUint("ack_max_us", (unsigned long)stats->ackLatencyMax_us);
+  payload.publish(false);
+}
+
+/*
+ * Logs if the heap was used after the startup has finished. In steady state
+ * the firmware must not allocate any memory. The steady state starts when
+ * all boot stages are settled (see heapstats_marksteadystate()), before
+ * that every allocation of the startup would be counted.
+ */
+void check_heap_allocations()
+{
+  static unsigned long prev_allocations = 0;
+  if (!boot_iscomplete())
+  {
+    return;
+  }
+  unsigned long allocations = heapstats_getsteadyallocations();
+  if (allocations != prev_allocations)
+  {
+    prev_allocations = allocations;
+    char buffer[80];
+    sprintf(buffer, "WARNING: %lu heap allocations in steady state", allocations);
+    hal_serial_println(buffer);
   }
 }
 
@@ -390,11 +540,10 @@ void publish_sensor_values()
 void watchdog_init()
 {
   // initialize digital pin LED_BUILTIN as an output.
-  pinMode(LED_BUILTIN, OUTPUT);
+  hal_gpio_mode(HAL_LED_BUILTIN, OUTPUT);
 
   // attach own handler which is called if watchdog is not triggered anymore
-  watchdog.attachShutdown(watchdog_onShutdown);
-  watchdog.setup(WDT_SOFTCYCLE16S);
+  hal_watchdog_init(HAL_WATCHDOG_16S, watchdog_onShutdown);
 }
 
 /*
@@ -403,13 +552,13 @@ void watchdog_init()
 void watchdog_reset()
 {
   // clear the watchdog
-  watchdog.clear();
+  hal_watchdog_clear();
 
-  // led the inbuilt led blink as a heartbeat with 1Hz frequency
-  if (timespan_one_second())
+  // led the inbuilt led blink as a heartbeat (heartbeatInterval_ms)
+  if (timespan_heartbeat())
   {
     ledState = (ledState == LOW) ? HIGH : LOW;
-    digitalWrite(LED_BUILTIN, ledState);
+    hal_gpio_write(HAL_LED_BUILTIN, ledState);
   }
 }
 
@@ -419,7 +568,13 @@ void watchdog_reset()
  */
 void watchdog_onShutdown()
 {
-  Serial.print("\nERROR: watchdog not cleared. Controller reboot initiated");
+  char buffer[80];
+  uint32_t elapsed_ms = 0;
+  supervisor_module_t module = supervisor_getactive(&elapsed_ms);
+  postmortem_setcause(POSTMORTEM_CAUSEWATCHDOG);
+  hal_serial_print("\nERROR: watchdog not cleared. Controller reboot initiated");
+  sprintf(buffer, " (stalled in %s for %lu ms)", supervisor_modulename(module), (unsigned long)elapsed_ms);
+  hal_serial_print(buffer);
 }
 
 /*
@@ -427,14 +582,13 @@ void watchdog_onShutdown()
 */
 void show_page_overview()
 {
-  String ethStatus = (ethClient.connected()==true) ? "connected" : "disconnected";
-  String mqttStatus = (mqtt_isconnected()==true) ? "connected" : "disconnected";
-  String text[4] = {
-    "Version " + version, 
-    "Copyright " + author, 
-    "Ethernet " + ethStatus,
-    "MQTT " + mqttStatus
-  };
+  const char* ethStatus = (hal_tcp_connected()==true) ? "connected" : "disconnected";
+  const char* mqttStatus = (mqtt_isconnected()==true) ? "connected" : "disconnected";
+  DisplayLine text[4];
+  text[0].format("Version %s", version);
+  text[1].format("Copyright %s", author);
+  text[2].format("Ethernet %s", ethStatus);
+  text[3].format("MQTT %s", mqttStatus);
   int len = sizeof(text) / sizeof(text[0]);
   hmi_display_frame(application, text, len);
 }
@@ -444,23 +598,43 @@ void show_page_overview()
 */
 void show_page_sensors()
 {
-  String text[4] = {
-      "Temperature: " + toString(sensors_get_temperature(), 1) + "\xb0" + "C",
-      "Humidity: " + toString(sensors_get_humidity()) + "%",
-      "Pressure: " + toString(sensors_get_pressure()) + "kPa",
-      "Illuminance: " + toString(sensors_get_illuminance()) + "lx"};
+  DisplayLine text[4];
+  text[0].append("Temperature: ").append(toString(sensors_get_temperature(), 1)).append("\xb0" "C");
+  text[1].append("Humidity: ").append(toString(sensors_get_humidity())).append("%");
+  text[2].append("Pressure: ").append(toString(sensors_get_pressure())).append("kPa");
+  text[3].append("Illuminance: ").append(toString(sensors_get_illuminance())).append("lx");
   int len = sizeof(text) / sizeof(text[0]);
   hmi_display_frame("Sensors", text, len);
 }
 
+/*
+* Displays the io states - all ios of a single door or a summary line
+* (open cmd, open status, close cmd, closed status) per door
+*/
 void show_page_driveio()
 {
-  String text[4] = {
-      "D0 (Output): " + String(driveio_getiostatus(CMD_OPENDOOR_OUTPUT)),
-      "D1 (Input): " + String(driveio_getiostatus(STATUS_DOORISOPEN_INPUT)),
-      "D2 (Output): " + String(driveio_getiostatus(CMD_CLOSEDOOR_OUTPUT)),
-      "D3 (Input): " + String(driveio_getiostatus(STATUS_DOORISCLOSED_INPUT))};
-  int len = sizeof(text) / sizeof(text[0]);
+  DisplayLine text[4];
+  int len = 0;
+  if (DOOR_COUNT == 1)
+  {
+    text[0].format("D0 (Output): %d", driveio_getiostatus(0, DRIVEIO_CMDOPENOUTPUT));
+    text[1].format("D1 (Input): %d", driveio_getiostatus(0, DRIVEIO_STATUSOPENINPUT));
+    text[2].format("D2 (Output): %d", driveio_getiostatus(0, DRIVEIO_CMDCLOSEOUTPUT));
+    text[3].format("D3 (Input): %d", driveio_getiostatus(0, DRIVEIO_STATUSCLOSEDINPUT));
+    len = 4;
+  }
+  else
+  {
+    len = (DOOR_COUNT < 4) ? DOOR_COUNT : 4;
+    for (int door = 0; door < len; door++)
+    {
+      text[door].format("Door %d: %d %d %d %d", door + 1,
+                        driveio_getiostatus(door, DRIVEIO_CMDOPENOUTPUT),
+                        driveio_getiostatus(door, DRIVEIO_STATUSOPENINPUT),
+                        driveio_getiostatus(door, DRIVEIO_CMDCLOSEOUTPUT),
+                        driveio_getiostatus(door, DRIVEIO_STATUSCLOSEDINPUT));
+    }
+  }
   hmi_display_frame("DRIVEIO", text, len);
 }
 
@@ -469,11 +643,10 @@ void show_page_driveio()
 */
 void show_page_hmi()
 {
-  String text[3] = {
-      "Led 1: " + String(hmi_getled(HMI_LED_DOOROPEN)),
-      "Led 2: " + String(hmi_getled(HMI_LED_SYSTEMINFO)),
-      "Led 3: " + String(hmi_getled(HMI_LED_DOORCLOSED)),
-  };
+  DisplayLine text[3];
+  text[0].format("Led 1: %d", hmi_getled(HMI_LED_DOOROPEN));
+  text[1].format("Led 2: %d", hmi_getled(HMI_LED_SYSTEMINFO));
+  text[2].format("Led 3: %d", hmi_getled(HMI_LED_DOORCLOSED));
   int len = sizeof(text) / sizeof(text[0]);
   hmi_display_frame("HMI", text, len);
 }
@@ -483,17 +656,17 @@ void show_page_hmi()
 */
 void show_page_mqtt()
 {
-  String text[3] = {
-      "Msg.Sent: " + String(mqtt_getpacketssent()),
-      "Msg.Received: " + String(mqtt_getpacketsreceived()),
-      "Connected: " + String(mqtt_isconnected()),
-  };
+  DisplayLine text[4];
+  text[0].format("Msg.Sent: %d", mqtt_getpacketssent());
+  text[1].format("Msg.Received: %d", mqtt_getpacketsreceived());
+  text[2].format("Conn: %d Saved: %lu", mqtt_isconnected(), mqtt_getheartbeatstats()->saved);
+  text[3].format("Queue: %u Rejected: %lu", cmdqueue_getstats()->depth, cmdqueue_getrejected());
   int len = sizeof(text) / sizeof(text[0]);
   hmi_display_frame("MQTT", text, len);
 }
 
 /*
-* Display the IP, Link status and Uptime
+* Display the IP, Link status, Uptime and the free ram (current and lowest)
 */
 void show_page_system()
 {
@@ -509,13 +682,11 @@ void show_page_system()
   mins=mins-(hours*60); 
   hours=hours-(days*24); 
 
-  char buffer[80];
-  sprintf(buffer, "%u.%02u:%02u:%02u", days, hours, mins, secs);
-  String text[3] = {
-      "IP: " + IPAddressToString(Ethernet.localIP()),
-      "Link: " + String(Ethernet.linkStatus()),
-      "Uptime: " + String(buffer),
-  };
+  DisplayLine text[4];
+  text[0].append("IP: ").append(IPAddressToString(hal_net_localip()));
+  text[1].format("Link: %d", hal_net_linkup());
+  text[2].format("Uptime: %u.%02u:%02u:%02u", days, hours, mins, secs);
+  text[3].format("RAM: %u min %u", memstats_getfree(), memstats_getminfree());
   int len = sizeof(text) / sizeof(text[0]);
   hmi_display_frame("System", text, len);
 }
\ No newline at end of file
@@ -0,0 +1,171 @@
+#include "hal.h"
+
+#include "config.h"
+#include "heapstats.h"
+#include "memstats.h"
+#include "mqtt.h"
+#include "payload.h"
+#include "fixedstring.h"
+
+// current values and watermarks
+unsigned int memFree = 0;
+unsigned int memMinFree = 0xFFFFFFFF;
+unsigned int memStackMax = 0;
+unsigned int memHeapSize = 0;
+unsigned int memHeapUsed = 0;
+unsigned int memFragmentation = 0;
+bool memIsLow = false;
+
+uint32_t prev_ms_memstats = 0;
+
+// forward declarations
+void memstats_sample();
+void memstats_analyze();
+void memstats_publish();
+
+/*
+* Paints the unused ram between the heap and the stack with a known pattern.
+* Must be called as early as possible in setup() - the deepest stack usage
+* is found later by searching the first byte which was overwritten.
+*/
+void memstats_init()
+{
+    hal_mem_paint(MEMSTATS_PAINTPATTERN, MEMSTATS_PAINTGUARD);
+    prev_ms_memstats = hal_millis();
+    memstats_sample();
+}
+
+/*
+* Samples the free memory in every pass and analyzes heap and stack in
+* the configured interval. Dropping below the low memory threshold raises
+* an alert, the alert is cleared if the free memory has recovered by 25%.
+* Both compare the current free memory, the watermark never rises again.
+*/
+void memstats_loop()
+{
+    memstats_sample();
+
+    if (hal_millis() - prev_ms_memstats >= (uint32_t)memPublishInterval_ms)
+    {
+        prev_ms_memstats = hal_millis();
+        memstats_analyze();
+        memstats_publish();
+    }
+
+    if (!memIsLow && (memFree < (unsigned int)memLowThreshold_bytes))
+    {
+        FixedString<80> line;
+        memIsLow = true;
+        hal_serial_println(line.format("WARNING: low memory (%u bytes free)", memFree).c_str());
+        mqtt_publish(MQTT_TOPICSYSTEMALERT, "lowmemory", false);
+    }
+    else if (memIsLow && (memFree > (unsigned int)memLowThreshold_bytes + memLowThreshold_bytes / 4))
+    {
+        memIsLow = false;
+        mqtt_publish(MQTT_TOPICSYSTEMALERT, "none", false);
+    }
+}
+
+/*
+* Free memory is the gap between heap and stack plus the free blocks
+* inside the heap. This is cheap enough to be called in every pass.
+*/
+void memstats_sample()
+{
+    hal_meminfo_t info;
+    hal_mem_info(&info, false);
+    memFree = info.free;
+    if (memFree < memMinFree)
+    {
+        memMinFree = memFree;
+    }
+}
+
+/*
+* Finds the stack high water mark and the fragmentation of the heap. The
+* fragmentation is the share of free heap memory which is not part of the
+* largest free block.
+*/
+void memstats_analyze()
+{
+    // search the first painted byte which was overwritten by the stack
+    memStackMax = hal_mem_stackmax(MEMSTATS_PAINTPATTERN);
+
+    hal_meminfo_t info;
+    hal_mem_info(&info, true);
+    memHeapSize = info.heapSize;
+    memHeapUsed = info.heapUsed;
+    memFragmentation = (info.heapFree > 0) ? 100 - (unsigned int)((unsigned long)info.largestFreeBlock * 100 / info.heapFree) : 0;
+}
+
+/*
+* Publishes the memory statistics as json or binary (see payload.h)
+*/
+void memstats_publish()
+{
+    PayloadWriter payload(MQTT_TOPICSYSTEMMEMORY, PAYLOAD_SCHEMAMEMORY);
+    payload.addUint("free", memFree);
+    payload.addUint("minfree", memMinFree);
+    payload.addUint("stackmax", memStackMax);
+    payload.addUint("heap", memHeapSize);
+    payload.addUint("heapused", memHeapUsed);
+    payload.addUint("fragmentation", memFragmentation);
+    payload.addUint("allocations", heapstats_getsteadyallocations());
+    payload.publish(false);
+}
+
+/*
+* Returns the free memory in bytes
+*/
+unsigned int memstats_getfree()
+{
+    return memFree;
+}
+
+/*
+* Returns the lowest free memory since start in bytes
+*/
+unsigned int memstats_getminfree()
+{
+    return memMinFree;
+}
+
+/*
+* Returns the deepest stack usage since start in bytes
+*/
+unsigned int memstats_getstackmax()
+{
+    return memStackMax;
+}
+
+/*
+* Returns the high water mark of the heap in bytes
+*/
+unsigned int memstats_getheapsize()
+{
+    return memHeapSize;
+}
+
+/*
+* Returns the heap memory in use in bytes
+*/
+unsigned int memstats_getheapused()
+{
+    return memHeapUsed;
+}
+
+/*
+* Returns the fragmentation of the free heap memory in percent
+*/
+unsigned int memstats_getfragmentation()
+{
+    return memFragmentation;
+}
+
+/*
+* Returns true if the free memory has dropped below the threshold
+*/
+bool memstats_islow()
+{
+    return memIsLow;
+}
\ No newline at end of file
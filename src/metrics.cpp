@@ -0,0 +1,490 @@
+#include "hal.h"
+
+#include "config.h"
+#include "driveio.h"
+#include "sensors.h"
+#include "memstats.h"
+#include "cmdqueue.h"
+#include "mqtt.h"
+#include "resync.h"
+#include "metrics.h"
+#include "idle.h"
+#include "buildfeatures.h"
+
+// states of the endpoint
+#define METRICS_IDLE        0   // waiting for a client
+#define METRICS_REQUEST     1   // reading the request
+#define METRICS_RESPONSE    2   // streaming the response
+#define METRICS_CLOSING     3   // waiting for the client to close
+
+#define METRICS_HEADER200   "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nConnection: close\r\n\r\n"
+#define METRICS_HEADER404   "HTTP/1.0 404 Not Found\r\nConnection: close\r\n\r\n"
+
+// a metric with one sample or one sample per door (label door="1"...)
+struct metric_t
+{
+    const char *name;
+    const char *type;
+    bool perDoor;
+    void (*value)(int index, MetricsLine &line);
+};
+
+uint8_t metricsState = METRICS_IDLE;
+uint32_t prev_ms_accept = 0;
+uint32_t prev_ms_accepted = 0;
+uint32_t prev_ms_closing = 0;
+metrics_stats_t metricsStats;
+
+// request line and the number of consecutive line ends (2 = end of the header)
+FixedString<24> metricsRequest;
+bool metricsRequestLineDone = false;
+uint8_t metricsLineEnds = 0;
+
+// position of the response: -1 is the http header, then the metric and its
+// sample (-1 is the type comment). Only the current line is held in ram.
+bool metricsFound = false;
+int metricsIndex = -1;
+int metricsSample = -1;
+MetricsLine metricsLine;
+size_t metricsPos = 0;
+
+// duration of the main loop passes since the last scrape
+uint32_t prev_us_loop = 0;
+unsigned long loopPasses = 0;
+unsigned long loopWindowPasses = 0;
+uint64_t loopWindowTotal_us = 0;
+uint32_t loopWindowMax_us = 0;
+
+// door cycles (a door which reached the closed state after it was open or moving)
+unsigned long doorCycles[DOOR_COUNT];
+int doorLastStatus[DOOR_COUNT];
+
+/*
+* value functions of the metrics
+*/
+void metric_uptime(int index, MetricsLine &line)
+{
+    line.appendf("%lu", uptime_in_secs);
+}
+
+void metric_looppasses(int index, MetricsLine &line)
+{
+    line.appendf("%lu", loopPasses);
+}
+
+void metric_loopmean(int index, MetricsLine &line)
+{
+    line.appendf("%lu", loopWindowPasses ? (unsigned long)(loopWindowTotal_us / loopWindowPasses) : 0UL);
+}
+
+void metric_loopmax(int index, MetricsLine &line)
+{
+    line.appendf("%lu", (unsigned long)loopWindowMax_us);
+}
+
+void metric_doorstate(int index, MetricsLine &line)
+{
+    line.appendf("%d", driveio_getcurrentdoorstatus(index));
+}
+
+void metric_doorcycles(int index, MetricsLine &line)
+{
+    line.appendf("%lu", doorCycles[index]);
+}
+
+void metric_mqttconnected(int index, MetricsLine &line)
+{
+    line.appendf("%d", mqtt_isconnected() ? 1 : 0);
+}
+
+void metric_mqttconnects(int index, MetricsLine &line)
+{
+    line.appendf("%lu", resync_getstats()->connects);
+}
+
+void metric_mqttsent(int index, MetricsLine &line)
+{
+    line.appendf("%d", mqtt_getpacketssent());
+}
+
+void metric_mqttreceived(int index, MetricsLine &line)
+{
+    line.appendf("%d", mqtt_getpacketsreceived());
+}
+
+void metric_mqttretransmits(int index, MetricsLine &line)
+{
+    line.appendf("%lu", mqtt_getdeliverystats()->retransmits);
+}
+
+void metric_mqttexpired(int index, MetricsLine &line)
+{
+    line.appendf("%lu", mqtt_getdeliverystats()->expired);
+}
+
+void metric_commandsaccepted(int index, MetricsLine &line)
+{
+    line.appendf("%lu", cmdqueue_getstats()->accepted);
+}
+
+void metric_commandsrejected(int index, MetricsLine &line)
+{
+    line.appendf("%lu", cmdqueue_getrejected());
+}
+
+void metric_temperature(int index, MetricsLine &line)
+{
+    line.appendfloat(sensors_get_temperature(), 2);
+}
+
+void metric_humidity(int index, MetricsLine &line)
+{
+    line.appendfloat(sensors_get_humidity(), 2);
+}
+
+void metric_pressure(int index, MetricsLine &line)
+{
+    line.appendfloat(sensors_get_pressure(), 3);
+}
+
+void metric_illuminance(int index, MetricsLine &line)
+{
+    line.appendfloat(sensors_get_illuminance(), 2);
+}
+
+void metric_memfree(int index, MetricsLine &line)
+{
+    line.appendf("%u", memstats_getfree());
+}
+
+void metric_memminfree(int index, MetricsLine &line)
+{
+    line.appendf("%u", memstats_getminfree());
+}
+
+void metric_memstackmax(int index, MetricsLine &line)
+{
+    line.appendf("%u", memstats_getstackmax());
+}
+
+void metric_memheapused(int index, MetricsLine &line)
+{
+    line.appendf("%u", memstats_getheapused());
+}
+
+// seconds with ms resolution - a float would lose the ms after a few hours
+void metric_seconds(uint64_t us, MetricsLine &line)
+{
+    uint64_t ms = us / 1000;
+    line.appendf("%lu.%03lu", (unsigned long)(ms / 1000), (unsigned long)(ms % 1000));
+}
+
+void metric_awake(int index, MetricsLine &line)
+{
+    metric_seconds(idle_getstats()->awake_us, line);
+}
+
+void metric_asleep(int index, MetricsLine &line)
+{
+    metric_seconds(idle_getstats()->idle_us + idle_getstats()->standby_us, line);
+}
+
+void metric_scrapes(int index, MetricsLine &line)
+{
+    line.appendf("%lu", metricsStats.scrapes);
+}
+
+const metric_t metrics[] = {
+    {"gdc_uptime_seconds", "gauge", false, metric_uptime},
+    {"gdc_loop_passes_total", "counter", false, metric_looppasses},
+    {"gdc_loop_duration_mean_us", "gauge", false, metric_loopmean},
+    {"gdc_loop_duration_max_us", "gauge", false, metric_loopmax},
+    {"gdc_door_state", "gauge", true, metric_doorstate},
+    {"gdc_door_cycles_total", "counter", true, metric_doorcycles},
+    {"gdc_mqtt_connected", "gauge", false, metric_mqttconnected},
+    {"gdc_mqtt_connects_total", "counter", false, metric_mqttconnects},
+    {"gdc_mqtt_packets_sent_total", "counter", false, metric_mqttsent},
+    {"gdc_mqtt_packets_received_total", "counter", false, metric_mqttreceived},
+    {"gdc_mqtt_retransmits_total", "counter", false, metric_mqttretransmits},
+    {"gdc_mqtt_expired_total", "counter", false, metric_mqttexpired},
+    {"gdc_commands_accepted_total", "counter", false, metric_commandsaccepted},
+    {"gdc_commands_rejected_total", "counter", false, metric_commandsrejected},
+#if GDC_FEATURE_SENSORS
+    {"gdc_temperature_celsius", "gauge", false, metric_temperature},
+    {"gdc_humidity_percent", "gauge", false, metric_humidity},
+    {"gdc_pressure_kilopascals", "gauge", false, metric_pressure},
+    {"gdc_illuminance_lux", "gauge", false, metric_illuminance},
+#endif
+    {"gdc_memory_free_bytes", "gauge", false, metric_memfree},
+    {"gdc_memory_minfree_bytes", "gauge", false, metric_memminfree},
+    {"gdc_memory_stackmax_bytes", "gauge", false, metric_memstackmax},
+    {"gdc_memory_heapused_bytes", "gauge", false, metric_memheapused},
+    {"gdc_awake_seconds_total", "counter", false, metric_awake},
+    {"gdc_asleep_seconds_total", "counter", false, metric_asleep},
+    {"gdc_metrics_scrapes_total", "counter", false, metric_scrapes}};
+
+#define METRICS_COUNT   (int)(sizeof(metrics) / sizeof(metrics[0]))
+
+/*
+* Starts listening on metricsPort
+*/
+void metrics_init()
+{
+    memset(&metricsStats, 0, sizeof(metricsStats));
+    for (int door = 0; door < DOOR_COUNT; door++)
+    {
+        doorCycles[door] = 0;
+        doorLastStatus[door] = driveio_getcurrentdoorstatus(door);
+    }
+    metricsState = METRICS_IDLE;
+    if (!hal_server_begin(metricsPort))
+    {
+        hal_serial_println("ERROR: Metrics endpoint can't be started");
+    }
+}
+
+/*
+* Is called by loop() for every status change of a door
+*/
+void metrics_doorstatus(int door, int status)
+{
+    if ((status == DOORSTATUSCLOSED) && ((doorLastStatus[door] == DOORSTATUSOPEN) || (doorLastStatus[door] == DOORSTATUSMOVINGORSTOPPED)))
+    {
+        doorCycles[door]++;
+    }
+    doorLastStatus[door] = status;
+}
+
+/*
+* Renders the next line of the response. Returns false at the end.
+*/
+bool metrics_nextline()
+{
+    metricsLine.clear();
+    metricsPos = 0;
+    if (metricsIndex < 0)
+    {
+        metricsLine.append(metricsFound ? METRICS_HEADER200 : METRICS_HEADER404);
+        metricsIndex = metricsFound ? 0 : METRICS_COUNT;
+        return true;
+    }
+    while (metricsIndex < METRICS_COUNT)
+    {
+        const metric_t &metric = metrics[metricsIndex];
+        if (metricsSample < 0)
+        {
+            metricsLine.format("# TYPE %s %s\n", metric.name, metric.type);
+            metricsSample = 0;
+            return true;
+        }
+        if (metricsSample < (metric.perDoor ? DOOR_COUNT : 1))
+        {
+            metricsLine.append(metric.name);
+            if (metric.perDoor)
+            {
+                metricsLine.appendf("{door=\"%d\"}", metricsSample + 1);
+            }
+            metricsLine.append(' ');
+            metric.value(metricsSample, metricsLine);
+            metricsLine.append('\n');
+            metricsSample++;
+            return true;
+        }
+        metricsIndex++;
+        metricsSample = -1;
+    }
+    return false;
+}
+
+/*
+* Reads the request until the end of its header. Only the request line is
+* kept.
+*/
+void metrics_readrequest()
+{
+    uint8_t buffer[32];
+    int available = hal_server_available();
+    while ((available > 0) && (metricsState == METRICS_REQUEST))
+    {
+        int count = hal_server_read(buffer, ((size_t)available < sizeof(buffer)) ? available : sizeof(buffer));
+        if (count <= 0)
+        {
+            return;
+        }
+        available -= count;
+        for (int i = 0; (i < count) && (metricsState == METRICS_REQUEST); i++)
+        {
+            char c = buffer[i];
+            if (c == '\n')
+            {
+                metricsRequestLineDone = true;
+                metricsLineEnds++;
+            }
+            else if (c != '\r')
+            {
+                metricsLineEnds = 0;
+                if (!metricsRequestLineDone)
+                {
+                    metricsRequest.append(c);
+                }
+            }
+            if (metricsLineEnds == 2)
+            {
+                const char *request = metricsRequest.c_str();
+                metricsFound = (strncmp(request, "GET /metrics", 12) == 0) && ((request[12] == ' ') || (request[12] == 0));
+                metricsIndex = -1;
+                metricsSample = -1;
+                metricsLine.clear();
+                metricsPos = 0;
+                metricsState = METRICS_RESPONSE;
+            }
+        }
+    }
+}
+
+/*
+* Writes the response until the pass budget is used or the send buffer of
+* the socket is full. Returns false at the end of the response.
+*/
+bool metrics_writeresponse()
+{
+    size_t budget = METRICS_MAXBYTESPERPASS;
+    while (budget > 0)
+    {
+        if ((metricsPos == metricsLine.length()) && !metrics_nextline())
+        {
+            return false;
+        }
+        size_t count = metricsLine.length() - metricsPos;
+        size_t writable = hal_server_writable();
+        count = (count < writable) ? count : writable;
+        count = (count < budget) ? count : budget;
+        if (count == 0)
+        {
+            return true;
+        }
+        size_t written = hal_server_write((const uint8_t *)metricsLine.c_str() + metricsPos, count);
+        metricsPos += written;
+        budget -= written;
+        metricsStats.bytes += written;
+        if (written < count)
+        {
+            return true;
+        }
+    }
+    return true;
+}
+
+/*
+* Starts closing the connection, the socket is freed by metrics_loop()
+*/
+void metrics_close()
+{
+    hal_server_disconnect();
+    prev_ms_closing = hal_millis();
+    metricsState = METRICS_CLOSING;
+}
+
+/*
+* Ends a scrape: the loop timings start a new window
+*/
+void metrics_endscrape()
+{
+    if (metricsFound)
+    {
+        metricsStats.scrapes++;
+        loopWindowPasses = 0;
+        loopWindowTotal_us = 0;
+        loopWindowMax_us = 0;
+    }
+    else
+    {
+        metricsStats.rejected++;
+    }
+    metrics_close();
+}
+
+/*
+* Measures the duration of the loop passes and serves the endpoint. Must be
+* called once per pass of loop().
+*/
+void metrics_loop()
+{
+    uint32_t now_us = hal_micros();
+    if (loopPasses > 0)
+    {
+        // the low-power wait between the passes doesn't count
+        uint32_t duration_us = now_us - prev_us_loop - idle_getstats()->lastSleep_us;
+        loopWindowPasses++;
+        loopWindowTotal_us += duration_us;
+        if (duration_us > loopWindowMax_us)
+        {
+            loopWindowMax_us = duration_us;
+        }
+    }
+    prev_us_loop = now_us;
+    loopPasses++;
+
+    switch (metricsState)
+    {
+    case METRICS_IDLE:
+        // polling the server socket costs a few spi transfers, so new
+        // clients are looked for only every METRICS_ACCEPTINTERVAL_MS
+        if (hal_millis() - prev_ms_accept < METRICS_ACCEPTINTERVAL_MS)
+        {
+            break;
+        }
+        prev_ms_accept = hal_millis();
+        if (hal_server_accept())
+        {
+            prev_ms_accepted = hal_millis();
+            metricsRequest.clear();
+            metricsRequestLineDone = false;
+            metricsLineEnds = 0;
+            metricsState = METRICS_REQUEST;
+        }
+        break;
+    case METRICS_REQUEST:
+        metrics_readrequest();
+        break;
+    case METRICS_RESPONSE:
+        if (!metrics_writeresponse())
+        {
+            metrics_endscrape();
+        }
+        break;
+    case METRICS_CLOSING:
+        if (hal_server_closed() || (hal_millis() - prev_ms_closing >= METRICS_CLOSETIMEOUT_MS))
+        {
+            hal_server_stop();
+            metricsState = METRICS_IDLE;
+        }
+        break;
+    }
+
+    // a client which doesn't send its request or doesn't read the response
+    bool serving = (metricsState == METRICS_REQUEST) || (metricsState == METRICS_RESPONSE);
+    if (serving && ((hal_millis() - prev_ms_accepted > METRICS_TIMEOUT_MS) || !hal_server_connected()))
+    {
+        metricsStats.dropped++;
+        metrics_close();
+    }
+
+    // a client is served without waiting, the close is polled
+    if (metricsState == METRICS_IDLE)
+    {
+        idle_due(IDLE_SOURCENETWORK, prev_ms_accept + METRICS_ACCEPTINTERVAL_MS);
+    }
+    else
+    {
+        idle_due(IDLE_SOURCENETWORK, serving ? hal_millis() : hal_millis() + IDLE_NETPOLL_MS);
+    }
+}
+
+/*
+* Returns the counters of the endpoint
+*/
+const metrics_stats_t *metrics_getstats()
+{
+    return &metricsStats;
+}
@@ -1,31 +1,230 @@
 // Include libraries
-#include <Arduino.h>
-#include <MQTTPubSubClient.h>
-#include <Ethernet.h>
-#include <ArduinoJson.h>
+#include "hal.h"
 
 #include "config.h"
 #include "mqtt.h"
+#include "mqttclient.h"
+#include "driveio.h"
+#include "trace.h"
+#include "cmdqueue.h"
+#include "resync.h"
+#include "payload.h"
+#include "postmortem.h"
+#include "settings.h"
+#include "update.h"
+#include "state.h"
+#include "idle.h"
 
-// MQTT broker/topic configuration
-// 256 bytes need to publish the sensors topic
-MQTTPubSub::PubSubClient<256> mqttClient;
+// subscriptions of a session: the command and the retained state topic of
+// every door, uptime request, settings, update chunks, state request and
+// the retained info and status topics
+#define MQTT_NUMSUBSCRIPTIONS   (2 * DOOR_COUNT + 6)
+static_assert(MQTT_NUMSUBSCRIPTIONS <= MQTTCLIENT_MAXSUBSCRIPTIONS, "MQTTCLIENT_MAXSUBSCRIPTIONS is too small for DOOR_COUNT");
+
+// states of the broker connection
+#define MQTT_STATEDISCONNECTED  0   // waiting for the next connect attempt
+#define MQTT_STATECONNECTING    1   // CONNECT sent, waiting for the CONNACK
+#define MQTT_STATERESYNC        2   // connected, receiving the retained topics
+#define MQTT_STATECONNECTED     3
 
-String command ="";
+// MQTT broker/topic configuration
+// 256 bytes need to publish the sensors topic (see MQTTCLIENT_BUFFERSIZE)
+MQTTClient mqttClient;
 
 int numPacketsReceived = 0;
 int numPacketsSent = 0;
 
-bool mqttFirstRun = true;
 bool mqttInitialized = false;
+bool mqttAttempted = false;         // the first connect attempt has ended
+
+uint8_t mqttState = MQTT_STATEDISCONNECTED;
+uint32_t prev_ms_state = 0;
+uint32_t mqttReconnectDelay_ms = 0;
+uint8_t mqttReconnectAttempt = 0;
+
+// heartbeat: seconds connected, time of the last uptime publish and a
+// pending uptime request
+mqtt_heartbeatstats_t heartbeatStats;
+unsigned long heartbeatSeconds = 0;
+uint32_t prev_ms_heartbeat = 0;
+uint32_t prev_ms_uptimepublish = 0;
+bool heartbeatRequested = false;
+
+// path of every topic below the topic prefix in the order of the topic ids.
+// The control topics are listed once and repeated for every door.
+const char *const mqttTopicPaths[MQTT_TOPICFIRSTDOOR + MQTT_NUMDOORTOPICS] = {
+    "system/uptime",
+    "system/uptime/get",
+    "system/info",
+    "system/status",
+    "system/memory",
+    "system/alert",
+    "system/sensors",
+    "system/snapshot",
+    "diag/trace",
+    "diag/commandqueue",
+    "diag/delivery",
+    "system/boot",
+    "diag/watchdog",
+    "diag/crash",
+    "config/set",
+    "config/active",
+    "update/chunk",
+    "update/status",
+    "state",
+    "state/delta",
+    "state/get",
+    "diag/idle",
+    "control/setnewdoorstate",
+    "control/getnewdoorstate",
+    "control/getcurrentdoorstate",
+    "control/commandsource"};
+
+// full topic names of this device - built by mqtt_buildtopics() whenever the
+// topic prefix changes. The client keeps pointers to them (will, subscriptions).
+char mqttTopicNames[MQTT_NUMTOPICS][MQTTCLIENT_MAXTOPICLENGTH];
+
+// forward declarations
+void mqtt_connect();
+void mqtt_subscribe(mqtt_topic_t topic, mqttclient_callback_t callback, uint8_t qos = 0);
+void mqtt_connected();
+void mqtt_connectfailed();
+void mqtt_schedulereconnect();
+void mqtt_resync();
+void mqtt_heartbeat();
+void mqtt_send(mqtt_topic_t topic, const uint8_t* payload, size_t size, bool retain);
+
+// handler for mqtt receive - one instance per door
+template <int Door>
+void onTopicControlSetNewDoorStateReceived(const char *payload, const size_t size);
+
+/*
+* Subscribes the command topics of the doors 0..Count-1. The handlers are
+* instantiated at compile time, so no door index needs to be looked up when
+* a command is received.
+*/
+template <int Count>
+void subscribe_doors();
+
+template <>
+void subscribe_doors<0>()
+{
+}
+
+template <int Count>
+void subscribe_doors()
+{
+    subscribe_doors<Count - 1>();
+    mqtt_subscribe(mqtt_doortopic(Count - 1, MQTT_TOPICCONTROLSETNEWDOORSTATE), &onTopicControlSetNewDoorStateReceived<Count - 1>, mqttDoorTopicQos);
+}
+
+/*
+* Handler of an uptime request - the uptime is published by the next loop
+*/
+void onTopicUptimeRequestReceived(const char *payload, const size_t size)
+{
+    heartbeatRequested = true;
+    heartbeatStats.requests++;
+}
+
+/*
+* Handler of the retained settings - delivered again after every connect
+*/
+void onTopicConfigReceived(const char *payload, const size_t size)
+{
+    numPacketsReceived++;
+    settings_apply(payload, size, SETTINGS_SOURCEBROKER);
+}
+
+/*
+* Handler of a message on a subscribed topic which was too large for the
+* receive buffer of the client - a settings document is rejected
+*/
+void onOversizeReceived(const char *topic, const size_t size)
+{
+    FixedString<96> line;
+    numPacketsReceived++;
+    hal_serial_println(line.format("WARNING: Dropped %u bytes received on %s", (unsigned int)size, topic).c_str());
+    if (strcmp(topic, mqtt_topicname(MQTT_TOPICCONFIGSET)) == 0)
+    {
+        settings_rejectoversize(SETTINGS_SOURCEBROKER);
+    }
+}
+
+/*
+* Handler of a request of the full state document
+*/
+void onTopicStateRequestReceived(const char *payload, const size_t size)
+{
+    numPacketsReceived++;
+    state_request();
+}
+
+/*
+* Handler of the chunks of a firmware image - written to the SD card right
+* away (see update.h)
+*/
+void onTopicUpdateChunkReceived(const char *payload, const size_t size)
+{
+    numPacketsReceived++;
+    update_chunk((const uint8_t *)payload, size);
+}
+
+// handler for the retained topics of the device delivered by the broker
+template <mqtt_topic_t Topic>
+void onRetainedTopicReceived(const char *payload, const size_t size)
+{
+    resync_received(Topic, payload, size);
+}
+
+/*
+* Subscribes the retained topics of this device - the broker delivers its
+* copies of them right after the subscription. The door state topics of the
+* doors 0..Count-1 are subscribed in the same way as the command topics.
+*/
+template <int Count>
+void subscribe_retained();
+
+template <>
+void subscribe_retained<0>()
+{
+    mqtt_subscribe(MQTT_TOPICSYSTEMINFO, &onRetainedTopicReceived<MQTT_TOPICSYSTEMINFO>);
+    mqtt_subscribe(MQTT_TOPICSYSTEMSTATUS, &onRetainedTopicReceived<MQTT_TOPICSYSTEMSTATUS>);
+}
+
+template <int Count>
+void subscribe_retained()
+{
+    subscribe_retained<Count - 1>();
+    mqtt_subscribe(mqtt_doortopic(Count - 1, MQTT_TOPICCONTROLGETCURRENTDOORSTATE),
+                   &onRetainedTopicReceived<mqtt_doortopic(Count - 1, MQTT_TOPICCONTROLGETCURRENTDOORSTATE)>);
+}
 
-// handler for mqtt receive
-void onTopicControlSetNewDoorStateReceived(const String &payload, const size_t size);
-void mqtt_publish(String topic, String payload);
+/*
+* Builds the full names of all topics from the topic prefix. The door number
+* is inserted after the prefix for all doors but the first one.
+*/
+void mqtt_buildtopics()
+{
+    for (int topic = 0; topic < MQTT_NUMTOPICS; topic++)
+    {
+        int door = (topic < MQTT_TOPICFIRSTDOOR) ? 0 : (topic - MQTT_TOPICFIRSTDOOR) / MQTT_NUMDOORTOPICS;
+        const char *path = mqtt_topicpath((mqtt_topic_t)topic);
+        if (door == 0)
+        {
+            snprintf(mqttTopicNames[topic], MQTTCLIENT_MAXTOPICLENGTH, "%s/%s", mqttTopicPrefix, path);
+        }
+        else
+        {
+            snprintf(mqttTopicNames[topic], MQTTCLIENT_MAXTOPICLENGTH, "%s/" MQTT_TOPICDOORPREFIX "%d/%s", mqttTopicPrefix, door + 1, path);
+        }
+    }
+}
 
 /*
-* Creates the connection to the MQTT broker and performs the authentificaton. The 
-* topics will be initially published and the subscriptions will be created
+* Sets up the client, the first connect to the MQTT broker is started by
+* the next mqtt_loop(). If the broker can't be reached, mqtt_loop() retries
+* in the background.
 */
 void mqtt_init()
 {
@@ -34,127 +233,468 @@ void mqtt_init()
     mqttClient.setCleanSession(true);
 
     // Lastwill topic is equal to system status topic
-    String mqttLastWillTopic = MQTT_TOPICSYSTEMSTATUS;
-    mqttClient.setWill(mqttLastWillTopic, mqttLastWillMsg, true, 0);
+    mqtt_buildtopics();
+    mqttClient.setWill(mqtt_topicname(MQTT_TOPICSYSTEMSTATUS), mqttLastWillMsg, true, 0);
+    mqttClient.setOversizeCallback(onOversizeReceived);
 
-    // Connect to the broker
-    Serial.print("INIT: Connecting mqtt broker...");
-    while (!ethClient.connect(mqttBrokerAddress, mqttBrokerPort))
+    // the jitter of the reconnects differs from device to device
+    resync_init(resync_hash(mqttClientID, strlen(mqttClientID)) ^ hal_micros());
+    mqttReconnectAttempt = 0;
+    mqttReconnectDelay_ms = 0;
+    mqttAttempted = false;
+    mqttState = MQTT_STATEDISCONNECTED;
+    prev_ms_state = hal_millis();
+}
+
+/*
+* Opens the socket to the broker and sends the CONNECT packet, the CONNACK
+* is awaited by mqtt_loop()
+*/
+void mqtt_connect()
+{
+    hal_serial_println("RUN: Connecting mqtt broker");
+    mqttClient.begin();
+    if (!hal_tcp_connect(mqttBrokerAddress, mqttBrokerPort) || !mqttClient.connect(mqttClientID, mqttUsername, mqttPassword))
     {
-        Serial.print(".");
-        delay(1000);
+        mqtt_connectfailed();
+        return;
     }
-    Serial.println(" success");
+    mqttState = MQTT_STATECONNECTING;
+    prev_ms_state = hal_millis();
+}
+
+/*
+* The broker hasn't answered or has refused the connection - the next
+* attempt is scheduled
+*/
+void mqtt_connectfailed()
+{
+    mqttAttempted = true;
+    hal_tcp_stop();
+    mqtt_schedulereconnect();
+    FixedString<80> line;
+    hal_serial_println(line.format("RUN: Connecting mqtt broker failed, next attempt in %lu ms", (unsigned long)mqttReconnectDelay_ms).c_str());
+}
 
-    // Authenticate the client
-    mqttClient.begin(ethClient);
-    Serial.print("INIT: Logging into mqtt broker...");
-    while (!mqttClient.connect(mqttClientID, mqttUsername, mqttPassword))
+/*
+* The broker has accepted the connection - the command topics and the
+* retained topics of the device are subscribed and the resynchronization
+* starts
+*/
+void mqtt_connected()
+{
+    hal_serial_println("RUN: Connected to mqtt broker");
+    postmortem_event("mqtt connected");
+
+    mqttInitialized = true;
+    mqttAttempted = true;
+    mqttReconnectAttempt = 0;
+
+    // Subscribe command topic of every door, then learn which retained
+    // topics the broker holds
+    subscribe_doors<DOOR_COUNT>();
+    mqtt_subscribe(MQTT_TOPICSYSTEMUPTIMEREQUEST, &onTopicUptimeRequestReceived);
+    mqtt_subscribe(MQTT_TOPICCONFIGSET, &onTopicConfigReceived);
+    mqtt_subscribe(MQTT_TOPICUPDATECHUNK, &onTopicUpdateChunkReceived, 1);
+    mqtt_subscribe(MQTT_TOPICSTATEREQUEST, &onTopicStateRequestReceived);
+    resync_begin();
+    subscribe_retained<DOOR_COUNT>();
+    mqttState = MQTT_STATERESYNC;
+    prev_ms_state = hal_millis();
+}
+
+/*
+* Subscribes a topic of this device - a failed subscription is logged, the
+* topic is too long (MQTTCLIENT_MAXTOPICLENGTH) or the connection is lost
+*/
+void mqtt_subscribe(mqtt_topic_t topic, mqttclient_callback_t callback, uint8_t qos)
+{
+    if (!mqttClient.subscribe(mqtt_topicname(topic), callback, qos))
     {
-        Serial.print(".");
-        delay(1000);
+        FixedString<96> line;
+        hal_serial_println(line.format("ERROR: Subscribing %s failed", mqtt_topicname(topic)).c_str());
     }
-    Serial.println(" success");
+}
 
-    mqttInitialized = true;
-    mqttFirstRun = true;
+/*
+* Schedules the next connect attempt with an increasing, randomized delay
+*/
+void mqtt_schedulereconnect()
+{
+    mqttReconnectDelay_ms = resync_reconnectdelay(mqttReconnectAttempt);
+    if (mqttReconnectAttempt < 255)
+    {
+        mqttReconnectAttempt++;
+    }
+    mqttState = MQTT_STATEDISCONNECTED;
+    prev_ms_state = hal_millis();
+}
 
-    // Subscribe command topic
-    mqttClient.subscribe(MQTT_TOPICCONTROLSETNEWDOORSTATE, &onTopicControlSetNewDoorStateReceived);
+/*
+* Ends the resynchronization: publishes the retained topics the broker
+* doesn't hold with the current payload and a snapshot of the device state
+*/
+void mqtt_resync()
+{
+    mqttClient.unsubscribe(mqtt_topicname(MQTT_TOPICSYSTEMINFO));
+    mqttClient.unsubscribe(mqtt_topicname(MQTT_TOPICSYSTEMSTATUS));
+    for (int door = 0; door < DOOR_COUNT; door++)
+    {
+        mqttClient.unsubscribe(mqtt_topicname(mqtt_doortopic(door, MQTT_TOPICCONTROLGETCURRENTDOORSTATE)));
+    }
+
+    PayloadWriter info(MQTT_TOPICSYSTEMINFO, PAYLOAD_SCHEMAINFO);
+    info.addString("application", application);
+    info.addString("version", version);
+    info.addString("author", author);
+    info.end();
+    if (resync_isdivergent(MQTT_TOPICSYSTEMINFO, info.data(), info.size()))
+    {
+        info.publish(true);
+    }
+    if (resync_isdivergent(MQTT_TOPICSYSTEMSTATUS, mqttFirstWillMsg, strlen(mqttFirstWillMsg)))
+    {
+        mqtt_publish(MQTT_TOPICSYSTEMSTATUS, mqttFirstWillMsg, true);
+        heartbeatStats.statusPublishes++;
+    }
+
+    // the door state is retained only if the door is open or closed
+    for (int door = 0; door < DOOR_COUNT; door++)
+    {
+        const char *state = mqtt_doorstate(door);
+        mqtt_topic_t topic = mqtt_doortopic(door, MQTT_TOPICCONTROLGETCURRENTDOORSTATE);
+        if (((driveio_getcurrentdoorstatus(door) == DOORSTATUSOPEN) || (driveio_getcurrentdoorstatus(door) == DOORSTATUSCLOSED)) &&
+            resync_isdivergent(topic, state, strlen(state)))
+        {
+            mqtt_publish(topic, state, true);
+        }
+    }
+
+    // snapshot, e.g. {"uptime":42,"connects":2,"resent":1,"skipped":2,"doors":["closed"]}
+    const resync_stats_t *stats = resync_getstats();
+    PayloadWriter snapshot(MQTT_TOPICSYSTEMSNAPSHOT, PAYLOAD_SCHEMASNAPSHOT);
+    snapshot.addUint("uptime", uptime_in_secs);
+    snapshot.addUint("connects", stats->connects);
+    snapshot.addUint("resent", stats->resent);
+    snapshot.addUint("skipped", stats->skipped);
+    snapshot.beginArray("doors", DOOR_COUNT);
+    for (int door = 0; door < DOOR_COUNT; door++)
+    {
+        snapshot.addString(NULL, mqtt_doorstate(door));
+    }
+    snapshot.endArray();
+    snapshot.publish(false);
+
+    // the uptime follows right after the connect
+    heartbeatRequested = true;
+    prev_ms_heartbeat = hal_millis();
+    mqttState = MQTT_STATECONNECTED;
+}
+
+/*
+* Returns the current state of a door as topic value
+*/
+const char* mqtt_doorstate(int door)
+{
+    switch (driveio_getcurrentdoorstatus(door))
+    {
+    case DOORSTATUSOPEN:
+        return MQTT_STATUSDOOROPEN;
+    case DOORSTATUSCLOSED:
+        return MQTT_STATUSDOORCLOSED;
+    default:
+        return MQTT_STATUSDOORUNKNOWN;
+    }
+}
+
+/*
+* Returns true if a correlation id can be published as it is: at most
+* TRACE_MAXIDLENGTH characters of [A-Za-z0-9._-] (json values aren't
+* escaped, see PayloadWriter)
+*/
+bool mqtt_validcorrelationid(const char *id)
+{
+    size_t length = 0;
+    for (; id[length] != 0; length++)
+    {
+        char c = id[length];
+        if (!isalnum((unsigned char)c) && (c != '.') && (c != '_') && (c != '-'))
+        {
+            return false;
+        }
+    }
+    return length <= TRACE_MAXIDLENGTH;
 }
 
 /*
  * This handler is called when a subscribed topic (the command) is received.
  */
-void onTopicControlSetNewDoorStateReceived(const String &payload, const size_t size)
+template <int Door>
+void onTopicControlSetNewDoorStateReceived(const char *payload, const size_t size)
 {
-    char buffer[80];
+    FixedString<128> line;
     numPacketsReceived++;
 
+    // split off the optional correlation id
+    FixedString<16> newCommand;
+    const char *correlationId = "";
+    const char *separator = strchr(payload, MQTT_CORRELATIONSEPARATOR);
+    if (separator != NULL)
+    {
+        newCommand.append(payload, separator - payload);
+        correlationId = separator + 1;
+    }
+    else
+    {
+        newCommand.append(payload);
+    }
+
     // Copy command topic back if payload is valid
-    if (!(payload == MQTT_COMMANDDOOROPEN || payload == MQTT_COMMANDDOORCLOSE))
+    line.format("RUN: Subscribe: set %s to %s", mqtt_topicname(mqtt_doortopic(Door, MQTT_TOPICCONTROLSETNEWDOORSTATE)), payload);
+    if (!(newCommand == MQTT_COMMANDDOOROPEN || newCommand == MQTT_COMMANDDOORCLOSE))
     {
-        sprintf(buffer,"RUN: Subscribe: set %s to %s (invalid)",MQTT_TOPICCONTROLSETNEWDOORSTATE, payload.c_str());
-        Serial.println(buffer);
+        line.append(" (invalid)");
+        hal_serial_println(line.c_str());
     }
     else
     {
-        sprintf(buffer,"RUN: Subscribe: set %s to %s",MQTT_TOPICCONTROLSETNEWDOORSTATE, payload.c_str());
-        Serial.println(buffer);
-        command = payload;
-      }
+        int doorCommand = (newCommand == MQTT_COMMANDDOOROPEN) ? DOORCOMMANDOPEN : DOORCOMMANDCLOSE;
+        uint16_t seq = cmdqueue_push(Door, doorCommand, CMDQUEUE_SOURCEREMOTE);
+        if (seq == 0)
+        {
+            line.append(" (rejected)");
+            hal_serial_println(line.c_str());
+            return;
+        }
+        line.appendf(" (seq=%u)", seq);
+        // an invalid id is replaced by a generated one
+        if (!mqtt_validcorrelationid(correlationId))
+        {
+            line.append(" (invalid id)");
+            correlationId = "";
+        }
+        hal_serial_println(line.c_str());
+        trace_begin(Door, doorCommand, correlationId);
+    }
+}
+
+/*
+ * Sets the client id and the topic prefix (e.g. "gdc/garage2") of this device.
+ * Must be called before mqtt_init(). Returns false if a value is too long.
+ */
+bool mqtt_setdevice(const char* clientId, const char* topicPrefix)
+{
+    if ((strlen(clientId) >= MQTT_MAXCLIENTIDLENGTH) || (strlen(topicPrefix) >= MQTT_MAXTOPICPREFIXLENGTH))
+    {
+        return false;
+    }
+    strcpy(mqttClientID, clientId);
+    strcpy(mqttTopicPrefix, topicPrefix);
+    mqtt_buildtopics();
+    return true;
 }
 
 /*
  * This function publishes a topic. It passes the parameters without change to the
- * underlying mqtt client but adds a serial print for logging purposes
+ * underlying mqtt client but adds a serial print for logging purposes.
  */
-void mqtt_publish(String topic, String payload, bool retain)
+void mqtt_publish(mqtt_topic_t topic, const char* payload, bool retain)
 {
-    Serial.println("RUN: Publish: set " + topic + " to " + payload);
-    mqttClient.publish(topic, payload, false, 0);
+    hal_serial_print("RUN: Publish: set ");
+    hal_serial_print(mqttTopicNames[topic]);
+    hal_serial_print(" to ");
+    hal_serial_println(payload);
+    mqtt_send(topic, (const uint8_t *)payload, strlen(payload), retain);
+}
+
+/*
+ * Publishes a binary payload (see payload.h), only its size is logged
+ */
+void mqtt_publish(mqtt_topic_t topic, const uint8_t* payload, size_t size, bool retain)
+{
+    FixedString<24> text;
+    hal_serial_print("RUN: Publish: set ");
+    hal_serial_print(mqttTopicNames[topic]);
+    hal_serial_print(" to ");
+    hal_serial_println(text.format("<%u bytes binary>", (unsigned int)size).c_str());
+    mqtt_send(topic, payload, size, retain);
+}
+
+/*
+ * Sends a payload - the door topics with mqttDoorTopicQos, all others with
+ * QoS 0 - and records the retained ones for the resynchronization. The
+ * door topics are mirrored in the aggregated state (see state.h). A payload
+ * which doesn't fit into the send buffer with the topic, e.g. with a long
+ * topic prefix, is dropped and neither counted nor recorded.
+ */
+void mqtt_send(mqtt_topic_t topic, const uint8_t* payload, size_t size, bool retain)
+{
+    bool sent = mqttClient.publish(mqttTopicNames[topic], payload, size, retain, (topic >= MQTT_TOPICFIRSTDOOR) ? mqttDoorTopicQos : 0);
+    state_published(topic, (const char *)payload, size);
+    if (!sent)
+    {
+        if (mqttClient.isConnected())
+        {
+            FixedString<96> line;
+            hal_serial_println(line.format("WARNING: Publish of %u bytes on %s failed", (unsigned int)size, mqttTopicNames[topic]).c_str());
+        }
+        return;
+    }
+    if (retain)
+    {
+        resync_published(topic, (const char *)payload, size);
+    }
     numPacketsSent++;
 }
 
 /*
- * Returns the
+ * Returns the full name of a topic of this device, e.g. "gdc/system/status"
  */
-String mqtt_getcommand()
+const char* mqtt_topicname(mqtt_topic_t topic)
 {
-    String retval = command;
-    command = "";
-    return retval;
+    return mqttTopicNames[topic];
 }
 
 /*
- * This function is manages the mqtt connection and publishes the uptime every sec.
+ * Returns the path of a topic below the topic prefix, e.g. "system/status".
+ * The control topics of all doors return the path of the first door.
+ */
+const char* mqtt_topicpath(mqtt_topic_t topic)
+{
+    if (topic >= MQTT_TOPICFIRSTDOOR)
+    {
+        return mqttTopicPaths[MQTT_TOPICFIRSTDOOR + (topic - MQTT_TOPICFIRSTDOOR) % MQTT_NUMDOORTOPICS];
+    }
+    return mqttTopicPaths[topic];
+}
+
+/*
+ * Publishes the heartbeat according to mqttHeartbeatPolicy
+ */
+void mqtt_heartbeat()
+{
+    bool second = (hal_millis() - prev_ms_heartbeat >= 1000);
+    if (second)
+    {
+        prev_ms_heartbeat += 1000;
+        heartbeatSeconds++;
+    }
+
+    bool publishUptime = heartbeatRequested;
+    if (mqttHeartbeatPolicy == MQTT_HEARTBEATFIXED)
+    {
+        publishUptime |= second;
+    }
+    else if (mqttUptimeInterval_ms > 0)
+    {
+        publishUptime |= (hal_millis() - prev_ms_uptimepublish >= (uint32_t)mqttUptimeInterval_ms);
+    }
+
+    if (publishUptime)
+    {
+        char buffer[12];
+        sprintf(buffer, "%lu", uptime_in_secs);
+        mqttClient.publish(mqtt_topicname(MQTT_TOPICSYSTEMUPTIME), buffer);
+        numPacketsSent++;
+        heartbeatStats.uptimePublishes++;
+        heartbeatRequested = false;
+        prev_ms_uptimepublish = hal_millis();
+    }
+    if ((mqttHeartbeatPolicy == MQTT_HEARTBEATFIXED) && second)
+    {
+        mqttClient.publish(mqtt_topicname(MQTT_TOPICSYSTEMSTATUS), mqttFirstWillMsg, true, 0);
+        resync_published(MQTT_TOPICSYSTEMSTATUS, mqttFirstWillMsg, strlen(mqttFirstWillMsg));
+        numPacketsSent++;
+        heartbeatStats.statusPublishes++;
+    }
+}
+
+/*
+* Returns true while the command pulse of a door is active
+*/
+bool mqtt_pulseactive()
+{
+    for (int door = 0; door < DOOR_COUNT; door++)
+    {
+        if (driveio_doorcommandactive(door))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * This function is manages the mqtt connection and publishes the heartbeat.
  */
 void mqtt_loop()
 {
-    // if connection to the broker is lost, try to reconnect
-    if (!mqttClient.isConnected())
+    if (mqttState == MQTT_STATEDISCONNECTED)
     {
-        Serial.println("RUN: Lost connection to mqtt broker. Trying to reconnect");
-        mqtt_init();
+        // reconnect after the delay - not during a command pulse, as the
+        // tcp connect may block for a moment (see hal_tcp_connect)
+        if ((hal_millis() - prev_ms_state >= mqttReconnectDelay_ms) && !mqtt_pulseactive())
+        {
+            mqtt_connect();
+        }
+    }
+    else if (mqttState == MQTT_STATECONNECTING)
+    {
+        mqttClient.update();
+        if (mqttClient.isConnected())
+        {
+            mqtt_connected();
+        }
+        else if (!mqttClient.isConnecting())
+        {
+            mqtt_connectfailed();
+        }
+    }
+    else if (!mqttClient.isConnected())
+    {
+        // if connection to the broker is lost, try to reconnect
+        mqtt_schedulereconnect();
+        postmortem_event("mqtt lost");
+        FixedString<80> line;
+        hal_serial_println(line.format("RUN: Lost connection to mqtt broker. Trying to reconnect in %lu ms", (unsigned long)mqttReconnectDelay_ms).c_str());
     }
     else
     {
         mqttClient.update();
-        if (mqttFirstRun)
+        if ((mqttState == MQTT_STATERESYNC) && (hal_millis() - prev_ms_state >= (uint32_t)mqttResyncWindow_ms))
         {
-            // global buffer for dealing with json packets
-            DynamicJsonDocument jsonDoc(128);
-            char jsonBuffer[128];
-
-            // prepare json payload for info topic
-            jsonDoc["application"] = application;
-            jsonDoc["version"] = version;
-            jsonDoc["author"] = author;
-
-            // serialize json document into global buffer and publish
-            // attention: size of buffer is limited to 256 bytes
-            serializeJson(jsonDoc, jsonBuffer);
-            mqttClient.publish(MQTT_TOPICSYSTEMINFO, jsonBuffer, true, 0);
+            mqtt_resync();
         }
 
-        // publish uptime message and online status every 1s
-        static uint32_t prev_ms = millis();
-        char buffer[12];
-        sprintf(buffer, "%lu", uptime_in_secs);
-        if (millis() > prev_ms + 1000)
+        if (mqttState == MQTT_STATECONNECTED)
         {
-            prev_ms = millis();
-            mqttClient.publish(MQTT_TOPICSYSTEMUPTIME, buffer);
-            numPacketsSent++;
-            
-            mqttClient.publish(MQTT_TOPICSYSTEMSTATUS, mqttFirstWillMsg, true, 0);
-            numPacketsSent++;
+            mqtt_heartbeat();
         }
-        mqttFirstRun = false;
     }
 
+    // the socket is polled, without a connection the reconnect is due
+    idle_due(IDLE_SOURCENETWORK, (mqttState == MQTT_STATEDISCONNECTED) ? prev_ms_state + mqttReconnectDelay_ms : hal_millis() + IDLE_NETPOLL_MS);
+
     // let other loops run
-    yield();
+    hal_yield();
+}
+
+/*
+* Returns the counters of the heartbeat
+*/
+const mqtt_heartbeatstats_t* mqtt_getheartbeatstats()
+{
+    unsigned long sent = heartbeatStats.uptimePublishes + heartbeatStats.statusPublishes;
+    heartbeatStats.saved = (2 * heartbeatSeconds > sent) ? 2 * heartbeatSeconds - sent : 0;
+    return &heartbeatStats;
+}
+
+/*
+* Returns the counters of the QoS 1 delivery
+*/
+const mqttclient_stats_t* mqtt_getdeliverystats()
+{
+    return mqttClient.getStats();
 }
 
 /*
@@ -179,8 +719,17 @@ int mqtt_getpacketssent()
 bool mqtt_isconnected()
 {
     bool retval = false;
-    if (mqttInitialized){
+    if (mqttInitialized && (mqttState != MQTT_STATEDISCONNECTED)){
         retval = mqttClient.isConnected();
     }
     return retval;
+}
+
+/*
+* Returns true once the first connect attempt has ended, whether the broker
+* has accepted it or not - the client retries in the background
+*/
+bool mqtt_hasattempted()
+{
+    return mqttAttempted;
 }
\ No newline at end of file
@@ -0,0 +1,692 @@
+#include "hal.h"
+
+#include "mqttclient.h"
+
+// states of the receive state machine
+#define RXSTATE_HEADER      0
+#define RXSTATE_LENGTH      1
+#define RXSTATE_BODY        2
+
+/*
+* Resets the session state and the subscriptions (the session is always
+* clean). The tcp socket must be connected to the broker (hal_tcp_connect)
+* before connect() is called.
+*/
+void MQTTClient::begin()
+{
+    connected = false;
+    connecting = false;
+    rxState = RXSTATE_HEADER;
+    numSubscriptions = 0;
+}
+
+/*
+* Sets the keep alive interval in seconds
+*/
+void MQTTClient::setKeepAliveTimeout(uint16_t seconds)
+{
+    keepAlive_s = seconds;
+}
+
+/*
+* Sets the clean session flag of the CONNECT packet
+*/
+void MQTTClient::setCleanSession(bool clean)
+{
+    cleanSession = clean;
+}
+
+/*
+* Sets the last will. Topic and message are not copied and must stay valid.
+*/
+void MQTTClient::setWill(const char *topic, const char *message, bool retain, uint8_t qos)
+{
+    willTopic = topic;
+    willMessage = message;
+    willRetain = retain;
+    willQos = qos;
+}
+
+/*
+* Sets the handler which is told about a message on a subscribed topic that
+* was too large for the receive buffer
+*/
+void MQTTClient::setOversizeCallback(mqttclient_oversizecallback_t callback)
+{
+    oversizeCallback = callback;
+}
+
+/*
+* Sends the CONNECT packet, the CONNACK of the broker is received by
+* update(). isConnecting() is true until it arrives or
+* MQTTCLIENT_CONNECTTIMEOUT_MS have passed, then isConnected() tells whether
+* the broker has accepted the connection. Returns false if the packet
+* can't be sent.
+*/
+bool MQTTClient::connect(const char *clientId, const char *username, const char *password)
+{
+    if (!hal_tcp_connected())
+    {
+        return false;
+    }
+
+    // calculate the length of variable header and payload
+    uint32_t length = 10 + 2 + strlen(clientId);
+    uint8_t flags = cleanSession ? 0x02 : 0x00;
+    if (willTopic != NULL)
+    {
+        length += 2 + strlen(willTopic) + 2 + strlen(willMessage);
+        flags |= 0x04 | (willQos << 3) | (willRetain ? 0x20 : 0x00);
+    }
+    if (username != NULL)
+    {
+        length += 2 + strlen(username);
+        flags |= 0x80;
+    }
+    if (password != NULL)
+    {
+        length += 2 + strlen(password);
+        flags |= 0x40;
+    }
+    if (length + 5 > MQTTCLIENT_BUFFERSIZE)
+    {
+        return false;
+    }
+
+    size_t pos = writeheader(MQTTCLIENT_CONNECT, length);
+    pos = writestring(pos, "MQTT");
+    txBuffer[pos++] = 4; // protocol level 3.1.1
+    txBuffer[pos++] = flags;
+    txBuffer[pos++] = keepAlive_s >> 8;
+    txBuffer[pos++] = keepAlive_s & 0xFF;
+    pos = writestring(pos, clientId);
+    if (willTopic != NULL)
+    {
+        pos = writestring(pos, willTopic);
+        pos = writestring(pos, willMessage);
+    }
+    if (username != NULL)
+    {
+        pos = writestring(pos, username);
+    }
+    if (password != NULL)
+    {
+        pos = writestring(pos, password);
+    }
+
+    rxState = RXSTATE_HEADER;
+    connected = false;
+    connackReceived = false;
+    if (!send(pos))
+    {
+        return false;
+    }
+    connecting = true;
+    prev_ms_connect = hal_millis();
+    return true;
+}
+
+/*
+* Receives the CONNACK of the broker. The connection attempt fails if it
+* doesn't arrive within MQTTCLIENT_CONNECTTIMEOUT_MS.
+*/
+void MQTTClient::receiveconnack()
+{
+    if (hal_tcp_connected())
+    {
+        receive();
+    }
+    if (!connackReceived)
+    {
+        if (!hal_tcp_connected() || (hal_millis() - prev_ms_connect >= MQTTCLIENT_CONNECTTIMEOUT_MS))
+        {
+            connecting = false;
+        }
+        return;
+    }
+    connecting = false;
+    connected = (connackCode == 0);
+    prev_ms_received = hal_millis();
+    pingOutstanding = false;
+
+    // the session is clean - publishes without PUBACK are sent again
+    for (uint8_t i = 0; connected && (i < MQTTCLIENT_MAXINFLIGHT); i++)
+    {
+        if (inflight[i].used)
+        {
+            sendinflight(inflight[i]);
+        }
+    }
+}
+
+/*
+* Sends the DISCONNECT packet and closes the network connection
+*/
+void MQTTClient::disconnect()
+{
+    if (connected)
+    {
+        send(writeheader(MQTTCLIENT_DISCONNECT, 0));
+    }
+    connected = false;
+    connecting = false;
+    hal_tcp_stop();
+}
+
+/*
+* Returns true if the session with the broker is established
+*/
+bool MQTTClient::isConnected()
+{
+    return connected && hal_tcp_connected();
+}
+
+/*
+* Returns true while the CONNACK of the broker is awaited
+*/
+bool MQTTClient::isConnecting()
+{
+    return connecting;
+}
+
+/*
+* Subscribes a topic with QoS 0 or 1. The topic is not copied and must stay
+* valid. Subscribing a topic again replaces its handler and renews the
+* subscription at the broker.
+*/
+bool MQTTClient::subscribe(const char *topic, mqttclient_callback_t callback, uint8_t qos)
+{
+    size_t topicLength = strlen(topic);
+    if (topicLength >= MQTTCLIENT_MAXTOPICLENGTH)
+    {
+        return false;
+    }
+
+    uint32_t topicHash = hash((const uint8_t *)topic, topicLength);
+    subscription_t *subscription = NULL;
+    for (uint8_t i = 0; i < numSubscriptions; i++)
+    {
+        if ((subscriptions[i].hash == topicHash) && (strcmp(subscriptions[i].topic, topic) == 0))
+        {
+            subscription = &subscriptions[i];
+        }
+    }
+    if (subscription == NULL)
+    {
+        if (numSubscriptions == MQTTCLIENT_MAXSUBSCRIPTIONS)
+        {
+            return false;
+        }
+        subscription = &subscriptions[numSubscriptions++];
+    }
+    subscription->topic = topic;
+    subscription->length = topicLength;
+    subscription->hash = topicHash;
+    subscription->callback = callback;
+
+    uint16_t id = packetid();
+    size_t pos = writeheader(MQTTCLIENT_SUBSCRIBE | 0x02, 2 + 2 + topicLength + 1);
+    txBuffer[pos++] = id >> 8;
+    txBuffer[pos++] = id & 0xFF;
+    pos = writestring(pos, topic);
+    txBuffer[pos++] = qos; // requested QoS
+    return send(pos);
+}
+
+/*
+* Removes the subscription of a topic and ends it at the broker
+*/
+bool MQTTClient::unsubscribe(const char *topic)
+{
+    size_t topicLength = strlen(topic);
+    uint32_t topicHash = hash((const uint8_t *)topic, topicLength);
+    for (uint8_t i = 0; i < numSubscriptions; i++)
+    {
+        if ((subscriptions[i].hash == topicHash) && (strcmp(subscriptions[i].topic, topic) == 0))
+        {
+            subscriptions[i] = subscriptions[--numSubscriptions];
+            break;
+        }
+    }
+
+    uint16_t id = packetid();
+    size_t pos = writeheader(MQTTCLIENT_UNSUBSCRIBE | 0x02, 2 + 2 + topicLength);
+    txBuffer[pos++] = id >> 8;
+    txBuffer[pos++] = id & 0xFF;
+    pos = writestring(pos, topic);
+    return send(pos);
+}
+
+/*
+* Publishes a zero terminated payload
+*/
+bool MQTTClient::publish(const char *topic, const char *payload, bool retain, uint8_t qos)
+{
+    return publish(topic, (const uint8_t *)payload, strlen(payload), retain, qos);
+}
+
+/*
+* Publishes a payload with QoS 0 or 1. A QoS 1 publish is kept until its
+* PUBACK arrives, so its topic must stay valid. If it doesn't fit into the
+* in-flight table it is sent with QoS 0. Returns false if the packet
+* doesn't fit into the send buffer or can't be sent.
+*/
+bool MQTTClient::publish(const char *topic, const uint8_t *payload, size_t size, bool retain, uint8_t qos)
+{
+    if (qos > 0)
+    {
+        inflight_t *entry = NULL;
+        for (uint8_t i = 0; (entry == NULL) && (i < MQTTCLIENT_MAXINFLIGHT); i++)
+        {
+            if (!inflight[i].used)
+            {
+                entry = &inflight[i];
+            }
+        }
+        if ((entry != NULL) && (size <= MQTTCLIENT_MAXINFLIGHTPAYLOAD) && (2 + strlen(topic) + 2 + size + 5 <= MQTTCLIENT_BUFFERSIZE))
+        {
+            entry->used = true;
+            entry->sent = false;
+            entry->retain = retain;
+            entry->retries = 0;
+            entry->size = size;
+            entry->id = packetid();
+            entry->topic = topic;
+            memcpy(entry->payload, payload, size);
+            entry->us_published = hal_micros();
+            stats.published++;
+            if (isConnected())
+            {
+                sendinflight(*entry);
+            }
+            return true;
+        }
+        stats.downgraded++;
+    }
+
+    if (!isConnected())
+    {
+        return false;
+    }
+    return sendpublish(topic, payload, size, retain, 0, 0);
+}
+
+/*
+* Receives the CONNACK, processes received packets and maintains the keep
+* alive. Must be called from the main loop.
+*/
+void MQTTClient::update()
+{
+    if (connecting)
+    {
+        receiveconnack();
+        return;
+    }
+    if (!isConnected())
+    {
+        connected = false;
+        return;
+    }
+    receive();
+
+    // send a ping if nothing was sent or received during the keep alive
+    // interval (a broker only sends if it is asked to) and give up the
+    // connection if the ping isn't answered within half an interval
+    uint32_t keepAlive_ms = (uint32_t)keepAlive_s * 1000;
+    if (keepAlive_ms > 0)
+    {
+        if (!pingOutstanding && ((hal_millis() - prev_ms_sent >= keepAlive_ms) || (hal_millis() - prev_ms_received >= keepAlive_ms)))
+        {
+            send(writeheader(MQTTCLIENT_PINGREQ, 0));
+            prev_ms_ping = hal_millis();
+            pingOutstanding = true;
+        }
+        if (pingOutstanding && (hal_millis() - prev_ms_ping > keepAlive_ms / 2))
+        {
+            connected = false;
+            hal_tcp_stop();
+            return;
+        }
+    }
+
+    // retransmit the QoS 1 publishes without PUBACK
+    for (uint8_t i = 0; i < MQTTCLIENT_MAXINFLIGHT; i++)
+    {
+        inflight_t &entry = inflight[i];
+        if (entry.used && (hal_millis() - entry.prev_ms_sent >= MQTTCLIENT_RETRYTIMEOUT_MS))
+        {
+            if (entry.retries == MQTTCLIENT_MAXRETRIES)
+            {
+                entry.used = false;
+                stats.expired++;
+                continue;
+            }
+            sendinflight(entry);
+        }
+    }
+}
+
+/*
+* Returns the number of QoS 1 publishes waiting for their PUBACK
+*/
+uint8_t MQTTClient::getInflight()
+{
+    uint8_t count = 0;
+    for (uint8_t i = 0; i < MQTTCLIENT_MAXINFLIGHT; i++)
+    {
+        count += inflight[i].used;
+    }
+    return count;
+}
+
+/*
+* Returns the counters of the QoS 1 delivery
+*/
+const mqttclient_stats_t *MQTTClient::getStats()
+{
+    return &stats;
+}
+
+/*
+* Writes the fixed header into the send buffer and returns the position
+* of the variable header
+*/
+size_t MQTTClient::writeheader(uint8_t header, uint32_t remainingLength)
+{
+    size_t pos = 0;
+    txBuffer[pos++] = header;
+    do
+    {
+        uint8_t digit = remainingLength % 128;
+        remainingLength /= 128;
+        txBuffer[pos++] = (remainingLength > 0) ? (digit | 0x80) : digit;
+    } while (remainingLength > 0);
+    return pos;
+}
+
+/*
+* Writes a length prefixed string into the send buffer
+*/
+size_t MQTTClient::writestring(size_t pos, const char *text)
+{
+    size_t length = strlen(text);
+    txBuffer[pos++] = length >> 8;
+    txBuffer[pos++] = length & 0xFF;
+    memcpy(txBuffer + pos, text, length);
+    return pos + length;
+}
+
+/*
+* Writes a PUBLISH packet into the send buffer and sends it. The flags are
+* the QoS and DUP bits of the fixed header, a QoS 1 publish carries the id.
+*/
+bool MQTTClient::sendpublish(const char *topic, const uint8_t *payload, size_t size, bool retain, uint8_t flags, uint16_t id)
+{
+    size_t topicLength = strlen(topic);
+    uint32_t length = 2 + topicLength + ((flags & 0x06) ? 2 : 0) + size;
+    if (length + 5 > MQTTCLIENT_BUFFERSIZE)
+    {
+        return false;
+    }
+    size_t pos = writeheader(MQTTCLIENT_PUBLISH | flags | (retain ? 0x01 : 0x00), length);
+    pos = writestring(pos, topic);
+    if (flags & 0x06)
+    {
+        txBuffer[pos++] = id >> 8;
+        txBuffer[pos++] = id & 0xFF;
+    }
+    memcpy(txBuffer + pos, payload, size);
+    return send(pos + size);
+}
+
+/*
+* Sends a QoS 1 publish of the in-flight table - with the DUP flag if it has
+* been sent before
+*/
+void MQTTClient::sendinflight(inflight_t &entry)
+{
+    if (entry.sent)
+    {
+        entry.retries++;
+        stats.retransmits++;
+    }
+    sendpublish(entry.topic, entry.payload, entry.size, entry.retain, 0x02 | (entry.sent ? 0x08 : 0x00), entry.id);
+    entry.sent = true;
+    entry.prev_ms_sent = hal_millis();
+}
+
+/*
+* Sends the content of the send buffer
+*/
+bool MQTTClient::send(size_t length)
+{
+    size_t written = hal_tcp_write(txBuffer, length);
+    prev_ms_sent = hal_millis();
+    return written == length;
+}
+
+/*
+* Reads all available bytes and handles complete packets. The body of a
+* packet is read in blocks, packets larger than the buffer are skipped.
+*/
+void MQTTClient::receive()
+{
+    while (hal_tcp_available() > 0)
+    {
+        if (rxState == RXSTATE_BODY)
+        {
+            uint32_t remaining = rxLength - rxPos;
+            if (rxPos < MQTTCLIENT_BUFFERSIZE)
+            {
+                uint32_t space = MQTTCLIENT_BUFFERSIZE - rxPos;
+                int received = hal_tcp_read(rxBuffer + rxPos, (remaining < space) ? remaining : space);
+                if (received <= 0)
+                {
+                    return;
+                }
+                rxPos += received;
+            }
+            else
+            {
+                // packet is too large - discard the rest of it
+                uint8_t discard;
+                if (hal_tcp_read(&discard, 1) <= 0)
+                {
+                    return;
+                }
+                rxPos++;
+            }
+        }
+        else
+        {
+            uint8_t c;
+            if (hal_tcp_read(&c, 1) <= 0)
+            {
+                return;
+            }
+            if (rxState == RXSTATE_HEADER)
+            {
+                rxHeader = c;
+                rxLength = 0;
+                rxMultiplier = 1;
+                rxPos = 0;
+                rxState = RXSTATE_LENGTH;
+                continue;
+            }
+            rxLength += (c & 0x7F) * rxMultiplier;
+            rxMultiplier *= 128;
+            if (c & 0x80)
+            {
+                continue;
+            }
+            rxState = RXSTATE_BODY;
+        }
+        if ((rxState == RXSTATE_BODY) && (rxPos >= rxLength))
+        {
+            prev_ms_received = hal_millis();
+            pingOutstanding = false;
+            if (rxLength <= MQTTCLIENT_BUFFERSIZE)
+            {
+                handlepacket();
+            }
+            else if ((rxHeader & 0xF0) == MQTTCLIENT_PUBLISH)
+            {
+                handleoversize();
+            }
+            rxState = RXSTATE_HEADER;
+        }
+    }
+}
+
+/*
+* Handles a PUBLISH which didn't fit into the receive buffer - only its start
+* is there. A QoS 1 message is acknowledged, so the broker doesn't deliver it
+* again, and the oversize handler is told about the topic.
+*/
+void MQTTClient::handleoversize()
+{
+    uint16_t topicLength = (rxBuffer[0] << 8) | rxBuffer[1];
+    uint8_t qos = (rxHeader >> 1) & 0x03;
+    uint32_t pos = 2 + topicLength + ((qos > 0) ? 2 : 0);
+    if (pos > MQTTCLIENT_BUFFERSIZE)
+    {
+        return;
+    }
+    if (qos > 0)
+    {
+        size_t ack = writeheader(MQTTCLIENT_PUBACK, 2);
+        txBuffer[ack++] = rxBuffer[pos - 2];
+        txBuffer[ack++] = rxBuffer[pos - 1];
+        send(ack);
+    }
+    uint32_t topicHash = hash(rxBuffer + 2, topicLength);
+    for (uint8_t i = 0; (oversizeCallback != NULL) && (i < numSubscriptions); i++)
+    {
+        if ((subscriptions[i].hash == topicHash) && (subscriptions[i].length == topicLength))
+        {
+            oversizeCallback(subscriptions[i].topic, rxLength - pos);
+        }
+    }
+}
+
+/*
+* Handles a complete packet in the receive buffer
+*/
+void MQTTClient::handlepacket()
+{
+    switch (rxHeader & 0xF0)
+    {
+    case MQTTCLIENT_CONNACK:
+        connackReceived = true;
+        connackCode = (rxLength >= 2) ? rxBuffer[1] : 0xFF;
+        break;
+
+    case MQTTCLIENT_PUBLISH:
+    {
+        if (rxLength < 2)
+        {
+            break;
+        }
+        uint16_t topicLength = (rxBuffer[0] << 8) | rxBuffer[1];
+        uint8_t qos = (rxHeader >> 1) & 0x03;
+        uint32_t pos = 2 + topicLength;
+        if (qos > 0)
+        {
+            // acknowledge QoS 1 messages
+            if (pos + 2 > rxLength)
+            {
+                break;
+            }
+            uint16_t id = (rxBuffer[pos] << 8) | rxBuffer[pos + 1];
+            size_t ack = writeheader(MQTTCLIENT_PUBACK, 2);
+            txBuffer[ack++] = rxBuffer[pos];
+            txBuffer[ack++] = rxBuffer[pos + 1];
+            send(ack);
+            pos += 2;
+
+            // a redelivery (DUP) of a message which has been received already
+            bool duplicate = false;
+            for (uint8_t i = 0; (rxHeader & 0x08) && (i < MQTTCLIENT_MAXRECEIVEDIDS); i++)
+            {
+                duplicate |= (receivedIds[i] == id);
+            }
+            if (duplicate)
+            {
+                stats.duplicates++;
+                break;
+            }
+            receivedIds[nextReceivedId] = id;
+            nextReceivedId = (nextReceivedId + 1) % MQTTCLIENT_MAXRECEIVEDIDS;
+        }
+        if (pos > rxLength)
+        {
+            break;
+        }
+
+        // zero terminate the payload and pass it to the handler of the topic
+        rxBuffer[rxLength] = 0;
+        uint32_t topicHash = hash(rxBuffer + 2, topicLength);
+        for (uint8_t i = 0; i < numSubscriptions; i++)
+        {
+            if ((subscriptions[i].hash == topicHash) && (subscriptions[i].length == topicLength))
+            {
+                subscriptions[i].callback((const char *)rxBuffer + pos, rxLength - pos);
+            }
+        }
+        break;
+    }
+
+    case MQTTCLIENT_PUBACK:
+    {
+        if (rxLength < 2)
+        {
+            break;
+        }
+        uint16_t id = (rxBuffer[0] << 8) | rxBuffer[1];
+        for (uint8_t i = 0; i < MQTTCLIENT_MAXINFLIGHT; i++)
+        {
+            if (inflight[i].used && (inflight[i].id == id))
+            {
+                uint32_t latency_us = hal_micros() - inflight[i].us_published;
+                stats.acknowledged++;
+                stats.ackLatencyTotal_us += latency_us;
+                if (latency_us > stats.ackLatencyMax_us)
+                {
+                    stats.ackLatencyMax_us = latency_us;
+                }
+                inflight[i].used = false;
+            }
+        }
+        break;
+    }
+
+    default:
+        // SUBACK, UNSUBACK and PINGRESP need no handling
+        break;
+    }
+}
+
+/*
+* Returns the next packet identifier (never 0)
+*/
+uint16_t MQTTClient::packetid()
+{
+    if (nextPacketId == 0)
+    {
+        nextPacketId = 1;
+    }
+    return nextPacketId++;
+}
+
+/*
+* Returns the FNV-1a hash of a topic
+*/
+uint32_t MQTTClient::hash(const uint8_t *data, size_t length)
+{
+    uint32_t value = 2166136261UL;
+    for (size_t i = 0; i < length; i++)
+    {
+        value = (value ^ data[i]) * 16777619UL;
+    }
+    return value;
+}
\ No newline at end of file
@@ -0,0 +1,331 @@
+#include "hal.h"
+
+#include "config.h"
+#include "fixedstring.h"
+#include "mqtt.h"
+#include "payload.h"
+
+// CBOR major types and simple values
+#define CBOR_UINT       0
+#define CBOR_TEXT       3
+#define CBOR_ARRAY      4
+#define CBOR_FALSE      0xF4
+#define CBOR_TRUE       0xF5
+#define CBOR_NULL       0xF6
+#define CBOR_FLOAT32    0xFA
+
+/*
+* Starts a payload in the encoding selected for the topic
+*/
+PayloadWriter::PayloadWriter(mqtt_topic_t topic, uint8_t schema)
+{
+    init(topic, schema, payload_isbinarytopic(topic));
+}
+
+/*
+* Starts a payload in the given encoding, e.g. to compare both
+*/
+PayloadWriter::PayloadWriter(mqtt_topic_t topic, uint8_t schema, bool binary)
+{
+    init(topic, schema, binary);
+}
+
+void PayloadWriter::init(mqtt_topic_t topic, uint8_t schema, bool binary)
+{
+    this->topic = topic;
+    this->binary = binary;
+    overflow = false;
+    ended = false;
+    inArray = false;
+    fields = 0;
+    items = 0;
+    len = 0;
+    if (binary)
+    {
+        // the array header is set by end() when the number of fields is known
+        putbyte(schema);
+        putbyte(CBOR_ARRAY << 5);
+    }
+    else
+    {
+        putbyte('{');
+    }
+}
+
+void PayloadWriter::addUint(const char *name, unsigned long value)
+{
+    field(name);
+    if (binary)
+    {
+        putheader(CBOR_UINT, value);
+    }
+    else
+    {
+        FixedString<12> text;
+        puttext(text.format("%lu", value).c_str());
+    }
+}
+
+void PayloadWriter::addBool(const char *name, bool value)
+{
+    field(name);
+    if (binary)
+    {
+        putbyte(value ? CBOR_TRUE : CBOR_FALSE);
+    }
+    else
+    {
+        puttext(value ? "true" : "false");
+    }
+}
+
+/*
+* Adds a text - json values are not escaped, so the text must not contain
+* quotes or backslashes
+*/
+void PayloadWriter::addString(const char *name, const char *value)
+{
+    field(name);
+    if (binary)
+    {
+        size_t length = strlen(value);
+        putheader(CBOR_TEXT, length);
+        put(value, length);
+    }
+    else
+    {
+        putbyte('"');
+        puttext(value);
+        putbyte('"');
+    }
+}
+
+/*
+* Adds a measured value: in json an object with the value as text with the
+* given number of decimals and the unit, in CBOR a 32 bit float
+*/
+void PayloadWriter::addMeasurement(const char *name, float value, unsigned int decimals, const char *unit)
+{
+    field(name);
+    if (binary)
+    {
+        putfloat(value);
+    }
+    else
+    {
+        FixedString<16> text;
+        puttext("{\"value\":\"");
+        puttext(text.appendfloat(value, decimals).c_str());
+        puttext("\",\"unit\":\"");
+        puttext(unit);
+        puttext("\"}");
+    }
+}
+
+/*
+* Adds a number with the given number of decimals: in json a plain number,
+* in CBOR a 32 bit float
+*/
+void PayloadWriter::addNumber(const char *name, float value, unsigned int decimals)
+{
+    field(name);
+    if (binary)
+    {
+        putfloat(value);
+    }
+    else
+    {
+        FixedString<16> text;
+        puttext(text.appendfloat(value, decimals).c_str());
+    }
+}
+
+/*
+* Marks an optional field without a value: it is omitted in json and keeps
+* its position as null in CBOR
+*/
+void PayloadWriter::addMissing(const char *name)
+{
+    if (binary)
+    {
+        field(name);
+        putbyte(CBOR_NULL);
+    }
+}
+
+/*
+* Starts an array with the given number of values, which are added without
+* names. Arrays can't be nested.
+*/
+void PayloadWriter::beginArray(const char *name, uint8_t count)
+{
+    field(name);
+    if (binary)
+    {
+        putheader(CBOR_ARRAY, count);
+    }
+    else
+    {
+        putbyte('[');
+    }
+    inArray = true;
+    items = 0;
+}
+
+void PayloadWriter::endArray()
+{
+    if (!binary)
+    {
+        putbyte(']');
+    }
+    inArray = false;
+}
+
+/*
+* Completes the payload. A json payload is zero terminated.
+*/
+void PayloadWriter::end()
+{
+    if (ended)
+    {
+        return;
+    }
+    ended = true;
+    if (binary)
+    {
+        if (fields > PAYLOAD_MAXFIELDS)
+        {
+            overflow = true;
+        }
+        buffer[1] = (CBOR_ARRAY << 5) | fields;
+    }
+    else
+    {
+        putbyte('}');
+        buffer[len] = 0;
+    }
+}
+
+/*
+* Publishes the payload on its topic. A payload which didn't fit into the
+* buffer is dropped.
+*/
+void PayloadWriter::publish(bool retain)
+{
+    end();
+    if (overflow)
+    {
+        hal_serial_print("WARNING: Payload too large for ");
+        hal_serial_println(mqtt_topicname(topic));
+        return;
+    }
+    if (binary)
+    {
+        mqtt_publish(topic, buffer, len, retain);
+    }
+    else
+    {
+        mqtt_publish(topic, data(), retain);
+    }
+}
+
+/*
+* Writes the separator and the name of the next field (json) or counts the
+* field (CBOR)
+*/
+void PayloadWriter::field(const char *name)
+{
+    if (inArray)
+    {
+        if (!binary && (items > 0))
+        {
+            putbyte(',');
+        }
+        items++;
+        return;
+    }
+    if (!binary)
+    {
+        if (fields > 0)
+        {
+            putbyte(',');
+        }
+        putbyte('"');
+        puttext(name);
+        putbyte('"');
+        putbyte(':');
+    }
+    fields++;
+}
+
+void PayloadWriter::put(const void *data, size_t count)
+{
+    if (len + count > PAYLOAD_MAXSIZE)
+    {
+        overflow = true;
+        return;
+    }
+    memcpy(buffer + len, data, count);
+    len += count;
+}
+
+void PayloadWriter::putbyte(uint8_t c)
+{
+    put(&c, 1);
+}
+
+/*
+* Writes the CBOR header of a major type with its value (number, length
+* or count) in the shortest form
+*/
+void PayloadWriter::putheader(uint8_t major, uint32_t value)
+{
+    major <<= 5;
+    if (value < 24)
+    {
+        putbyte(major | value);
+    }
+    else if (value <= 0xFF)
+    {
+        putbyte(major | 24);
+        putbyte(value);
+    }
+    else if (value <= 0xFFFF)
+    {
+        putbyte(major | 25);
+        putbyte(value >> 8);
+        putbyte(value);
+    }
+    else
+    {
+        putbyte(major | 26);
+        for (int shift = 24; shift >= 0; shift -= 8)
+        {
+            putbyte((uint8_t)(value >> shift));
+        }
+    }
+}
+
+void PayloadWriter::puttext(const char *text)
+{
+    put(text, strlen(text));
+}
+
+void PayloadWriter::putfloat(float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    putbyte(CBOR_FLOAT32);
+    for (int shift = 24; shift >= 0; shift -= 8)
+    {
+        putbyte((uint8_t)(bits >> shift));
+    }
+}
+
+/*
+* Returns true if the payloads of the topic are sent in the binary form
+*/
+bool payload_isbinarytopic(mqtt_topic_t topic)
+{
+    return (topic < 32) && (mqttBinaryTopics & (1UL << topic));
+}
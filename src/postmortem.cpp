@@ -0,0 +1,239 @@
+#include "hal.h"
+
+#include "postmortem.h"
+#include "supervisor.h"
+#include "mqtt.h"
+#include "payload.h"
+#include "fixedstring.h"
+
+// the record of the running firmware - not initialized at startup
+HAL_NOINIT postmortem_record_t postmortemRecord;
+
+// the record found after the reset and the reset cause of the hardware
+postmortem_record_t postmortemLast;
+uint8_t postmortemResetCause = HAL_RESETPOWERON;
+bool postmortemLastValid = false;
+bool postmortemPublished = false;
+uint32_t postmortemStart_ms = 0;
+
+/*
+* Sum of all words of a record but the checksum
+*/
+uint32_t postmortem_sum(const postmortem_record_t *record)
+{
+    const uint32_t *word = (const uint32_t *)record;
+    uint32_t sum = 0;
+    for (size_t i = 0; i < offsetof(postmortem_record_t, checksum) / 4; i++)
+    {
+        sum += word[i];
+    }
+    return sum;
+}
+
+/*
+* Time since the start of the record in ms
+*/
+uint32_t postmortem_uptime()
+{
+    return hal_millis() - postmortemStart_ms;
+}
+
+/*
+* Writes a word of the record and updates the checksum. Once the cause of a
+* reset is recorded the record is frozen - on the host the firmware keeps
+* running until the reset is simulated. The shutdown handler of the watchdog
+* writes the record from its interrupt, so the update of the checksum and the
+* word must not be interrupted.
+*/
+void postmortem_set(uint32_t *word, uint32_t value)
+{
+    uint32_t state = hal_interrupts_disable();
+    if (postmortemRecord.cause == POSTMORTEM_CAUSENONE)
+    {
+        postmortemRecord.checksum += value - *word;
+        *word = value;
+    }
+    hal_interrupts_restore(state);
+}
+
+const char *postmortem_causename(uint32_t cause, uint8_t resetCause)
+{
+    if (cause == POSTMORTEM_CAUSEWATCHDOG)
+    {
+        return "watchdog";
+    }
+    if (cause == POSTMORTEM_CAUSESUPERVISOR)
+    {
+        return "supervisor";
+    }
+    switch (resetCause)
+    {
+    case HAL_RESETBROWNOUT:
+        return "brownout";
+    case HAL_RESETEXTERNAL:
+        return "external";
+    case HAL_RESETWATCHDOG:
+        return "watchdog";
+    case HAL_RESETSYSTEM:
+        return "system";
+    }
+    return "unknown";
+}
+
+/*
+* Publishes the record found after the reset on gdc/diag/crash
+*/
+void postmortem_publish()
+{
+    const postmortem_record_t &record = postmortemLast;
+    bool inModule = record.module < SUPERVISOR_NUMMODULES;
+    PayloadWriter payload(MQTT_TOPICDIAGCRASH, PAYLOAD_SCHEMACRASH);
+    payload.addString("cause", postmortem_causename(record.cause, postmortemResetCause));
+    payload.addUint("uptime", record.uptime_ms / 1000);
+    payload.addString("module", supervisor_modulename(inModule ? (supervisor_module_t)record.module : SUPERVISOR_NONE));
+    payload.addUint("module_ms", inModule ? record.uptime_ms - record.moduleBegin_ms : 0);
+
+    // oldest first - the passes of a short run are not all recorded
+    uint8_t count = 0;
+    for (int i = 0; i < POSTMORTEM_LOOPS; i++)
+    {
+        count += (record.loops_us[i] > 0);
+    }
+    payload.beginArray("loops_us", count);
+    for (int i = 0; i < POSTMORTEM_LOOPS; i++)
+    {
+        uint32_t duration_us = record.loops_us[(record.loopHead + i) % POSTMORTEM_LOOPS];
+        if (duration_us > 0)
+        {
+            payload.addUint(NULL, duration_us);
+        }
+    }
+    payload.endArray();
+
+    count = 0;
+    for (int i = 0; i < POSTMORTEM_EVENTS; i++)
+    {
+        count += (record.events[i][0] != 0);
+    }
+    payload.beginArray("events", count);
+    for (int i = 0; i < POSTMORTEM_EVENTS; i++)
+    {
+        const char *text = (const char *)record.events[(record.eventHead + i) % POSTMORTEM_EVENTS];
+        if (text[0] != 0)
+        {
+            payload.addString(NULL, text);
+        }
+    }
+    payload.endArray();
+    payload.publish(true);
+}
+
+/*
+* Checks the record which survived the reset, keeps a copy of a valid one and
+* starts a new record. Is called by setup() and on the host after a reset
+* which returned.
+*/
+void postmortem_init()
+{
+    FixedString<80> line;
+    postmortemLastValid = (postmortemRecord.magic == POSTMORTEM_MAGIC) && (postmortemRecord.checksum == postmortem_sum(&postmortemRecord));
+    postmortemPublished = false;
+    if (postmortemLastValid)
+    {
+        // the strings of a damaged record are terminated anyway
+        postmortemLast = postmortemRecord;
+        for (int i = 0; i < POSTMORTEM_EVENTS; i++)
+        {
+            ((char *)postmortemLast.events[i])[POSTMORTEM_EVENTLENGTH - 1] = 0;
+        }
+        postmortemResetCause = hal_system_resetcause();
+        hal_serial_println(line.format("INIT: Post-mortem record found (cause %s, uptime %lu s)", postmortem_causename(postmortemLast.cause, postmortemResetCause), (unsigned long)(postmortemLast.uptime_ms / 1000)).c_str());
+    }
+
+    postmortemStart_ms = hal_millis();
+    memset(&postmortemRecord, 0, sizeof(postmortemRecord));
+    postmortemRecord.magic = POSTMORTEM_MAGIC;
+    postmortemRecord.module = SUPERVISOR_NONE;
+    postmortemRecord.checksum = postmortem_sum(&postmortemRecord);
+}
+
+/*
+* Publishes the record of the previous run once the broker is connected
+*/
+void postmortem_loop()
+{
+    if (postmortemLastValid && !postmortemPublished && mqtt_isconnected())
+    {
+        postmortemPublished = true;
+        postmortem_publish();
+    }
+}
+
+/*
+* Records the duration of a pass of the main loop
+*/
+void postmortem_looptime(uint32_t duration_us)
+{
+    if (duration_us > POSTMORTEM_MAXLOOP_US)
+    {
+        duration_us = POSTMORTEM_MAXLOOP_US;
+    }
+    // 0 marks an unused entry
+    postmortem_set(&postmortemRecord.loops_us[postmortemRecord.loopHead], duration_us ? duration_us : 1);
+    postmortem_set(&postmortemRecord.loopHead, (postmortemRecord.loopHead + 1) % POSTMORTEM_LOOPS);
+    postmortem_set(&postmortemRecord.uptime_ms, postmortem_uptime());
+}
+
+/*
+* Records the supervised module which runs now (SUPERVISOR_NONE when its
+* pass is done)
+*/
+void postmortem_module(uint8_t module)
+{
+    uint32_t now = postmortem_uptime();
+    postmortem_set(&postmortemRecord.module, module);
+    postmortem_set(&postmortemRecord.uptime_ms, now);
+    if (module != SUPERVISOR_NONE)
+    {
+        postmortem_set(&postmortemRecord.moduleBegin_ms, now);
+    }
+}
+
+/*
+* Records a door or mqtt event, e.g. "door1 closed" - longer texts are cut
+*/
+void postmortem_event(const char *text)
+{
+    uint32_t words[POSTMORTEM_EVENTLENGTH / 4];
+    memset(words, 0, sizeof(words));
+    strncpy((char *)words, text, POSTMORTEM_EVENTLENGTH - 1);
+
+    uint32_t *event = postmortemRecord.events[postmortemRecord.eventHead];
+    for (int i = 0; i < POSTMORTEM_EVENTLENGTH / 4; i++)
+    {
+        postmortem_set(&event[i], words[i]);
+    }
+    postmortem_set(&postmortemRecord.eventHead, (postmortemRecord.eventHead + 1) % POSTMORTEM_EVENTS);
+    postmortem_set(&postmortemRecord.uptime_ms, postmortem_uptime());
+}
+
+/*
+* Records why the firmware resets the controller - the first cause is kept,
+* e.g. the watchdog expired while the supervisor was waiting to reset
+*/
+void postmortem_setcause(uint8_t cause)
+{
+    if (postmortemRecord.cause == POSTMORTEM_CAUSENONE)
+    {
+        postmortem_set(&postmortemRecord.uptime_ms, postmortem_uptime());
+        postmortem_set(&postmortemRecord.cause, cause);
+    }
+}
+
+/*
+* Returns the record found after the reset or NULL
+*/
+const postmortem_record_t *postmortem_getlast()
+{
+    return postmortemLastValid ? &postmortemLast : NULL;
+}
@@ -0,0 +1,115 @@
+#include "hal.h"
+
+#include "config.h"
+#include "resync.h"
+
+// hash of the payload the broker holds for every topic - a topic without a
+// known payload is treated as divergent
+uint32_t resyncKnownHash[MQTT_NUMTOPICS];
+bool resyncKnown[MQTT_NUMTOPICS];
+
+uint32_t resyncRandom = 1;
+resync_stats_t resyncStats;
+
+/*
+* Inits the random generator of the reconnect jitter. The seed should be
+* different on every device, e.g. the hash of the client id.
+*/
+void resync_init(uint32_t seed)
+{
+    resyncRandom = (seed != 0) ? seed : 1;
+    memset(&resyncStats, 0, sizeof(resyncStats));
+    memset(resyncKnown, 0, sizeof(resyncKnown));
+}
+
+/*
+* Returns the delay in ms before the given reconnect attempt (0 = first).
+* The delay doubles with every attempt from mqttReconnectMin_ms up to
+* mqttReconnectMax_ms. Only the first half of it is fixed, the second half
+* is random.
+*/
+uint32_t resync_reconnectdelay(uint8_t attempt)
+{
+    uint32_t delay_ms = mqttReconnectMin_ms;
+    while ((attempt-- > 0) && (delay_ms < (uint32_t)mqttReconnectMax_ms))
+    {
+        delay_ms *= 2;
+    }
+    if (delay_ms > (uint32_t)mqttReconnectMax_ms)
+    {
+        delay_ms = mqttReconnectMax_ms;
+    }
+
+    // xorshift32
+    resyncRandom ^= resyncRandom << 13;
+    resyncRandom ^= resyncRandom >> 17;
+    resyncRandom ^= resyncRandom << 5;
+    return delay_ms / 2 + resyncRandom % (delay_ms / 2 + 1);
+}
+
+/*
+* Starts a new session: the content of the broker is unknown until its
+* retained messages have been received
+*/
+void resync_begin()
+{
+    memset(resyncKnown, 0, sizeof(resyncKnown));
+    resyncStats.connects++;
+}
+
+/*
+* Records a retained message delivered by the broker
+*/
+void resync_received(mqtt_topic_t topic, const char *payload, size_t size)
+{
+    resyncKnownHash[topic] = resync_hash(payload, size);
+    resyncKnown[topic] = true;
+}
+
+/*
+* Records a retained publish of the device - the broker holds it from now on
+*/
+void resync_published(mqtt_topic_t topic, const char *payload, size_t size)
+{
+    resyncKnownHash[topic] = resync_hash(payload, size);
+    resyncKnown[topic] = true;
+}
+
+/*
+* Returns true if the broker doesn't hold the payload on the topic, so it
+* must be published again. Counts the resent and skipped topics.
+*/
+bool resync_isdivergent(mqtt_topic_t topic, const char *payload, size_t size)
+{
+    bool divergent = !resyncKnown[topic] || (resyncKnownHash[topic] != resync_hash(payload, size));
+    if (divergent)
+    {
+        resyncStats.resent++;
+    }
+    else
+    {
+        resyncStats.skipped++;
+    }
+    return divergent;
+}
+
+/*
+* Returns the FNV-1a hash of a payload
+*/
+uint32_t resync_hash(const char *data, size_t size)
+{
+    uint32_t value = 2166136261UL;
+    for (size_t i = 0; i < size; i++)
+    {
+        value = (value ^ (uint8_t)data[i]) * 16777619UL;
+    }
+    return value;
+}
+
+/*
+* Returns the counters of the resynchronization
+*/
+const resync_stats_t *resync_getstats()
+{
+    return &resyncStats;
+}
\ No newline at end of file
@@ -1,4 +1,4 @@
-#include <Arduino_MKRENV.h>
+#include "hal.h"
 
 #define HOMEKIT_LOWER_LIMIT 0.0001
 
@@ -8,16 +8,16 @@
  float illuminance = HOMEKIT_LOWER_LIMIT;
 
 /*
-* inits the MKR ENV shield
+* inits the MKR ENV shield, returns false if it isn't present
 */
-void sensors_init()
+bool sensors_init()
 {
-    if (!ENV.begin())
+    if (!hal_env_begin())
     {
-        Serial.println("ERROR: Failed to initialize MKR ENV shield");
-        while (1)
-            ;
+        hal_serial_println("ERROR: Failed to initialize MKR ENV shield");
+        return false;
     }
+    return true;
 }
 
 /*
@@ -26,13 +26,13 @@ void sensors_init()
 void sensors_loop()
 {
     // read all the sensor values
-    temperature = ENV.readTemperature();
-    humidity = ENV.readHumidity();
-    pressure = ENV.readPressure();
-    illuminance = ENV.readIlluminance();
+    temperature = hal_env_temperature();
+    humidity = hal_env_humidity();
+    pressure = hal_env_pressure();
+    illuminance = hal_env_illuminance();
 
     // let the other loops run
-    yield();
+    hal_yield();
 }
 
 /*
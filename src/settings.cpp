@@ -0,0 +1,283 @@
+#include "hal.h"
+
+#include "config.h"
+#include "settings.h"
+#include "mqtt.h"
+#include "payload.h"
+#include "fixedstring.h"
+
+// the tunable settings - the names are the fields of the json documents
+const settings_def_t settingsTable[] = {
+    {"display_ms", &displayTimeout_ms, 1000, 600000},
+    {"blink_ms", &ledBlinkDuration_ms, 20, 2000},
+    {"pulse_ms", &commandDuration_ms, 100, 5000},
+    {"debounce_ms", &debounce_button_ms, 10, 1000},
+    {"sensors_ms", &sensorInterval_ms, 1000, 3600000},
+    {"heartbeat_ms", &heartbeatInterval_ms, 100, 10000}};
+
+#define SETTINGS_COUNT (int)(sizeof(settingsTable) / sizeof(settingsTable[0]))
+
+const char *const settingsSources[] = {"default", "sd", "broker"};
+
+// compiled values, the active document and the fields of the last rejected one
+int settingsDefaults[SETTINGS_COUNT];
+bool settingsDefaultsSaved = false;
+char settingsDocument[SETTINGS_MAXDOCUMENT];
+size_t settingsDocumentSize = 0;
+FixedString<64> settingsRejected;
+bool settingsEchoPending = false;
+settings_stats_t settingsStats;
+
+int settings_find(const char *name)
+{
+    for (int index = 0; index < SETTINGS_COUNT; index++)
+    {
+        if (strcmp(settingsTable[index].name, name) == 0)
+        {
+            return index;
+        }
+    }
+    return -1;
+}
+
+const char *settings_skipspace(const char *p, const char *end)
+{
+    while ((p < end) && ((*p == ' ') || (*p == '\t') || (*p == '\r') || (*p == '\n')))
+    {
+        p++;
+    }
+    return p;
+}
+
+/*
+* Parses a flat json object with unsigned numbers, e.g. {"display_ms":60000},
+* into the staged values. Returns false if the document is malformed or a
+* field is unknown or out of range - the names of these fields are added to
+* settingsRejected.
+*/
+bool settings_parse(const char *document, size_t size, int *staged)
+{
+    const char *p = document;
+    const char *end = document + size;
+    bool valid = true;
+
+    p = settings_skipspace(p, end);
+    if ((p == end) || (*p++ != '{'))
+    {
+        return false;
+    }
+    p = settings_skipspace(p, end);
+    if ((p < end) && (*p == '}'))
+    {
+        return true;
+    }
+    while (p < end)
+    {
+        // "name"
+        FixedString<SETTINGS_MAXNAMELENGTH> name;
+        if (*p++ != '"')
+        {
+            return false;
+        }
+        const char *nameStart = p;
+        while ((p < end) && (*p != '"'))
+        {
+            p++;
+        }
+        if (p == end)
+        {
+            return false;
+        }
+        name.append(nameStart, p - nameStart);
+        p++;
+
+        // :value
+        p = settings_skipspace(p, end);
+        if ((p == end) || (*p++ != ':'))
+        {
+            return false;
+        }
+        p = settings_skipspace(p, end);
+        uint32_t value = 0;
+        const char *digits = p;
+        while ((p < end) && (*p >= '0') && (*p <= '9') && (value <= 0x7FFFFFFF / 10))
+        {
+            value = value * 10 + (*p++ - '0');
+        }
+        int index = settings_find(name.c_str());
+        bool isNumber = (p > digits) && ((p == end) || (*p < '0') || (*p > '9'));
+        if ((index < 0) || !isNumber || (value < (uint32_t)settingsTable[index].min) || (value > (uint32_t)settingsTable[index].max))
+        {
+            settingsRejected.appendf("%s%s", settingsRejected.length() ? "," : "", name.c_str());
+            valid = false;
+            // skip the value
+            while ((p < end) && (*p != ',') && (*p != '}'))
+            {
+                p++;
+            }
+        }
+        else
+        {
+            staged[index] = (int)value;
+        }
+
+        // , or }
+        p = settings_skipspace(p, end);
+        if (p == end)
+        {
+            return false;
+        }
+        if (*p == '}')
+        {
+            return valid;
+        }
+        if (*p++ != ',')
+        {
+            return false;
+        }
+        p = settings_skipspace(p, end);
+    }
+    return false;
+}
+
+/*
+* Publishes the active values (retained) on gdc/config/active
+*/
+void settings_publish()
+{
+    PayloadWriter payload(MQTT_TOPICCONFIGACTIVE, PAYLOAD_SCHEMACONFIG);
+    for (int index = 0; index < SETTINGS_COUNT; index++)
+    {
+        payload.addUint(settingsTable[index].name, *settingsTable[index].value);
+    }
+    payload.addString("source", settingsSources[settingsStats.source]);
+    payload.addString("rejected", settingsRejected.c_str());
+    payload.publish(true);
+}
+
+/*
+* Rejects a document - the fields which were invalid are in settingsRejected,
+* without any the document as a whole was (too large, no json object)
+*/
+void settings_reject(uint8_t source)
+{
+    FixedString<80> line;
+    if (settingsRejected.length() == 0)
+    {
+        settingsRejected.append("document");
+    }
+    settingsStats.rejected++;
+    settingsEchoPending = true;
+    hal_serial_println(line.format("WARNING: Settings from %s rejected (%s)", settingsSources[source], settingsRejected.c_str()).c_str());
+}
+
+/*
+* A document which was too large for the receive buffer of the mqtt client
+* is rejected without its content
+*/
+void settings_rejectoversize(uint8_t source)
+{
+    settingsRejected.clear();
+    settings_reject(source);
+}
+
+/*
+* Validates a document and applies it if all fields are valid. A document
+* from the broker is cached on the SD card. An empty document restores the
+* defaults. Returns false if the document was rejected.
+*/
+bool settings_apply(const char *document, size_t size, uint8_t source)
+{
+    FixedString<80> line;
+    if ((size == settingsDocumentSize) && (memcmp(document, settingsDocument, size) == 0))
+    {
+        // the retained document is delivered again after every connect
+        if ((size > 0) && (source != settingsStats.source))
+        {
+            settingsStats.source = source;
+            settingsEchoPending = true;
+        }
+        return true;
+    }
+
+    int staged[SETTINGS_COUNT];
+    memcpy(staged, settingsDefaults, sizeof(staged));
+    settingsRejected.clear();
+    if ((size > 0) && ((size > SETTINGS_MAXDOCUMENT) || !settings_parse(document, size, staged)))
+    {
+        settings_reject(source);
+        return false;
+    }
+
+    for (int index = 0; index < SETTINGS_COUNT; index++)
+    {
+        *settingsTable[index].value = staged[index];
+    }
+    memcpy(settingsDocument, document, size);
+    settingsDocumentSize = size;
+    settingsStats.accepted++;
+    settingsStats.source = (size > 0) ? source : SETTINGS_SOURCEDEFAULT;
+    settingsEchoPending = true;
+    hal_serial_println(line.format("RUN: Settings from %s applied", settingsSources[settingsStats.source]).c_str());
+
+    // the cache follows the retained document of the broker
+    if (source == SETTINGS_SOURCEBROKER)
+    {
+        bool cached = (size > 0) ? hal_file_write(SETTINGS_CACHEFILE, (const uint8_t *)document, size) : hal_file_remove(SETTINGS_CACHEFILE);
+        settingsStats.cacheWrites += cached;
+    }
+    return true;
+}
+
+/*
+* Starts with the compiled values and loads the settings cached on the SD
+* card - is called by the config stage (see boot.h)
+*/
+void settings_init()
+{
+    if (!settingsDefaultsSaved)
+    {
+        settingsDefaultsSaved = true;
+        for (int index = 0; index < SETTINGS_COUNT; index++)
+        {
+            settingsDefaults[index] = *settingsTable[index].value;
+        }
+    }
+    for (int index = 0; index < SETTINGS_COUNT; index++)
+    {
+        *settingsTable[index].value = settingsDefaults[index];
+    }
+    settingsDocumentSize = 0;
+    settingsRejected.clear();
+    settingsStats.source = SETTINGS_SOURCEDEFAULT;
+    settingsEchoPending = true;
+
+    if (!hal_sd_begin())
+    {
+        hal_serial_println("INIT: No SD card, settings are received from the broker only");
+        return;
+    }
+    char document[SETTINGS_MAXDOCUMENT + 1];
+    int size = hal_file_read(SETTINGS_CACHEFILE, 0, (uint8_t *)document, sizeof(document));
+    if ((size > 0) && (size <= (int)SETTINGS_MAXDOCUMENT))
+    {
+        settings_apply(document, size, SETTINGS_SOURCESD);
+    }
+}
+
+/*
+* Echoes the active values when they have changed and the broker is connected
+*/
+void settings_loop()
+{
+    if (settingsEchoPending && mqtt_isconnected())
+    {
+        settingsEchoPending = false;
+        settings_publish();
+    }
+}
+
+const settings_stats_t *settings_getstats()
+{
+    return &settingsStats;
+}
@@ -0,0 +1,675 @@
+#ifndef ARDUINO
+
+// Include libraries
+#include <stdlib.h>
+#include <time.h>
+
+#include "hal.h"
+#include "hal_native.h"
+#include "config.h"
+#include "hmi.h"
+#include "mqtt.h"
+#include "broker.h"
+#include "sim.h"
+#include "idle.h"
+
+// firmware entry points (main.cpp)
+void setup();
+void loop();
+
+// pins on an expander are encoded by DRIVEIO_EXPANDERPIN(address, pin)
+#define SIM_ISEXPANDERPIN(pin)      (((pin) & 0x80) != 0)
+#define SIM_EXPANDERADDRESS(pin)    (((pin) >> 3) & 0x07)
+#define SIM_EXPANDERIO(pin)         ((pin) & 0x07)
+
+// the display shield expander with the buttons
+#define SIM_HMIEXPANDER             0
+
+// delay between the start of a command pulse and the door leaving its end position
+#define SIM_DOORSTART_MS            300
+
+// event queue - sorted by time, events with the same time keep their order
+sim_event_t simEvents[SIM_MAXEVENTS];
+int simEventHead = 0;
+int simEventCount = 0;
+
+uint32_t simLoopTick_us = HAL_NATIVE_LOOPTICK_US;
+uint64_t simStart_us = 0;
+uint64_t simHost_ns = 0;
+uint64_t simVirtual_us = 0;
+sim_loopstats_t simLoopStats;
+
+// simulated drive of every door
+struct simdoor_t
+{
+    bool model;
+    uint32_t travel_ms;
+    int prevOpenOutput;
+    int prevCloseOutput;
+};
+simdoor_t simDoors[DOOR_COUNT];
+
+// topics published by the firmware (recorded from the broker)
+struct simtopic_t
+{
+    char topic[BROKER_MAXTOPICLENGTH];
+    char payload[SIM_MAXPAYLOAD];
+    bool retain;
+    unsigned long count;
+};
+simtopic_t simTopics[SIM_MAXTOPICS];
+int simNumTopics = 0;
+
+void (*simPublishHook)(const char *topic, const char *payload, bool retain) = NULL;
+
+/*
+* Returns the monotonic host time in ns
+*/
+uint64_t sim_host_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/*
+* Sets a native or expander input
+*/
+void sim_setpin(uint8_t pin, int value)
+{
+    if (SIM_ISEXPANDERPIN(pin))
+    {
+        hal_native_setexpanderinput(SIM_EXPANDERADDRESS(pin), SIM_EXPANDERIO(pin), value);
+    }
+    else
+    {
+        hal_native_setinput(pin, value);
+    }
+}
+
+/*
+* Reads a native or expander output
+*/
+int sim_getpin(uint8_t pin)
+{
+    if (SIM_ISEXPANDERPIN(pin))
+    {
+        return hal_native_getexpanderoutput(SIM_EXPANDERADDRESS(pin), SIM_EXPANDERIO(pin));
+    }
+    return hal_native_getoutput(pin);
+}
+
+/*
+* Sets both status inputs of a door
+*/
+void sim_setdoor(int door, int state)
+{
+    sim_setpin(doorPins[door].statusOpenInput, (state == SIM_DOOROPEN) || (state == SIM_DOORMOVING));
+    sim_setpin(doorPins[door].statusClosedInput, (state == SIM_DOORCLOSED) || (state == SIM_DOORMOVING));
+}
+
+/*
+* Records every message routed by the broker
+*/
+void sim_record(const char *topic, const uint8_t *data, size_t size, bool retain)
+{
+    char payload[SIM_MAXPAYLOAD];
+    snprintf(payload, sizeof(payload), "%.*s", (int)size, (const char *)data);
+
+    simtopic_t *entry = NULL;
+    for (int i = 0; i < simNumTopics; i++)
+    {
+        if (strcmp(simTopics[i].topic, topic) == 0)
+        {
+            entry = &simTopics[i];
+        }
+    }
+    if ((entry == NULL) && (simNumTopics < SIM_MAXTOPICS))
+    {
+        entry = &simTopics[simNumTopics++];
+        snprintf(entry->topic, sizeof(entry->topic), "%s", topic);
+    }
+    if (entry != NULL)
+    {
+        snprintf(entry->payload, sizeof(entry->payload), "%s", payload);
+        entry->retain = retain;
+        entry->count++;
+    }
+    if (simPublishHook != NULL)
+    {
+        simPublishHook(topic, payload, retain);
+    }
+}
+
+/*
+* Executes a single event
+*/
+void sim_execute(const sim_event_t &event)
+{
+    switch (event.type)
+    {
+    case SIM_EVENTDOOR:
+        sim_setdoor(event.index, event.value);
+        break;
+    case SIM_EVENTINPUT:
+        sim_setpin(event.index, event.value);
+        break;
+    case SIM_EVENTBUTTON:
+        hal_native_setexpanderinput(SIM_HMIEXPANDER, event.index, LOW);
+        break;
+    case SIM_EVENTBUTTONRELEASE:
+        hal_native_setexpanderinput(SIM_HMIEXPANDER, event.index, HIGH);
+        break;
+    case SIM_EVENTSENSORS:
+        hal_native_setenv(true, event.values[0], event.values[1], event.values[2], event.values[3]);
+        break;
+    case SIM_EVENTBROKER:
+        broker_setonline(event.value);
+        break;
+    case SIM_EVENTLINK:
+        hal_native_setlink(event.value);
+        break;
+    case SIM_EVENTCOMMAND:
+        broker_publish(mqtt_topicname(mqtt_doortopic(event.index, MQTT_TOPICCONTROLSETNEWDOORSTATE)), event.text, false);
+        break;
+    }
+}
+
+/*
+* Starts the simulated door movement when the firmware pulses an output
+*/
+void sim_drivedoors()
+{
+    for (int door = 0; door < DOOR_COUNT; door++)
+    {
+        simdoor_t &d = simDoors[door];
+        if (!d.model)
+        {
+            continue;
+        }
+        int openOutput = sim_getpin(doorPins[door].cmdOpenOutput);
+        int closeOutput = sim_getpin(doorPins[door].cmdCloseOutput);
+        uint64_t now = sim_now_ms();
+        if ((openOutput == HIGH) && (d.prevOpenOutput == LOW))
+        {
+            sim_door(now + SIM_DOORSTART_MS, door, SIM_DOORMOVING);
+            sim_door(now + d.travel_ms, door, SIM_DOOROPEN);
+        }
+        if ((closeOutput == HIGH) && (d.prevCloseOutput == LOW))
+        {
+            sim_door(now + SIM_DOORSTART_MS, door, SIM_DOORMOVING);
+            sim_door(now + d.travel_ms, door, SIM_DOORCLOSED);
+        }
+        d.prevOpenOutput = openOutput;
+        d.prevCloseOutput = closeOutput;
+    }
+}
+
+/*
+* Called by the hal whenever the virtual clock advances - fires all due
+* events and services the broker, also while the firmware is blocked
+*/
+void sim_tick()
+{
+    uint64_t now = sim_now_ms();
+    while ((simEventHead < simEventCount) && (simEvents[simEventHead].at_ms <= now))
+    {
+        sim_execute(simEvents[simEventHead++]);
+    }
+    if (simEventHead == simEventCount)
+    {
+        simEventHead = 0;
+        simEventCount = 0;
+    }
+    sim_drivedoors();
+    broker_poll();
+}
+
+/*
+* Starts the virtual clock at start_ms (e.g. shortly before the wrap of
+* millis()), connects the firmware to the in-process broker and runs setup().
+* Every pass of loop() takes looptick_us of virtual time.
+*/
+void sim_init(uint32_t start_ms, uint32_t looptick_us)
+{
+    simLoopTick_us = looptick_us;
+    memset(&simLoopStats, 0, sizeof(simLoopStats));
+    hal_native_setclock(HAL_NATIVE_CLOCKVIRTUAL, start_ms);
+    simStart_us = hal_native_time_us();
+    hal_native_setserial(false, NULL);
+    broker_init();
+    broker_subscribe("#", sim_record);
+    hal_native_settcp(broker_tcp());
+    hal_native_settimehook(sim_tick);
+    for (int door = 0; door < DOOR_COUNT; door++)
+    {
+        sim_setdoor(door, SIM_DOORCLOSED);
+    }
+    setup();
+}
+
+/*
+* Changes the virtual time of a loop() pass. Long soak tests use a coarse
+* tick, the firmware works with a resolution of some 10ms.
+*/
+void sim_setlooptick(uint32_t looptick_us)
+{
+    simLoopTick_us = looptick_us;
+}
+
+/*
+* Lets the simulated drive of a door react on the command pulses. The door
+* starts moving shortly after the pulse and reaches its end position after
+* travel_ms.
+*/
+void sim_doormodel(int door, uint32_t travel_ms)
+{
+    simDoors[door].model = true;
+    simDoors[door].travel_ms = travel_ms;
+}
+
+/*
+* Inserts an event into the queue. Returns false if the queue is full.
+*/
+bool sim_schedule(const sim_event_t &event)
+{
+    if (simEventCount == SIM_MAXEVENTS)
+    {
+        if (simEventHead == 0)
+        {
+            return false;
+        }
+        memmove(simEvents, simEvents + simEventHead, (simEventCount - simEventHead) * sizeof(sim_event_t));
+        simEventCount -= simEventHead;
+        simEventHead = 0;
+    }
+    int pos = simEventCount;
+    while ((pos > simEventHead) && (simEvents[pos - 1].at_ms > event.at_ms))
+    {
+        pos--;
+    }
+    memmove(simEvents + pos + 1, simEvents + pos, (simEventCount - pos) * sizeof(sim_event_t));
+    simEvents[pos] = event;
+    simEventCount++;
+    return true;
+}
+
+/*
+* Helper to create an event
+*/
+sim_event_t sim_event(uint64_t at_ms, uint8_t type, int16_t index, int32_t value)
+{
+    sim_event_t event;
+    memset(&event, 0, sizeof(event));
+    event.at_ms = at_ms;
+    event.type = type;
+    event.index = index;
+    event.value = value;
+    return event;
+}
+
+bool sim_door(uint64_t at_ms, int door, int state)
+{
+    return sim_schedule(sim_event(at_ms, SIM_EVENTDOOR, door, state));
+}
+
+bool sim_input(uint64_t at_ms, uint8_t pin, int value)
+{
+    return sim_schedule(sim_event(at_ms, SIM_EVENTINPUT, pin, value));
+}
+
+/*
+* Presses a button (HMI_BUTTON_xxx) for duration_ms
+*/
+bool sim_button(uint64_t at_ms, int button, uint32_t duration_ms)
+{
+    return sim_schedule(sim_event(at_ms, SIM_EVENTBUTTON, button, 0)) &&
+           sim_schedule(sim_event(at_ms + duration_ms, SIM_EVENTBUTTONRELEASE, button, 0));
+}
+
+bool sim_sensors(uint64_t at_ms, float temperature, float humidity, float pressure, float illuminance)
+{
+    sim_event_t event = sim_event(at_ms, SIM_EVENTSENSORS, 0, 0);
+    event.values[0] = temperature;
+    event.values[1] = humidity;
+    event.values[2] = pressure;
+    event.values[3] = illuminance;
+    return sim_schedule(event);
+}
+
+/*
+* Schedules a linear sensor curve (temperature, humidity, pressure,
+* illuminance) with one event every step_ms. Returns the number of events.
+*/
+int sim_sensorramp(uint64_t from_ms, uint64_t to_ms, uint32_t step_ms, const float from[4], const float to[4])
+{
+    int count = 0;
+    for (uint64_t at = from_ms; at <= to_ms; at += step_ms)
+    {
+        float share = (to_ms > from_ms) ? (float)(at - from_ms) / (to_ms - from_ms) : 1.0f;
+        float values[4];
+        for (int i = 0; i < 4; i++)
+        {
+            values[i] = from[i] + (to[i] - from[i]) * share;
+        }
+        if (!sim_sensors(at, values[0], values[1], values[2], values[3]))
+        {
+            break;
+        }
+        count++;
+    }
+    return count;
+}
+
+bool sim_broker(uint64_t at_ms, bool up)
+{
+    return sim_schedule(sim_event(at_ms, SIM_EVENTBROKER, 0, up));
+}
+
+bool sim_link(uint64_t at_ms, bool up)
+{
+    return sim_schedule(sim_event(at_ms, SIM_EVENTLINK, 0, up));
+}
+
+bool sim_command(uint64_t at_ms, int door, const char *payload)
+{
+    sim_event_t event = sim_event(at_ms, SIM_EVENTCOMMAND, door, 0);
+    snprintf(event.text, sizeof(event.text), "%s", payload);
+    return sim_schedule(event);
+}
+
+/*
+* Parses a single line of a trace. Returns false if the line is invalid.
+*/
+bool sim_parseline(const char *line)
+{
+    unsigned long long at;
+    char type[16];
+    char arg[SIM_MAXTEXT];
+    int n = 0;
+    int value = 0;
+    float values[4];
+
+    while ((*line == ' ') || (*line == '\t'))
+    {
+        line++;
+    }
+    if ((*line == 0) || (*line == '#') || (*line == '\n') || (*line == '\r'))
+    {
+        return true;
+    }
+    if (sscanf(line, "%llu %15s %n", &at, type, &n) != 2)
+    {
+        return false;
+    }
+    line += n;
+
+    if (strcmp(type, "door") == 0)
+    {
+        const char *states[] = {"open", "closed", "moving", "external"};
+        if (sscanf(line, "%d %63s", &value, arg) != 2)
+        {
+            return false;
+        }
+        for (int state = 0; state < 4; state++)
+        {
+            if (strcmp(arg, states[state]) == 0)
+            {
+                return sim_door(at, value, state);
+            }
+        }
+        return false;
+    }
+    if (strcmp(type, "input") == 0)
+    {
+        int pin;
+        return (sscanf(line, "%d %d", &pin, &value) == 2) && sim_input(at, pin, value);
+    }
+    if (strcmp(type, "button") == 0)
+    {
+        if (sscanf(line, "%63s %d", arg, &value) != 2)
+        {
+            return false;
+        }
+        int button = (strcmp(arg, "open") == 0) ? HMI_BUTTON_OPENDOOR : (strcmp(arg, "close") == 0) ? HMI_BUTTON_CLOSEDOOR
+                                                                     : (strcmp(arg, "info") == 0)    ? HMI_BUTTON_SYSTEMINFO
+                                                                                                     : HMI_BUTTON_NONE;
+        return (button != HMI_BUTTON_NONE) && sim_button(at, button, value);
+    }
+    if (strcmp(type, "sensors") == 0)
+    {
+        return (sscanf(line, "%f %f %f %f", &values[0], &values[1], &values[2], &values[3]) == 4) &&
+               sim_sensors(at, values[0], values[1], values[2], values[3]);
+    }
+    if ((strcmp(type, "broker") == 0) || (strcmp(type, "link") == 0))
+    {
+        if (sscanf(line, "%63s", arg) != 1)
+        {
+            return false;
+        }
+        bool up = (strcmp(arg, "up") == 0);
+        if (!up && (strcmp(arg, "down") != 0))
+        {
+            return false;
+        }
+        return (type[0] == 'b') ? sim_broker(at, up) : sim_link(at, up);
+    }
+    if (strcmp(type, "command") == 0)
+    {
+        return (sscanf(line, "%d %63s", &value, arg) == 2) && sim_command(at, value, arg);
+    }
+    return false;
+}
+
+/*
+* Schedules all events of a trace. Returns the number of the first invalid
+* line as a negative value or the number of lines.
+*/
+int sim_loadtrace(const char *text)
+{
+    int lineNumber = 0;
+    while (*text != 0)
+    {
+        char line[128];
+        const char *end = strchr(text, '\n');
+        size_t length = (end != NULL) ? (size_t)(end - text) : strlen(text);
+        snprintf(line, sizeof(line), "%.*s", (int)length, text);
+        lineNumber++;
+        if (!sim_parseline(line))
+        {
+            return -lineNumber;
+        }
+        text += length;
+        if (*text == '\n')
+        {
+            text++;
+        }
+    }
+    return lineNumber;
+}
+
+/*
+* Schedules all events of a trace file. Returns -1 if the file can't be read.
+*/
+int sim_loadfile(const char *path)
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+    {
+        return -1;
+    }
+    int lineNumber = 0;
+    char line[128];
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        lineNumber++;
+        if (!sim_parseline(line))
+        {
+            fclose(file);
+            return -lineNumber;
+        }
+    }
+    fclose(file);
+    return lineNumber;
+}
+
+/*
+* Returns the number of events which have not fired yet
+*/
+int sim_pending()
+{
+    return simEventCount - simEventHead;
+}
+
+/*
+* Runs loop() until duration_ms of virtual time have passed and collects
+* the timing of every pass
+*/
+void sim_run(uint64_t duration_ms)
+{
+    uint64_t end_us = hal_native_time_us() + duration_ms * 1000;
+    hal_native_setsleeplimit(end_us);
+    uint64_t startHost_ns = sim_host_ns();
+    uint64_t startVirtual_us = hal_native_time_us();
+    while (hal_native_time_us() < end_us)
+    {
+        uint64_t pass_ns = sim_host_ns();
+        uint64_t pass_us = hal_native_time_us();
+        loop();
+        pass_ns = sim_host_ns() - pass_ns;
+        pass_us = hal_native_time_us() - pass_us - idle_getstats()->lastSleep_us;
+
+        simLoopStats.passes++;
+        simLoopStats.hostTotal_ns += pass_ns;
+        simLoopStats.virtualTotal_us += pass_us;
+        if (pass_ns > simLoopStats.hostMax_ns)
+        {
+            simLoopStats.hostMax_ns = pass_ns;
+        }
+        if (pass_us > simLoopStats.virtualMax_us)
+        {
+            simLoopStats.virtualMax_us = pass_us;
+        }
+        int bucket = 0;
+        while ((bucket < SIM_HISTOGRAMBUCKETS - 1) && (pass_us >= (1ULL << bucket)))
+        {
+            bucket++;
+        }
+        simLoopStats.histogram[bucket]++;
+
+        hal_native_advance(simLoopTick_us);
+    }
+    hal_native_setsleeplimit(0);
+    simHost_ns += sim_host_ns() - startHost_ns;
+    simVirtual_us += hal_native_time_us() - startVirtual_us;
+}
+
+/*
+* Returns the virtual time since sim_init() in ms
+*/
+uint64_t sim_now_ms()
+{
+    return (hal_native_time_us() - simStart_us) / 1000;
+}
+
+/*
+* Returns how much faster than real time the simulation has run so far
+*/
+double sim_speedup()
+{
+    return (simHost_ns > 0) ? (double)simVirtual_us * 1000 / simHost_ns : 0;
+}
+
+/*
+* Returns how often the firmware has published a topic
+*/
+unsigned long sim_publishcount(const char *topic)
+{
+    for (int i = 0; i < simNumTopics; i++)
+    {
+        if (strcmp(simTopics[i].topic, topic) == 0)
+        {
+            return simTopics[i].count;
+        }
+    }
+    return 0;
+}
+
+/*
+* Returns the last payload of a topic ("" if never published)
+*/
+const char *sim_lastpayload(const char *topic)
+{
+    for (int i = 0; i < simNumTopics; i++)
+    {
+        if (strcmp(simTopics[i].topic, topic) == 0)
+        {
+            return simTopics[i].payload;
+        }
+    }
+    return "";
+}
+
+/*
+* Returns the retain flag of the last publish of a topic
+*/
+bool sim_lastretain(const char *topic)
+{
+    for (int i = 0; i < simNumTopics; i++)
+    {
+        if (strcmp(simTopics[i].topic, topic) == 0)
+        {
+            return simTopics[i].retain;
+        }
+    }
+    return false;
+}
+
+/*
+* Returns the number of sessions the firmware has opened
+*/
+unsigned long sim_connects()
+{
+    return broker_getstats()->connects;
+}
+
+bool sim_connected()
+{
+    return broker_clientconnected(mqttClientID);
+}
+
+const sim_loopstats_t *sim_loopstats()
+{
+    return &simLoopStats;
+}
+
+/*
+* Returns the upper bound of the virtual loop time in us below which the
+* given percentage of all passes stayed (from the histogram). The bound of
+* a bucket is clamped to the longest pass, the last bucket has no bound.
+*/
+uint64_t sim_looppercentile_us(int percent)
+{
+    unsigned long limit = (simLoopStats.passes * percent + 99) / 100;
+    unsigned long sum = 0;
+    for (int bucket = 0; bucket < SIM_HISTOGRAMBUCKETS; bucket++)
+    {
+        sum += simLoopStats.histogram[bucket];
+        if ((sum >= limit) && (bucket < SIM_HISTOGRAMBUCKETS - 1))
+        {
+            uint64_t bound_us = 1ULL << bucket;
+            return (bound_us < simLoopStats.virtualMax_us) ? bound_us : simLoopStats.virtualMax_us;
+        }
+    }
+    return simLoopStats.virtualMax_us;
+}
+
+/*
+* Sets a handler which is called for every publish of the firmware
+*/
+void sim_sethook(void (*hook)(const char *topic, const char *payload, bool retain))
+{
+    simPublishHook = hook;
+}
+
+#endif // ARDUINO
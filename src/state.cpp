@@ -0,0 +1,307 @@
+#include "hal.h"
+
+#include "config.h"
+#include "state.h"
+#include "mqtt.h"
+#include "payload.h"
+#include "resync.h"
+#include "sensors.h"
+#include "supervisor.h"
+#include "idle.h"
+#include "buildfeatures.h"
+
+// fields of the document which changed since the last publish
+#define STATE_FIELDDOORS        0x0001
+#define STATE_FIELDSOURCES      0x0002
+#define STATE_FIELDSENSOR       0x0004      // one bit per sensor value
+#define STATE_FIELDLINK         0x0040
+#define STATE_FIELDCONNECTS     0x0080
+#define STATE_FIELDHEALTHY      0x0100
+
+#define STATE_UNKNOWN           "unknown"
+#define STATE_NOSOURCE          "none"
+
+// the sensor values and the precision they are compared and published with
+struct state_sensor_t
+{
+    const char *name;
+    uint8_t decimals;
+    long scale;
+    float (*get)();
+};
+
+const state_sensor_t stateSensorDefs[] = {
+    {"temperature", 1, 10, sensors_get_temperature},
+    {"humidity", 0, 1, sensors_get_humidity},
+    {"pressure", 1, 10, sensors_get_pressure},
+    {"illuminance", 0, 1, sensors_get_illuminance}};
+
+#define STATE_NUMSENSORS (int)(sizeof(stateSensorDefs) / sizeof(stateSensorDefs[0]))
+
+// the state as last published
+char stateDoors[DOOR_COUNT][STATE_MAXTEXT];
+char stateSources[DOOR_COUNT][STATE_MAXTEXT];
+long stateSensors[STATE_NUMSENSORS];
+bool stateLink = false;
+unsigned long stateConnects = 0;
+bool stateHealthy = true;
+
+uint16_t stateChanged = 0;
+bool stateFullPending = false;
+bool stateWasConnected = false;
+uint32_t stateFullSeq = 0;
+uint32_t prev_ms_poll = 0;
+uint32_t prev_ms_full = 0;
+state_stats_t stateStats;
+
+/*
+* Copies a topic value into a text of the document, returns true if it
+* differs from the previous one
+*/
+bool state_settext(char *text, const char *value, size_t size)
+{
+    if (size >= STATE_MAXTEXT)
+    {
+        size = STATE_MAXTEXT - 1;
+    }
+    if ((strncmp(text, value, size) == 0) && (text[size] == 0))
+    {
+        return false;
+    }
+    memcpy(text, value, size);
+    text[size] = 0;
+    return true;
+}
+
+long state_round(float value, long scale)
+{
+    float scaled = value * scale;
+    return (long)((scaled < 0) ? scaled - 0.5f : scaled + 0.5f);
+}
+
+/*
+* Samples the values which aren't published by the firmware itself
+*/
+void state_poll()
+{
+    if (featureSensors)
+    {
+        for (int i = 0; i < STATE_NUMSENSORS; i++)
+        {
+            long value = state_round(stateSensorDefs[i].get(), stateSensorDefs[i].scale);
+            if (value != stateSensors[i])
+            {
+                stateSensors[i] = value;
+                stateChanged |= STATE_FIELDSENSOR << i;
+            }
+        }
+    }
+    bool link = hal_net_linkup();
+    if (link != stateLink)
+    {
+        stateLink = link;
+        stateChanged |= STATE_FIELDLINK;
+    }
+    unsigned long connects = resync_getstats()->connects;
+    if (connects != stateConnects)
+    {
+        stateConnects = connects;
+        stateChanged |= STATE_FIELDCONNECTS;
+    }
+    bool healthy = supervisor_ishealthy();
+    if (healthy != stateHealthy)
+    {
+        stateHealthy = healthy;
+        stateChanged |= STATE_FIELDHEALTHY;
+    }
+}
+
+/*
+* Publishes the full document (retained) or a delta with the changed fields
+*/
+void state_publish(bool full)
+{
+    uint16_t fields = full ? 0xFFFF : stateChanged;
+    PayloadWriter payload(full ? MQTT_TOPICSTATE : MQTT_TOPICSTATEDELTA, PAYLOAD_SCHEMASTATE);
+    payload.addUint("seq", stateStats.seq);
+    if (fields & STATE_FIELDDOORS)
+    {
+        payload.beginArray("doors", DOOR_COUNT);
+        for (int door = 0; door < DOOR_COUNT; door++)
+        {
+            payload.addString(NULL, stateDoors[door]);
+        }
+        payload.endArray();
+    }
+    else
+    {
+        payload.addMissing("doors");
+    }
+    if (fields & STATE_FIELDSOURCES)
+    {
+        payload.beginArray("sources", DOOR_COUNT);
+        for (int door = 0; door < DOOR_COUNT; door++)
+        {
+            payload.addString(NULL, stateSources[door]);
+        }
+        payload.endArray();
+    }
+    else
+    {
+        payload.addMissing("sources");
+    }
+    for (int i = 0; i < STATE_NUMSENSORS; i++)
+    {
+        const state_sensor_t &def = stateSensorDefs[i];
+        if (featureSensors && (fields & (STATE_FIELDSENSOR << i)))
+        {
+            payload.addNumber(def.name, (float)stateSensors[i] / def.scale, def.decimals);
+        }
+        else
+        {
+            payload.addMissing(def.name);
+        }
+    }
+    if (fields & STATE_FIELDLINK)
+    {
+        payload.addBool("link", stateLink);
+    }
+    else
+    {
+        payload.addMissing("link");
+    }
+    if (fields & STATE_FIELDCONNECTS)
+    {
+        payload.addUint("connects", stateConnects);
+    }
+    else
+    {
+        payload.addMissing("connects");
+    }
+    if (fields & STATE_FIELDHEALTHY)
+    {
+        payload.addBool("healthy", stateHealthy);
+    }
+    else
+    {
+        payload.addMissing("healthy");
+    }
+    payload.publish(full);
+}
+
+/*
+* Starts with unknown doors - is called by the core stage (see boot.h)
+*/
+void state_init()
+{
+    for (int door = 0; door < DOOR_COUNT; door++)
+    {
+        strcpy(stateDoors[door], STATE_UNKNOWN);
+        strcpy(stateSources[door], STATE_NOSOURCE);
+    }
+    memset(stateSensors, 0, sizeof(stateSensors));
+    memset(&stateStats, 0, sizeof(stateStats));
+    stateChanged = 0;
+    stateFullPending = false;
+    stateWasConnected = false;
+    stateFullSeq = 0;
+    prev_ms_poll = hal_millis();
+}
+
+/*
+* Records the values published on the door topics - is called for every
+* publish (see mqtt_send)
+*/
+void state_published(mqtt_topic_t topic, const char *payload, size_t size)
+{
+    if (topic < MQTT_TOPICFIRSTDOOR)
+    {
+        return;
+    }
+    int door = (topic - MQTT_TOPICFIRSTDOOR) / MQTT_NUMDOORTOPICS;
+    mqtt_topic_t doorTopic = (mqtt_topic_t)(MQTT_TOPICFIRSTDOOR + (topic - MQTT_TOPICFIRSTDOOR) % MQTT_NUMDOORTOPICS);
+    if ((doorTopic == MQTT_TOPICCONTROLGETCURRENTDOORSTATE) && state_settext(stateDoors[door], payload, size))
+    {
+        stateChanged |= STATE_FIELDDOORS;
+    }
+    if ((doorTopic == MQTT_TOPICCONTROLCOMMANDSOURCE) && state_settext(stateSources[door], payload, size))
+    {
+        stateChanged |= STATE_FIELDSOURCES;
+    }
+}
+
+/*
+* The full document was requested on gdc/state/get
+*/
+void state_request()
+{
+    stateStats.requests++;
+    stateFullPending = true;
+}
+
+/*
+* Publishes the full document after a connect, on request or to refresh
+* it, and the changes as deltas
+*/
+void state_loop()
+{
+    uint32_t now = hal_millis();
+    bool connected = mqtt_isconnected();
+    if (connected && !stateWasConnected)
+    {
+        stateFullPending = true;
+    }
+    stateWasConnected = connected;
+    if (now - prev_ms_poll >= STATE_POLL_MS)
+    {
+        prev_ms_poll = now;
+        state_poll();
+    }
+    idle_due(IDLE_SOURCESTATE, prev_ms_poll + STATE_POLL_MS);
+    if (!connected)
+    {
+        return;
+    }
+
+    if (!stateFullPending && (stateFullSeq != stateStats.seq) && (now - prev_ms_full >= STATE_REFRESH_MS))
+    {
+        stateFullPending = true;
+    }
+    if (stateFullPending)
+    {
+        // the state of a door which wasn't published since the start is
+        // taken from its inputs
+        for (int door = 0; door < DOOR_COUNT; door++)
+        {
+            if (strcmp(stateDoors[door], STATE_UNKNOWN) == 0)
+            {
+                const char *doorState = mqtt_doorstate(door);
+                state_settext(stateDoors[door], doorState, strlen(doorState));
+            }
+        }
+        // changes which weren't published yet get a seq of their own
+        if (stateChanged)
+        {
+            stateStats.seq++;
+            stateChanged = 0;
+        }
+        stateFullPending = false;
+        stateFullSeq = stateStats.seq;
+        prev_ms_full = now;
+        stateStats.fulls++;
+        state_publish(true);
+        return;
+    }
+    if (stateChanged)
+    {
+        stateStats.seq++;
+        stateStats.deltas++;
+        state_publish(false);
+        stateChanged = 0;
+    }
+}
+
+const state_stats_t *state_getstats()
+{
+    return &stateStats;
+}
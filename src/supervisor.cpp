@@ -0,0 +1,254 @@
+#include "hal.h"
+
+#include "supervisor.h"
+#include "mqtt.h"
+#include "payload.h"
+#include "postmortem.h"
+#include "fixedstring.h"
+
+// budget of one pass and deadline between two check-ins of a module
+struct supervisor_moduledef_t
+{
+    const char *name;
+    bool critical;
+    uint32_t budget_ms;
+    uint32_t deadline_ms;
+};
+
+// the modules in the order of supervisor_module_t - the door control is
+// critical, a blocking broker connect or sensor read is only reported
+const supervisor_moduledef_t supervisorModules[SUPERVISOR_NUMMODULES] = {
+    {"driveio", true, 50, 1000},
+    {"hmi", true, 50, 1000},
+    {"sensors", false, 250, 5000},
+    {"mqtt", false, 2000, 10000},
+    {"display", false, 100, 5000}};
+
+// state of a module
+struct supervisor_state_t
+{
+    bool armed;             // supervised since its first pass
+    uint32_t begin_ms;
+    uint32_t checkin_ms;
+    uint32_t window_ms;
+    uint8_t windowOverruns;
+    const char *pendingEvent;
+    uint32_t pendingElapsed_ms;
+    uint32_t published_ms;
+    bool publishedOnce;
+};
+
+supervisor_stats_t supervisorStats[SUPERVISOR_NUMMODULES];
+supervisor_state_t supervisorState[SUPERVISOR_NUMMODULES];
+supervisor_module_t supervisorActive = SUPERVISOR_NONE;
+supervisor_module_t supervisorUnhealthy = SUPERVISOR_NONE;
+uint32_t supervisorUnhealthy_ms = 0;
+
+/*
+* Publishes an event of a module on gdc/diag/watchdog, e.g.
+* {"module":"sensors","event":"overrun","elapsed_ms":400,"limit_ms":250,"overruns":3}
+*/
+void supervisor_publish(int module, const char *event, uint32_t elapsed_ms)
+{
+    const supervisor_moduledef_t &def = supervisorModules[module];
+    PayloadWriter payload(MQTT_TOPICDIAGWATCHDOG, PAYLOAD_SCHEMAWATCHDOG);
+    payload.addString("module", def.name);
+    payload.addString("event", event);
+    payload.addUint("elapsed_ms", elapsed_ms);
+    payload.addUint("limit_ms", (strcmp(event, SUPERVISOR_EVENTOVERRUN) == 0) ? def.budget_ms : def.deadline_ms);
+    payload.addUint("overruns", supervisorStats[module].overruns);
+    payload.publish(false);
+}
+
+/*
+* Records a warning - it is published by the next supervisor_loop() unless
+* one was published for the module within SUPERVISOR_WINDOW_MS
+*/
+void supervisor_warn(int module, const char *event, uint32_t elapsed_ms)
+{
+    FixedString<80> line;
+    supervisor_state_t &state = supervisorState[module];
+    hal_serial_println(line.format("WARNING: Module %s %s: %lu ms", supervisorModules[module].name, event, (unsigned long)elapsed_ms).c_str());
+    if ((state.pendingEvent == NULL) || (elapsed_ms > state.pendingElapsed_ms))
+    {
+        state.pendingEvent = event;
+        state.pendingElapsed_ms = elapsed_ms;
+    }
+}
+
+/*
+* A critical module got unhealthy - the hardware watchdog isn't cleared
+* anymore and the controller is reset after SUPERVISOR_RESETGRACE_MS
+*/
+void supervisor_escalate(int module, uint32_t elapsed_ms)
+{
+    FixedString<80> line;
+    supervisorStats[module].healthy = false;
+    if (supervisorUnhealthy != SUPERVISOR_NONE)
+    {
+        return;
+    }
+    supervisorUnhealthy = (supervisor_module_t)module;
+    supervisorUnhealthy_ms = hal_millis();
+    hal_serial_println(line.format("ERROR: Module %s is unhealthy, controller reset in %d ms", supervisorModules[module].name, SUPERVISOR_RESETGRACE_MS).c_str());
+
+    // the reset replaces a pending warning of the module
+    supervisor_state_t &state = supervisorState[module];
+    supervisor_publish(module, SUPERVISOR_EVENTRESET, elapsed_ms);
+    state.pendingEvent = NULL;
+    state.published_ms = supervisorUnhealthy_ms;
+    state.publishedOnce = true;
+}
+
+/*
+* Clears all counters - is called by setup() and after a reset which
+* returned (only on the host)
+*/
+void supervisor_init()
+{
+    memset(supervisorStats, 0, sizeof(supervisorStats));
+    memset(supervisorState, 0, sizeof(supervisorState));
+    for (int module = 0; module < SUPERVISOR_NUMMODULES; module++)
+    {
+        supervisorStats[module].healthy = true;
+    }
+    supervisorActive = SUPERVISOR_NONE;
+    supervisorUnhealthy = SUPERVISOR_NONE;
+}
+
+/*
+* Is called right before the loop function of a module
+*/
+void supervisor_begin(supervisor_module_t module)
+{
+    supervisorActive = module;
+    supervisorState[module].begin_ms = hal_millis();
+    postmortem_module(module);
+}
+
+/*
+* Is called right after the loop function of a module: checks the duration
+* of the pass against the budget and deadline of the module and checks in
+*/
+void supervisor_end(supervisor_module_t module)
+{
+    const supervisor_moduledef_t &def = supervisorModules[module];
+    supervisor_state_t &state = supervisorState[module];
+    supervisor_stats_t &stats = supervisorStats[module];
+    uint32_t now = hal_millis();
+    uint32_t elapsed_ms = now - state.begin_ms;
+
+    supervisorActive = SUPERVISOR_NONE;
+    postmortem_module(SUPERVISOR_NONE);
+    stats.passes++;
+    if (elapsed_ms > stats.max_ms)
+    {
+        stats.max_ms = elapsed_ms;
+    }
+    state.armed = true;
+    state.checkin_ms = now;
+    if (elapsed_ms <= def.budget_ms)
+    {
+        return;
+    }
+
+    stats.overruns++;
+    stats.lastOverrun_ms = elapsed_ms - def.budget_ms;
+    if (now - state.window_ms >= SUPERVISOR_WINDOW_MS)
+    {
+        state.window_ms = now;
+        state.windowOverruns = 0;
+    }
+    state.windowOverruns++;
+    supervisor_warn(module, SUPERVISOR_EVENTOVERRUN, elapsed_ms);
+    if (def.critical && ((elapsed_ms > def.deadline_ms) || (state.windowOverruns >= SUPERVISOR_MAXOVERRUNS)))
+    {
+        supervisor_escalate(module, elapsed_ms);
+    }
+
+    // the other modules couldn't run meanwhile - the overrun is blamed on
+    // this module only
+    for (int other = 0; other < SUPERVISOR_NUMMODULES; other++)
+    {
+        supervisorState[other].checkin_ms = now;
+    }
+}
+
+/*
+* Checks the deadlines of all modules, publishes the pending warnings and
+* resets the controller if a critical module is unhealthy for longer than
+* SUPERVISOR_RESETGRACE_MS. Is called once per pass of the main loop.
+*/
+void supervisor_loop()
+{
+    uint32_t now = hal_millis();
+    for (int module = 0; module < SUPERVISOR_NUMMODULES; module++)
+    {
+        const supervisor_moduledef_t &def = supervisorModules[module];
+        supervisor_state_t &state = supervisorState[module];
+        uint32_t elapsed_ms = now - state.checkin_ms;
+        if (state.armed && (elapsed_ms > def.deadline_ms))
+        {
+            // counted once per deadline
+            state.checkin_ms = now;
+            supervisorStats[module].missed++;
+            supervisor_warn(module, SUPERVISOR_EVENTMISSED, elapsed_ms);
+            if (def.critical)
+            {
+                supervisor_escalate(module, elapsed_ms);
+            }
+        }
+
+        if ((state.pendingEvent != NULL) && (!state.publishedOnce || (now - state.published_ms >= SUPERVISOR_WINDOW_MS)))
+        {
+            supervisor_publish(module, state.pendingEvent, state.pendingElapsed_ms);
+            state.pendingEvent = NULL;
+            state.published_ms = now;
+            state.publishedOnce = true;
+        }
+    }
+
+    if ((supervisorUnhealthy != SUPERVISOR_NONE) && (now - supervisorUnhealthy_ms >= SUPERVISOR_RESETGRACE_MS))
+    {
+        FixedString<64> line;
+        hal_serial_println(line.format("ERROR: Controller reset by the supervisor (module %s)", supervisorModules[supervisorUnhealthy].name).c_str());
+        postmortem_setcause(POSTMORTEM_CAUSESUPERVISOR);
+        hal_system_reset();
+
+        // only reached on the host - start over like after a reboot
+        supervisor_init();
+        postmortem_init();
+    }
+}
+
+/*
+* Returns the module whose pass is running and for how long, e.g. in the
+* shutdown handler of the hardware watchdog
+*/
+supervisor_module_t supervisor_getactive(uint32_t *elapsed_ms)
+{
+    if ((supervisorActive != SUPERVISOR_NONE) && (elapsed_ms != NULL))
+    {
+        *elapsed_ms = hal_millis() - supervisorState[supervisorActive].begin_ms;
+    }
+    return supervisorActive;
+}
+
+const char *supervisor_modulename(supervisor_module_t module)
+{
+    return (module < SUPERVISOR_NUMMODULES) ? supervisorModules[module].name : "none";
+}
+
+const supervisor_stats_t *supervisor_getstats(supervisor_module_t module)
+{
+    return &supervisorStats[module];
+}
+
+/*
+* Returns true if all critical modules are healthy - only then the hardware
+* watchdog may be cleared
+*/
+bool supervisor_ishealthy()
+{
+    return supervisorUnhealthy == SUPERVISOR_NONE;
+}
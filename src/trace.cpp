@@ -0,0 +1,147 @@
+#include "hal.h"
+
+#include "config.h"
+#include "driveio.h"
+#include "mqtt.h"
+#include "payload.h"
+#include "trace.h"
+
+/*
+* A trace follows a single remote command from the mqtt callback to the
+* final door state. There is at most one trace per door, a new command
+* replaces the trace of the previous one.
+*/
+struct trace_t
+{
+    bool active;
+    bool complete;
+    int command;
+    uint32_t ms_started;
+    uint32_t us[TRACE_NUMSTAGES];
+    uint8_t marked;
+    char id[TRACE_MAXIDLENGTH + 1];
+};
+
+trace_t traces[DOOR_COUNT];
+
+// used to generate an id if the command didn't provide one
+unsigned long traceCounter = 0;
+
+// forward declarations
+void trace_publish(int door, bool timeout);
+
+/*
+* Starts a new trace for a door. The receive timestamp is taken immediately.
+*/
+void trace_begin(int door, int command, const char* correlationId)
+{
+    trace_t &trace = traces[door];
+    trace.active = true;
+    trace.complete = false;
+    trace.command = command;
+    trace.ms_started = hal_millis();
+    trace.marked = 0;
+    traceCounter++;
+    if ((correlationId != NULL) && (correlationId[0] != 0))
+    {
+        strncpy(trace.id, correlationId, TRACE_MAXIDLENGTH);
+        trace.id[TRACE_MAXIDLENGTH] = 0;
+    }
+    else
+    {
+        snprintf(trace.id, sizeof(trace.id), "gdc-%lu", traceCounter);
+    }
+    trace_mark(door, TRACE_RECEIVED);
+}
+
+/*
+* Takes the timestamp of a stage. Only the first occurence of a stage is
+* recorded, e.g. the first input change of a moving door.
+*/
+void trace_mark(int door, int stage)
+{
+    trace_t &trace = traces[door];
+    if (!trace.active || (trace.marked & (1 << stage)))
+    {
+        return;
+    }
+    trace.us[stage] = hal_micros();
+    trace.marked |= (1 << stage);
+    if (stage == TRACE_FINALSTATE)
+    {
+        trace.complete = true;
+    }
+}
+
+/*
+* Is called by driveio for every status change of a door. The first change
+* after the pulse and the requested end state are recorded.
+*/
+void trace_doorstatus(int door, int status)
+{
+    trace_t &trace = traces[door];
+    if (!trace.active || !(trace.marked & (1 << TRACE_PULSESTART)))
+    {
+        return;
+    }
+    trace_mark(door, TRACE_FIRSTCHANGE);
+    if (((trace.command == DOORCOMMANDOPEN) && (status == DOORSTATUSOPEN)) ||
+        ((trace.command == DOORCOMMANDCLOSE) && (status == DOORSTATUSCLOSED)))
+    {
+        trace_mark(door, TRACE_FINALSTATE);
+    }
+}
+
+/*
+* Publishes completed traces and traces which ran into the timeout. The
+* publishing is done here and not in trace_mark() to keep the mqtt traffic
+* out of the drive io path.
+*/
+void trace_loop()
+{
+    for (int door = 0; door < DOOR_COUNT; door++)
+    {
+        trace_t &trace = traces[door];
+        if (!trace.active)
+        {
+            continue;
+        }
+        if (trace.complete)
+        {
+            trace_publish(door, false);
+        }
+        else if (hal_millis() - trace.ms_started > TRACE_TIMEOUT_MS)
+        {
+            trace_publish(door, true);
+        }
+    }
+}
+
+/*
+* Publishes a trace as json or binary (see payload.h). All stage times are
+* given in us relative to the receive timestamp, stages which were not
+* reached are omitted (null in the binary form).
+*/
+void trace_publish(int door, bool timeout)
+{
+    static const char *stageNames[TRACE_NUMSTAGES] = {"received", "dequeued", "pulse", "change", "final"};
+    trace_t &trace = traces[door];
+    PayloadWriter payload(MQTT_TOPICDIAGTRACE, PAYLOAD_SCHEMATRACE);
+    payload.addString("id", trace.id);
+    payload.addUint("door", door + 1);
+    payload.addString("command", (trace.command == DOORCOMMANDOPEN) ? MQTT_COMMANDDOOROPEN : MQTT_COMMANDDOORCLOSE);
+    for (int stage = 0; stage < TRACE_NUMSTAGES; stage++)
+    {
+        if (trace.marked & (1 << stage))
+        {
+            payload.addUint(stageNames[stage], (unsigned long)(trace.us[stage] - trace.us[TRACE_RECEIVED]));
+        }
+        else
+        {
+            payload.addMissing(stageNames[stage]);
+        }
+    }
+    payload.addBool("timeout", timeout);
+    payload.publish(false);
+    trace.active = false;
+}
\ No newline at end of file
@@ -0,0 +1,256 @@
+#include "hal.h"
+
+#include "config.h"
+#include "driveio.h"
+#include "cmdqueue.h"
+#include "trace.h"
+#include "fixedstring.h"
+#include "sha256.h"
+#include "udpcontrol.h"
+#include "update.h"
+
+// the highest accepted counter on the SD card
+struct udpcontrol_record_t
+{
+    uint32_t magic;
+    uint32_t counter;
+    uint32_t checksum;  // CRC-32 of the fields above
+};
+
+bool udpControlActive = false;
+uint32_t udpLastCounter = 0;
+uint32_t udpSavedCounter = 0;
+uint32_t prev_ms_countersave = 0;
+udpcontrol_stats_t udpStats;
+
+/*
+* Loads the highest accepted counter, a missing file is a first start
+*/
+bool udpcontrol_loadcounter()
+{
+    udpcontrol_record_t record;
+    if (!hal_sd_begin())
+    {
+        return false;
+    }
+    int size = hal_file_read(UDPCONTROL_COUNTERFILE, 0, (uint8_t *)&record, sizeof(record));
+    if (size < 0)
+    {
+        udpLastCounter = 0;
+        udpSavedCounter = 0;
+        return true;
+    }
+    if ((size != sizeof(record)) || (record.magic != UDPCONTROL_COUNTERMAGIC) ||
+        (record.checksum != update_crc32(0, (const uint8_t *)&record, offsetof(udpcontrol_record_t, checksum))))
+    {
+        return false;
+    }
+    udpLastCounter = record.counter;
+    udpSavedCounter = record.counter;
+    return true;
+}
+
+bool udpcontrol_savecounter(uint32_t counter)
+{
+    udpcontrol_record_t record;
+    record.magic = UDPCONTROL_COUNTERMAGIC;
+    record.counter = counter;
+    record.checksum = update_crc32(0, (const uint8_t *)&record, offsetof(udpcontrol_record_t, checksum));
+    prev_ms_countersave = hal_millis();
+    if (!hal_file_write(UDPCONTROL_COUNTERFILE, (const uint8_t *)&record, sizeof(record)))
+    {
+        return false;
+    }
+    udpSavedCounter = counter;
+    udpStats.counterWrites++;
+    return true;
+}
+
+/*
+* Opens the udp socket if the channel is enabled (udpControlPort > 0) and
+* the counter is loaded from the SD card
+*/
+void udpcontrol_init()
+{
+    memset(&udpStats, 0, sizeof(udpStats));
+    udpControlActive = false;
+    if (udpControlPort == 0)
+    {
+        return;
+    }
+    if (!udpcontrol_loadcounter())
+    {
+        hal_serial_println("ERROR: UDP control channel needs a valid " UDPCONTROL_COUNTERFILE " on the SD card");
+        return;
+    }
+    udpControlActive = hal_udp_begin(udpControlPort);
+    if (!udpControlActive)
+    {
+        hal_serial_println("ERROR: UDP control channel can't be started");
+    }
+}
+
+/*
+* Writes a frame with its mac into buffer (UDPCONTROL_FRAMESIZE bytes)
+*/
+void udpcontrol_encode(const udpcontrol_frame_t &frame, const uint8_t *key, size_t keySize, uint8_t *buffer)
+{
+    uint8_t mac[SHA256_DIGESTSIZE];
+    buffer[0] = UDPCONTROL_MAGIC;
+    buffer[1] = UDPCONTROL_VERSION;
+    buffer[2] = frame.type;
+    buffer[3] = frame.door;
+    buffer[4] = frame.value;
+    buffer[5] = frame.result;
+    buffer[6] = (uint8_t)(frame.seq >> 8);
+    buffer[7] = (uint8_t)frame.seq;
+    for (int i = 0; i < 4; i++)
+    {
+        buffer[8 + i] = (uint8_t)(frame.counter >> (24 - 8 * i));
+    }
+    hmac_sha256(key, keySize, buffer, UDPCONTROL_MACOFFSET, mac);
+    memcpy(buffer + UDPCONTROL_MACOFFSET, mac, UDPCONTROL_MACSIZE);
+}
+
+/*
+* Checks the size, header and mac of a frame and reads its fields. The mac
+* is compared in constant time. Returns UDPCONTROL_FRAMEVALID or the reason
+* the frame is dropped.
+*/
+uint8_t udpcontrol_decode(const uint8_t *buffer, size_t size, const uint8_t *key, size_t keySize, udpcontrol_frame_t *frame)
+{
+    if ((size != UDPCONTROL_FRAMESIZE) || (buffer[0] != UDPCONTROL_MAGIC) || (buffer[1] != UDPCONTROL_VERSION))
+    {
+        return UDPCONTROL_FRAMEMALFORMED;
+    }
+    uint8_t mac[SHA256_DIGESTSIZE];
+    hmac_sha256(key, keySize, buffer, UDPCONTROL_MACOFFSET, mac);
+    uint8_t difference = 0;
+    for (int i = 0; i < UDPCONTROL_MACSIZE; i++)
+    {
+        difference |= mac[i] ^ buffer[UDPCONTROL_MACOFFSET + i];
+    }
+    if (difference != 0)
+    {
+        return UDPCONTROL_FRAMEBADMAC;
+    }
+    frame->type = buffer[2];
+    frame->door = buffer[3];
+    frame->value = buffer[4];
+    frame->result = buffer[5];
+    frame->seq = ((uint16_t)buffer[6] << 8) | buffer[7];
+    frame->counter = ((uint32_t)buffer[8] << 24) | ((uint32_t)buffer[9] << 16) | ((uint32_t)buffer[10] << 8) | buffer[11];
+    return UDPCONTROL_FRAMEVALID;
+}
+
+/*
+* Executes a valid frame and returns the result for the status frame
+*/
+uint8_t udpcontrol_execute(const udpcontrol_frame_t &request, uint16_t *seq)
+{
+    FixedString<80> line;
+    if ((request.door < 1) || (request.door > DOOR_COUNT))
+    {
+        return UDPCONTROL_INVALID;
+    }
+    if (request.type == UDPCONTROL_QUERY)
+    {
+        return UDPCONTROL_OK;
+    }
+    if ((request.type != UDPCONTROL_COMMAND) || ((request.value != DOORCOMMANDOPEN) && (request.value != DOORCOMMANDCLOSE)))
+    {
+        return UDPCONTROL_INVALID;
+    }
+
+    int door = request.door - 1;
+    *seq = cmdqueue_push(door, request.value, CMDQUEUE_SOURCEREMOTE);
+    line.format("RUN: UDP: %s door %d (counter=%lu", (request.value == DOORCOMMANDOPEN) ? "open" : "close", request.door,
+                (unsigned long)request.counter);
+    if (*seq == 0)
+    {
+        line.append(", rejected)");
+        hal_serial_println(line.c_str());
+        return UDPCONTROL_REJECTED;
+    }
+    line.appendf(", seq=%u)", *seq);
+    hal_serial_println(line.c_str());
+
+    FixedString<16> correlationId;
+    trace_begin(door, request.value, correlationId.format("udp-%lu", (unsigned long)request.counter).c_str());
+    return UDPCONTROL_OK;
+}
+
+/*
+* Handles the waiting frames and answers every valid one with the current
+* state of its door
+*/
+void udpcontrol_loop()
+{
+    if (!udpControlActive)
+    {
+        return;
+    }
+    if ((udpSavedCounter != udpLastCounter) && (hal_millis() - prev_ms_countersave >= UDPCONTROL_SAVEINTERVAL_MS))
+    {
+        udpcontrol_savecounter(udpLastCounter);
+    }
+    const uint8_t *key = (const uint8_t *)udpControlKey;
+    size_t keySize = strlen(udpControlKey);
+    for (int i = 0; i < UDPCONTROL_MAXPERPASS; i++)
+    {
+        uint8_t buffer[UDPCONTROL_FRAMESIZE];
+        IPAddress remoteIp;
+        uint16_t remotePort;
+        int size = hal_udp_receive(buffer, sizeof(buffer), &remoteIp, &remotePort);
+        if (size <= 0)
+        {
+            return;
+        }
+        udpStats.received++;
+
+        udpcontrol_frame_t request;
+        uint8_t valid = udpcontrol_decode(buffer, size, key, keySize, &request);
+        if (valid == UDPCONTROL_FRAMEMALFORMED)
+        {
+            udpStats.malformed++;
+            continue;
+        }
+        if (valid == UDPCONTROL_FRAMEBADMAC)
+        {
+            udpStats.badMac++;
+            continue;
+        }
+        if (request.counter <= udpLastCounter)
+        {
+            udpStats.replayed++;
+            continue;
+        }
+        // a command must never be accepted twice, not even after a reset
+        if ((request.type == UDPCONTROL_COMMAND) && !udpcontrol_savecounter(request.counter))
+        {
+            udpStats.counterFailures++;
+            hal_serial_println("ERROR: UDP control counter can't be written, command dropped");
+            continue;
+        }
+        udpLastCounter = request.counter;
+        udpStats.accepted++;
+
+        udpcontrol_frame_t status;
+        status.type = UDPCONTROL_STATUS;
+        status.door = request.door;
+        status.seq = 0;
+        status.result = udpcontrol_execute(request, &status.seq);
+        status.value = (status.result == UDPCONTROL_INVALID) ? 0 : driveio_getcurrentdoorstatus(request.door - 1);
+        status.counter = request.counter;
+        udpcontrol_encode(status, key, keySize, buffer);
+        hal_udp_send(remoteIp, remotePort, buffer, UDPCONTROL_FRAMESIZE);
+    }
+}
+
+/*
+* Returns the counters of the control channel
+*/
+const udpcontrol_stats_t *udpcontrol_getstats()
+{
+    return &udpStats;
+}
@@ -0,0 +1,288 @@
+#include "hal.h"
+
+#include "update.h"
+#include "mqtt.h"
+#include "payload.h"
+#include "postmortem.h"
+#include "fixedstring.h"
+
+#define UPDATE_STATEMAGIC   0x47445355UL    // "GDSU"
+
+// progress of the transfer as written to UPDATE_STATEFILE - only whole
+// sectors are recorded
+struct update_record_t
+{
+    uint32_t magic;
+    uint32_t state;
+    uint32_t size;
+    uint32_t crc;
+    uint32_t next;
+    uint32_t imageCrc;          // crc of the chunks before next
+    uint32_t checksum;          // crc of the words above
+};
+
+const char *const updateStates[] = {"idle", "receiving", "complete", "failed"};
+
+// CRC-32 with a table of 16 entries - four bits per step
+const uint32_t updateCrcTable[16] = {
+    0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+    0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C};
+
+update_stats_t updateStats;
+uint32_t updateImageCrc = 0;
+uint32_t updateSectorCrc = 0;       // crc of the chunks before the sector
+uint8_t updateSector[UPDATE_SECTORSIZE];
+bool updateStatusPending = false;
+bool updateRateStarted = false;     // start_ms is set by the next chunk
+
+/*
+* Continues the CRC-32 of a block (start with 0) - the same as zlib.crc32
+*/
+uint32_t update_crc32(uint32_t crc, const uint8_t *data, size_t size)
+{
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++)
+    {
+        crc = updateCrcTable[(crc ^ data[i]) & 0x0F] ^ (crc >> 4);
+        crc = updateCrcTable[(crc ^ (data[i] >> 4)) & 0x0F] ^ (crc >> 4);
+    }
+    return ~crc;
+}
+
+uint32_t update_chunks(uint32_t size)
+{
+    return (size + UPDATE_CHUNKSIZE - 1) / UPDATE_CHUNKSIZE;
+}
+
+/*
+* Bytes of the image before chunk next
+*/
+uint32_t update_bytes(uint32_t next)
+{
+    uint32_t bytes = next * UPDATE_CHUNKSIZE;
+    return (bytes < updateStats.size) ? bytes : updateStats.size;
+}
+
+uint32_t update_le32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/*
+* Writes the progress - is called after every sector
+*/
+bool update_saverecord()
+{
+    update_record_t record;
+    record.magic = UPDATE_STATEMAGIC;
+    record.state = updateStats.state;
+    record.size = updateStats.size;
+    record.crc = updateStats.crc;
+    record.next = updateStats.next;
+    record.imageCrc = updateImageCrc;
+    record.checksum = update_crc32(0, (const uint8_t *)&record, offsetof(update_record_t, checksum));
+    return hal_file_write(UPDATE_STATEFILE, (const uint8_t *)&record, sizeof(record));
+}
+
+/*
+* Starts a new image - the staged file of the previous one is removed
+*/
+void update_start(uint32_t size, uint32_t crc)
+{
+    FixedString<80> line;
+    hal_serial_println(line.format("RUN: Update of %lu bytes started (crc %08lx)", (unsigned long)size, (unsigned long)crc).c_str());
+    postmortem_event("update started");
+    hal_file_remove(UPDATE_IMAGEFILE);
+    updateStats.state = UPDATE_STATERECEIVING;
+    updateStats.size = size;
+    updateStats.crc = crc;
+    updateStats.next = 0;
+    updateStats.received = 0;
+    updateImageCrc = 0;
+    updateRateStarted = false;
+}
+
+/*
+* The transfer can't go on - the sender has to start over with chunk 0
+*/
+void update_fail(const char *reason)
+{
+    FixedString<80> line;
+    hal_serial_println(line.format("ERROR: Update failed (%s)", reason).c_str());
+    updateStats.state = UPDATE_STATEFAILED;
+    updateStats.errors++;
+    update_saverecord();
+}
+
+/*
+* Writes the sector of the chunk before next and checks the image after
+* the last chunk
+*/
+void update_flush()
+{
+    uint32_t chunks = update_chunks(updateStats.size);
+    uint32_t first = (updateStats.next - 1) / UPDATE_CHUNKSPERSECTOR * UPDATE_CHUNKSPERSECTOR;
+    uint32_t offset = first * UPDATE_CHUNKSIZE;
+    uint32_t end = (updateStats.next == chunks) ? updateStats.size : updateStats.next * UPDATE_CHUNKSIZE;
+    if (!hal_file_writeat(UPDATE_IMAGEFILE, offset, updateSector, end - offset))
+    {
+        // the chunks of the sector have to be sent again
+        hal_serial_println("WARNING: Update sector not written");
+        updateStats.next = first;
+        updateStats.received = update_bytes(first);
+        updateImageCrc = updateSectorCrc;
+        updateStats.errors++;
+        return;
+    }
+    updateStats.sectorWrites++;
+    if (updateStats.next == chunks)
+    {
+        if (updateImageCrc != updateStats.crc)
+        {
+            update_fail("image crc");
+            return;
+        }
+        updateStats.state = UPDATE_STATECOMPLETE;
+        hal_serial_println("RUN: Update image complete");
+        postmortem_event("update complete");
+    }
+    update_saverecord();
+}
+
+/*
+* Handles a chunk received on gdc/update/chunk
+*/
+void update_chunk(const uint8_t *payload, size_t size)
+{
+    if ((size < UPDATE_HEADERSIZE) || (payload[0] != UPDATE_VERSION))
+    {
+        updateStats.errors++;
+        updateStatusPending = true;
+        return;
+    }
+    uint32_t index = (uint32_t)payload[2] | ((uint32_t)payload[3] << 8);
+    uint32_t imageSize = update_le32(payload + 4);
+    uint32_t imageCrc = update_le32(payload + 8);
+    uint32_t chunkCrc = update_le32(payload + 12);
+    const uint8_t *data = payload + UPDATE_HEADERSIZE;
+    size_t length = size - UPDATE_HEADERSIZE;
+
+    uint32_t chunks = update_chunks(imageSize);
+    uint32_t expected = (index + 1 < chunks) ? UPDATE_CHUNKSIZE : imageSize - index * UPDATE_CHUNKSIZE;
+    if ((imageSize == 0) || (imageSize > UPDATE_MAXIMAGESIZE) || (index >= chunks) || (length != expected) || (update_crc32(0, data, length) != chunkCrc))
+    {
+        updateStats.errors++;
+        updateStatusPending = true;
+        return;
+    }
+
+    // chunk 0 of another image or of a failed one starts over
+    bool sameImage = (imageSize == updateStats.size) && (imageCrc == updateStats.crc);
+    if ((index == 0) && (!sameImage || (updateStats.state == UPDATE_STATEFAILED)))
+    {
+        update_start(imageSize, imageCrc);
+        sameImage = true;
+    }
+    if (!sameImage || (updateStats.state != UPDATE_STATERECEIVING) || (index > updateStats.next))
+    {
+        // the status tells the sender where to go on
+        updateStats.errors += (sameImage && (index > updateStats.next));
+        updateStatusPending = true;
+        return;
+    }
+    if (index < updateStats.next)
+    {
+        updateStats.duplicates++;
+        return;
+    }
+
+    uint32_t now = hal_millis();
+    if (!updateRateStarted)
+    {
+        updateRateStarted = true;
+        updateStats.start_ms = now;
+        updateStats.startReceived = updateStats.received;
+    }
+    if (index % UPDATE_CHUNKSPERSECTOR == 0)
+    {
+        updateSectorCrc = updateImageCrc;
+    }
+    memcpy(updateSector + (index % UPDATE_CHUNKSPERSECTOR) * UPDATE_CHUNKSIZE, data, length);
+    updateImageCrc = update_crc32(updateImageCrc, data, length);
+    updateStats.next++;
+    updateStats.received += length;
+    updateStats.last_ms = now;
+    if ((updateStats.next % UPDATE_CHUNKSPERSECTOR == 0) || (updateStats.next == chunks))
+    {
+        update_flush();
+        updateStatusPending = true;
+    }
+}
+
+/*
+* Publishes the state of the transfer (retained) on gdc/update/status
+*/
+void update_publish()
+{
+    uint32_t elapsed_ms = updateStats.last_ms - updateStats.start_ms;
+    uint32_t bytes = (updateStats.received > updateStats.startReceived) ? updateStats.received - updateStats.startReceived : 0;
+    PayloadWriter payload(MQTT_TOPICUPDATESTATUS, PAYLOAD_SCHEMAUPDATE);
+    payload.addString("state", updateStates[updateStats.state]);
+    payload.addUint("size", updateStats.size);
+    payload.addUint("crc", updateStats.crc);
+    payload.addUint("next", updateStats.next);
+    payload.addUint("received", updateStats.received);
+    payload.addUint("rate_bps", (updateRateStarted && (elapsed_ms > 0)) ? (unsigned long)((uint64_t)bytes * 1000 / elapsed_ms) : 0UL);
+    payload.addUint("errors", updateStats.errors);
+    payload.publish(true);
+}
+
+/*
+* Loads the progress of an interrupted transfer from the SD card - is
+* called by the config stage (see boot.h)
+*/
+void update_init()
+{
+    FixedString<80> line;
+    memset(&updateStats, 0, sizeof(updateStats));
+    updateImageCrc = 0;
+    updateStatusPending = true;
+    updateRateStarted = false;
+
+    update_record_t record;
+    if (!hal_sd_begin() || (hal_file_read(UPDATE_STATEFILE, 0, (uint8_t *)&record, sizeof(record)) != sizeof(record)))
+    {
+        return;
+    }
+    if ((record.magic != UPDATE_STATEMAGIC) || (record.state > UPDATE_STATEFAILED) ||
+        (record.checksum != update_crc32(0, (const uint8_t *)&record, offsetof(update_record_t, checksum))))
+    {
+        hal_serial_println("WARNING: Update state on the SD card is invalid");
+        return;
+    }
+    updateStats.state = record.state;
+    updateStats.size = record.size;
+    updateStats.crc = record.crc;
+    updateStats.next = record.next;
+    updateStats.received = update_bytes(record.next);
+    updateImageCrc = record.imageCrc;
+    hal_serial_println(line.format("INIT: Update %s at chunk %lu of %lu", updateStates[record.state], (unsigned long)record.next,
+                                   (unsigned long)update_chunks(record.size)).c_str());
+}
+
+/*
+* Publishes the state when it has changed and the broker is connected
+*/
+void update_loop()
+{
+    if (updateStatusPending && mqtt_isconnected())
+    {
+        updateStatusPending = false;
+        update_publish();
+    }
+}
+
+const update_stats_t *update_getstats()
+{
+    return &updateStats;
+}
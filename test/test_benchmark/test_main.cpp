@@ -0,0 +1,354 @@
+/*
+* Microbenchmarks of the firmware hot paths on the native target. Every
+* benchmark calls a real function of the firmware many times and reports
+* the time and the heap allocations per call, the payload encoders also the
+* size of the payload. The results are written as
+* json (GDC_BENCHMARK_OUTPUT, default benchmark.json) and can be compared
+* with a baseline by scripts/benchmark_compare.py.
+*
+*   pio test -e native -f test_benchmark
+*/
+#include <unity.h>
+#include <stdlib.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "hal.h"
+#include "hal_native.h"
+#include "config.h"
+#include "driveio.h"
+#include "hmi.h"
+#include "mqtt.h"
+#include "sensors.h"
+#include "cmdqueue.h"
+#include "heapstats.h"
+#include "payload.h"
+
+#define BENCHMARK_ITERATIONS    5000
+#define BENCHMARK_WARMUP        50
+#define BENCHMARK_MAXRESULTS    20
+
+// firmware functions of main.cpp which have no header
+extern bool mainFirstRun;
+void publish_sensor_values();
+void show_page_overview();
+void show_page_sensors();
+void show_page_driveio();
+void show_page_hmi();
+void show_page_mqtt();
+void show_page_system();
+
+struct benchmark_t
+{
+    const char *name;
+    unsigned long iterations;
+    double nsPerCall;
+    double cyclesPerCall;
+    double allocationsPerCall;
+    size_t payloadBytes;
+};
+
+benchmark_t results[BENCHMARK_MAXRESULTS];
+int numResults = 0;
+
+/*
+* Tcp back end which accepts the mqtt session and swallows all packets, so
+* the publish path runs completely without a network
+*/
+const uint8_t sinkConnack[] = {0x20, 0x02, 0x00, 0x00};
+size_t sinkRxPos = sizeof(sinkConnack);
+bool sinkConnected = false;
+unsigned long sinkBytesWritten = 0;
+
+bool sink_connect(const char *host, uint16_t port)
+{
+    sinkConnected = true;
+    sinkRxPos = 0;
+    return true;
+}
+
+bool sink_connected()
+{
+    return sinkConnected;
+}
+
+size_t sink_write(const uint8_t *buffer, size_t size)
+{
+    sinkBytesWritten += size;
+    return size;
+}
+
+int sink_available()
+{
+    return sizeof(sinkConnack) - sinkRxPos;
+}
+
+int sink_read(uint8_t *buffer, size_t size)
+{
+    size_t count = 0;
+    while ((count < size) && (sinkRxPos < sizeof(sinkConnack)))
+    {
+        buffer[count++] = sinkConnack[sinkRxPos++];
+    }
+    return count;
+}
+
+void sink_stop()
+{
+    sinkConnected = false;
+}
+
+const hal_native_tcpops_t sinkTcp = {sink_connect, sink_connected, sink_write, sink_available, sink_read, sink_stop};
+
+/*
+* Returns the monotonic host time in ns
+*/
+uint64_t benchmark_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/*
+* Returns the cpu cycle counter (0 if the host has none)
+*/
+uint64_t benchmark_cycles()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+/*
+* Runs a function BENCHMARK_ITERATIONS times after a short warmup and
+* records the cost per call
+*/
+const benchmark_t &benchmark(const char *name, void (*function)())
+{
+    for (int i = 0; i < BENCHMARK_WARMUP; i++)
+    {
+        function();
+    }
+
+    unsigned long allocations = heapstats_getallocations();
+    uint64_t cycles = benchmark_cycles();
+    uint64_t ns = benchmark_ns();
+    for (int i = 0; i < BENCHMARK_ITERATIONS; i++)
+    {
+        function();
+    }
+    ns = benchmark_ns() - ns;
+    cycles = benchmark_cycles() - cycles;
+    allocations = heapstats_getallocations() - allocations;
+
+    benchmark_t &result = results[numResults++];
+    result.name = name;
+    result.iterations = BENCHMARK_ITERATIONS;
+    result.nsPerCall = (double)ns / BENCHMARK_ITERATIONS;
+    result.cyclesPerCall = (double)cycles / BENCHMARK_ITERATIONS;
+    result.allocationsPerCall = (double)allocations / BENCHMARK_ITERATIONS;
+    result.payloadBytes = 0;
+    printf("%-24s %10.1f ns %12.1f cycles %6.2f allocations\n", name, result.nsPerCall, result.cyclesPerCall, result.allocationsPerCall);
+    return result;
+}
+
+/*
+* Writes all results as json
+*/
+void benchmark_write(const char *path)
+{
+    FILE *file = fopen(path, "w");
+    if (file == NULL)
+    {
+        printf("cannot write %s\n", path);
+        return;
+    }
+    fprintf(file, "{\"version\":\"%s\",\"benchmarks\":[\n", version);
+    for (int i = 0; i < numResults; i++)
+    {
+        const benchmark_t &result = results[i];
+        fprintf(file, "  {\"name\":\"%s\",\"iterations\":%lu,\"ns_per_call\":%.1f,\"cycles_per_call\":%.1f,\"allocations_per_call\":%.3f",
+                result.name, result.iterations, result.nsPerCall, result.cyclesPerCall, result.allocationsPerCall);
+        if (result.payloadBytes > 0)
+        {
+            fprintf(file, ",\"payload_bytes\":%u", (unsigned int)result.payloadBytes);
+        }
+        fprintf(file, "}%s\n", (i + 1 < numResults) ? "," : "");
+    }
+    fprintf(file, "]}\n");
+    fclose(file);
+    printf("results written to %s\n", path);
+}
+
+// functions under test
+void bench_publish_sensor_values()
+{
+    mainFirstRun = true;
+    publish_sensor_values();
+}
+
+void bench_mqtt_publish()
+{
+    mqtt_publish(mqtt_doortopic(0, MQTT_TOPICCONTROLGETCURRENTDOORSTATE), MQTT_STATUSDOOROPENING, false);
+}
+
+// size of the last encoded payload
+size_t payloadBytes = 0;
+
+/*
+* Encodes the sensors topic like publish_sensor_values without sending it
+*/
+void encode_sensors(bool binary)
+{
+    PayloadWriter payload(MQTT_TOPICSYSTEMSENSORS, PAYLOAD_SCHEMASENSORS, binary);
+    payload.addMeasurement("temperature", sensors_get_temperature(), 1, "°C");
+    payload.addMeasurement("humidity", sensors_get_humidity(), 0, "%");
+    payload.addMeasurement("pressure", sensors_get_pressure(), 0, "kPa");
+    payload.addMeasurement("illuminance", sensors_get_illuminance(), 4, "lx");
+    payload.end();
+    payloadBytes = payload.size();
+}
+
+void bench_encode_sensors_json()
+{
+    encode_sensors(false);
+}
+
+void bench_encode_sensors_binary()
+{
+    encode_sensors(true);
+}
+
+/*
+* Encodes the delivery counters (diag/delivery)
+*/
+void encode_delivery(bool binary)
+{
+    const mqttclient_stats_t *stats = mqtt_getdeliverystats();
+    PayloadWriter payload(MQTT_TOPICDIAGDELIVERY, PAYLOAD_SCHEMADELIVERY, binary);
+    payload.addUint("published", stats->published);
+    payload.addUint("acked", stats->acknowledged);
+    payload.addUint("retransmits", stats->retransmits);
+    payload.addUint("expired", stats->expired);
+    payload.addUint("downgraded", stats->downgraded);
+    payload.addUint("duplicates", stats->duplicates);
+    payload.addUint("ack_mean_us", 1740526);
+    payload.addUint("ack_max_us", 8001550);
+    payload.end();
+    payloadBytes = payload.size();
+}
+
+void bench_encode_delivery_json()
+{
+    encode_delivery(false);
+}
+
+void bench_encode_delivery_binary()
+{
+    encode_delivery(true);
+}
+
+void bench_hmi_display_frame()
+{
+    DisplayLine text[4];
+    text[0].append("Version 0.1.5");
+    text[1].append("Copyright smhex");
+    text[2].append("Ethernet connected");
+    text[3].append("MQTT connected");
+    hmi_display_frame("GarageDoorController", text, 4);
+}
+
+void bench_driveio_loop()
+{
+    driveio_loop();
+}
+
+void setUp()
+{
+}
+
+void tearDown()
+{
+}
+
+/*
+* Every benchmarked path must work without the heap
+*/
+void run(const char *name, void (*function)())
+{
+    const benchmark_t &result = benchmark(name, function);
+    TEST_ASSERT_EQUAL(0, result.allocationsPerCall * result.iterations);
+}
+
+/*
+* Benchmarks a payload encoder and records the size of its payload
+*/
+size_t run_encoder(const char *name, void (*function)())
+{
+    run(name, function);
+    results[numResults - 1].payloadBytes = payloadBytes;
+    printf("%-24s %10u bytes\n", name, (unsigned int)payloadBytes);
+    return payloadBytes;
+}
+
+void test_encode_sensors()
+{
+    size_t json = run_encoder("encode_sensors_json", bench_encode_sensors_json);
+    size_t binary = run_encoder("encode_sensors_binary", bench_encode_sensors_binary);
+    TEST_ASSERT_LESS_THAN(json / 4, binary);
+}
+
+void test_encode_delivery()
+{
+    size_t json = run_encoder("encode_delivery_json", bench_encode_delivery_json);
+    size_t binary = run_encoder("encode_delivery_binary", bench_encode_delivery_binary);
+    TEST_ASSERT_LESS_THAN(json / 4, binary);
+}
+
+void test_publish_sensor_values() { run("publish_sensor_values", bench_publish_sensor_values); }
+void test_mqtt_publish() { run("mqtt_publish", bench_mqtt_publish); }
+void test_hmi_display_frame() { run("hmi_display_frame", bench_hmi_display_frame); }
+void test_driveio_loop() { run("driveio_loop", bench_driveio_loop); }
+void test_show_page_overview() { run("show_page_overview", show_page_overview); }
+void test_show_page_sensors() { run("show_page_sensors", show_page_sensors); }
+void test_show_page_driveio() { run("show_page_driveio", show_page_driveio); }
+void test_show_page_hmi() { run("show_page_hmi", show_page_hmi); }
+void test_show_page_mqtt() { run("show_page_mqtt", show_page_mqtt); }
+void test_show_page_system() { run("show_page_system", show_page_system); }
+
+int main(int argc, char **argv)
+{
+    // the firmware runs against the simulated hardware and the sink, the
+    // serial output is dropped to measure only the firmware itself
+    hal_native_setserial(false, NULL);
+    hal_native_settcp(&sinkTcp);
+    hmi_init();
+    sensors_init();
+    driveio_init();
+    cmdqueue_init();
+    mqtt_init();
+    sensors_loop();
+
+    UNITY_BEGIN();
+    RUN_TEST(test_publish_sensor_values);
+    RUN_TEST(test_mqtt_publish);
+    RUN_TEST(test_encode_sensors);
+    RUN_TEST(test_encode_delivery);
+    RUN_TEST(test_hmi_display_frame);
+    RUN_TEST(test_driveio_loop);
+    RUN_TEST(test_show_page_overview);
+    RUN_TEST(test_show_page_sensors);
+    RUN_TEST(test_show_page_driveio);
+    RUN_TEST(test_show_page_hmi);
+    RUN_TEST(test_show_page_mqtt);
+    RUN_TEST(test_show_page_system);
+
+    const char *output = getenv("GDC_BENCHMARK_OUTPUT");
+    benchmark_write((output != NULL) ? output : "benchmark.json");
+    return UNITY_END();
+}
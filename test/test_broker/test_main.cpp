@@ -0,0 +1,896 @@
+/*
+* Tests of the local MQTT broker (broker.h) and benchmarks of the firmware
+* against it: the round trip of a remote command and the maximum sustained
+* publish rate, in-process and over a loopback socket. The udp control
+* channel (udpcontrol.h), the runtime settings (settings.h), the firmware
+* staging (update.h) and the aggregated state (state.h) are tested here as
+* well. The firmware runs on
+* the simulator (sim.h). The benchmark results are written as json
+* (GDC_BENCHMARK_OUTPUT, default broker.json) in the format of
+* scripts/benchmark_compare.py.
+*
+*   pio test -e native -f test_broker
+*/
+#include <unity.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "hal.h"
+#include "hal_native.h"
+#include "config.h"
+#include "mqtt.h"
+#include "cmdqueue.h"
+#include "broker.h"
+#include "resync.h"
+#include "payload.h"
+#include "driveio.h"
+#include "sha256.h"
+#include "udpcontrol.h"
+#include "settings.h"
+#include "update.h"
+#include "state.h"
+#include "sensors.h"
+#include "sim.h"
+
+#define TEST_TRAVEL_MS          2000
+#define TEST_ROUNDTRIPS         500
+#define TEST_RATEDURATION_NS    500000000ULL
+#define TEST_MAXRESULTS         8
+
+struct result_t
+{
+    const char *name;
+    unsigned long iterations;
+    double nsPerCall;
+};
+
+result_t results[TEST_MAXRESULTS];
+int numResults = 0;
+
+// observations of the test observer
+unsigned long received = 0;
+unsigned long responses = 0;
+bool lastRetain = false;
+
+void onMessage(const char *topic, const uint8_t *payload, size_t size, bool retain)
+{
+    received++;
+    lastRetain = retain;
+}
+
+void onResponse(const char *topic, const uint8_t *payload, size_t size, bool retain)
+{
+    responses++;
+}
+
+unsigned long retainedPublishes = 0;
+
+void onRetained(const char *topic, const uint8_t *payload, size_t size, bool retain)
+{
+    retainedPublishes += retain;
+}
+
+uint8_t sensorsPayload[PAYLOAD_MAXSIZE];
+size_t sensorsSize = 0;
+
+void onSensors(const char *topic, const uint8_t *payload, size_t size, bool retain)
+{
+    sensorsSize = (size < sizeof(sensorsPayload)) ? size : sizeof(sensorsPayload);
+    memcpy(sensorsPayload, payload, sensorsSize);
+}
+
+char deltaPayload[PAYLOAD_MAXSIZE + 1];
+unsigned long deltas = 0;
+
+void onDelta(const char *topic, const uint8_t *payload, size_t size, bool retain)
+{
+    size = (size < PAYLOAD_MAXSIZE) ? size : PAYLOAD_MAXSIZE;
+    memcpy(deltaPayload, payload, size);
+    deltaPayload[size] = 0;
+    deltas++;
+}
+
+char tracePayload[PAYLOAD_MAXSIZE + 1];
+
+void onTrace(const char *topic, const uint8_t *payload, size_t size, bool retain)
+{
+    size = (size < PAYLOAD_MAXSIZE) ? size : PAYLOAD_MAXSIZE;
+    memcpy(tracePayload, payload, size);
+    tracePayload[size] = 0;
+}
+
+/*
+* Returns the monotonic host time in ns
+*/
+uint64_t host_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void record(const char *name, unsigned long iterations, uint64_t ns)
+{
+    result_t &result = results[numResults++];
+    result.name = name;
+    result.iterations = iterations;
+    result.nsPerCall = (double)ns / iterations;
+    printf("%-24s %10.1f ns %12.0f per second\n", name, result.nsPerCall, 1e9 / result.nsPerCall);
+}
+
+/*
+* Sends a command to the first door and runs the firmware until it has
+* echoed the new door state. Returns the virtual round trip time in us.
+*/
+uint64_t roundtrip(const char *command)
+{
+    unsigned long count = responses;
+    uint64_t start_us = hal_native_time_us();
+    broker_publish(mqtt_topicname(mqtt_doortopic(0, MQTT_TOPICCONTROLSETNEWDOORSTATE)), command, false);
+    while ((responses == count) && (hal_native_time_us() - start_us < 1000000))
+    {
+        sim_run(1);
+    }
+    return hal_native_time_us() - start_us;
+}
+
+/*
+* Reconnects the firmware over a new transport
+*/
+void reconnect(const hal_native_tcpops_t *tcp)
+{
+    hal_native_settcp(tcp);
+    sim_run(3000);
+}
+
+/*
+* Sends a control frame to the firmware and runs it until the status frame
+* has arrived, returns false if it doesn't come within 100ms
+*/
+bool udp_exchange(int sock, const uint8_t *frame, udpcontrol_frame_t *status)
+{
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(hal_native_udpport());
+    sendto(sock, frame, UDPCONTROL_FRAMESIZE, 0, (struct sockaddr *)&address, sizeof(address));
+
+    uint8_t buffer[64];
+    for (int i = 0; i < 100; i++)
+    {
+        sim_run(1);
+        ssize_t size = recv(sock, buffer, sizeof(buffer), MSG_DONTWAIT);
+        if (size > 0)
+        {
+            return udpcontrol_decode(buffer, size, (const uint8_t *)udpControlKey, strlen(udpControlKey), status) == UDPCONTROL_FRAMEVALID;
+        }
+    }
+    return false;
+}
+
+void setUp()
+{
+}
+
+void tearDown()
+{
+    broker_setlatency(0);
+    broker_setloss(0, 1);
+}
+
+void test_topic_matches()
+{
+    TEST_ASSERT_TRUE(broker_topicmatches("gdc/system/status", "gdc/system/status"));
+    TEST_ASSERT_FALSE(broker_topicmatches("gdc/system/status", "gdc/system/statu"));
+    TEST_ASSERT_FALSE(broker_topicmatches("gdc/system", "gdc/system/status"));
+    TEST_ASSERT_TRUE(broker_topicmatches("gdc/+/status", "gdc/system/status"));
+    TEST_ASSERT_FALSE(broker_topicmatches("gdc/+", "gdc/system/status"));
+    TEST_ASSERT_TRUE(broker_topicmatches("gdc/#", "gdc/system/status"));
+    TEST_ASSERT_TRUE(broker_topicmatches("gdc/#", "gdc"));
+    TEST_ASSERT_TRUE(broker_topicmatches("#", "gdc/system/status"));
+    TEST_ASSERT_TRUE(broker_topicmatches("+/+/+", "gdc/system/status"));
+    TEST_ASSERT_FALSE(broker_topicmatches("#", "$SYS/broker/uptime"));
+}
+
+/*
+* The firmware connects with its will and publishes retained topics, which
+* are delivered to new subscribers with the retain flag
+*/
+void test_connect_retained()
+{
+    sim_run(3000);
+    TEST_ASSERT_TRUE(broker_clientconnected(mqttClientID));
+    TEST_ASSERT_EQUAL_STRING(mqttFirstWillMsg, broker_retained(mqtt_topicname(MQTT_TOPICSYSTEMSTATUS)));
+
+    received = 0;
+    TEST_ASSERT_TRUE(broker_subscribe(mqtt_topicname(MQTT_TOPICSYSTEMSTATUS), onMessage));
+    TEST_ASSERT_EQUAL(1, received);
+    TEST_ASSERT_TRUE(lastRetain);
+}
+
+/*
+* An abrupt close publishes the will, a DISCONNECT does not
+*/
+void test_will()
+{
+    unsigned long wills = broker_getstats()->wills;
+    hal_tcp_stop();
+    TEST_ASSERT_EQUAL(wills + 1, broker_getstats()->wills);
+    TEST_ASSERT_EQUAL_STRING(mqttLastWillMsg, broker_retained(mqtt_topicname(MQTT_TOPICSYSTEMSTATUS)));
+
+    sim_run(5000);
+    TEST_ASSERT_TRUE(broker_clientconnected(mqttClientID));
+    TEST_ASSERT_EQUAL_STRING(mqttFirstWillMsg, broker_retained(mqtt_topicname(MQTT_TOPICSYSTEMSTATUS)));
+
+    // a regular disconnect of the client
+    const uint8_t disconnect[] = {0xE0, 0x00};
+    hal_tcp_write(disconnect, sizeof(disconnect));
+    hal_tcp_stop();
+    TEST_ASSERT_EQUAL(wills + 1, broker_getstats()->wills);
+    TEST_ASSERT_EQUAL_STRING(mqttFirstWillMsg, broker_retained(mqtt_topicname(MQTT_TOPICSYSTEMSTATUS)));
+    sim_run(5000);
+    TEST_ASSERT_TRUE(broker_clientconnected(mqttClientID));
+}
+
+/*
+* After a reconnect only the retained topics the broker doesn't hold with the
+* current payload are resent, followed by one snapshot
+*/
+void test_resync()
+{
+    const char *doorTopic = mqtt_topicname(MQTT_TOPICCONTROLGETCURRENTDOORSTATE);
+    sim_run(2000);
+    TEST_ASSERT_NOT_NULL(broker_retained(doorTopic));
+    char state[16];
+    strcpy(state, broker_retained(doorTopic));
+
+    // a stale door state on the broker is corrected, info is not resent
+    broker_publish(doorTopic, strcmp(state, MQTT_STATUSDOOROPEN) == 0 ? MQTT_STATUSDOORCLOSED : MQTT_STATUSDOOROPEN, true);
+    broker_subscribe(mqtt_topicname(MQTT_TOPICSYSTEMINFO), onRetained);
+    unsigned long resent = resync_getstats()->resent;
+    retainedPublishes = 0;
+    hal_tcp_stop();
+    sim_run(3000);
+    TEST_ASSERT_TRUE(broker_clientconnected(mqttClientID));
+    TEST_ASSERT_EQUAL_STRING(state, broker_retained(doorTopic));
+    TEST_ASSERT_EQUAL(0, retainedPublishes);
+    TEST_ASSERT_EQUAL(resent + 2, resync_getstats()->resent); // status (will) and door
+    TEST_ASSERT_NOT_NULL(strstr(broker_retained(mqtt_topicname(MQTT_TOPICSYSTEMINFO)), "\"application\""));
+}
+
+/*
+* The reconnect delay doubles up to the maximum, half of it is random
+*/
+void test_reconnect_jitter()
+{
+    uint32_t cap_ms = mqttReconnectMin_ms;
+    for (uint8_t attempt = 0; attempt < 8; attempt++)
+    {
+        uint32_t delay_ms = resync_reconnectdelay(attempt);
+        TEST_ASSERT_GREATER_OR_EQUAL(cap_ms / 2, delay_ms);
+        TEST_ASSERT_LESS_OR_EQUAL(cap_ms, delay_ms);
+        cap_ms = (2 * cap_ms < (uint32_t)mqttReconnectMax_ms) ? 2 * cap_ms : mqttReconnectMax_ms;
+    }
+
+    // devices with another seed reconnect at other times
+    uint32_t delays[2][4];
+    for (int device = 0; device < 2; device++)
+    {
+        resync_init(resync_hash(device == 0 ? "gdc-a" : "gdc-b", 5));
+        for (int i = 0; i < 4; i++)
+        {
+            delays[device][i] = resync_reconnectdelay(3);
+        }
+    }
+    TEST_ASSERT_TRUE(memcmp(delays[0], delays[1], sizeof(delays[0])) != 0);
+}
+
+/*
+* Door states are published with QoS 1: publishes lost on the way to the
+* broker are retransmitted until they are acknowledged
+*/
+void test_qos1_retransmit()
+{
+    const mqttclient_stats_t *stats = mqtt_getdeliverystats();
+    unsigned long published = stats->published;
+    unsigned long acknowledged = stats->acknowledged;
+    unsigned long retransmits = stats->retransmits;
+    const char *doorTopic = mqtt_topicname(MQTT_TOPICCONTROLGETCURRENTDOORSTATE);
+
+    broker_setloss(0, 4711);
+    broker_setpublishloss(50);
+    for (int cycle = 0; cycle < 4; cycle++)
+    {
+        const char *command = (cycle % 2 == 0) ? MQTT_COMMANDDOOROPEN : MQTT_COMMANDDOORCLOSE;
+        broker_publish(mqtt_topicname(MQTT_TOPICCONTROLSETNEWDOORSTATE), command, false);
+        sim_run(TEST_TRAVEL_MS + 15000);
+        TEST_ASSERT_EQUAL_STRING((cycle % 2 == 0) ? MQTT_STATUSDOOROPEN : MQTT_STATUSDOORCLOSED, broker_retained(doorTopic));
+    }
+    broker_setpublishloss(0);
+    sim_run(5000);
+
+    printf("qos 1: %lu published, %lu retransmits, ack mean %lu us max %lu us\n", stats->published - published,
+           stats->retransmits - retransmits, (unsigned long)(stats->ackLatencyTotal_us / stats->acknowledged),
+           (unsigned long)stats->ackLatencyMax_us);
+    TEST_ASSERT_GREATER_THAN(published, stats->published);
+    TEST_ASSERT_EQUAL(stats->published - published, stats->acknowledged - acknowledged);
+    TEST_ASSERT_GREATER_THAN(retransmits, stats->retransmits);
+    TEST_ASSERT_EQUAL(0, stats->expired);
+}
+
+/*
+* Commands are subscribed with QoS 1: a redelivered command is executed once
+*/
+void test_qos1_duplicates()
+{
+    unsigned long duplicates = mqtt_getdeliverystats()->duplicates;
+    unsigned long accepted = cmdqueue_getstats()->accepted;
+    broker_setduplicates(100);
+    broker_publish(mqtt_topicname(MQTT_TOPICCONTROLSETNEWDOORSTATE), MQTT_COMMANDDOOROPEN, false);
+    sim_run(100);
+    broker_setduplicates(0);
+    TEST_ASSERT_EQUAL(duplicates + 1, mqtt_getdeliverystats()->duplicates);
+    TEST_ASSERT_EQUAL(accepted + 1, cmdqueue_getstats()->accepted);
+    sim_run(TEST_TRAVEL_MS + 1000);
+}
+
+/*
+* Topics selected in mqttBinaryTopics are published as schema version and
+* CBOR array, a retained one is resent in the new form after a reconnect
+*/
+void test_binary_payloads()
+{
+    broker_subscribe(mqtt_topicname(MQTT_TOPICSYSTEMSENSORS), onSensors);
+    sensorsSize = 0;
+    sim_run(11000);
+    TEST_ASSERT_EQUAL('{', sensorsPayload[0]);
+    size_t jsonSize = sensorsSize;
+
+    mqttBinaryTopics = (1UL << MQTT_TOPICSYSTEMSENSORS) | (1UL << MQTT_TOPICSYSTEMINFO);
+    hal_tcp_stop();
+    sim_run(11000);
+    printf("sensors: json %u bytes, binary %u bytes\n", (unsigned int)jsonSize, (unsigned int)sensorsSize);
+    TEST_ASSERT_EQUAL(2 + 4 * 5, sensorsSize);
+    TEST_ASSERT_EQUAL(PAYLOAD_SCHEMASENSORS, sensorsPayload[0]);
+    TEST_ASSERT_EQUAL(0x84, sensorsPayload[1]);
+    TEST_ASSERT_EQUAL(0xFA, sensorsPayload[2]);
+    const char *info = broker_retained(mqtt_topicname(MQTT_TOPICSYSTEMINFO));
+    TEST_ASSERT_EQUAL(PAYLOAD_SCHEMAINFO, info[0]);
+    TEST_ASSERT_EQUAL(0x83, (uint8_t)info[1]);
+
+    mqttBinaryTopics = 0;
+    hal_tcp_stop();
+    sim_run(3000);
+    TEST_ASSERT_NOT_NULL(strstr(broker_retained(mqtt_topicname(MQTT_TOPICSYSTEMINFO)), "\"application\""));
+}
+
+/*
+* RFC 4231 test case 2
+*/
+void test_hmac_sha256()
+{
+    const char *data = "what do ya want for nothing?";
+    const uint8_t expected[SHA256_DIGESTSIZE] = {
+        0x5b, 0xdc, 0xc1, 0x46, 0xbf, 0x60, 0x75, 0x4e, 0x6a, 0x04, 0x24, 0x26, 0x08, 0x95, 0x75, 0xc7,
+        0x5a, 0x00, 0x3f, 0x08, 0x9d, 0x27, 0x39, 0x83, 0x9d, 0xec, 0x58, 0xb9, 0x64, 0xec, 0x38, 0x43};
+    uint8_t mac[SHA256_DIGESTSIZE];
+    hmac_sha256((const uint8_t *)"Jefe", 4, (const uint8_t *)data, strlen(data), mac);
+    TEST_ASSERT_EQUAL_UINT8_ARRAY(expected, mac, SHA256_DIGESTSIZE);
+}
+
+/*
+* A signed command over the udp control channel moves the door while the
+* broker is down and is answered at once, replayed (also after a reset) and
+* forged frames are dropped without an answer
+*/
+void test_udp_control()
+{
+    const uint8_t *key = (const uint8_t *)udpControlKey;
+    size_t keySize = strlen(udpControlKey);
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    TEST_ASSERT_TRUE(sock >= 0);
+    TEST_ASSERT_TRUE(hal_native_udpport() > 0);
+    sim_broker(sim_now_ms(), false);
+    sim_run(100);
+    TEST_ASSERT_FALSE(sim_connected());
+
+    uint8_t frame[UDPCONTROL_FRAMESIZE];
+    udpcontrol_frame_t request = {UDPCONTROL_QUERY, 1, 0, 0, 0, 1000};
+    udpcontrol_frame_t status;
+    udpcontrol_encode(request, key, keySize, frame);
+    TEST_ASSERT_TRUE(udp_exchange(sock, frame, &status));
+    TEST_ASSERT_EQUAL(UDPCONTROL_STATUS, status.type);
+    TEST_ASSERT_EQUAL(1000, status.counter);
+    TEST_ASSERT_EQUAL(driveio_getcurrentdoorstatus(0), status.value);
+
+    int command = (status.value == DOORSTATUSOPEN) ? DOORCOMMANDCLOSE : DOORCOMMANDOPEN;
+    int target = (command == DOORCOMMANDOPEN) ? DOORSTATUSOPEN : DOORSTATUSCLOSED;
+    request.type = UDPCONTROL_COMMAND;
+    request.value = command;
+    request.counter = 1001;
+    udpcontrol_encode(request, key, keySize, frame);
+    uint64_t start_us = hal_native_time_us();
+    TEST_ASSERT_TRUE(udp_exchange(sock, frame, &status));
+    printf("udp command answered after %lu us\n", (unsigned long)(hal_native_time_us() - start_us));
+    TEST_ASSERT_EQUAL(UDPCONTROL_OK, status.result);
+    TEST_ASSERT_TRUE(status.seq != 0);
+    sim_run(TEST_TRAVEL_MS + 1000);
+    TEST_ASSERT_EQUAL(target, driveio_getcurrentdoorstatus(0));
+
+    // the same frame again and a frame with a wrong mac
+    const udpcontrol_stats_t *stats = udpcontrol_getstats();
+    unsigned long accepted = stats->accepted;
+    TEST_ASSERT_FALSE(udp_exchange(sock, frame, &status));
+    TEST_ASSERT_EQUAL(1, stats->replayed);
+    request.counter = 1002;
+    udpcontrol_encode(request, (const uint8_t *)"wrong key", 9, frame);
+    TEST_ASSERT_FALSE(udp_exchange(sock, frame, &status));
+    TEST_ASSERT_EQUAL(1, stats->badMac);
+    TEST_ASSERT_EQUAL(accepted, stats->accepted);
+
+    // after a reset the counter is loaded from the SD card, the command
+    // stays a replay
+    request.counter = 1001;
+    udpcontrol_encode(request, key, keySize, frame);
+    udpcontrol_init();
+    TEST_ASSERT_FALSE(udp_exchange(sock, frame, &status));
+    TEST_ASSERT_EQUAL(1, stats->replayed);
+
+    // an unknown door is answered as invalid
+    request.door = DOOR_COUNT + 1;
+    request.counter = 1002;
+    udpcontrol_encode(request, key, keySize, frame);
+    TEST_ASSERT_TRUE(udp_exchange(sock, frame, &status));
+    TEST_ASSERT_EQUAL(UDPCONTROL_INVALID, status.result);
+
+    close(sock);
+    sim_broker(sim_now_ms(), true);
+    sim_run(5000);
+    TEST_ASSERT_TRUE(sim_connected());
+}
+
+/*
+* The injected latency delays every packet in both directions
+*/
+void test_latency()
+{
+    uint64_t direct_us = roundtrip("open");
+    sim_run(TEST_TRAVEL_MS + 1000);
+    broker_setlatency(20000);
+    uint64_t delayed_us = roundtrip("close");
+    sim_run(TEST_TRAVEL_MS + 1000);
+    // packets already on their way keep the latency
+    broker_setlatency(0);
+    sim_run(100);
+    printf("command round trip %lu us, with 20ms latency %lu us\n", (unsigned long)direct_us, (unsigned long)delayed_us);
+    TEST_ASSERT_LESS_THAN(10000, direct_us);
+    TEST_ASSERT_GREATER_OR_EQUAL(40000, delayed_us);
+    TEST_ASSERT_LESS_THAN(60000, delayed_us);
+}
+
+/*
+* A correlation id is published with the trace of the command, an id which
+* would break the json is replaced
+*/
+void test_correlation_id()
+{
+    broker_subscribe(mqtt_topicname(MQTT_TOPICDIAGTRACE), onTrace);
+    roundtrip("open:a\"}x");
+    sim_run(TEST_TRAVEL_MS + 1000);
+    printf("trace: %s\n", tracePayload);
+    TEST_ASSERT_NOT_NULL(strstr(tracePayload, "{\"id\":\"gdc-"));
+    roundtrip("close:job-7.a_b");
+    sim_run(TEST_TRAVEL_MS + 1000);
+    TEST_ASSERT_NOT_NULL(strstr(tracePayload, "{\"id\":\"job-7.a_b\","));
+}
+
+/*
+* The injected loss drops a share of the publishes
+*/
+void test_loss()
+{
+    const unsigned long count = 2000;
+    broker_setloss(30, 12345);
+    unsigned long routed = broker_getstats()->publishesReceived;
+    unsigned long dropped = broker_getstats()->publishesDropped;
+    received = 0;
+    for (unsigned long i = 0; i < count; i++)
+    {
+        mqtt_publish(MQTT_TOPICSYSTEMSTATUS, mqttFirstWillMsg, false);
+    }
+    printf("%lu of %lu publishes received with 30%% loss\n", received, count);
+    TEST_ASSERT_EQUAL(routed + count, broker_getstats()->publishesReceived);
+    TEST_ASSERT_GREATER_OR_EQUAL(count - received, broker_getstats()->publishesDropped - dropped);
+    TEST_ASSERT_GREATER_THAN(count * 60 / 100, received);
+    TEST_ASSERT_LESS_THAN(count * 80 / 100, received);
+}
+
+/*
+* Host time of a remote command from the broker to the echo of the firmware
+*/
+void test_benchmark_roundtrip()
+{
+    uint64_t total_ns = 0;
+    uint64_t virtual_us = 0;
+    uint64_t max_us = 0;
+    for (int i = 0; i < TEST_ROUNDTRIPS; i++)
+    {
+        uint64_t start_ns = host_ns();
+        uint64_t roundtrip_us = roundtrip((i % 2 == 0) ? "open" : "close");
+        total_ns += host_ns() - start_ns;
+        virtual_us += roundtrip_us;
+        if (roundtrip_us > max_us)
+        {
+            max_us = roundtrip_us;
+        }
+        sim_run(TEST_TRAVEL_MS + 1000);
+    }
+    printf("virtual round trip mean %.0f us max %lu us\n", (double)virtual_us / TEST_ROUNDTRIPS, (unsigned long)max_us);
+    record("command_roundtrip", TEST_ROUNDTRIPS, total_ns);
+    TEST_ASSERT_LESS_THAN(100000, max_us);
+}
+
+/*
+* Publishes of the firmware as fast as possible for a fixed time. Records
+* the host time per publish which arrived at the observer.
+*/
+void benchmark_rate(const char *name, bool poll)
+{
+    unsigned long published = 0;
+    received = 0;
+    uint64_t start_ns = host_ns();
+    while (host_ns() - start_ns < TEST_RATEDURATION_NS)
+    {
+        for (int i = 0; i < 100; i++)
+        {
+            mqtt_publish(MQTT_TOPICSYSTEMSTATUS, mqttFirstWillMsg, false);
+            if (poll)
+            {
+                broker_poll();
+            }
+        }
+        published += 100;
+    }
+    while (poll && (received < published) && (host_ns() - start_ns < 2 * TEST_RATEDURATION_NS))
+    {
+        broker_poll();
+    }
+    uint64_t ns = host_ns() - start_ns;
+    TEST_ASSERT_EQUAL(published, received);
+    record(name, received, ns);
+}
+
+void test_benchmark_rate_inprocess()
+{
+    benchmark_rate("publish_rate_inprocess", false);
+}
+
+/*
+* The firmware connects to the broker over a loopback socket
+*/
+void test_benchmark_rate_loopback()
+{
+    uint16_t port = broker_listen(0);
+    TEST_ASSERT_GREATER_THAN(0, port);
+    hal_native_setbroker("127.0.0.1", port);
+    reconnect(NULL);
+    TEST_ASSERT_TRUE(broker_clientconnected(mqttClientID));
+    TEST_ASSERT_FALSE(broker_tcp()->connected());
+
+    unsigned long count = responses;
+    roundtrip("open");
+    TEST_ASSERT_EQUAL(count + 1, responses);
+    sim_run(TEST_TRAVEL_MS + 1000);
+
+    benchmark_rate("publish_rate_loopback", true);
+
+    reconnect(broker_tcp());
+    broker_close();
+    TEST_ASSERT_TRUE(broker_clientconnected(mqttClientID));
+}
+
+/*
+* Devices sharing a broker use their own client id and topic prefix
+*/
+void test_device_prefix()
+{
+    TEST_ASSERT_FALSE(mqtt_setdevice("a-client-id-which-is-too-long", "site"));
+    TEST_ASSERT_TRUE(mqtt_setdevice("gdc-garage2", "site/garage2"));
+    TEST_ASSERT_EQUAL_STRING("site/garage2/control/commandsource", mqtt_topicname(MQTT_TOPICCONTROLCOMMANDSOURCE));
+    TEST_ASSERT_EQUAL_STRING("control/commandsource", mqtt_topicpath(mqtt_doortopic(DOOR_COUNT - 1, MQTT_TOPICCONTROLCOMMANDSOURCE)));
+    hal_tcp_stop();
+    sim_run(5000);
+    TEST_ASSERT_TRUE(broker_clientconnected("gdc-garage2"));
+    TEST_ASSERT_EQUAL_STRING(mqttFirstWillMsg, broker_retained("site/garage2/system/status"));
+    TEST_ASSERT_EQUAL_STRING(mqttLastWillMsg, broker_retained("gdc/system/status"));
+
+    // the door state is resent on the new topic, commands are received on
+    // the new topic only
+    TEST_ASSERT_NOT_NULL(broker_retained("site/garage2/control/getcurrentdoorstate"));
+    bool closed = (strcmp(broker_retained("site/garage2/control/getcurrentdoorstate"), MQTT_STATUSDOORCLOSED) == 0);
+    const char *command = closed ? MQTT_COMMANDDOOROPEN : MQTT_COMMANDDOORCLOSE;
+    broker_publish("gdc/control/setnewdoorstate", command, false);
+    sim_run(TEST_TRAVEL_MS * 2);
+    TEST_ASSERT_EQUAL(closed, strcmp(broker_retained("site/garage2/control/getcurrentdoorstate"), MQTT_STATUSDOORCLOSED) == 0);
+    broker_publish("site/garage2/control/setnewdoorstate", command, false);
+    sim_run(TEST_TRAVEL_MS * 2);
+    TEST_ASSERT_EQUAL(!closed, strcmp(broker_retained("site/garage2/control/getcurrentdoorstate"), MQTT_STATUSDOORCLOSED) == 0);
+}
+
+/*
+* With the topic prefix a payload of PAYLOAD_MAXSIZE doesn't fit into the
+* send buffer - it is dropped and neither counted nor recorded as retained
+*/
+void test_publish_too_large()
+{
+    const char *topic = mqtt_topicname(MQTT_TOPICCONFIGACTIVE);
+    TEST_ASSERT_GREATER_THAN(MQTTCLIENT_BUFFERSIZE - 5 - 2 - PAYLOAD_MAXSIZE, strlen(topic));
+    char payload[PAYLOAD_MAXSIZE + 1];
+    memset(payload, 'x', PAYLOAD_MAXSIZE);
+    payload[PAYLOAD_MAXSIZE] = 0;
+    int sent = mqtt_getpacketssent();
+    mqtt_publish(MQTT_TOPICCONFIGACTIVE, payload, true);
+    sim_run(100);
+    TEST_ASSERT_EQUAL(sent, mqtt_getpacketssent());
+    TEST_ASSERT_TRUE((broker_retained(topic) == NULL) || (strcmp(payload, broker_retained(topic)) != 0));
+    TEST_ASSERT_TRUE(resync_isdivergent(MQTT_TOPICCONFIGACTIVE, payload, PAYLOAD_MAXSIZE));
+    TEST_ASSERT_TRUE(sim_connected());
+}
+
+/*
+* Settings from the retained config topic are applied at once, echoed and
+* cached on the SD card. A document with an invalid field changes nothing,
+* the cache is loaded like after a reboot and an empty document restores
+* the defaults.
+*/
+void test_settings()
+{
+    const char *setTopic = mqtt_topicname(MQTT_TOPICCONFIGSET);
+    const char *activeTopic = mqtt_topicname(MQTT_TOPICCONFIGACTIVE);
+    const char *sensorsTopic = mqtt_topicname(MQTT_TOPICSYSTEMSENSORS);
+    const settings_stats_t *stats = settings_getstats();
+    int defaultDisplay_ms = displayTimeout_ms;
+    int defaultSensors_ms = sensorInterval_ms;
+    TEST_ASSERT_NOT_NULL(strstr(broker_retained(activeTopic), "\"source\":\"default\""));
+
+    broker_publish(setTopic, "{\"display_ms\": 60000, \"sensors_ms\":2000}", true);
+    sim_run(100);
+    TEST_ASSERT_EQUAL(60000, displayTimeout_ms);
+    TEST_ASSERT_EQUAL(2000, sensorInterval_ms);
+    printf("settings: %s\n", broker_retained(activeTopic));
+    TEST_ASSERT_NOT_NULL(strstr(broker_retained(activeTopic), "{\"display_ms\":60000,"));
+    TEST_ASSERT_NOT_NULL(strstr(broker_retained(activeTopic), "\"source\":\"broker\",\"rejected\":\"\"}"));
+    TEST_ASSERT_EQUAL(1, stats->cacheWrites);
+    unsigned long sensors = sim_publishcount(sensorsTopic);
+    sim_run(10000);
+    TEST_ASSERT_GREATER_OR_EQUAL(4, sim_publishcount(sensorsTopic) - sensors);
+
+    // the document is delivered again after a reconnect, it isn't cached again
+    hal_tcp_stop();
+    sim_run(5000);
+    TEST_ASSERT_TRUE(sim_connected());
+    TEST_ASSERT_EQUAL(1, stats->cacheWrites);
+
+    broker_publish(setTopic, "{\"display_ms\":5000,\"debounce_ms\":1,\"speed\":3}", true);
+    sim_run(100);
+    TEST_ASSERT_EQUAL(60000, displayTimeout_ms);
+    TEST_ASSERT_EQUAL(1, stats->rejected);
+    TEST_ASSERT_NOT_NULL(strstr(broker_retained(activeTopic), "\"rejected\":\"debounce_ms,speed\"}"));
+    broker_publish(setTopic, "{\"display_ms\":\"60000\"}", true);
+    sim_run(100);
+    TEST_ASSERT_EQUAL(2, stats->rejected);
+
+    // a document larger than the receive buffer is rejected as a whole
+    char document[MQTTCLIENT_BUFFERSIZE + 16];
+    memset(document, ' ', sizeof(document) - 1);
+    document[sizeof(document) - 1] = '\0';
+    memcpy(document, "{\"display_ms\":5000", 17);
+    document[sizeof(document) - 2] = '}';
+    broker_publish(setTopic, document, false);
+    sim_run(100);
+    TEST_ASSERT_EQUAL(60000, displayTimeout_ms);
+    TEST_ASSERT_EQUAL(3, stats->rejected);
+    TEST_ASSERT_NOT_NULL(strstr(broker_retained(activeTopic), "\"rejected\":\"document\"}"));
+    TEST_ASSERT_TRUE(sim_connected());
+
+    // after a reboot the cache is active before the broker is connected
+    settings_init();
+    TEST_ASSERT_EQUAL(SETTINGS_SOURCESD, stats->source);
+    TEST_ASSERT_EQUAL(60000, displayTimeout_ms);
+    TEST_ASSERT_EQUAL(2000, sensorInterval_ms);
+
+    uint8_t buffer[SETTINGS_MAXDOCUMENT];
+    broker_publish(setTopic, "", true);
+    sim_run(100);
+    TEST_ASSERT_EQUAL(defaultDisplay_ms, displayTimeout_ms);
+    TEST_ASSERT_EQUAL(defaultSensors_ms, sensorInterval_ms);
+    TEST_ASSERT_EQUAL(SETTINGS_SOURCEDEFAULT, stats->source);
+    TEST_ASSERT_EQUAL(-1, hal_file_read(SETTINGS_CACHEFILE, 0, buffer, sizeof(buffer)));
+}
+
+/*
+* Publishes chunk index of an image on gdc/update/chunk - the chunk crc
+* doesn't match the data if corrupt is set
+*/
+void send_chunk(const uint8_t *image, uint32_t size, uint32_t crc, uint16_t index, bool corrupt)
+{
+    uint8_t chunk[UPDATE_HEADERSIZE + UPDATE_CHUNKSIZE];
+    uint32_t offset = index * UPDATE_CHUNKSIZE;
+    uint32_t length = (size - offset < UPDATE_CHUNKSIZE) ? size - offset : UPDATE_CHUNKSIZE;
+    uint32_t chunkCrc = update_crc32(0, image + offset, length) ^ (corrupt ? 1 : 0);
+    uint32_t header[3] = {size, crc, chunkCrc};
+    chunk[0] = UPDATE_VERSION;
+    chunk[1] = 0;
+    chunk[2] = index & 0xFF;
+    chunk[3] = index >> 8;
+    memcpy(chunk + 4, header, sizeof(header));
+    memcpy(chunk + UPDATE_HEADERSIZE, image + offset, length);
+    broker_publish(mqtt_topicname(MQTT_TOPICUPDATECHUNK), chunk, UPDATE_HEADERSIZE + length, false);
+    sim_run(10);
+}
+
+void test_update()
+{
+    const char *statusTopic = mqtt_topicname(MQTT_TOPICUPDATESTATUS);
+    const update_stats_t *stats = update_getstats();
+    uint8_t image[1000];
+    uint8_t staged[sizeof(image)];
+    for (size_t i = 0; i < sizeof(image); i++)
+    {
+        image[i] = (uint8_t)(i * 7 + (i >> 8));
+    }
+    uint32_t crc = update_crc32(0, image, sizeof(image));
+    TEST_ASSERT_EQUAL_UINT32(0xCBF43926, update_crc32(0, (const uint8_t *)"123456789", 9));
+
+    // the first sector is written, chunk 4 is lost by a reset
+    for (uint16_t index = 0; index < 5; index++)
+    {
+        send_chunk(image, sizeof(image), crc, index, false);
+    }
+    TEST_ASSERT_EQUAL(UPDATE_STATERECEIVING, stats->state);
+    TEST_ASSERT_EQUAL(1, stats->sectorWrites);
+    TEST_ASSERT_NOT_NULL(strstr(broker_retained(statusTopic), "\"next\":4,\"received\":512,"));
+    update_init();
+    sim_run(100);
+    TEST_ASSERT_EQUAL(4, stats->next);
+    printf("update: %s\n", broker_retained(statusTopic));
+    TEST_ASSERT_NOT_NULL(strstr(broker_retained(statusTopic), "{\"state\":\"receiving\",\"size\":1000,"));
+    TEST_ASSERT_NOT_NULL(strstr(broker_retained(statusTopic), "\"next\":4,\"received\":512,\"rate_bps\":0,"));
+
+    // a gap and a bad chunk are dropped, a duplicate is ignored
+    send_chunk(image, sizeof(image), crc, 6, false);
+    send_chunk(image, sizeof(image), crc, 4, true);
+    send_chunk(image, sizeof(image), crc, 3, false);
+    TEST_ASSERT_EQUAL(4, stats->next);
+    TEST_ASSERT_EQUAL(2, stats->errors);
+    TEST_ASSERT_EQUAL(1, stats->duplicates);
+
+    // the transfer is resumed and the image checked
+    for (uint16_t index = 4; index < 8; index++)
+    {
+        send_chunk(image, sizeof(image), crc, index, false);
+    }
+    TEST_ASSERT_EQUAL(UPDATE_STATECOMPLETE, stats->state);
+    TEST_ASSERT_EQUAL(sizeof(image), stats->received);
+    TEST_ASSERT_EQUAL(512, stats->startReceived);
+    TEST_ASSERT_EQUAL(sizeof(image), hal_file_read(UPDATE_IMAGEFILE, 0, staged, sizeof(staged) + 1));
+    TEST_ASSERT_EQUAL_MEMORY(image, staged, sizeof(image));
+    printf("update: %s\n", broker_retained(statusTopic));
+    TEST_ASSERT_NOT_NULL(strstr(broker_retained(statusTopic), "{\"state\":\"complete\",\"size\":1000,"));
+
+    // an image whose crc doesn't match fails, chunk 0 starts over
+    send_chunk(image, 200, crc, 0, false);
+    send_chunk(image, 200, crc, 1, false);
+    TEST_ASSERT_EQUAL(UPDATE_STATEFAILED, stats->state);
+    send_chunk(image, 200, update_crc32(0, image, 200), 0, false);
+    send_chunk(image, 200, update_crc32(0, image, 200), 1, false);
+    TEST_ASSERT_EQUAL(UPDATE_STATECOMPLETE, stats->state);
+    TEST_ASSERT_EQUAL(200, hal_file_read(UPDATE_IMAGEFILE, 0, staged, sizeof(staged)));
+    hal_file_remove(UPDATE_IMAGEFILE);
+    hal_file_remove(UPDATE_STATEFILE);
+}
+
+void test_state()
+{
+    const char *fullTopic = mqtt_topicname(MQTT_TOPICSTATE);
+    const state_stats_t *stats = state_getstats();
+    broker_subscribe(mqtt_topicname(MQTT_TOPICSTATEDELTA), onDelta);
+    sim_run(1000);
+    printf("state: %s\n", broker_retained(fullTopic));
+    TEST_ASSERT_NOT_NULL(strstr(broker_retained(fullTopic), "\"link\":true,\"connects\":"));
+    TEST_ASSERT_NOT_NULL(strstr(broker_retained(fullTopic), "\"healthy\":true}"));
+
+    // a remote command changes the door - the source was remote before
+    uint32_t seq = stats->seq;
+    unsigned long count = deltas;
+    broker_publish(mqtt_topicname(MQTT_TOPICCONTROLSETNEWDOORSTATE), "open", false);
+    sim_run(100);
+    printf("state delta: %s\n", deltaPayload);
+    TEST_ASSERT_EQUAL(count + 1, deltas);
+    TEST_ASSERT_EQUAL(seq + 1, stats->seq);
+    FixedString<64> expected;
+    TEST_ASSERT_NOT_NULL(strstr(deltaPayload, expected.format("{\"seq\":%lu,\"doors\":[\"opening\"]}", (unsigned long)(seq + 1)).c_str()));
+    sim_run(TEST_TRAVEL_MS + 1000);
+    TEST_ASSERT_NOT_NULL(strstr(deltaPayload, "\"doors\":[\"open\"]}"));
+
+    // only the changed sensor value is sent
+    sim_sensors(sim_now_ms(), sensors_get_temperature() + 1.0f, sensors_get_humidity(), sensors_get_pressure(), sensors_get_illuminance());
+    sim_run(sensorInterval_ms + STATE_POLL_MS);
+    TEST_ASSERT_NOT_NULL(strstr(deltaPayload, ",\"temperature\":"));
+    TEST_ASSERT_NULL(strstr(deltaPayload, "humidity"));
+
+    // the full document on request carries the seq of the last delta
+    broker_publish(mqtt_topicname(MQTT_TOPICSTATEREQUEST), "", false);
+    sim_run(100);
+    TEST_ASSERT_EQUAL(1, stats->requests);
+    TEST_ASSERT_NOT_NULL(strstr(broker_retained(fullTopic), expected.format("{\"seq\":%lu,\"doors\":[\"open\"]", (unsigned long)stats->seq).c_str()));
+
+    broker_publish(mqtt_topicname(MQTT_TOPICCONTROLSETNEWDOORSTATE), "close", false);
+    sim_run(TEST_TRAVEL_MS + 1000);
+}
+
+/*
+* Writes all results as json
+*/
+void write_results(const char *path)
+{
+    FILE *file = fopen(path, "w");
+    if (file == NULL)
+    {
+        printf("cannot write %s\n", path);
+        return;
+    }
+    fprintf(file, "{\"version\":\"%s\",\"benchmarks\":[\n", version);
+    for (int i = 0; i < numResults; i++)
+    {
+        fprintf(file, "  {\"name\":\"%s\",\"iterations\":%lu,\"ns_per_call\":%.1f,\"cycles_per_call\":0,\"allocations_per_call\":0}%s\n",
+                results[i].name, results[i].iterations, results[i].nsPerCall, (i + 1 < numResults) ? "," : "");
+    }
+    fprintf(file, "]}\n");
+    fclose(file);
+    printf("results written to %s\n", path);
+}
+
+int main(int argc, char **argv)
+{
+    char sdDir[] = "/tmp/gdc-sd-XXXXXX";
+    TEST_ASSERT_NOT_NULL(mkdtemp(sdDir));
+    hal_native_setsddir(sdDir);
+    udpControlPort = 4210;
+    hal_native_setudpport(0);
+    sim_doormodel(0, TEST_TRAVEL_MS);
+    sim_init(0, HAL_NATIVE_LOOPTICK_US);
+    broker_subscribe(mqtt_topicname(mqtt_doortopic(0, MQTT_TOPICCONTROLGETNEWDOORSTATE)), onResponse);
+
+    UNITY_BEGIN();
+    RUN_TEST(test_topic_matches);
+    RUN_TEST(test_connect_retained);
+    RUN_TEST(test_will);
+    RUN_TEST(test_resync);
+    RUN_TEST(test_reconnect_jitter);
+    RUN_TEST(test_qos1_retransmit);
+    RUN_TEST(test_qos1_duplicates);
+    RUN_TEST(test_binary_payloads);
+    RUN_TEST(test_hmac_sha256);
+    RUN_TEST(test_udp_control);
+    RUN_TEST(test_settings);
+    RUN_TEST(test_update);
+    RUN_TEST(test_state);
+    RUN_TEST(test_latency);
+    RUN_TEST(test_correlation_id);
+    RUN_TEST(test_loss);
+    RUN_TEST(test_benchmark_roundtrip);
+    RUN_TEST(test_benchmark_rate_inprocess);
+    RUN_TEST(test_benchmark_rate_loopback);
+    RUN_TEST(test_device_prefix);
+    RUN_TEST(test_publish_too_large);
+
+    const char *output = getenv("GDC_BENCHMARK_OUTPUT");
+    write_results((output != NULL) ? output : "broker.json");
+    rmdir(sdDir);
+    return UNITY_END();
+}
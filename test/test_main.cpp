@@ -1,6 +0,0 @@
-#include <unity.h>
-
-int main( int argc, char **argv) {
-    UNITY_BEGIN();
-    UNITY_END();
-}
\ No newline at end of file
@@ -0,0 +1,643 @@
+/*
+* Soak tests of the complete firmware on the discrete-event simulator
+* (sim.h). All tests share one timeline which starts 30s before millis()
+* wraps around, so every later test runs on a wrapped clock.
+*
+*   pio test -e native -f test_simulation
+*/
+#include <unity.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "hal.h"
+#include "hal_native.h"
+#include "config.h"
+#include "driveio.h"
+#include "hmi.h"
+#include "mqtt.h"
+#include "heapstats.h"
+#include "cmdqueue.h"
+#include "memstats.h"
+#include "broker.h"
+#include "metrics.h"
+#include "boot.h"
+#include "supervisor.h"
+#include "postmortem.h"
+#include "idle.h"
+#include "sim.h"
+
+#define TEST_STARTMILLIS    (0xFFFFFFFFUL - 30000)
+#define TEST_TRAVEL_MS      15000
+#define TEST_HOUR_MS        (3600UL * 1000)
+#define TEST_DAY_MS         (24 * TEST_HOUR_MS)
+
+// loop tick of the long running tests
+#define TEST_SOAKTICK_US    20000
+
+// firmware state of main.cpp
+extern unsigned long uptime_in_secs;
+
+unsigned long doorStatePublishes = 0;
+unsigned long lowMemoryAlerts = 0;
+unsigned long clearedAlerts = 0;
+bool watchdogStallReported = false;
+
+/*
+* Looks for the stall report of the watchdog shutdown handler
+*/
+void onSerial(const char *line)
+{
+    if (strstr(line, "ERROR: watchdog not cleared") && strstr(line, "(stalled in hmi for 18000 ms)"))
+    {
+        watchdogStallReported = true;
+    }
+}
+
+/*
+* Counts the state changes of the first door and the system alerts
+*/
+void onPublish(const char *topic, const char *payload, bool retain)
+{
+    if (strcmp(topic, mqtt_topicname(MQTT_TOPICCONTROLGETCURRENTDOORSTATE)) == 0)
+    {
+        doorStatePublishes++;
+    }
+    if (strcmp(topic, mqtt_topicname(MQTT_TOPICSYSTEMALERT)) == 0)
+    {
+        lowMemoryAlerts += (strcmp(payload, "lowmemory") == 0);
+        clearedAlerts += (strcmp(payload, "none") == 0);
+    }
+}
+
+void setUp()
+{
+}
+
+void tearDown()
+{
+}
+
+/*
+* setup() only runs the core stage, the doors can be controlled at once.
+* The ENV shield is missing at first: its stage is retried while the other
+* stages finish, the profile is published when all stages are settled.
+*/
+void test_staged_boot()
+{
+    TEST_ASSERT_TRUE(boot_isready(BOOT_STAGECORE));
+    TEST_ASSERT_EQUAL(0, boot_getstageinfo(BOOT_STAGECORE)->ready_ms);
+    TEST_ASSERT_FALSE(boot_isready(BOOT_STAGEMQTT));
+    sim_run(10);
+    TEST_ASSERT_EQUAL(DOORSTATUSCLOSED, driveio_getcurrentdoorstatus(0));
+
+    sim_run(1490);
+    TEST_ASSERT_TRUE(boot_isready(BOOT_STAGENETWORK));
+    TEST_ASSERT_TRUE(boot_isready(BOOT_STAGEMQTT));
+    TEST_ASSERT_FALSE(boot_isready(BOOT_STAGESENSORS));
+    TEST_ASSERT_FALSE(boot_iscomplete());
+    TEST_ASSERT_EQUAL(0, sim_publishcount(mqtt_topicname(MQTT_TOPICSYSTEMSENSORS)));
+
+    hal_native_setenv(true, 20.0, 50.0, 101.3, 100.0);
+    sim_run(1000);
+    const boot_stageinfo_t *sensors = boot_getstageinfo(BOOT_STAGESENSORS);
+    TEST_ASSERT_TRUE(boot_iscomplete());
+    TEST_ASSERT_EQUAL(3, sensors->attempts);
+    TEST_ASSERT_GREATER_OR_EQUAL(2000, sensors->ready_ms);
+    TEST_ASSERT_LESS_THAN(2100, sensors->ready_ms);
+    const char *profile = broker_retained(mqtt_topicname(MQTT_TOPICSYSTEMBOOT));
+    printf("boot profile: %s\n", profile);
+    TEST_ASSERT_NOT_NULL(strstr(profile, "\"failed\":\"\""));
+    TEST_ASSERT_NOT_NULL(strstr(profile, "{\"total\":"));
+    TEST_ASSERT_NOT_NULL(strstr(profile, ",\"connected\":"));
+}
+
+/*
+* The firmware is connected to the broker and has published the initial
+* door state
+*/
+void test_startup()
+{
+    sim_run(5000 - sim_now_ms());
+    TEST_ASSERT_EQUAL(1, sim_connects());
+    TEST_ASSERT_TRUE(mqtt_isconnected());
+    TEST_ASSERT_EQUAL_STRING(MQTT_STATUSDOORCLOSED, sim_lastpayload(mqtt_topicname(MQTT_TOPICCONTROLGETCURRENTDOORSTATE)));
+    TEST_ASSERT_TRUE(sim_lastretain(mqtt_topicname(MQTT_TOPICCONTROLGETCURRENTDOORSTATE)));
+    TEST_ASSERT_EQUAL_STRING("online", sim_lastpayload(mqtt_topicname(MQTT_TOPICSYSTEMSTATUS)));
+}
+
+/*
+* A command pulse which starts right before millis() wraps must end after
+* 500ms and the uptime must keep counting
+*/
+void test_millis_wrap()
+{
+    unsigned long uptime = uptime_in_secs;
+    uint64_t wrap_ms = 0x100000000ULL - TEST_STARTMILLIS;
+    sim_command(wrap_ms - 200, 0, "open");
+    sim_run(wrap_ms - sim_now_ms() + 300);
+    TEST_ASSERT_TRUE(hal_millis() < 1000);
+    TEST_ASSERT_TRUE(driveio_doorcommandactive(0));
+    sim_run(500);
+    TEST_ASSERT_FALSE(driveio_doorcommandactive(0));
+    sim_run(TEST_TRAVEL_MS);
+    TEST_ASSERT_EQUAL_STRING(MQTT_STATUSDOOROPEN, sim_lastpayload(mqtt_topicname(MQTT_TOPICCONTROLGETCURRENTDOORSTATE)));
+
+    // uptime after the wrap continues from the value before (the test runs
+    // 40.8s from the end of the startup)
+    TEST_ASSERT_GREATER_OR_EQUAL(uptime + 25, uptime_in_secs);
+    TEST_ASSERT_LESS_OR_EQUAL(uptime + 41, uptime_in_secs);
+    broker_publish(mqtt_topicname(MQTT_TOPICSYSTEMUPTIMEREQUEST), "", false);
+    sim_run(100);
+    char expected[12];
+    sprintf(expected, "%lu", uptime_in_secs);
+    TEST_ASSERT_EQUAL_STRING(expected, sim_lastpayload(mqtt_topicname(MQTT_TOPICSYSTEMUPTIME)));
+}
+
+/*
+* The close button starts a local command
+*/
+void test_button_press()
+{
+    sim_button(sim_now_ms() + 100, HMI_BUTTON_CLOSEDOOR, 300);
+    sim_run(1000);
+    TEST_ASSERT_EQUAL_STRING(MQTT_COMMANDSOURCELOCAL, sim_lastpayload(mqtt_topicname(MQTT_TOPICCONTROLCOMMANDSOURCE)));
+    sim_run(TEST_TRAVEL_MS);
+    TEST_ASSERT_EQUAL_STRING(MQTT_STATUSDOORCLOSED, sim_lastpayload(mqtt_topicname(MQTT_TOPICCONTROLGETCURRENTDOORSTATE)));
+}
+
+/*
+* Pushes a remote command for count doors from first on and returns the
+* number of accepted ones - the doors are only numbers for the queue
+*/
+int push_commands(int first, int count)
+{
+    int accepted = 0;
+    for (int door = first; door < first + count; door++)
+    {
+        accepted += (cmdqueue_push(door, DOORCOMMANDOPEN, CMDQUEUE_SOURCEREMOTE) != 0);
+    }
+    return accepted;
+}
+
+/*
+* The rate limit of a source, merging per door and both overflow policies.
+* The clock is advanced without a pass of the loop, the commands are taken
+* from the queue by the test and no door moves.
+*/
+void test_command_queue()
+{
+    const cmdqueue_stats_t *stats = cmdqueue_getstats();
+    command_t command;
+
+    // a source gets its burst, then one token per refill interval - the
+    // other source has its own bucket
+    cmdqueue_init();
+    cmdQueueMergePerDoor = false;
+    TEST_ASSERT_EQUAL(cmdRateRemoteBurst, push_commands(0, cmdRateRemoteBurst + 1));
+    TEST_ASSERT_EQUAL(1, stats->rejectedRateLimit);
+    TEST_ASSERT_NOT_EQUAL(0, cmdqueue_push(0, DOORCOMMANDCLOSE, CMDQUEUE_SOURCELOCAL));
+    hal_native_advance(cmdRateRemoteRefill_ms * 1000UL);
+    TEST_ASSERT_EQUAL(1, push_commands(0, 2));
+    TEST_ASSERT_EQUAL(2, stats->rejectedRateLimit);
+    while (cmdqueue_pop(&command)) {}
+
+    // a waiting command of the same door is replaced in its place and
+    // queued anew
+    cmdqueue_init();
+    cmdQueueMergePerDoor = true;
+    uint16_t first = cmdqueue_push(0, DOORCOMMANDOPEN, CMDQUEUE_SOURCEREMOTE);
+    cmdqueue_push(1, DOORCOMMANDOPEN, CMDQUEUE_SOURCEREMOTE);
+    hal_native_advance(500000);
+    uint16_t second = cmdqueue_push(0, DOORCOMMANDCLOSE, CMDQUEUE_SOURCEREMOTE);
+    TEST_ASSERT_EQUAL(first + 2, second);
+    TEST_ASSERT_EQUAL(1, stats->merged);
+    TEST_ASSERT_EQUAL(2, stats->depth);
+    TEST_ASSERT_TRUE(cmdqueue_pop(&command));
+    TEST_ASSERT_EQUAL(second, command.seq);
+    TEST_ASSERT_EQUAL(DOORCOMMANDCLOSE, command.command);
+    TEST_ASSERT_EQUAL(hal_millis(), command.ms_queued);
+    while (cmdqueue_pop(&command)) {}
+
+    // a full queue rejects the newest command without taking a token or a
+    // sequence number, a merge still fits
+    int burst = cmdRateRemoteBurst;
+    cmdRateRemoteBurst = CMDQUEUE_CAPACITY + 2;
+    cmdqueue_init();
+    cmdQueueMergePerDoor = true;
+    cmdQueueOverflowPolicy = CMDQUEUE_POLICYDROPNEWEST;
+    TEST_ASSERT_EQUAL(CMDQUEUE_CAPACITY - 1, push_commands(0, CMDQUEUE_CAPACITY - 1));
+    uint16_t last = cmdqueue_push(CMDQUEUE_CAPACITY - 1, DOORCOMMANDOPEN, CMDQUEUE_SOURCEREMOTE);
+    TEST_ASSERT_NOT_EQUAL(0, last);
+    TEST_ASSERT_EQUAL(0, push_commands(CMDQUEUE_CAPACITY, 3));
+    TEST_ASSERT_EQUAL(3, stats->rejectedFull);
+    TEST_ASSERT_EQUAL(0, stats->rejectedRateLimit);
+    TEST_ASSERT_EQUAL(last + 1, cmdqueue_push(0, DOORCOMMANDCLOSE, CMDQUEUE_SOURCEREMOTE));
+    TEST_ASSERT_EQUAL(1, stats->merged);
+    TEST_ASSERT_TRUE(cmdqueue_pop(&command));
+    TEST_ASSERT_EQUAL(0, command.door);
+    while (cmdqueue_pop(&command)) {}
+
+    // the oldest command makes room for the newest one
+    cmdqueue_init();
+    cmdQueueOverflowPolicy = CMDQUEUE_POLICYDROPOLDEST;
+    TEST_ASSERT_EQUAL(CMDQUEUE_CAPACITY + 1, push_commands(0, CMDQUEUE_CAPACITY + 1));
+    TEST_ASSERT_EQUAL(1, stats->rejectedFull);
+    TEST_ASSERT_EQUAL(CMDQUEUE_CAPACITY, stats->depth);
+    TEST_ASSERT_TRUE(cmdqueue_pop(&command));
+    TEST_ASSERT_EQUAL(1, command.door);
+    while (cmdqueue_pop(&command)) {}
+
+    cmdRateRemoteBurst = burst;
+    cmdQueueOverflowPolicy = CMDQUEUE_POLICYDROPNEWEST;
+    cmdqueue_init();
+}
+
+/*
+* The firmware reconnects after a broker outage and resynchronizes
+*/
+void test_broker_outage()
+{
+    unsigned long connects = sim_connects();
+    unsigned long snapshots = sim_publishcount(mqtt_topicname(MQTT_TOPICSYSTEMSNAPSHOT));
+    sim_broker(sim_now_ms() + 1000, false);
+    sim_broker(sim_now_ms() + 9000, true);
+    sim_run(15000);
+    TEST_ASSERT_TRUE(sim_connected());
+    TEST_ASSERT_EQUAL(connects + 1, sim_connects());
+    TEST_ASSERT_EQUAL(snapshots + 1, sim_publishcount(mqtt_topicname(MQTT_TOPICSYSTEMSNAPSHOT)));
+    TEST_ASSERT_EQUAL_STRING(mqttFirstWillMsg, broker_retained(mqtt_topicname(MQTT_TOPICSYSTEMSTATUS)));
+    TEST_ASSERT_EQUAL(0, hal_native_watchdogexpired());
+}
+
+/*
+* The adaptive heartbeat publishes the uptime once per interval and the
+* status not at all, the fixed one both every second
+*/
+void test_heartbeat()
+{
+    unsigned long uptimeCount = sim_publishcount(mqtt_topicname(MQTT_TOPICSYSTEMUPTIME));
+    unsigned long statusCount = sim_publishcount(mqtt_topicname(MQTT_TOPICSYSTEMSTATUS));
+    unsigned long saved = mqtt_getheartbeatstats()->saved;
+    sim_run(10 * 60000);
+    TEST_ASSERT_EQUAL(uptimeCount + 10, sim_publishcount(mqtt_topicname(MQTT_TOPICSYSTEMUPTIME)));
+    TEST_ASSERT_EQUAL(statusCount, sim_publishcount(mqtt_topicname(MQTT_TOPICSYSTEMSTATUS)));
+    TEST_ASSERT_EQUAL(saved + 2 * 600 - 10, mqtt_getheartbeatstats()->saved);
+
+    mqttHeartbeatPolicy = MQTT_HEARTBEATFIXED;
+    sim_run(10000);
+    mqttHeartbeatPolicy = MQTT_HEARTBEATADAPTIVE;
+    TEST_ASSERT_EQUAL(statusCount + 10, sim_publishcount(mqtt_topicname(MQTT_TOPICSYSTEMSTATUS)));
+    printf("heartbeat: %lu uptime, %lu status publishes, %lu requests, %lu saved\n", mqtt_getheartbeatstats()->uptimePublishes,
+           mqtt_getheartbeatstats()->statusPublishes, mqtt_getheartbeatstats()->requests, mqtt_getheartbeatstats()->saved);
+}
+
+/*
+* A dip of the free memory below the threshold raises one alert and the
+* recovery clears it once - the watermark stays low afterwards
+*/
+void test_low_memory()
+{
+    lowMemoryAlerts = 0;
+    clearedAlerts = 0;
+    void *block = malloc(HAL_NATIVE_RAMSIZE - memLowThreshold_bytes / 2);
+    TEST_ASSERT_NOT_NULL(block);
+    sim_run(5000);
+    TEST_ASSERT_TRUE(memstats_islow());
+    free(block);
+    sim_run(5000);
+    TEST_ASSERT_FALSE(memstats_islow());
+    TEST_ASSERT_LESS_THAN((unsigned int)memLowThreshold_bytes, memstats_getminfree());
+    TEST_ASSERT_EQUAL(1, lowMemoryAlerts);
+    TEST_ASSERT_EQUAL(1, clearedAlerts);
+}
+
+/*
+* Recorded traces drive the inputs and sensors
+*/
+void test_trace()
+{
+    const char *trace =
+        "# door opened by hand, then closed again\n"
+        "1000 door 0 moving\n"
+        "9000 door 0 open\n"
+        "9500 sensors 21.5 40 100.5 250\n"
+        "20000 door 0 moving\n"
+        "30000 door 0 closed\n";
+    unsigned long base = sim_now_ms();
+    const char *line = trace;
+    char shifted[512] = "";
+    // shift the trace to the current time
+    while (*line != 0)
+    {
+        unsigned long at;
+        int n;
+        if ((*line != '#') && (sscanf(line, "%lu%n", &at, &n) == 1))
+        {
+            sprintf(shifted + strlen(shifted), "%lu", base + at);
+            line += n;
+        }
+        const char *end = strchr(line, '\n');
+        strncat(shifted, line, end - line + 1);
+        line = end + 1;
+    }
+    TEST_ASSERT_EQUAL(6, sim_loadtrace(shifted));
+    TEST_ASSERT_EQUAL(-1, sim_loadtrace("1000 door 0 ajar\n"));
+
+    sim_run(9200);
+    TEST_ASSERT_EQUAL_STRING(MQTT_STATUSDOOROPEN, sim_lastpayload(mqtt_topicname(MQTT_TOPICCONTROLGETCURRENTDOORSTATE)));
+    sim_run(12000);
+    TEST_ASSERT_TRUE(strstr(sim_lastpayload("gdc/system/sensors"), "\"21.5\"") != NULL);
+    sim_run(10000);
+    TEST_ASSERT_EQUAL_STRING(MQTT_STATUSDOORCLOSED, sim_lastpayload(mqtt_topicname(MQTT_TOPICCONTROLGETCURRENTDOORSTATE)));
+}
+
+/*
+* Thousands of remote door cycles - every cycle must end in the
+* commanded end position
+*/
+void test_door_cycles()
+{
+    const int cycles = 2000;
+    unsigned long publishes = doorStatePublishes;
+    sim_setlooptick(TEST_SOAKTICK_US);
+    for (int cycle = 0; cycle < cycles; cycle++)
+    {
+        sim_command(sim_now_ms() + 100, 0, (cycle % 2 == 0) ? "open" : "close");
+        sim_run(TEST_TRAVEL_MS + 2000);
+        TEST_ASSERT_EQUAL_STRING((cycle % 2 == 0) ? MQTT_STATUSDOOROPEN : MQTT_STATUSDOORCLOSED,
+                                 sim_lastpayload(mqtt_topicname(MQTT_TOPICCONTROLGETCURRENTDOORSTATE)));
+    }
+    // "opening"/"closing" and the end position per cycle
+    TEST_ASSERT_EQUAL(publishes + 2 * cycles, doorStatePublishes);
+    sim_setlooptick(HAL_NATIVE_LOOPTICK_US);
+}
+
+/*
+* Between the passes the firmware waits in low-power mode for the work which
+* is due next (idle.h): the decision, the duty cycle of a door at rest and
+* the wakeup by a door input
+*/
+void test_idle()
+{
+    // the earliest due time decides, short waits and a hold use IDLE
+    idle_plan_t plan;
+    uint32_t now = hal_millis();
+    idle_begin();
+    idle_plan(now, &plan);
+    TEST_ASSERT_EQUAL(IDLE_STANDBY, plan.mode);
+    TEST_ASSERT_EQUAL(IDLE_MAXSLEEP_MS, plan.sleep_ms);
+    TEST_ASSERT_EQUAL(IDLE_SOURCENONE, plan.source);
+    idle_due(IDLE_SOURCESENSORS, now + 300);
+    idle_due(IDLE_SOURCENETWORK, now + 60);
+    idle_due(IDLE_SOURCENETWORK, now + 40);
+    idle_plan(now, &plan);
+    TEST_ASSERT_EQUAL(IDLE_STANDBY, plan.mode);
+    TEST_ASSERT_EQUAL(40, plan.sleep_ms);
+    TEST_ASSERT_EQUAL_STRING("network", idle_sourcename(plan.source));
+    idle_hold();
+    idle_plan(now, &plan);
+    TEST_ASSERT_EQUAL(IDLE_SLEEP, plan.mode);
+    idle_due(IDLE_SOURCELEDS, now + IDLE_MINSLEEP_MS - 1);
+    idle_plan(now, &plan);
+    TEST_ASSERT_EQUAL(IDLE_RUN, plan.mode);
+    TEST_ASSERT_EQUAL(IDLE_SOURCELEDS, plan.source);
+
+    // work which is overdue runs at once, also across the wrap of millis()
+    idle_begin();
+    idle_due(IDLE_SOURCEHEARTBEAT, now - 5);
+    idle_plan(now, &plan);
+    TEST_ASSERT_EQUAL(IDLE_RUN, plan.mode);
+    idle_begin();
+    idle_due(IDLE_SOURCEDISPLAY, now + IDLE_STANDBYMIN_MS - 1);
+    idleMode = IDLE_MODEIDLE;
+    idle_plan(now, &plan);
+    TEST_ASSERT_EQUAL(IDLE_SLEEP, plan.mode);
+    idleMode = IDLE_MODEOFF;
+    idle_plan(now, &plan);
+    TEST_ASSERT_EQUAL(IDLE_RUN, plan.mode);
+    idleMode = IDLE_MODESTANDBY;
+
+    // a door at rest is awake for a few % of the time - the first window
+    // still has the passes of the soak tick
+    const char *idleTopic = mqtt_topicname(MQTT_TOPICDIAGIDLE);
+    const idle_stats_t *stats = idle_getstats();
+    sim_run(IDLE_PUBLISH_MS + 1000);
+    unsigned long publishes = sim_publishcount(idleTopic);
+    unsigned long passes = sim_loopstats()->passes;
+    sim_run(IDLE_PUBLISH_MS + 1000);
+    TEST_ASSERT_EQUAL(publishes + 1, sim_publishcount(idleTopic));
+    const char *payload = sim_lastpayload(idleTopic);
+    printf("idle: %s, %lu passes\n", payload, sim_loopstats()->passes - passes);
+    TEST_ASSERT_EQUAL_STRING_LEN("{\"duty\":", payload, 8);
+    TEST_ASSERT_LESS_THAN(10, (int)atof(payload + 8));
+    TEST_ASSERT_LESS_THAN((IDLE_PUBLISH_MS + 1000) / 20, sim_loopstats()->passes - passes);
+    TEST_ASSERT_GREATER_THAN(0, stats->standbys);
+
+    // the door inputs end a wait at once, the door is reported like without
+    // the low-power wait
+    unsigned long wakeups = stats->wakeups;
+    sim_command(sim_now_ms() + 100, 0, "open");
+    sim_run(TEST_TRAVEL_MS + 2000);
+    TEST_ASSERT_EQUAL_STRING(MQTT_STATUSDOOROPEN, sim_lastpayload(mqtt_topicname(MQTT_TOPICCONTROLGETCURRENTDOORSTATE)));
+    TEST_ASSERT_GREATER_THAN(wakeups, stats->wakeups);
+    sim_command(sim_now_ms() + 100, 0, "close");
+    sim_run(TEST_TRAVEL_MS + 2000);
+    TEST_ASSERT_EQUAL_STRING(MQTT_STATUSDOORCLOSED, sim_lastpayload(mqtt_topicname(MQTT_TOPICCONTROLGETCURRENTDOORSTATE)));
+}
+
+/*
+* Sends a request to the metrics endpoint and runs the firmware until it has
+* closed the connection. Returns the length of the response.
+*/
+size_t scrape(const char *request, char *response, size_t size)
+{
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(hal_native_serverport());
+    int client = socket(AF_INET, SOCK_STREAM, 0);
+    TEST_ASSERT_EQUAL(0, connect(client, (struct sockaddr *)&address, sizeof(address)));
+    send(client, request, strlen(request), 0);
+
+    size_t length = 0;
+    for (int pass = 0; pass < 1000; pass++)
+    {
+        sim_run(1);
+        ssize_t received;
+        while ((received = recv(client, response + length, size - 1 - length, MSG_DONTWAIT)) > 0)
+        {
+            length += received;
+        }
+        if (received == 0)
+        {
+            break;
+        }
+    }
+    close(client);
+    response[length] = 0;
+    return length;
+}
+
+/*
+* The metrics are streamed over several loop passes from the live counters
+*/
+void test_metrics()
+{
+    static char response[4096];
+    unsigned long scrapes = metrics_getstats()->scrapes;
+    size_t length = scrape("GET /metrics HTTP/1.1\r\nHost: gdc\r\n\r\n", response, sizeof(response));
+    TEST_ASSERT_GREATER_THAN(METRICS_MAXBYTESPERPASS * 4, length);
+    TEST_ASSERT_EQUAL(0, strncmp(response, "HTTP/1.0 200 OK\r\n", 17));
+    TEST_ASSERT_NOT_NULL(strstr(response, "\n# TYPE gdc_door_cycles_total counter\ngdc_door_cycles_total{door=\"1\"} "));
+    TEST_ASSERT_NOT_NULL(strstr(response, "\ngdc_mqtt_connected 1\n"));
+    TEST_ASSERT_NOT_NULL(strstr(response, "# TYPE gdc_uptime_seconds gauge\n"));
+    TEST_ASSERT_NOT_NULL(strstr(response, "\ngdc_temperature_celsius "));
+    unsigned long cycles = strtoul(strstr(response, "gdc_door_cycles_total{door=\"1\"} ") + 32, NULL, 10);
+    TEST_ASSERT_GREATER_OR_EQUAL(1000, cycles);
+    TEST_ASSERT_EQUAL(scrapes + 1, metrics_getstats()->scrapes);
+
+    scrape("GET /status HTTP/1.0\r\n\r\n", response, sizeof(response));
+    TEST_ASSERT_EQUAL(0, strncmp(response, "HTTP/1.0 404", 12));
+}
+
+/*
+* One week of operation: hourly door cycles, daily temperature curves and
+* a short broker outage every day
+*/
+void test_soak_week()
+{
+    unsigned long uptime = uptime_in_secs;
+    unsigned long connects = sim_connects();
+    unsigned long allocations = heapstats_getsteadyallocations();
+    sim_setlooptick(TEST_SOAKTICK_US);
+    for (int day = 0; day < 7; day++)
+    {
+        uint64_t start = sim_now_ms();
+        const float night[4] = {5.0, 80, 101.0, 0};
+        const float noon[4] = {25.0, 40, 100.5, 20000};
+        sim_sensorramp(start, start + TEST_DAY_MS / 2, 600000, night, noon);
+        sim_sensorramp(start + TEST_DAY_MS / 2, start + TEST_DAY_MS, 600000, noon, night);
+        for (int hour = 0; hour < 24; hour++)
+        {
+            sim_command(start + hour * TEST_HOUR_MS + 60000, 0, (hour % 2 == 0) ? "open" : "close");
+        }
+        sim_broker(start + 3 * TEST_HOUR_MS + 1000, false);
+        sim_broker(start + 3 * TEST_HOUR_MS + 6000, true);
+        sim_run(TEST_DAY_MS);
+    }
+
+    const sim_loopstats_t *stats = sim_loopstats();
+    printf("virtual time %.1f days, %lu loop passes, %.0fx real time\n", sim_now_ms() / 86400000.0, stats->passes, sim_speedup());
+    printf("loop: host mean %.2f us max %.1f us, virtual p50 %lu us p99 %lu us max %lu us\n",
+           stats->hostTotal_ns / 1000.0 / stats->passes, stats->hostMax_ns / 1000.0,
+           (unsigned long)sim_looppercentile_us(50), (unsigned long)sim_looppercentile_us(99), (unsigned long)stats->virtualMax_us);
+
+    TEST_ASSERT_LESS_OR_EQUAL(stats->virtualMax_us, sim_looppercentile_us(99));
+    TEST_ASSERT_EQUAL(connects + 7, sim_connects());
+    TEST_ASSERT_EQUAL(0, hal_native_watchdogexpired());
+    TEST_ASSERT_EQUAL(0, hal_native_resets());
+    for (int module = 0; module < SUPERVISOR_NUMMODULES; module++)
+    {
+        TEST_ASSERT_EQUAL(0, supervisor_getstats((supervisor_module_t)module)->overruns);
+    }
+    TEST_ASSERT_EQUAL(allocations, heapstats_getsteadyallocations());
+    TEST_ASSERT_GREATER_OR_EQUAL(uptime + 7 * 86400 - 1, uptime_in_secs);
+    TEST_ASSERT_EQUAL_STRING(MQTT_STATUSDOORCLOSED, sim_lastpayload(mqtt_topicname(MQTT_TOPICCONTROLGETCURRENTDOORSTATE)));
+    TEST_ASSERT_GREATER_OR_EQUAL(1000, (long)sim_speedup());
+}
+
+/*
+* A slow sensor is only reported. A stalled critical module stops the
+* hardware watchdog and resets the controller, a hang is attributed to the
+* module in the shutdown handler of the watchdog.
+*/
+void test_supervisor()
+{
+    const char *watchdogTopic = mqtt_topicname(MQTT_TOPICDIAGWATCHDOG);
+    unsigned long expired = hal_native_watchdogexpired();
+    hal_native_setstall(HAL_NATIVE_STALLENV, 100);
+    sim_run(3000);
+    hal_native_setstall(HAL_NATIVE_STALLENV, 0);
+    const supervisor_stats_t *sensors = supervisor_getstats(SUPERVISOR_SENSORS);
+    TEST_ASSERT_GREATER_THAN(0, sensors->overruns);
+    TEST_ASSERT_GREATER_OR_EQUAL(150, sensors->lastOverrun_ms);
+    TEST_ASSERT_LESS_THAN(160, sensors->lastOverrun_ms);
+    TEST_ASSERT_TRUE(supervisor_ishealthy());
+    TEST_ASSERT_EQUAL(1, sim_publishcount(watchdogTopic));
+    printf("watchdog: %s\n", sim_lastpayload(watchdogTopic));
+    TEST_ASSERT_NOT_NULL(strstr(sim_lastpayload(watchdogTopic), "{\"module\":\"sensors\",\"event\":\"overrun\",\"elapsed_ms\":40"));
+    TEST_ASSERT_NOT_NULL(strstr(sim_lastpayload(watchdogTopic), "\"limit_ms\":250,"));
+
+    // one pass of the buttons takes 1.2s
+    hal_native_setstall(HAL_NATIVE_STALLEXPANDER, 400);
+    sim_run(500);
+    hal_native_setstall(HAL_NATIVE_STALLEXPANDER, 0);
+    TEST_ASSERT_FALSE(supervisor_ishealthy());
+    TEST_ASSERT_FALSE(supervisor_getstats(SUPERVISOR_HMI)->healthy);
+    TEST_ASSERT_NOT_NULL(strstr(sim_lastpayload(watchdogTopic), "\"module\":\"hmi\",\"event\":\"reset\""));
+    sim_run(1500);
+    TEST_ASSERT_EQUAL(1, hal_native_resets());
+    TEST_ASSERT_TRUE(supervisor_ishealthy());
+    TEST_ASSERT_EQUAL(expired, hal_native_watchdogexpired());
+
+    // the reset restarts the post-mortem record, the previous one is
+    // published once with the last events of the door cycles
+    const char *crashTopic = mqtt_topicname(MQTT_TOPICDIAGCRASH);
+    TEST_ASSERT_EQUAL(1, sim_publishcount(crashTopic));
+    printf("crash: %s\n", sim_lastpayload(crashTopic));
+    TEST_ASSERT_NOT_NULL(strstr(sim_lastpayload(crashTopic), "{\"cause\":\"supervisor\",\"uptime\":"));
+    TEST_ASSERT_NOT_NULL(strstr(sim_lastpayload(crashTopic), "\"module\":\"none\",\"module_ms\":0,"));
+    TEST_ASSERT_NOT_NULL(strstr(sim_lastpayload(crashTopic), "\"close1 remote\",\"door1 moving\",\"door1 closed\"]}"));
+
+    // a hang longer than the hardware watchdog
+    hal_native_setserial(false, onSerial);
+    hal_native_setstall(HAL_NATIVE_STALLEXPANDER, 6000);
+    sim_run(500);
+    hal_native_setstall(HAL_NATIVE_STALLEXPANDER, 0);
+    hal_native_setserial(false, NULL);
+    TEST_ASSERT_EQUAL(expired + 1, hal_native_watchdogexpired());
+    TEST_ASSERT_TRUE(watchdogStallReported);
+    sim_run(1500);
+    TEST_ASSERT_EQUAL(2, hal_native_resets());
+    TEST_ASSERT_TRUE(supervisor_ishealthy());
+
+    // the record was frozen by the shutdown handler of the watchdog
+    const postmortem_record_t *record = postmortem_getlast();
+    TEST_ASSERT_NOT_NULL(record);
+    TEST_ASSERT_EQUAL(POSTMORTEM_CAUSEWATCHDOG, record->cause);
+    TEST_ASSERT_EQUAL(SUPERVISOR_HMI, record->module);
+    TEST_ASSERT_GREATER_OR_EQUAL(16000, record->uptime_ms - record->moduleBegin_ms);
+    TEST_ASSERT_LESS_OR_EQUAL(18000, record->uptime_ms - record->moduleBegin_ms);
+    TEST_ASSERT_EQUAL(2, sim_publishcount(crashTopic));
+    TEST_ASSERT_NOT_NULL(strstr(sim_lastpayload(crashTopic), "{\"cause\":\"watchdog\",\"uptime\":"));
+    TEST_ASSERT_NOT_NULL(strstr(sim_lastpayload(crashTopic), "\"module\":\"hmi\","));
+}
+
+int main(int argc, char **argv)
+{
+    sim_sethook(onPublish);
+    sim_doormodel(0, TEST_TRAVEL_MS);
+    hal_native_setserverport(0);
+    hal_native_setenv(false, 20.0, 50.0, 101.3, 100.0);
+    sim_init(TEST_STARTMILLIS, HAL_NATIVE_LOOPTICK_US);
+
+    UNITY_BEGIN();
+    RUN_TEST(test_staged_boot);
+    RUN_TEST(test_startup);
+    RUN_TEST(test_millis_wrap);
+    RUN_TEST(test_button_press);
+    RUN_TEST(test_command_queue);
+    RUN_TEST(test_broker_outage);
+    RUN_TEST(test_heartbeat);
+    RUN_TEST(test_low_memory);
+    RUN_TEST(test_trace);
+    RUN_TEST(test_door_cycles);
+    RUN_TEST(test_idle);
+    RUN_TEST(test_metrics);
+    RUN_TEST(test_soak_week);
+    RUN_TEST(test_supervisor);
+    return UNITY_END();
+}